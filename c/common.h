@@ -1,5 +1,8 @@
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/list.h>
+#include <jsonemitter.h>
 
 typedef enum event_type {
 	EVENT_NEWLINE = 1,
@@ -17,12 +20,285 @@ typedef struct event {
 	list_node_t evt_link;
 } event_t;
 
+typedef enum copy_format {
+	COPY_FORMAT_TEXT = 1,
+	COPY_FORMAT_CSV,
+	COPY_FORMAT_BINARY,
+} copy_format_t;
+
 typedef struct command_copy {
 	char *cmdc_table_name;
 	strlist_t *cmdc_column_names;
+	copy_format_t cmdc_format;
 	char cmdc_delimiter;
 	char *cmdc_null_string;
+	int cmdc_header;		/* the first row is a header */
+	char cmdc_quote;		/* CSV quoting character */
+	char cmdc_escape;		/* CSV escape character */
+	strlist_t *cmdc_column_types;	/* for binary format; see below */
 } command_copy_t;
 
-extern int parse_command(list_t *, command_copy_t **);
+/*
+ * The column types of a table, from its CREATE TABLE command.  The binary
+ * COPY format does not describe the columns it contains, so their types must
+ * be known to convert them to text.  Before a binary COPY command is passed to
+ * copy_parser_alloc(), "cmdc_column_types" is filled in with the type of each
+ * column, or an empty string where it is not known.
+ */
+typedef struct command_table {
+	char *cmdt_table_name;
+	strlist_t *cmdt_column_names;
+	strlist_t *cmdt_column_types;
+	list_node_t cmdt_link;
+} command_table_t;
+
+extern int parse_command(list_t *, command_copy_t **, command_table_t **);
+extern void command_table_free(command_table_t *);
+
+
+/*
+ * Dump index (index.c).  The offsets of the COPY blocks and CREATE TABLE
+ * commands of a dump, in the order they appear, and for a gzip dump the
+ * restart points from which inflate may begin part way through the file.
+ */
+#define	INDEX_WINDOW		32768
+
+typedef enum index_kind {
+	INDEX_COPY = 1,
+	INDEX_TABLE,
+} index_kind_t;
+
+typedef struct index_entry {
+	index_kind_t ixe_kind;
+	char *ixe_table;
+	strlist_t *ixe_columns;		/* of a COPY */
+	uint64_t ixe_rows;
+	uint64_t ixe_start;		/* end of the previous command */
+	uint64_t ixe_data;		/* start of the COPY data */
+	uint64_t ixe_end;
+	list_node_t ixe_link;
+} index_entry_t;
+
+typedef struct index_point {
+	uint64_t ixp_out;		/* uncompressed offset */
+	uint64_t ixp_in;		/* compressed offset of the next byte */
+	int ixp_bits;			/* bits of the byte before it unread */
+	unsigned char *ixp_window;	/* deflated */
+	size_t ixp_window_len;
+	size_t ixp_window_zlen;
+} index_point_t;
+
+typedef struct dump_index {
+	int ix_gzip;
+	uint64_t ix_size;		/* of the file */
+	uint64_t ix_length;		/* of the uncompressed dump */
+	list_t ix_entries;
+	index_point_t *ix_points;
+	unsigned ix_npoints;
+	unsigned ix_maxpoints;
+} dump_index_t;
+
+extern int index_alloc(dump_index_t **);
+extern void index_free(dump_index_t *);
+extern index_entry_t *index_add_entry(dump_index_t *, index_kind_t,
+    const char *, strlist_t *, uint64_t, uint64_t);
+extern void index_add_point(dump_index_t *, uint64_t, uint64_t, int,
+    const unsigned char *, size_t);
+extern const index_point_t *index_find_point(dump_index_t *, uint64_t);
+extern ssize_t index_point_window(const index_point_t *, unsigned char *);
+extern int index_write(dump_index_t *, const char *);
+extern int index_read(dump_index_t **, const char *);
+
+/*
+ * Input sources (input.c).  The dump may be plain SQL text or gzip
+ * compressed; the format is detected when the input is opened.  Plain
+ * dumps in regular files are mapped, and may be read in place with
+ * input_next() rather than copied out with input_read().  With the restart
+ * points of an index, a gzip dump may be inflated on several threads at once
+ * by input_parallel().
+ */
+typedef struct input input_t;
+
+typedef struct input_stats {
+	uint64_t ins_offset;		/* uncompressed bytes produced */
+	uint64_t ins_raw_offset;	/* bytes read from the file */
+	uint64_t ins_ns;		/* time spent reading and inflating */
+	const char *ins_kind;		/* "read", "inflate" or "mmap" */
+} input_stats_t;
+
+extern int input_open(input_t **, const char *);
+extern void input_close(input_t *);
+extern ssize_t input_read(input_t *, char *, size_t);
+extern int input_is_mapped(input_t *);
+extern size_t input_next(input_t *, const char **, size_t);
+extern void input_stats(input_t *, input_stats_t *);
+extern uint64_t input_tell(input_t *);
+extern void input_index(input_t *, dump_index_t *);
+extern int input_seek(input_t *, uint64_t, dump_index_t *);
+extern int input_parallel(input_t *, dump_index_t *, unsigned);
+
+extern uint64_t gettime_ns(void);
+
+/*
+ * COPY data scanning (scan.c).
+ */
+extern size_t copy_scan(const char *, size_t, char);
+extern size_t copy_scan_chars(const char *, size_t, char, char, char);
+
+/*
+ * COPY row data parser (copy.c), for the text, CSV and binary formats.  Each
+ * complete row is passed to the row function as an array of columns in text
+ * form, where a column with a NULL pointer is an SQL NULL.  Column data is
+ * not NUL-terminated, and is only valid for the duration of the call.
+ */
+typedef struct copy_col {
+	const char *cc_ptr;
+	size_t cc_len;
+} copy_col_t;
+
+typedef struct copy_parser copy_parser_t;
+typedef void copy_row_func_t(void *, const copy_col_t *, unsigned);
+
+extern int copy_parser_alloc(copy_parser_t **, command_copy_t *,
+    copy_row_func_t *, void *);
+extern void copy_parser_free(copy_parser_t *);
+extern size_t copy_parse(copy_parser_t *, const char *, size_t, int *);
+extern uint64_t copy_parser_rows(copy_parser_t *);
+extern void copy_parser_restart(copy_parser_t *, uint64_t);
+extern int copy_parser_at_row(copy_parser_t *);
+
+/*
+ * COPY text format splitter (copy.c).  The data is divided at row boundaries
+ * without being parsed, so that the pieces may be parsed independently.
+ * After each call to copy_split(), "cs_skip" is the number of leading bytes
+ * consumed that were not row data (the end of the COPY command and any
+ * header line), "cs_chunk_rows" the number of rows that were completed, and
+ * "cs_cut" whether the data ended at a row boundary.  The end of data marker
+ * is consumed as row data, and sets "cs_done".
+ */
+typedef struct copy_split {
+	int cs_state;
+	int cs_header;
+	size_t cs_skip;
+	uint64_t cs_chunk_rows;
+	int cs_cut;
+	int cs_done;
+	uint64_t cs_rows;		/* in total */
+} copy_split_t;
+
+extern void copy_split_init(copy_split_t *, command_copy_t *);
+extern size_t copy_split(copy_split_t *, const char *, size_t, size_t);
+
+/*
+ * JSON parser (jsonparse.c).  Documents are parsed into a tree of values
+ * allocated from an arena, which may be edited and written back out with
+ * jsonemitter.  Strings are not NUL-terminated, and may point into the
+ * input; the names of object members are always NUL-terminated.
+ */
+#define	JV_NUMBUFSZ	32
+
+typedef enum jv_type {
+	JV_NULL = 1,
+	JV_TRUE,
+	JV_FALSE,
+	JV_NUMBER,
+	JV_STRING,
+	JV_ARRAY,
+	JV_OBJECT,
+} jv_type_t;
+
+typedef struct jv {
+	jv_type_t jv_type;
+	const char *jv_str;		/* number text or string value */
+	size_t jv_len;
+	const char *jv_name;		/* member name, if in an object */
+	size_t jv_namelen;
+	struct jv *jv_first;		/* array elements or object members */
+	struct jv *jv_last;
+	struct jv *jv_next;
+} jv_t;
+
+typedef struct jv_arena jv_arena_t;
+
+extern int jv_arena_alloc(jv_arena_t **);
+extern void jv_arena_free(jv_arena_t *);
+extern void jv_arena_reset(jv_arena_t *);
+extern void *jv_arena_zalloc(jv_arena_t *, size_t);
+extern jv_t *jv_alloc(jv_arena_t *, jv_type_t);
+extern int jv_parse(jv_arena_t *, const char *, size_t, jv_t **,
+    const char **);
+extern jv_t *jv_member(jv_t *, const char *);
+extern void jv_replace(jv_t *, jv_t *, jv_t *);
+extern void jv_set_member(jv_t *, const char *, jv_t *);
+extern void jv_delete_member(jv_t *, const char *);
+extern void jv_number_format(double, char *);
+extern const char *jv_number_text(const char *, size_t, char *, size_t *);
+extern int jv_parseint(const char *, size_t, double *);
+extern int jv_array_index(const char *, size_t, uint32_t *);
+extern void jv_emit(json_emit_t *, const char *, jv_t *);
+extern void jv_emit_bound(json_emit_t *, const json_label_t *, jv_t *);
+
+/*
+ * Moray buckets (moray.c).  The configuration of each bucket is loaded from
+ * the rows of the "buckets_config" table, and the rows of bucket tables are
+ * then converted into the objects that Moray would return.
+ */
+typedef struct moray_buckets moray_buckets_t;
+typedef struct moray_bucket moray_bucket_t;
+typedef struct moray_table moray_table_t;
+
+extern int moray_buckets_alloc(moray_buckets_t **);
+extern void moray_buckets_free(moray_buckets_t *);
+extern moray_bucket_t *moray_bucket_lookup(moray_buckets_t *, const char *);
+extern unsigned moray_buckets_count(moray_buckets_t *);
+extern void moray_bucket_config_row(moray_buckets_t *, command_copy_t *,
+    const copy_col_t *, unsigned);
+extern moray_table_t *moray_table_alloc(moray_buckets_t *, moray_bucket_t *,
+    command_copy_t *);
+extern void moray_table_free(moray_table_t *);
+extern void moray_table_row(moray_table_t *, json_emit_t *,
+    const copy_col_t *, unsigned);
+extern void moray_table_set_rows(moray_table_t *, uint64_t);
+extern uint64_t moray_table_parsed(moray_table_t *);
+
+/*
+ * Conversion pipeline (pipeline.c).  Rows of COPY data are passed to a stream
+ * for each table, and are converted to JSON by a pool of worker threads.  The
+ * operations of a stream are called on the worker threads: plo_init() once
+ * by each worker that converts rows of the stream, to create its own state
+ * for the stream; plo_row() for each row, with its number in the table; and
+ * plo_fini() for each worker's state once every row has been written.  The
+ * writer thread calls plo_close() last of all.
+ *
+ * The budget given to pipeline_alloc() limits the bytes of row data and
+ * output held in batches at once (0 for no limit).
+ *
+ * Rather than rows, a stream of a text format COPY may be given the raw row
+ * data, divided at row boundaries with copy_split().  The workers then parse
+ * the data as well as converting it, each with its own parser.
+ */
+typedef struct pipeline pipeline_t;
+typedef struct pipeline_stream pipeline_stream_t;
+
+typedef struct pipeline_ops {
+	void *(*plo_init)(void *);
+	void (*plo_row)(void *, void *, json_emit_t *, const copy_col_t *,
+	    unsigned, uint64_t);
+	void (*plo_fini)(void *, void *);
+	void (*plo_close)(void *);
+} pipeline_ops_t;
 
+extern int pipeline_alloc(pipeline_t **, unsigned, uint64_t);
+extern void pipeline_finish(pipeline_t *);
+extern void pipeline_free(pipeline_t *);
+extern unsigned pipeline_workers(pipeline_t *);
+extern uint64_t pipeline_wait_ns(pipeline_t *);
+extern uint64_t pipeline_steals(pipeline_t *);
+extern pipeline_stream_t *pipeline_stream_open(pipeline_t *, const char *,
+    int, command_copy_t *, const pipeline_ops_t *, void *);
+extern void pipeline_stream_row(pipeline_stream_t *, const copy_col_t *,
+    unsigned);
+extern size_t pipeline_stream_space(pipeline_stream_t *);
+extern void pipeline_stream_data(pipeline_stream_t *, const char *, size_t,
+    uint64_t, int);
+extern void pipeline_stream_close(pipeline_stream_t *);
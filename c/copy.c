@@ -0,0 +1,1570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <err.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+/*
+ * COPY row data parsers, for each of the formats of COPY data: text, CSV and
+ * binary.  All three produce rows of columns in text form, as the text
+ * format would have them after its escapes are decoded.
+ *
+ * The text format parser is described first.
+ * Rows are not accumulated a byte at a time.  Instead, each column is
+ * located in the input buffer with copy_scan(), and is described by a slice
+ * (a pointer and a length) of that buffer.  Only two kinds of column are
+ * copied, into a per-row scratch arena:
+ *
+ *   - columns containing backslash escapes, which must be decoded; and
+ *
+ *   - columns of a row that is not complete when the end of an input buffer
+ *     is reached, as the buffer may be reused before the row is finished.
+ *
+ * The arena may move as it grows, so arena columns are recorded by offset
+ * until the row is complete.
+ *
+ * Nearly every dump uses the default delimiter (tab) and NULL marker ("\N").
+ * The parser is written once, as inline functions that take the delimiter and
+ * NULL marker as arguments, and is instantiated twice: once with the defaults
+ * as constants, so that the checks compile down to constant compares, and
+ * once reading them from the command for any other COPY options.
+ */
+
+#define	COPY_INLINE	static inline __attribute__((__always_inline__))
+
+#define	COPY_DEFAULT_DELIMITER	'\t'
+#define	COPY_DEFAULT_NULL	"\\N"
+
+typedef enum copy_state {
+	COPY_REST = 1,		/* expecting newline after COPY command */
+	COPY_HEADER,		/* skipping the header line */
+	COPY_COLUMN,		/* scanning column text */
+	COPY_ESCAPE,		/* previous buffer ended with a backslash */
+	COPY_QUOTED,		/* scanning quoted CSV column text */
+	COPY_QUOTE,		/* CSV quote or escape seen (in cp_pending) */
+	COPY_DONE,		/* end of data marker seen */
+} copy_state_t;
+
+/*
+ * The items of the binary format.
+ */
+typedef enum copy_binary_state {
+	COPY_B_SIGNATURE = 1,
+	COPY_B_FLAGS,
+	COPY_B_EXTENSION_LEN,
+	COPY_B_EXTENSION,
+	COPY_B_TUPLE,		/* field count, or the trailer */
+	COPY_B_FIELD_LEN,
+	COPY_B_FIELD,
+} copy_binary_state_t;
+
+/*
+ * The column types that may be converted from the binary format to text.
+ */
+typedef enum copy_binary_type {
+	COPY_T_UNKNOWN = 0,
+	COPY_T_TEXT,
+	COPY_T_JSONB,
+	COPY_T_BYTEA,
+	COPY_T_BOOL,
+	COPY_T_INT,		/* integers, by length */
+	COPY_T_OID,
+	COPY_T_FLOAT,		/* real or double precision, by length */
+	COPY_T_NUMERIC,
+	COPY_T_DATE,
+	COPY_T_TIMESTAMP,
+	COPY_T_TIMESTAMPTZ,
+	COPY_T_UUID,
+} copy_binary_type_t;
+
+typedef struct copy_field {
+	const char *cf_ptr;	/* slice of the input buffer, or NULL */
+	size_t cf_off;		/* offset in the arena, if cf_ptr is NULL */
+	size_t cf_len;
+	int cf_null;
+} copy_field_t;
+
+typedef size_t copy_parse_func_t(copy_parser_t *, const char *, size_t,
+    int *);
+
+struct copy_parser {
+	command_copy_t *cp_command;
+	unsigned cp_ncols;
+	size_t cp_null_len;
+	copy_parse_func_t *cp_parse;
+
+	copy_row_func_t *cp_func;
+	void *cp_arg;
+
+	copy_state_t cp_state;
+	unsigned cp_col;		/* index of the current column */
+	copy_field_t *cp_fields;
+	copy_col_t *cp_out;
+
+	/*
+	 * The current column, which began either in the current buffer
+	 * (at cp_start) or in a previous buffer (in which case its raw text
+	 * so far is in the arena at cp_start_off).
+	 */
+	const char *cp_start;
+	size_t cp_start_off;
+	int cp_spilled;
+	int cp_escaped;
+	int cp_quoted;			/* CSV column was quoted */
+
+	char *cp_arena;
+	size_t cp_arena_len;
+	size_t cp_arena_size;
+
+	char cp_pending;		/* CSV quote or escape character */
+
+	copy_binary_state_t cp_bin_state;
+	copy_binary_type_t *cp_bin_types;
+	char cp_bin_buf[16];		/* partial item */
+	size_t cp_bin_have;
+	uint32_t cp_bin_remain;		/* of the extension or field */
+
+	uint64_t cp_rows;
+};
+
+static copy_parse_func_t copy_parse_default;
+static copy_parse_func_t copy_parse_generic;
+static copy_parse_func_t copy_parse_csv;
+static copy_parse_func_t copy_parse_binary;
+static copy_binary_type_t copy_binary_type(const char *);
+
+int
+copy_parser_alloc(copy_parser_t **cpp, command_copy_t *cmdc,
+    copy_row_func_t *func, void *arg)
+{
+	copy_parser_t *cp;
+
+	if ((cp = calloc(1, sizeof (*cp))) == NULL) {
+		return (-1);
+	}
+
+	cp->cp_command = cmdc;
+	cp->cp_ncols = strlist_contig_count(cmdc->cmdc_column_names);
+	cp->cp_null_len = strlen(cmdc->cmdc_null_string);
+	cp->cp_func = func;
+	cp->cp_arg = arg;
+	cp->cp_state = COPY_REST;
+
+	if (cmdc->cmdc_format == COPY_FORMAT_BINARY) {
+		cp->cp_parse = copy_parse_binary;
+	} else if (cmdc->cmdc_format == COPY_FORMAT_CSV) {
+		cp->cp_parse = copy_parse_csv;
+	} else if (cmdc->cmdc_delimiter == COPY_DEFAULT_DELIMITER &&
+	    strcmp(cmdc->cmdc_null_string, COPY_DEFAULT_NULL) == 0) {
+		cp->cp_parse = copy_parse_default;
+	} else {
+		cp->cp_parse = copy_parse_generic;
+	}
+
+	if ((cp->cp_fields = calloc(cp->cp_ncols + 1,
+	    sizeof (copy_field_t))) == NULL ||
+	    (cp->cp_out = calloc(cp->cp_ncols + 1,
+	    sizeof (copy_col_t))) == NULL ||
+	    (cp->cp_bin_types = calloc(cp->cp_ncols + 1,
+	    sizeof (copy_binary_type_t))) == NULL) {
+		free(cp->cp_fields);
+		free(cp->cp_out);
+		free(cp);
+		return (-1);
+	}
+
+	if (cmdc->cmdc_format == COPY_FORMAT_BINARY) {
+		cp->cp_bin_state = COPY_B_SIGNATURE;
+		for (unsigned i = 0; i < cp->cp_ncols; i++) {
+			const char *type = cmdc->cmdc_column_types == NULL ?
+			    NULL : strlist_get(cmdc->cmdc_column_types, i);
+
+			cp->cp_bin_types[i] = type == NULL ? COPY_T_UNKNOWN :
+			    copy_binary_type(type);
+		}
+	}
+
+	*cpp = cp;
+	return (0);
+}
+
+void
+copy_parser_free(copy_parser_t *cp)
+{
+	if (cp == NULL) {
+		return;
+	}
+
+	free(cp->cp_arena);
+	free(cp->cp_fields);
+	free(cp->cp_out);
+	free(cp->cp_bin_types);
+	free(cp);
+}
+
+uint64_t
+copy_parser_rows(copy_parser_t *cp)
+{
+	return (cp->cp_rows);
+}
+
+/*
+ * Discard any partial row, and prepare to parse text format row data from
+ * the start of a row, as the "rows"th row of the table.  This is used to
+ * parse data that has been divided with copy_split().
+ */
+void
+copy_parser_restart(copy_parser_t *cp, uint64_t rows)
+{
+	cp->cp_state = COPY_COLUMN;
+	cp->cp_col = 0;
+	cp->cp_spilled = 0;
+	cp->cp_escaped = 0;
+	cp->cp_arena_len = 0;
+	cp->cp_rows = rows;
+}
+
+/*
+ * Returns 1 if the data parsed so far ended at the end of a row, or with the
+ * end of data marker.
+ */
+int
+copy_parser_at_row(copy_parser_t *cp)
+{
+	return (cp->cp_state == COPY_DONE || (cp->cp_state == COPY_COLUMN &&
+	    cp->cp_col == 0 && !cp->cp_spilled));
+}
+
+/*
+ * Reserve "len" bytes at the end of the arena, returning the offset of the
+ * reserved space.
+ */
+static size_t
+copy_arena_reserve(copy_parser_t *cp, size_t len)
+{
+	size_t off = cp->cp_arena_len;
+
+	if (len > cp->cp_arena_size - cp->cp_arena_len) {
+		size_t sz = cp->cp_arena_size == 0 ? 4096 :
+		    cp->cp_arena_size;
+		char *n;
+
+		while (sz - cp->cp_arena_len < len) {
+			sz *= 2;
+		}
+
+		if ((n = realloc(cp->cp_arena, sz)) == NULL) {
+			err(1, "realloc");
+		}
+		cp->cp_arena = n;
+		cp->cp_arena_size = sz;
+	}
+
+	cp->cp_arena_len += len;
+	return (off);
+}
+
+static size_t
+copy_arena_append(copy_parser_t *cp, const char *buf, size_t len)
+{
+	size_t off = copy_arena_reserve(cp, len);
+
+	bcopy(buf, cp->cp_arena + off, len);
+	return (off);
+}
+
+static int
+copy_octal(char c)
+{
+	return (c >= '0' && c <= '7');
+}
+
+static int
+copy_hexval(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return (c - '0');
+	} else if (c >= 'a' && c <= 'f') {
+		return (c - 'a' + 10);
+	} else if (c >= 'A' && c <= 'F') {
+		return (c - 'A' + 10);
+	}
+
+	return (-1);
+}
+
+/*
+ * Decode the backslash escapes in a column, following the rules PostgreSQL
+ * uses when reading the COPY text format:
+ *
+ *	\b \f \n \r \t \v	the usual C control characters
+ *	\NNN			one to three octal digits
+ *	\xHH			"x" followed by one or two hex digits
+ *	\c			any other character stands for itself
+ *
+ * The text between escapes is located with memchr() and moved in bulk.  The
+ * output is never longer than the input, so "dst" may be the same as "src".
+ * Returns the decoded length.
+ */
+static size_t
+copy_unescape(const char *src, size_t len, char *dst)
+{
+	const char *end = src + len;
+	size_t o = 0;
+
+	while (src < end) {
+		const char *bs;
+		size_t run;
+		int c;
+
+		if ((bs = memchr(src, '\\', end - src)) == NULL) {
+			bs = end;
+		}
+		if ((run = bs - src) > 0) {
+			if (dst + o != src) {
+				memmove(dst + o, src, run);
+			}
+			o += run;
+		}
+		if (bs == end || bs + 1 == end) {
+			/*
+			 * The tokenizer never ends a column on a lone
+			 * backslash, but keep it if we are given one.
+			 */
+			if (bs + 1 == end) {
+				dst[o++] = '\\';
+			}
+			break;
+		}
+
+		src = bs + 1;
+		switch (c = (unsigned char)*src++) {
+		case 'b':
+			c = '\b';
+			break;
+		case 'f':
+			c = '\f';
+			break;
+		case 'n':
+			c = '\n';
+			break;
+		case 'r':
+			c = '\r';
+			break;
+		case 't':
+			c = '\t';
+			break;
+		case 'v':
+			c = '\v';
+			break;
+
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+			c -= '0';
+			if (src < end && copy_octal(*src)) {
+				c = (c << 3) + (*src++ - '0');
+				if (src < end && copy_octal(*src)) {
+					c = (c << 3) + (*src++ - '0');
+				}
+			}
+			c &= 0377;
+			break;
+
+		case 'x':
+			if (src < end && copy_hexval(*src) >= 0) {
+				c = copy_hexval(*src++);
+				if (src < end && copy_hexval(*src) >= 0) {
+					c = (c << 4) + copy_hexval(*src++);
+				}
+			}
+			break;
+		}
+
+		dst[o++] = (char)c;
+	}
+
+	return (o);
+}
+
+/*
+ * Move any completed columns of the current row that still refer to the
+ * input buffer into the arena.
+ */
+static void
+copy_spill_fields(copy_parser_t *cp)
+{
+	for (unsigned i = 0; i < cp->cp_col; i++) {
+		copy_field_t *cf = &cp->cp_fields[i];
+
+		if (cf->cf_ptr != NULL) {
+			cf->cf_off = copy_arena_append(cp, cf->cf_ptr,
+			    cf->cf_len);
+			cf->cf_ptr = NULL;
+		}
+	}
+}
+
+/*
+ * The end of the input buffer has been reached in the middle of a row.  Any
+ * columns of the row that still refer to the buffer must be moved into the
+ * arena, along with the current column's text so far.
+ */
+static void
+copy_spill(copy_parser_t *cp, const char *end)
+{
+	if (cp->cp_col == 0 && !cp->cp_spilled && cp->cp_start == end) {
+		/*
+		 * The buffer ended exactly at the end of a row.
+		 */
+		return;
+	}
+
+	copy_spill_fields(cp);
+
+	if (cp->cp_spilled) {
+		(void) copy_arena_append(cp, cp->cp_start, end - cp->cp_start);
+	} else {
+		cp->cp_start_off = copy_arena_append(cp, cp->cp_start,
+		    end - cp->cp_start);
+		cp->cp_spilled = 1;
+	}
+	cp->cp_start = NULL;
+}
+
+static void
+copy_emit_row(copy_parser_t *cp)
+{
+	for (unsigned i = 0; i < cp->cp_ncols; i++) {
+		copy_field_t *cf = &cp->cp_fields[i];
+		copy_col_t *cc = &cp->cp_out[i];
+
+		if (cf->cf_null) {
+			cc->cc_ptr = NULL;
+			cc->cc_len = 0;
+		} else {
+			cc->cc_ptr = cf->cf_ptr != NULL ? cf->cf_ptr :
+			    cp->cp_arena + cf->cf_off;
+			cc->cc_len = cf->cf_len;
+		}
+	}
+
+	cp->cp_func(cp->cp_arg, cp->cp_out, cp->cp_ncols);
+	cp->cp_rows++;
+}
+
+/*
+ * The current column ends at "end" in the current buffer.  Returns 1 if this
+ * was the end of data marker.  A CSV column that was quoted, even in part, is
+ * never the NULL marker or the end of data marker.
+ */
+COPY_INLINE int
+copy_end_column(copy_parser_t *cp, const char *end, int is_last, int quoted,
+    const char *null, size_t null_len)
+{
+	const char *raw;
+	size_t rawlen;
+
+	if (cp->cp_spilled) {
+		(void) copy_arena_append(cp, cp->cp_start, end - cp->cp_start);
+		raw = cp->cp_arena + cp->cp_start_off;
+		rawlen = cp->cp_arena_len - cp->cp_start_off;
+	} else {
+		raw = cp->cp_start;
+		rawlen = end - cp->cp_start;
+	}
+
+	if (!quoted && cp->cp_col == 0 && is_last && rawlen == 2 &&
+	    raw[0] == '\\' && raw[1] == '.') {
+		return (1);
+	}
+
+	if (cp->cp_col >= cp->cp_ncols) {
+		errx(1, "too many columns on COPY row");
+	}
+
+	copy_field_t *cf = &cp->cp_fields[cp->cp_col++];
+
+	/*
+	 * The NULL marker is matched against the raw column text, before any
+	 * escapes are decoded.
+	 */
+	if (!quoted && rawlen == null_len && (rawlen == 0 ||
+	    bcmp(raw, null, rawlen) == 0)) {
+		cf->cf_null = 1;
+		if (cp->cp_spilled) {
+			cp->cp_arena_len = cp->cp_start_off;
+		}
+	} else if (cp->cp_escaped) {
+		cf->cf_null = 0;
+		cf->cf_ptr = NULL;
+		if (cp->cp_spilled) {
+			cf->cf_off = cp->cp_start_off;
+			cf->cf_len = copy_unescape(raw, rawlen, (char *)raw);
+		} else {
+			cf->cf_off = copy_arena_reserve(cp, rawlen);
+			cf->cf_len = copy_unescape(raw, rawlen,
+			    cp->cp_arena + cf->cf_off);
+		}
+		cp->cp_arena_len = cf->cf_off + cf->cf_len;
+	} else if (cp->cp_spilled) {
+		cf->cf_null = 0;
+		cf->cf_ptr = NULL;
+		cf->cf_off = cp->cp_start_off;
+		cf->cf_len = rawlen;
+	} else {
+		cf->cf_null = 0;
+		cf->cf_ptr = raw;
+		cf->cf_len = rawlen;
+	}
+
+	if (is_last) {
+		if (cp->cp_col != cp->cp_ncols) {
+			errx(1, "too few columns on COPY row");
+		}
+
+		copy_emit_row(cp);
+		cp->cp_col = 0;
+		cp->cp_arena_len = 0;
+	}
+
+	cp->cp_spilled = 0;
+	cp->cp_escaped = 0;
+	return (0);
+}
+
+COPY_INLINE size_t
+copy_parse_impl(copy_parser_t *cp, const char *buf, size_t len, int *donep,
+    char delim, const char *null, size_t null_len)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+
+	*donep = 0;
+	if (len == 0) {
+		return (0);
+	}
+
+	switch (cp->cp_state) {
+	case COPY_ESCAPE:
+		/*
+		 * The backslash was the last byte of the previous buffer,
+		 * and is already in the arena.  This byte is the character
+		 * it escapes.
+		 */
+		(void) copy_arena_append(cp, p, 1);
+		p++;
+		cp->cp_state = COPY_COLUMN;
+		cp->cp_start = p;
+		break;
+
+	case COPY_COLUMN:
+		cp->cp_start = p;
+		break;
+
+	default:
+		errx(1, "COPY data after end marker");
+	}
+
+	while (p < end) {
+		p += copy_scan(p, end - p, delim);
+		if (p == end) {
+			break;
+		}
+
+		if (*p == '\\') {
+			cp->cp_escaped = 1;
+			if (++p == end) {
+				cp->cp_state = COPY_ESCAPE;
+				break;
+			}
+			p++;
+			continue;
+		}
+
+		if (copy_end_column(cp, p, *p == '\n', 0, null, null_len)) {
+			cp->cp_state = COPY_DONE;
+			*donep = 1;
+			return (p + 1 - buf);
+		}
+		cp->cp_start = ++p;
+	}
+
+	copy_spill(cp, end);
+	return (len);
+}
+
+static size_t
+copy_parse_default(copy_parser_t *cp, const char *buf, size_t len, int *donep)
+{
+	return (copy_parse_impl(cp, buf, len, donep, COPY_DEFAULT_DELIMITER,
+	    COPY_DEFAULT_NULL, sizeof (COPY_DEFAULT_NULL) - 1));
+}
+
+static size_t
+copy_parse_generic(copy_parser_t *cp, const char *buf, size_t len, int *donep)
+{
+	return (copy_parse_impl(cp, buf, len, donep,
+	    cp->cp_command->cmdc_delimiter, cp->cp_command->cmdc_null_string,
+	    cp->cp_null_len));
+}
+
+/*
+ * The CSV format.  Unquoted column text is handled as in the text format,
+ * as a slice of the input buffer where possible.  Once a quote is seen, the
+ * column's text so far is moved into the arena, and the contents of the
+ * quoted section are appended to it with the quote and escape characters
+ * removed.
+ */
+static size_t
+copy_parse_csv(copy_parser_t *cp, const char *buf, size_t len, int *donep)
+{
+	command_copy_t *cmdc = cp->cp_command;
+	char delim = cmdc->cmdc_delimiter;
+	char quote = cmdc->cmdc_quote;
+	char escape = cmdc->cmdc_escape;
+	const char *p = buf;
+	const char *end = buf + len;
+
+	*donep = 0;
+	if (len == 0) {
+		return (0);
+	}
+	if (cp->cp_state == COPY_DONE) {
+		errx(1, "COPY data after end marker");
+	}
+	cp->cp_start = p;
+
+	while (p < end) {
+		switch (cp->cp_state) {
+		case COPY_COLUMN:
+			p += copy_scan_chars(p, end - p, delim, '\n', quote);
+			if (p == end) {
+				break;
+			}
+
+			if (*p == quote) {
+				if (cp->cp_spilled) {
+					(void) copy_arena_append(cp,
+					    cp->cp_start, p - cp->cp_start);
+				} else {
+					/*
+					 * The column's text must be contiguous
+					 * in the arena, so any earlier columns
+					 * are moved there first.
+					 */
+					copy_spill_fields(cp);
+					cp->cp_start_off = copy_arena_append(cp,
+					    cp->cp_start, p - cp->cp_start);
+					cp->cp_spilled = 1;
+				}
+				cp->cp_quoted = 1;
+				cp->cp_state = COPY_QUOTED;
+				cp->cp_start = ++p;
+				break;
+			}
+
+			if (copy_end_column(cp, p, *p == '\n', cp->cp_quoted,
+			    cmdc->cmdc_null_string, cp->cp_null_len)) {
+				cp->cp_state = COPY_DONE;
+				*donep = 1;
+				return (p + 1 - buf);
+			}
+			cp->cp_quoted = 0;
+			cp->cp_start = ++p;
+			break;
+
+		case COPY_QUOTED:
+			p += copy_scan_chars(p, end - p, quote, escape, quote);
+			if (p == end) {
+				break;
+			}
+
+			(void) copy_arena_append(cp, cp->cp_start,
+			    p - cp->cp_start);
+			cp->cp_pending = *p++;
+			cp->cp_state = COPY_QUOTE;
+			cp->cp_start = p;
+			break;
+
+		case COPY_QUOTE:
+			if (cp->cp_pending == escape &&
+			    (*p == quote || *p == escape)) {
+				/*
+				 * An escaped quote or escape character.  When
+				 * they are the same character, this is a
+				 * doubled quote.
+				 */
+				(void) copy_arena_append(cp, p, 1);
+				p++;
+				cp->cp_state = COPY_QUOTED;
+			} else if (cp->cp_pending == quote) {
+				/*
+				 * The end of the quoted section.  This byte
+				 * is examined again as unquoted text.
+				 */
+				cp->cp_state = COPY_COLUMN;
+			} else {
+				/*
+				 * An escape character that escapes nothing
+				 * stands for itself.
+				 */
+				(void) copy_arena_append(cp, &cp->cp_pending,
+				    1);
+				cp->cp_state = COPY_QUOTED;
+			}
+			cp->cp_start = p;
+			break;
+
+		default:
+			abort();
+		}
+	}
+
+	copy_spill(cp, end);
+	return (len);
+}
+
+/*
+ * The binary format stores each value in the internal binary form of its
+ * type, and carries no type information; the types are those of the columns
+ * in the CREATE TABLE command for the table.  Values are converted to the
+ * text that PostgreSQL would have written in the text format.
+ */
+static const struct {
+	const char *cbt_name;
+	copy_binary_type_t cbt_type;
+} copy_binary_types[] = {
+	{ "text",			COPY_T_TEXT },
+	{ "character varying",		COPY_T_TEXT },
+	{ "varchar",			COPY_T_TEXT },
+	{ "character",			COPY_T_TEXT },
+	{ "char",			COPY_T_TEXT },
+	{ "bpchar",			COPY_T_TEXT },
+	{ "name",			COPY_T_TEXT },
+	{ "json",			COPY_T_TEXT },
+	{ "citext",			COPY_T_TEXT },
+	{ "xml",			COPY_T_TEXT },
+	{ "jsonb",			COPY_T_JSONB },
+	{ "bytea",			COPY_T_BYTEA },
+	{ "boolean",			COPY_T_BOOL },
+	{ "bool",			COPY_T_BOOL },
+	{ "smallint",			COPY_T_INT },
+	{ "integer",			COPY_T_INT },
+	{ "int",			COPY_T_INT },
+	{ "bigint",			COPY_T_INT },
+	{ "int2",			COPY_T_INT },
+	{ "int4",			COPY_T_INT },
+	{ "int8",			COPY_T_INT },
+	{ "smallserial",		COPY_T_INT },
+	{ "serial",			COPY_T_INT },
+	{ "bigserial",			COPY_T_INT },
+	{ "serial2",			COPY_T_INT },
+	{ "serial4",			COPY_T_INT },
+	{ "serial8",			COPY_T_INT },
+	{ "oid",			COPY_T_OID },
+	{ "real",			COPY_T_FLOAT },
+	{ "double precision",		COPY_T_FLOAT },
+	{ "float",			COPY_T_FLOAT },
+	{ "float4",			COPY_T_FLOAT },
+	{ "float8",			COPY_T_FLOAT },
+	{ "numeric",			COPY_T_NUMERIC },
+	{ "decimal",			COPY_T_NUMERIC },
+	{ "date",			COPY_T_DATE },
+	{ "timestamp",			COPY_T_TIMESTAMP },
+	{ "timestamp without time zone", COPY_T_TIMESTAMP },
+	{ "timestamptz",		COPY_T_TIMESTAMPTZ },
+	{ "timestamp with time zone",	COPY_T_TIMESTAMPTZ },
+	{ "uuid",			COPY_T_UUID },
+};
+
+static copy_binary_type_t
+copy_binary_type(const char *name)
+{
+	for (unsigned i = 0; i < sizeof (copy_binary_types) /
+	    sizeof (copy_binary_types[0]); i++) {
+		if (strcasecmp(name, copy_binary_types[i].cbt_name) == 0) {
+			return (copy_binary_types[i].cbt_type);
+		}
+	}
+
+	return (COPY_T_UNKNOWN);
+}
+
+static const char copy_hexdigits[] = "0123456789abcdef";
+
+static uint16_t
+copy_be16(const unsigned char *p)
+{
+	return ((uint16_t)(p[0] << 8 | p[1]));
+}
+
+static uint32_t
+copy_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static uint64_t
+copy_be64(const unsigned char *p)
+{
+	return ((uint64_t)copy_be32(p) << 32 | copy_be32(p + 4));
+}
+
+/*
+ * Convert a Julian day number to a Gregorian calendar date, as j2date() does
+ * in PostgreSQL.
+ */
+static void
+copy_j2date(int jd, int *year, int *month, int *day)
+{
+	unsigned julian, quad, extra;
+	int y;
+
+	julian = jd;
+	julian += 32044;
+	quad = julian / 146097;
+	extra = (julian - quad * 146097) * 4 + 3;
+	julian += 60 + quad * 3 + extra / 146097;
+	quad = julian / 1461;
+	julian -= quad * 1461;
+	y = julian * 4 / 1461;
+	julian = ((y != 0) ? ((julian + 305) % 365) :
+	    ((julian + 306) % 366)) + 123;
+	y += quad * 4;
+	*year = y - 4800;
+	quad = julian * 2141 / 65536;
+	*day = julian - 7834 * quad / 256;
+	*month = (quad + 10) % 12 + 1;
+}
+
+/*
+ * Dates and timestamps count from 2000-01-01.
+ */
+#define	COPY_POSTGRES_EPOCH_JDATE	2451545
+#define	COPY_USECS_PER_DAY		86400000000LL
+
+static size_t
+copy_format_date(char *out, int days, int64_t usecs, int time, int tz)
+{
+	int year, month, day;
+	size_t o;
+
+	copy_j2date(days + COPY_POSTGRES_EPOCH_JDATE, &year, &month, &day);
+	o = sprintf(out, "%04d-%02d-%02d", year > 0 ? year : -(year - 1),
+	    month, day);
+
+	if (time) {
+		int64_t secs = usecs / 1000000;
+		int fsec = usecs % 1000000;
+
+		o += sprintf(out + o, " %02d:%02d:%02d", (int)(secs / 3600),
+		    (int)(secs / 60 % 60), (int)(secs % 60));
+		if (fsec != 0) {
+			/*
+			 * Trailing zeroes of the fraction are not shown.
+			 */
+			o += sprintf(out + o, ".%06d", fsec);
+			while (out[o - 1] == '0') {
+				o--;
+			}
+		}
+		if (tz) {
+			o += sprintf(out + o, "+00");
+		}
+	}
+
+	if (year <= 0) {
+		o += sprintf(out + o, " BC");
+	}
+
+	return (o);
+}
+
+/*
+ * Format a float the way PostgreSQL does by default (with extra_float_digits
+ * set to 1): the shortest text that reads back as the same value, in fixed
+ * notation for moderate exponents and in exponential notation otherwise.
+ */
+static size_t
+copy_format_float(char *out, double v, int is_double)
+{
+	char tmp[40];
+	int prec, exp, ndig;
+	const char *digits;
+	size_t o = 0;
+
+	if (isnan(v)) {
+		return (sprintf(out, "NaN"));
+	} else if (isinf(v)) {
+		return (sprintf(out, "%sInfinity", v < 0 ? "-" : ""));
+	} else if (v == 0) {
+		return (sprintf(out, "%s0", signbit(v) ? "-" : ""));
+	}
+
+	for (prec = 0; prec < 17; prec++) {
+		(void) snprintf(tmp, sizeof (tmp), "%.*e", prec, v);
+		if (is_double ? strtod(tmp, NULL) == v :
+		    strtof(tmp, NULL) == (float)v) {
+			break;
+		}
+	}
+
+	/*
+	 * Collect the significant digits, without the decimal point and with
+	 * trailing zeroes removed, and the exponent.
+	 */
+	char *e = strchr(tmp, 'e');
+	exp = atoi(e + 1);
+	digits = tmp[0] == '-' ? tmp + 1 : tmp;
+	if (tmp[0] == '-') {
+		out[o++] = '-';
+	}
+	ndig = 0;
+	char dig[20];
+	for (const char *d = digits; d < e; d++) {
+		if (*d != '.') {
+			dig[ndig++] = *d;
+		}
+	}
+	while (ndig > 1 && dig[ndig - 1] == '0') {
+		ndig--;
+	}
+
+	if (exp < -4 || exp >= (is_double ? 15 : 6)) {
+		out[o++] = dig[0];
+		if (ndig > 1) {
+			out[o++] = '.';
+			bcopy(dig + 1, out + o, ndig - 1);
+			o += ndig - 1;
+		}
+		o += sprintf(out + o, "e%c%02d", exp < 0 ? '-' : '+',
+		    exp < 0 ? -exp : exp);
+	} else if (exp < 0) {
+		out[o++] = '0';
+		out[o++] = '.';
+		for (int i = -1; i > exp; i--) {
+			out[o++] = '0';
+		}
+		bcopy(dig, out + o, ndig);
+		o += ndig;
+	} else {
+		for (int i = 0; i <= exp; i++) {
+			out[o++] = i < ndig ? dig[i] : '0';
+		}
+		if (ndig > exp + 1) {
+			out[o++] = '.';
+			bcopy(dig + exp + 1, out + o, ndig - exp - 1);
+			o += ndig - exp - 1;
+		}
+	}
+
+	return (o);
+}
+
+/*
+ * Format a numeric value, following get_str_from_var() in PostgreSQL.  The
+ * digits are in base 10000, and "weight" is the power of 10000 of the first
+ * of them.  Returns -1 if the value is malformed.
+ */
+#define	COPY_NUMERIC_NEG	0x4000
+#define	COPY_NUMERIC_NAN	0xC000
+#define	COPY_NUMERIC_PINF	0xD000
+#define	COPY_NUMERIC_NINF	0xF000
+
+static ssize_t
+copy_format_numeric(char *out, const unsigned char *raw, size_t len)
+{
+	int ndigits = (int16_t)copy_be16(raw);
+	int weight = (int16_t)copy_be16(raw + 2);
+	unsigned sign = copy_be16(raw + 4);
+	int dscale = copy_be16(raw + 6);
+	const unsigned char *digits = raw + 8;
+	size_t o = 0;
+	int d;
+
+	if (sign == COPY_NUMERIC_NAN) {
+		return (sprintf(out, "NaN"));
+	} else if (sign == COPY_NUMERIC_PINF) {
+		return (sprintf(out, "Infinity"));
+	} else if (sign == COPY_NUMERIC_NINF) {
+		return (sprintf(out, "-Infinity"));
+	}
+	if (ndigits < 0 || len != 8 + 2 * (size_t)ndigits ||
+	    (sign != 0 && sign != COPY_NUMERIC_NEG)) {
+		return (-1);
+	}
+
+#define	COPY_NUMERIC_DIGIT(i)	\
+	((i) >= 0 && (i) < ndigits ? copy_be16(digits + 2 * (i)) : 0)
+
+	if (sign == COPY_NUMERIC_NEG) {
+		out[o++] = '-';
+	}
+
+	if (weight < 0) {
+		d = weight + 1;
+		out[o++] = '0';
+	} else {
+		for (d = 0; d <= weight; d++) {
+			unsigned dig = COPY_NUMERIC_DIGIT(d);
+
+			if (dig > 9999) {
+				return (-1);
+			}
+			o += sprintf(out + o, d == 0 ? "%u" : "%04u", dig);
+		}
+	}
+
+	if (dscale > 0) {
+		size_t endo;
+
+		out[o++] = '.';
+		endo = o + dscale;
+		for (int i = 0; i < dscale; d++, i += 4) {
+			unsigned dig = COPY_NUMERIC_DIGIT(d);
+
+			if (dig > 9999) {
+				return (-1);
+			}
+			o += sprintf(out + o, "%04u", dig);
+		}
+		o = endo;
+	}
+
+#undef	COPY_NUMERIC_DIGIT
+
+	return (o);
+}
+
+/*
+ * The largest text form of a value of each type, other than those whose text
+ * form depends on the length of the value.
+ */
+#define	COPY_BINARY_TEXT_MAX	64
+
+/*
+ * Convert a binary format value to text, storing the result in the arena.
+ * The raw value may itself be in the arena, at offset "rawoff".
+ */
+static void
+copy_binary_value(copy_parser_t *cp, copy_field_t *cf, const char *raw,
+    size_t len, int spilled, size_t rawoff)
+{
+	copy_binary_type_t type = cp->cp_bin_types[cp->cp_col];
+	const unsigned char *u;
+	size_t need, off;
+	ssize_t o;
+
+	if (type == COPY_T_TEXT) {
+		if (spilled) {
+			cf->cf_ptr = NULL;
+			cf->cf_off = rawoff;
+		} else {
+			cf->cf_ptr = raw;
+		}
+		cf->cf_len = len;
+		return;
+	}
+
+	switch (type) {
+	case COPY_T_JSONB:
+		need = len;
+		break;
+	case COPY_T_BYTEA:
+		need = 2 + 2 * len;
+		break;
+	case COPY_T_NUMERIC:
+		need = len < 8 ? 0 : 2 + 4 * (size_t)(abs((int16_t)copy_be16(
+		    (const unsigned char *)raw + 2)) + 1) +
+		    copy_be16((const unsigned char *)raw + 6) + 4;
+		need = need < COPY_BINARY_TEXT_MAX ? COPY_BINARY_TEXT_MAX :
+		    need;
+		break;
+	default:
+		need = COPY_BINARY_TEXT_MAX;
+		break;
+	}
+
+	off = copy_arena_reserve(cp, need);
+	if (spilled) {
+		raw = cp->cp_arena + rawoff;
+	}
+	u = (const unsigned char *)raw;
+
+	char *out = cp->cp_arena + off;
+	switch (type) {
+	case COPY_T_JSONB:
+		if (len < 1 || u[0] != 1) {
+			errx(1, "unsupported jsonb version in binary COPY");
+		}
+		bcopy(raw + 1, out, len - 1);
+		o = len - 1;
+		break;
+
+	case COPY_T_BYTEA:
+		out[0] = '\\';
+		out[1] = 'x';
+		for (size_t i = 0; i < len; i++) {
+			out[2 + 2 * i] = copy_hexdigits[u[i] >> 4];
+			out[3 + 2 * i] = copy_hexdigits[u[i] & 0xf];
+		}
+		o = 2 + 2 * len;
+		break;
+
+	case COPY_T_BOOL:
+		o = len == 1 ? sprintf(out, "%c", u[0] != 0 ? 't' : 'f') : -1;
+		break;
+
+	case COPY_T_INT:
+		o = len == 2 ? sprintf(out, "%d", (int16_t)copy_be16(u)) :
+		    len == 4 ? sprintf(out, "%d", (int32_t)copy_be32(u)) :
+		    len == 8 ? sprintf(out, "%lld",
+		    (long long)(int64_t)copy_be64(u)) : -1;
+		break;
+
+	case COPY_T_OID:
+		o = len == 4 ? sprintf(out, "%u", copy_be32(u)) : -1;
+		break;
+
+	case COPY_T_FLOAT:
+		if (len == 4) {
+			uint32_t bits = copy_be32(u);
+			float f;
+
+			bcopy(&bits, &f, sizeof (f));
+			o = copy_format_float(out, f, 0);
+		} else if (len == 8) {
+			uint64_t bits = copy_be64(u);
+			double d;
+
+			bcopy(&bits, &d, sizeof (d));
+			o = copy_format_float(out, d, 1);
+		} else {
+			o = -1;
+		}
+		break;
+
+	case COPY_T_NUMERIC:
+		o = len < 8 ? -1 : copy_format_numeric(out, u, len);
+		break;
+
+	case COPY_T_DATE:
+		if (len != 4) {
+			o = -1;
+		} else if ((int32_t)copy_be32(u) == INT32_MIN) {
+			o = sprintf(out, "-infinity");
+		} else if ((int32_t)copy_be32(u) == INT32_MAX) {
+			o = sprintf(out, "infinity");
+		} else {
+			o = copy_format_date(out, (int32_t)copy_be32(u), 0, 0,
+			    0);
+		}
+		break;
+
+	case COPY_T_TIMESTAMP:
+	case COPY_T_TIMESTAMPTZ:
+		if (len != 8) {
+			o = -1;
+		} else if ((int64_t)copy_be64(u) == INT64_MIN) {
+			o = sprintf(out, "-infinity");
+		} else if ((int64_t)copy_be64(u) == INT64_MAX) {
+			o = sprintf(out, "infinity");
+		} else {
+			int64_t ts = (int64_t)copy_be64(u);
+			int64_t days = ts / COPY_USECS_PER_DAY;
+
+			ts -= days * COPY_USECS_PER_DAY;
+			if (ts < 0) {
+				ts += COPY_USECS_PER_DAY;
+				days--;
+			}
+			o = copy_format_date(out, (int)days, ts, 1,
+			    type == COPY_T_TIMESTAMPTZ);
+		}
+		break;
+
+	case COPY_T_UUID:
+		if (len != 16) {
+			o = -1;
+			break;
+		}
+		o = 0;
+		for (unsigned i = 0; i < 16; i++) {
+			if (i == 4 || i == 6 || i == 8 || i == 10) {
+				out[o++] = '-';
+			}
+			out[o++] = copy_hexdigits[u[i] >> 4];
+			out[o++] = copy_hexdigits[u[i] & 0xf];
+		}
+		break;
+
+	default:
+		errx(1, "COPY column \"%s\" has a type that cannot be read "
+		    "from the binary format",
+		    strlist_get(cp->cp_command->cmdc_column_names, cp->cp_col));
+	}
+
+	if (o < 0) {
+		errx(1, "invalid binary COPY value for column \"%s\"",
+		    strlist_get(cp->cp_command->cmdc_column_names, cp->cp_col));
+	}
+
+	cf->cf_ptr = NULL;
+	cf->cf_off = off;
+	cf->cf_len = o;
+	cp->cp_arena_len = off + o;
+}
+
+/*
+ * Gather a fixed size item of the binary format, which may span input
+ * buffers.  Returns a pointer to the item when it is complete, or NULL if
+ * the buffer ran out first.
+ */
+static const unsigned char *
+copy_binary_item(copy_parser_t *cp, const char **pp, const char *end,
+    size_t want)
+{
+	const char *p = *pp;
+	size_t n;
+
+	if (cp->cp_bin_have == 0 && (size_t)(end - p) >= want) {
+		*pp = p + want;
+		return ((const unsigned char *)p);
+	}
+
+	n = want - cp->cp_bin_have;
+	if (n > (size_t)(end - p)) {
+		n = end - p;
+	}
+	bcopy(p, cp->cp_bin_buf + cp->cp_bin_have, n);
+	cp->cp_bin_have += n;
+	*pp = p + n;
+
+	if (cp->cp_bin_have < want) {
+		return (NULL);
+	}
+	cp->cp_bin_have = 0;
+	return ((const unsigned char *)cp->cp_bin_buf);
+}
+
+#define	COPY_BINARY_SIGNATURE	"PGCOPY\n\377\r\n"
+
+static size_t
+copy_parse_binary(copy_parser_t *cp, const char *buf, size_t len, int *donep)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+	const unsigned char *u;
+
+	*donep = 0;
+	if (cp->cp_state == COPY_DONE && len > 0) {
+		errx(1, "COPY data after end marker");
+	}
+
+	while (p < end) {
+		switch (cp->cp_bin_state) {
+		case COPY_B_SIGNATURE:
+			/*
+			 * The signature includes its terminating NUL.
+			 */
+			if ((u = copy_binary_item(cp, &p, end,
+			    sizeof (COPY_BINARY_SIGNATURE))) == NULL) {
+				break;
+			}
+			if (bcmp(u, COPY_BINARY_SIGNATURE,
+			    sizeof (COPY_BINARY_SIGNATURE)) != 0) {
+				errx(1, "invalid binary COPY signature");
+			}
+			cp->cp_bin_state = COPY_B_FLAGS;
+			break;
+
+		case COPY_B_FLAGS:
+			if ((u = copy_binary_item(cp, &p, end, 4)) == NULL) {
+				break;
+			}
+			if (copy_be32(u) & (1U << 16)) {
+				errx(1, "binary COPY with OIDs is not "
+				    "supported");
+			}
+			if (copy_be32(u) & 0xffff0000U) {
+				errx(1, "unrecognised critical flags in binary "
+				    "COPY header");
+			}
+			cp->cp_bin_state = COPY_B_EXTENSION_LEN;
+			break;
+
+		case COPY_B_EXTENSION_LEN:
+			if ((u = copy_binary_item(cp, &p, end, 4)) == NULL) {
+				break;
+			}
+			cp->cp_bin_remain = copy_be32(u);
+			cp->cp_bin_state = COPY_B_EXTENSION;
+			break;
+
+		case COPY_B_EXTENSION: {
+			size_t n = end - p;
+
+			if (n > cp->cp_bin_remain) {
+				n = cp->cp_bin_remain;
+			}
+			p += n;
+			if ((cp->cp_bin_remain -= n) == 0) {
+				cp->cp_bin_state = COPY_B_TUPLE;
+			}
+			break;
+		}
+
+		case COPY_B_TUPLE:
+			if ((u = copy_binary_item(cp, &p, end, 2)) == NULL) {
+				break;
+			}
+			if ((int16_t)copy_be16(u) == -1) {
+				cp->cp_state = COPY_DONE;
+				*donep = 1;
+				return (p - buf);
+			}
+			if (copy_be16(u) != cp->cp_ncols) {
+				errx(1, "wrong number of columns on COPY row");
+			}
+			cp->cp_bin_state = COPY_B_FIELD_LEN;
+			break;
+
+		case COPY_B_FIELD_LEN:
+			if ((u = copy_binary_item(cp, &p, end, 4)) == NULL) {
+				break;
+			}
+			if ((int32_t)copy_be32(u) < -1) {
+				errx(1, "invalid binary COPY field length");
+			}
+			if ((int32_t)copy_be32(u) == -1) {
+				cp->cp_fields[cp->cp_col].cf_null = 1;
+			} else {
+				cp->cp_bin_remain = copy_be32(u);
+				cp->cp_bin_state = COPY_B_FIELD;
+				cp->cp_spilled = 0;
+				break;
+			}
+			goto next_field;
+
+		case COPY_B_FIELD: {
+			copy_field_t *cf = &cp->cp_fields[cp->cp_col];
+			size_t n = end - p;
+
+			if (n < cp->cp_bin_remain || cp->cp_spilled) {
+				/*
+				 * The value spans input buffers, and is
+				 * collected in the arena.
+				 */
+				if (n > cp->cp_bin_remain) {
+					n = cp->cp_bin_remain;
+				}
+				if (cp->cp_spilled) {
+					(void) copy_arena_append(cp, p, n);
+				} else {
+					copy_spill_fields(cp);
+					cp->cp_start_off = copy_arena_append(cp,
+					    p, n);
+					cp->cp_spilled = 1;
+				}
+				p += n;
+				if ((cp->cp_bin_remain -= n) > 0) {
+					break;
+				}
+				copy_binary_value(cp, cf,
+				    cp->cp_arena + cp->cp_start_off,
+				    cp->cp_arena_len - cp->cp_start_off, 1,
+				    cp->cp_start_off);
+			} else {
+				copy_binary_value(cp, cf, p, cp->cp_bin_remain,
+				    0, 0);
+				p += cp->cp_bin_remain;
+			}
+			cf->cf_null = 0;
+			cp->cp_spilled = 0;
+		}
+		next_field:
+			if (++cp->cp_col < cp->cp_ncols) {
+				cp->cp_bin_state = COPY_B_FIELD_LEN;
+				break;
+			}
+			copy_emit_row(cp);
+			cp->cp_col = 0;
+			cp->cp_arena_len = 0;
+			cp->cp_bin_state = COPY_B_TUPLE;
+			break;
+		}
+	}
+
+	copy_spill_fields(cp);
+	return (len);
+}
+
+/*
+ * Parse COPY row data from a buffer.  Returns the number of bytes consumed,
+ * which is the whole buffer unless the end of data marker was found; in that
+ * case "donep" is set and the bytes following the marker are not consumed.
+ * The buffer need not remain valid after this function returns.
+ */
+size_t
+copy_parse(copy_parser_t *cp, const char *buf, size_t len, int *donep)
+{
+	size_t n = 0;
+
+	*donep = 0;
+
+	if (cp->cp_state == COPY_REST && len > 0) {
+		if (buf[0] != '\n') {
+			errx(1, "expected new line after COPY command");
+		}
+		n = 1;
+		cp->cp_state = cp->cp_command->cmdc_header ? COPY_HEADER :
+		    COPY_COLUMN;
+	}
+
+	if (cp->cp_state == COPY_HEADER) {
+		/*
+		 * The header line of column names is ignored.
+		 */
+		const char *nl = memchr(buf + n, '\n', len - n);
+
+		if (nl == NULL) {
+			return (len);
+		}
+		n = nl + 1 - buf;
+		cp->cp_state = COPY_COLUMN;
+	}
+
+	return (n + cp->cp_parse(cp, buf + n, len - n, donep));
+}
+
+/*
+ * The text format splitter.  Rows end at a newline that is not escaped by a
+ * backslash, so finding them needs only a scan for those two characters,
+ * rather than the work of parsing each column.
+ */
+typedef enum copy_split_state {
+	COPY_S_REST = 1,	/* expecting newline after COPY command */
+	COPY_S_HEADER,		/* skipping the header line */
+	COPY_S_ROW_START,
+	COPY_S_ROW,
+	COPY_S_ESCAPE,		/* previous buffer ended with a backslash */
+	COPY_S_MARK,		/* backslash at the start of a row */
+	COPY_S_MARK_DOT,	/* "\." at the start of a row */
+	COPY_S_DONE,
+} copy_split_state_t;
+
+void
+copy_split_init(copy_split_t *cs, command_copy_t *cmdc)
+{
+	bzero(cs, sizeof (*cs));
+	cs->cs_state = COPY_S_REST;
+	cs->cs_header = cmdc->cmdc_header;
+}
+
+/*
+ * Consume text format COPY data from "buf", stopping early only at the end
+ * of data marker, or at the first row boundary once at least "want" bytes of
+ * row data have been consumed.  Returns the number of bytes consumed.
+ */
+size_t
+copy_split(copy_split_t *cs, const char *buf, size_t len, size_t want)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+	const char *data;
+	uint64_t rows = 0;
+
+	cs->cs_skip = 0;
+	cs->cs_cut = 0;
+	cs->cs_done = 0;
+
+	if (cs->cs_state == COPY_S_REST && p < end) {
+		if (*p++ != '\n') {
+			errx(1, "expected new line after COPY command");
+		}
+		cs->cs_state = cs->cs_header ? COPY_S_HEADER :
+		    COPY_S_ROW_START;
+	}
+
+	if (cs->cs_state == COPY_S_HEADER) {
+		const char *nl = memchr(p, '\n', end - p);
+
+		if (nl == NULL) {
+			cs->cs_skip = len;
+			cs->cs_chunk_rows = 0;
+			return (len);
+		}
+		p = nl + 1;
+		cs->cs_state = COPY_S_ROW_START;
+	}
+
+	data = p;
+	cs->cs_skip = data - buf;
+
+	while (p < end) {
+		switch (cs->cs_state) {
+		case COPY_S_ROW_START:
+			if ((size_t)(p - data) >= want) {
+				goto out;
+			}
+			if (*p == '\\') {
+				cs->cs_state = COPY_S_MARK;
+				p++;
+				continue;
+			}
+			cs->cs_state = COPY_S_ROW;
+			/* FALLTHROUGH */
+
+		case COPY_S_ROW:
+			p += copy_scan_chars(p, end - p, '\n', '\\', '\\');
+			if (p == end) {
+				continue;
+			}
+			if (*p++ == '\n') {
+				rows++;
+				cs->cs_state = COPY_S_ROW_START;
+			} else {
+				cs->cs_state = COPY_S_ESCAPE;
+			}
+			continue;
+
+		case COPY_S_ESCAPE:
+			p++;
+			cs->cs_state = COPY_S_ROW;
+			continue;
+
+		case COPY_S_MARK:
+			cs->cs_state = *p++ == '.' ? COPY_S_MARK_DOT :
+			    COPY_S_ROW;
+			continue;
+
+		case COPY_S_MARK_DOT:
+			if (*p == '\n') {
+				p++;
+				cs->cs_state = COPY_S_DONE;
+				cs->cs_done = 1;
+				goto out;
+			}
+			cs->cs_state = COPY_S_ROW;
+			continue;
+
+		default:
+			errx(1, "COPY data after end marker");
+		}
+	}
+
+out:
+	cs->cs_cut = cs->cs_state == COPY_S_ROW_START ||
+	    cs->cs_state == COPY_S_DONE;
+	cs->cs_chunk_rows = rows;
+	cs->cs_rows += rows;
+	return (p - buf);
+}
@@ -133,9 +133,18 @@ custr_expand(custr_t *cus, size_t expand_by)
 static int
 custr_append_vprintf(custr_t *cus, const char *fmt, va_list ap)
 {
-	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_list ap_copy;
+	int len;
 	size_t chunksz = STRING_CHUNK_SIZE;
 
+	/*
+	 * The argument list is consumed twice: once to size the output and
+	 * once to format it.
+	 */
+	va_copy(ap_copy, ap);
+	len = vsnprintf(NULL, 0, fmt, ap_copy);
+	va_end(ap_copy);
+
 	if (len < 0) {
 		return (-1);
 	}
@@ -180,7 +189,7 @@ custr_append_vprintf(custr_t *cus, const char *fmt, va_list ap)
 	 * Append new string to existing string:
 	 */
 	len = vsnprintf(cus->cus_data + cus->cus_strlen,
-	    (uintptr_t)cus->cus_data - (uintptr_t)cus->cus_strlen, fmt, ap);
+	    cus->cus_datalen - cus->cus_strlen, fmt, ap);
 	if (len == -1)
 		return (len);
 	cus->cus_strlen += len;
@@ -201,6 +210,20 @@ custr_appendc(custr_t *cus, char newc)
 	return (0);
 }
 
+int
+custr_append_buf(custr_t *cus, const char *buf, size_t len)
+{
+	if (custr_expand(cus, len) != 0) {
+		return (-1);
+	}
+
+	(void) memcpy(cus->cus_data + cus->cus_strlen, buf, len);
+	cus->cus_strlen += len;
+	cus->cus_data[cus->cus_strlen] = '\0';
+
+	return (0);
+}
+
 int
 custr_append_printf(custr_t *cus, const char *fmt, ...)
 {
@@ -217,7 +240,7 @@ custr_append_printf(custr_t *cus, const char *fmt, ...)
 int
 custr_append(custr_t *cus, const char *name)
 {
-	return (custr_append_printf(cus, "%s", name));
+	return (custr_append_buf(cus, name, strlen(name)));
 }
 
 int
@@ -21,6 +21,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define	JSON_SSE2	1
+#endif
 
 #include <custr.h>
 
@@ -31,6 +38,14 @@
  */
 #define	JSON_MAX_DEPTH	255
 
+/*
+ * JSON_BUFSZ is the size of the output buffer used by the stdio and file
+ * descriptor backends.  Output is collected there and written out in large
+ * pieces, rather than handed to the stream a character at a time.
+ */
+#define	JSON_BUFSZ	(128 * 1024)
+#define	JSON_BUFALIGN	4096
+
 typedef enum {
 	JSON_NONE,	/* no object is nested at the current depth */
 	JSON_OBJECT,	/* an object is nested at the current depth */
@@ -39,7 +54,8 @@ typedef enum {
 
 typedef enum {
 	JSON_BACKING_STDIO,
-	JSON_BACKING_STRING
+	JSON_BACKING_STRING,
+	JSON_BACKING_FD
 } json_backing_t;
 
 /*
@@ -56,6 +72,11 @@ struct json_emit {
 
 	FILE			*json_stream;		/* output stream */
 	custr_t			*json_string;		/* output string */
+	int			json_fd;		/* output descriptor */
+
+	/* Output buffer, for the stdio and descriptor backends. */
+	char			*json_buf;
+	size_t			json_buf_len;
 
 	/* Error conditions. */
 	int			json_error_stdio;	/* last stdio error */
@@ -75,6 +96,15 @@ struct json_emit {
 	uint8_t			json_error_utf8_byteval;
 };
 
+/*
+ * A pre-bound label holds the fully escaped and quoted label text, followed
+ * by the colon that separates it from the value.
+ */
+struct json_label {
+	char			*jl_text;
+	size_t			jl_len;
+};
+
 /*
  * General-purpose macros.
  */
@@ -90,10 +120,15 @@ static int json_assert_fail(const char *, const char *, int);
 
 static int json_has_error(json_emit_t *);
 
+static int json_buf_alloc(json_emit_t *);
+static int json_write(json_emit_t *, const char *, size_t, const char *,
+    size_t);
+static void json_emitb(json_emit_t *, const char *, size_t);
 static void json_emits(json_emit_t *, const char *);
 static void json_emitc(json_emit_t *, char);
-static void json_emit_utf8string(json_emit_t *, const char *);
+static void json_emit_utf8string(json_emit_t *, const char *, size_t);
 static void json_emit_prepare(json_emit_t *, const char *);
+static void json_emit_prepare_bound(json_emit_t *, const json_label_t *);
 
 static json_depthdesc_t json_nest_kind(json_emit_t *);
 static void json_nest_begin(json_emit_t *, json_depthdesc_t);
@@ -134,6 +169,38 @@ json_create_stdio(FILE *outstream)
 
 	jse->json_stream = outstream;
 
+	if (json_buf_alloc(jse) != 0) {
+		int e = errno;
+
+		json_fini(jse);
+
+		errno = e;
+		return (NULL);
+	}
+
+	return (jse);
+}
+
+json_emit_t *
+json_create_fd(int fd)
+{
+	json_emit_t *jse;
+
+	if ((jse = json_create_common(JSON_BACKING_FD)) == NULL) {
+		return (NULL);
+	}
+
+	jse->json_fd = fd;
+
+	if (json_buf_alloc(jse) != 0) {
+		int e = errno;
+
+		json_fini(jse);
+
+		errno = e;
+		return (NULL);
+	}
+
 	return (jse);
 }
 
@@ -161,11 +228,89 @@ json_create_string(void)
 void
 json_fini(json_emit_t *jse)
 {
+	json_flush(jse);
+
 	custr_free(jse->json_string);
 	custr_free(jse->json_scratch);
+	free(jse->json_buf);
 	free(jse);
 }
 
+/*
+ * Write out any buffered output.  For the stdio backend, the data is passed
+ * to the stream, which the caller may then wish to flush.  Any error is
+ * recorded as for the emitter functions.
+ */
+void
+json_flush(json_emit_t *jse)
+{
+	if (jse->json_buf_len == 0) {
+		return;
+	}
+
+	if (json_has_error(jse)) {
+		/*
+		 * This output is skipped, along with anything emitted after
+		 * the error.
+		 */
+		jse->json_stdio_nskipped++;
+	} else if (json_write(jse, jse->json_buf, jse->json_buf_len,
+	    NULL, 0) != 0) {
+		jse->json_error_stdio = errno;
+	}
+
+	jse->json_buf_len = 0;
+}
+
+/*
+ * Pre-bind a label, so that it need not be escaped again each time it is
+ * used.  Returns NULL on failure with errno set (to EILSEQ if the label is
+ * not valid UTF-8).
+ */
+json_label_t *
+json_label_create(const char *label)
+{
+	json_emit_t *jse;
+	json_label_t *jl = NULL;
+	int e = 0;
+
+	if ((jse = json_create_string()) == NULL) {
+		return (NULL);
+	}
+
+	json_emit_utf8string(jse, label, strlen(label));
+	json_emitc(jse, ':');
+
+	if (jse->json_error_utf8 != 0) {
+		e = jse->json_error_utf8;
+	} else if (json_has_error(jse)) {
+		e = jse->json_error_stdio != 0 ? jse->json_error_stdio :
+		    ENOMEM;
+	} else if ((jl = calloc(1, sizeof (*jl))) == NULL ||
+	    (jl->jl_text = strdup(json_string_cstr(jse))) == NULL) {
+		e = errno;
+		free(jl);
+		jl = NULL;
+	} else {
+		jl->jl_len = json_string_len(jse);
+	}
+
+	json_fini(jse);
+	errno = e;
+	return (jl);
+}
+
+void
+json_label_fini(json_label_t *jl)
+{
+	if (jl == NULL) {
+		return;
+	}
+
+	free(jl->jl_text);
+	free(jl);
+}
+
 json_error_t
 json_get_error(json_emit_t *jse, char *buf, size_t bufsz)
 {
@@ -173,7 +318,8 @@ json_get_error(json_emit_t *jse, char *buf, size_t bufsz)
 
 	if (jse->json_error_stdio != 0) {
 		kind = JSE_STDIO;
-		(void) snprintf(buf, bufsz, "%s", strerror(errno));
+		(void) snprintf(buf, bufsz, "%s",
+		    strerror(jse->json_error_stdio));
 	} else if (jse->json_depth_exceeded != 0) {
 		kind = JSE_TOODEEP;
 		(void) snprintf(buf, bufsz, "exceeded maximum supported depth");
@@ -267,6 +413,83 @@ json_has_error(json_emit_t *jse)
 	    jse->json_error_scratch != 0 || jse->json_error_utf8 != 0);
 }
 
+static int
+json_buf_alloc(json_emit_t *jse)
+{
+	void *buf;
+	int r;
+
+	if ((r = posix_memalign(&buf, JSON_BUFALIGN, JSON_BUFSZ)) != 0) {
+		errno = r;
+		return (-1);
+	}
+
+	jse->json_buf = buf;
+	jse->json_buf_len = 0;
+	return (0);
+}
+
+/*
+ * Write "buf0" followed by "buf1" (either may be empty) to the output stream
+ * or file descriptor.  The descriptor backend writes both with a single call
+ * to writev() where it can.  Returns 0 on success, or -1 with errno set.
+ */
+static int
+json_write(json_emit_t *jse, const char *buf0, size_t len0, const char *buf1,
+    size_t len1)
+{
+	struct iovec iov[2];
+	int iovcnt = 0;
+
+	if (jse->json_backing == JSON_BACKING_STDIO) {
+		if ((len0 > 0 && fwrite(buf0, 1, len0, jse->json_stream) !=
+		    len0) || (len1 > 0 && fwrite(buf1, 1, len1,
+		    jse->json_stream) != len1)) {
+			return (-1);
+		}
+		return (0);
+	}
+
+	VERIFY(jse->json_backing == JSON_BACKING_FD);
+
+	if (len0 > 0) {
+		iov[iovcnt].iov_base = (void *)buf0;
+		iov[iovcnt].iov_len = len0;
+		iovcnt++;
+	}
+	if (len1 > 0) {
+		iov[iovcnt].iov_base = (void *)buf1;
+		iov[iovcnt].iov_len = len1;
+		iovcnt++;
+	}
+
+	for (int i = 0; i < iovcnt; ) {
+		ssize_t r;
+
+		if ((r = writev(jse->json_fd, &iov[i], iovcnt - i)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+
+		/*
+		 * Account for a short write, which may end part way through
+		 * either buffer.
+		 */
+		while (i < iovcnt && (size_t)r >= iov[i].iov_len) {
+			r -= iov[i].iov_len;
+			i++;
+		}
+		if (i < iovcnt) {
+			iov[i].iov_base = (char *)iov[i].iov_base + r;
+			iov[i].iov_len -= r;
+		}
+	}
+
+	return (0);
+}
+
 static void
 json_emitc(json_emit_t *jse, char c)
 {
@@ -277,9 +500,15 @@ json_emitc(json_emit_t *jse, char c)
 
 	switch (jse->json_backing) {
 	case JSON_BACKING_STDIO:
-		if (fprintf(jse->json_stream, "%c", c) < 0) {
-			jse->json_error_stdio = errno;
+	case JSON_BACKING_FD:
+		if (jse->json_buf_len == JSON_BUFSZ) {
+			json_flush(jse);
+			if (json_has_error(jse)) {
+				jse->json_stdio_nskipped++;
+				return;
+			}
 		}
+		jse->json_buf[jse->json_buf_len++] = c;
 		break;
 
 	case JSON_BACKING_STRING:
@@ -291,7 +520,7 @@ json_emitc(json_emit_t *jse, char c)
 }
 
 static void
-json_emits(json_emit_t *jse, const char *s)
+json_emitb(json_emit_t *jse, const char *buf, size_t len)
 {
 	if (json_has_error(jse)) {
 		jse->json_stdio_nskipped++;
@@ -300,19 +529,50 @@ json_emits(json_emit_t *jse, const char *s)
 
 	switch (jse->json_backing) {
 	case JSON_BACKING_STDIO:
-		if (fprintf(jse->json_stream, "%s", s) < 0) {
-			jse->json_error_stdio = errno;
+	case JSON_BACKING_FD:
+		if (len <= JSON_BUFSZ - jse->json_buf_len) {
+			bcopy(buf, jse->json_buf + jse->json_buf_len, len);
+			jse->json_buf_len += len;
+			break;
+		}
+
+		/*
+		 * This does not fit in the buffer.  If it is large, write it
+		 * out directly along with what has been buffered so far;
+		 * otherwise, start a new buffer with it.
+		 */
+		if (len >= JSON_BUFSZ) {
+			if (json_write(jse, jse->json_buf, jse->json_buf_len,
+			    buf, len) != 0) {
+				jse->json_error_stdio = errno;
+			}
+			jse->json_buf_len = 0;
+			break;
 		}
+
+		json_flush(jse);
+		if (json_has_error(jse)) {
+			jse->json_stdio_nskipped++;
+			return;
+		}
+		bcopy(buf, jse->json_buf, len);
+		jse->json_buf_len = len;
 		break;
 
 	case JSON_BACKING_STRING:
-		if (custr_append(jse->json_string, s) != 0) {
+		if (custr_append_buf(jse->json_string, buf, len) != 0) {
 			jse->json_error_stdio = errno;
 		}
 		break;
 	}
 }
 
+static void
+json_emits(json_emit_t *jse, const char *s)
+{
+	json_emitb(jse, s, strlen(s));
+}
+
 static void
 json_scratch_appendc(json_emit_t *jse, char c)
 {
@@ -326,18 +586,92 @@ json_scratch_appendc(json_emit_t *jse, char c)
 	}
 }
 
+static void
+json_scratch_append(json_emit_t *jse, const char *buf, size_t len)
+{
+	if (json_has_error(jse)) {
+		return;
+	}
+
+	if (custr_append_buf(jse->json_scratch, buf, len) != 0) {
+		jse->json_error_scratch = errno;
+		return;
+	}
+}
+
+/*
+ * Returns the length of the leading run of "buf" that can be copied into a
+ * JSON string verbatim: printable ASCII other than the quotation mark and
+ * reverse solidus.  Control characters, and bytes with the high bit set
+ * (which must be checked as UTF-8), end the run.
+ */
+static size_t
+json_utf8_safe_run(const char *buf, size_t len)
+{
+	size_t i = 0;
+
+#ifdef	JSON_SSE2
+	/*
+	 * Bytes below 0x20 and bytes of 0x80 and above are exactly those
+	 * that are less than 0x20 in a signed comparison.
+	 */
+	const __m128i vlo = _mm_set1_epi8(0x20);
+	const __m128i vq = _mm_set1_epi8('"');
+	const __m128i vbs = _mm_set1_epi8('\\');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i m = _mm_or_si128(_mm_cmplt_epi8(v, vlo),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, vq), _mm_cmpeq_epi8(v, vbs)));
+		unsigned mask = _mm_movemask_epi8(m);
+
+		if (mask != 0) {
+			return (i + __builtin_ctz(mask));
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		unsigned char code = buf[i];
+
+		if (code < 0x20 || code > 0x7F || code == '"' || code == '\\') {
+			break;
+		}
+	}
+
+	return (i);
+}
+
 /*
- * Emits a UTF-8 (or 7-bit clean ASCII) string, with appropriate translation of
- * characters that must be escaped in the JSON representation.
+ * Emits a UTF-8 (or 7-bit clean ASCII) string of "len" bytes, with
+ * appropriate translation of characters that must be escaped in the JSON
+ * representation.  A NUL byte is escaped like any other control character.
  */
 static void
-json_emit_utf8string(json_emit_t *jse, const char *utf8str)
+json_emit_utf8string(json_emit_t *jse, const char *utf8str, size_t len)
 {
 	unsigned utf8_more_bytes = 0;
 
+	const char *end = utf8str + len;
+
 	custr_reset(jse->json_scratch);
 
-	for (const char *cp = utf8str; *cp != '\0'; cp++) {
+	for (const char *cp = utf8str; cp < end; cp++) {
+		if (utf8_more_bytes == 0) {
+			/*
+			 * Copy any run of characters that need neither
+			 * escaping nor validation in one go.
+			 */
+			size_t run = json_utf8_safe_run(cp, end - cp);
+
+			if (run > 0) {
+				json_scratch_append(jse, cp, run);
+				if ((cp += run) == end) {
+					break;
+				}
+			}
+		}
+
 		char c = *cp;
 		unsigned char code = c;
 
@@ -430,6 +764,26 @@ json_emit_utf8string(json_emit_t *jse, const char *utf8str)
 			continue;
 		}
 
+		/*
+		 * A UTF-16 surrogate has no valid UTF-8 encoding, but a JSON
+		 * string may contain one as a lone escape sequence.  If a
+		 * surrogate has been encoded as if it were any other
+		 * character, write it back out as an escape sequence, as
+		 * JSON.stringify() does.
+		 */
+		if (code == 0xED && end - cp >= 3 &&
+		    ((unsigned char)cp[1] & 0xE0) == 0xA0 &&
+		    ((unsigned char)cp[2] & 0xC0) == 0x80) {
+			char num[7];
+
+			(void) snprintf(num, sizeof (num), "\\u%04x",
+			    0xD000 | (((unsigned char)cp[1] & 0x3F) << 6) |
+			    ((unsigned char)cp[2] & 0x3F));
+			json_scratch_append(jse, num, 6);
+			cp += 2;
+			continue;
+		}
+
 		/*
 		 * Check for a UTF-8 multibyte character.
 		 *
@@ -470,7 +824,8 @@ json_emit_utf8string(json_emit_t *jse, const char *utf8str)
 	}
 
 	json_emitc(jse, '"');
-	json_emits(jse, custr_cstr(jse->json_scratch));
+	json_emitb(jse, custr_cstr(jse->json_scratch),
+	    custr_len(jse->json_scratch));
 	json_emitc(jse, '"');
 }
 
@@ -502,10 +857,25 @@ json_emit_prepare(json_emit_t *jse, const char *label)
 	}
 
 	VERIFY(kind == JSON_OBJECT);
-	json_emit_utf8string(jse, label);
+	json_emit_utf8string(jse, label, strlen(label));
 	json_emitc(jse, ':');
 }
 
+/*
+ * As for json_emit_prepare(), but with a pre-bound label, which is always
+ * required.
+ */
+static void
+json_emit_prepare_bound(json_emit_t *jse, const json_label_t *jl)
+{
+	VERIFY(json_nest_kind(jse) == JSON_OBJECT);
+	if (jse->json_nemitted[jse->json_depth] > 0) {
+		json_emitc(jse, ',');
+	}
+
+	json_emitb(jse, jl->jl_text, jl->jl_len);
+}
+
 static void
 json_emit_finish(json_emit_t *jse)
 {
@@ -664,6 +1034,90 @@ void
 json_utf8string(json_emit_t *jse, const char *label, const char *value)
 {
 	json_emit_prepare(jse, label);
-	json_emit_utf8string(jse, value);
+	json_emit_utf8string(jse, value, strlen(value));
+	json_emit_finish(jse);
+}
+
+/*
+ * As for json_utf8string(), but the value is "len" bytes long and need not be
+ * NUL-terminated.
+ */
+void
+json_utf8string_len(json_emit_t *jse, const char *label, const char *value,
+    size_t len)
+{
+	json_emit_prepare(jse, label);
+	json_emit_utf8string(jse, value, len);
+	json_emit_finish(jse);
+}
+
+/*
+ * Emit a value that has already been formatted as JSON text.  The caller is
+ * responsible for the validity of the text.
+ */
+void
+json_rawvalue(json_emit_t *jse, const char *label, const char *value,
+    size_t len)
+{
+	json_emit_prepare(jse, label);
+	json_emitb(jse, value, len);
+	json_emit_finish(jse);
+}
+
+/*
+ * Emitter functions for pre-bound labels.  The string value need not be
+ * NUL-terminated.
+ */
+
+void
+json_object_begin_bound(json_emit_t *jse, const json_label_t *jl)
+{
+	json_emit_prepare_bound(jse, jl);
+	json_emitc(jse, '{');
+	json_nest_begin(jse, JSON_OBJECT);
+}
+
+void
+json_array_begin_bound(json_emit_t *jse, const json_label_t *jl)
+{
+	json_emit_prepare_bound(jse, jl);
+	json_emitc(jse, '[');
+	json_nest_begin(jse, JSON_ARRAY);
+}
+
+void
+json_boolean_bound(json_emit_t *jse, const json_label_t *jl,
+    json_boolean_t value)
+{
+	VERIFY(value == JSON_B_FALSE || value == JSON_B_TRUE);
+
+	json_emit_prepare_bound(jse, jl);
+	json_emits(jse, value == JSON_B_TRUE ? "true" : "false");
+	json_emit_finish(jse);
+}
+
+void
+json_null_bound(json_emit_t *jse, const json_label_t *jl)
+{
+	json_emit_prepare_bound(jse, jl);
+	json_emits(jse, "null");
+	json_emit_finish(jse);
+}
+
+void
+json_utf8string_bound(json_emit_t *jse, const json_label_t *jl,
+    const char *value, size_t len)
+{
+	json_emit_prepare_bound(jse, jl);
+	json_emit_utf8string(jse, value, len);
+	json_emit_finish(jse);
+}
+
+void
+json_rawvalue_bound(json_emit_t *jse, const json_label_t *jl,
+    const char *value, size_t len)
+{
+	json_emit_prepare_bound(jse, jl);
+	json_emitb(jse, value, len);
 	json_emit_finish(jse);
 }
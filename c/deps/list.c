@@ -30,6 +30,7 @@
 #include <sys/list_impl.h>
 #include <sys/types.h>
 #include <sys/sysmacros.h>
+#include <stddef.h>
 #ifdef _KERNEL
 #include <sys/debug.h>
 #else
@@ -1,19 +1,23 @@
 
 
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include <err.h>
-#include <ctype.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <sys/list.h>
 #include <custr.h>
 #include <strlist.h>
 #include <jsonemitter.h>
-#include <libnvpair.h>
 
 #include "common.h"
 
@@ -32,144 +36,460 @@ typedef enum sql_state {
 	STATE_SQL_NUMBER_EXPONENT,
 	STATE_SQL_STRING,
 	STATE_SQL_STRING_QUOTE,
+	STATE_SQL_ESTRING,
+	STATE_SQL_ESTRING_ESCAPE,
+	STATE_SQL_ESTRING_QUOTE,
 	STATE_SQL_QUOTED_ID,
 	STATE_SQL_QUOTED_ID_QUOTE,
 	STATE_SQL_NAME,
 } sql_state_t;
 
-typedef enum copy_state {
-	STATE_COPY_REST = 1,
-	STATE_COPY_NULL_CHECK,
-	STATE_COPY_COLUMN,
-	STATE_COPY_COLUMN_ESCAPED,
-	STATE_COPY_MAYBE_EOD,
-} copy_state_t;
-
-typedef enum ingest_action {
-	INGEST_AGAIN = 1,
-	INGEST_NEXT,
-	INGEST_ERROR,
-} ingest_action_t;
+/*
+ * Character classes for the SQL tokenizer.  Each byte of input is classified
+ * with a single lookup in this table, rather than with a series of ctype(3C)
+ * calls and strchr(3C) scans.  As in the C locale, bytes outside of ASCII
+ * have no class.
+ */
+#define	SQL_C_NAME0	0x01	/* may begin a name */
+#define	SQL_C_NAME	0x02	/* may continue a name */
+#define	SQL_C_DIGIT	0x04
+#define	SQL_C_BREAK	0x08	/* ends a name */
+#define	SQL_C_OPER	0x10	/* may continue an operator */
+#define	SQL_C_STRING	0x20	/* ends a string */
+#define	SQL_C_QUOTED	0x40	/* ends a quoted identifier */
+#define	SQL_C_ESTRING	0x80	/* ends a run of an escape string */
+
+static const uint8_t sql_cclass[256] = {
+	['\t'] = SQL_C_BREAK,
+	['\n'] = SQL_C_BREAK | SQL_C_STRING | SQL_C_QUOTED | SQL_C_ESTRING,
+	['\v'] = SQL_C_BREAK,
+	['\f'] = SQL_C_BREAK,
+	['\r'] = SQL_C_BREAK,
+	[' '] = SQL_C_BREAK,
+	['A' ... 'Z'] = SQL_C_NAME0 | SQL_C_NAME,
+	['a' ... 'z'] = SQL_C_NAME0 | SQL_C_NAME,
+	['_'] = SQL_C_NAME0 | SQL_C_NAME,
+	['0' ... '9'] = SQL_C_NAME | SQL_C_DIGIT,
+	['$'] = SQL_C_NAME | SQL_C_BREAK,
+	['='] = SQL_C_BREAK | SQL_C_OPER,
+	[':'] = SQL_C_BREAK | SQL_C_OPER,
+	['*'] = SQL_C_BREAK | SQL_C_OPER,
+	['+'] = SQL_C_BREAK | SQL_C_OPER,
+	['-'] = SQL_C_BREAK,
+	['/'] = SQL_C_BREAK,
+	['<'] = SQL_C_BREAK,
+	['>'] = SQL_C_BREAK,
+	['~'] = SQL_C_BREAK,
+	['!'] = SQL_C_BREAK,
+	['@'] = SQL_C_BREAK,
+	['#'] = SQL_C_BREAK,
+	['%'] = SQL_C_BREAK,
+	['^'] = SQL_C_BREAK,
+	['&'] = SQL_C_BREAK,
+	['|'] = SQL_C_BREAK,
+	['`'] = SQL_C_BREAK,
+	['?'] = SQL_C_BREAK,
+	['('] = SQL_C_BREAK,
+	[')'] = SQL_C_BREAK,
+	['['] = SQL_C_BREAK,
+	[']'] = SQL_C_BREAK,
+	[','] = SQL_C_BREAK,
+	[';'] = SQL_C_BREAK,
+	['.'] = SQL_C_BREAK,
+	['\''] = SQL_C_STRING | SQL_C_ESTRING,
+	['\\'] = SQL_C_ESTRING,
+	['"'] = SQL_C_QUOTED,
+};
+
+/*
+ * The action taken for each byte that may begin a token, in the
+ * STATE_SQL_REST state.
+ */
+typedef enum sql_start {
+	SQL_S_INVALID = 0,
+	SQL_S_SPACE,
+	SQL_S_NEWLINE,
+	SQL_S_NAME,
+	SQL_S_SPECIAL,
+	SQL_S_DOLLAR,
+	SQL_S_DASH,
+	SQL_S_SLASH,
+	SQL_S_OPERATOR,
+	SQL_S_NUMBER,
+	SQL_S_STRING,
+	SQL_S_QUOTED_ID,
+} sql_start_t;
+
+static const uint8_t sql_start[256] = {
+	['\t'] = SQL_S_SPACE,
+	['\n'] = SQL_S_NEWLINE,
+	['\v'] = SQL_S_SPACE,
+	['\f'] = SQL_S_SPACE,
+	['\r'] = SQL_S_SPACE,
+	[' '] = SQL_S_SPACE,
+	['A' ... 'Z'] = SQL_S_NAME,
+	['a' ... 'z'] = SQL_S_NAME,
+	['_'] = SQL_S_NAME,
+	['.'] = SQL_S_SPECIAL,
+	[';'] = SQL_S_SPECIAL,
+	[','] = SQL_S_SPECIAL,
+	['('] = SQL_S_SPECIAL,
+	[')'] = SQL_S_SPECIAL,
+	['$'] = SQL_S_DOLLAR,
+	['-'] = SQL_S_DASH,
+	['/'] = SQL_S_SLASH,
+	['='] = SQL_S_OPERATOR,
+	[':'] = SQL_S_OPERATOR,
+	['*'] = SQL_S_OPERATOR,
+	['+'] = SQL_S_OPERATOR,
+	['0' ... '9'] = SQL_S_NUMBER,
+	['\''] = SQL_S_STRING,
+	['"'] = SQL_S_QUOTED_ID,
+};
+
+/*
+ * The COPY data for a table that appears before "buckets_config" cannot be
+ * converted until the bucket configuration is known.  Rather than read the
+ * dump twice, the raw data is appended to a temporary spool file, and
+ * replayed through a new row parser once "buckets_config" has been read.
+ */
+typedef struct sqlt_spool {
+	command_copy_t *sqsp_command;
+	uint64_t sqsp_off;		/* offset in the spool file */
+	uint64_t sqsp_len;
+	list_node_t sqsp_link;
+} sqlt_spool_t;
+
+/*
+ * Default limit on the amount of COPY data that may be spooled.
+ */
+#define	SPOOL_MAX_MIB		1024
+
+/*
+ * Limit on the number of conversion workers, and the default limit on the
+ * row data and output buffered in the pipeline.
+ */
+#define	PIPELINE_MAX		256
+#define	PIPELINE_BUDGET_MIB	256
+
+/*
+ * Limit on the number of threads inflating a gzip dump with an index.
+ */
+#define	INFLATE_MAX		64
 
 typedef struct sqlt_copy {
 	command_copy_t *sqcp_command;
-	copy_state_t sqcp_state;
-	strlist_t *sqcp_output;
-	unsigned sqcp_output_ncols;
-	custr_t *sqcp_accum;
-	unsigned sqcp_rows;
-	FILE *sqcp_file;
+	copy_parser_t *sqcp_parser;
+	int sqcp_fd;
 	json_emit_t *sqcp_json;
-	nvlist_t *sqcp_nvl;
+	json_label_t **sqcp_labels;	/* one for each column */
+	unsigned sqcp_ncols;
+	moray_buckets_t *sqcp_buckets;	/* if this is "buckets_config" */
+	moray_table_t *sqcp_moray;	/* if this is a bucket table */
+	moray_buckets_t *sqcp_registry;	/* for the workers' moray_table_t */
+	moray_bucket_t *sqcp_bucket;
+	uint64_t sqcp_parsed;		/* rows of _value parsed in full */
+	pipeline_stream_t *sqcp_stream;	/* if converted by the pipeline */
+	int sqcp_raw;			/* stream is given unparsed rows */
+	copy_split_t sqcp_split;
+	int sqcp_skip;			/* if the rows are discarded */
+	sqlt_spool_t *sqcp_spool;	/* if the data is being spooled */
+	int sqcp_replay;		/* if the data is from the spool */
+	uint64_t sqcp_start;		/* offsets in the dump, for -w */
+	uint64_t sqcp_data;
+	uint64_t sqcp_end;
 } sqlt_copy_t;
 
-typedef struct sqlt {
-	list_t sqlt_inq;
-	list_t sqlt_state_stack;
-	FILE *sqlt_file;
-	sql_state_t sqlt_state;
-	custr_t *sqlt_accum;
-	custr_t *sqlt_dollar_token;
-	list_t sqlt_command;
-	unsigned sqlt_command_count;
-	sqlt_copy_t *sqlt_copy;
-} sqlt_t;
+/*
+ * With an index (-i), only the parts of the dump holding the selected tables
+ * (and "buckets_config") are read: each range of the uncompressed dump in
+ * turn, as if they were the whole of it.
+ */
+typedef struct sqlt_range {
+	uint64_t sqr_start;
+	uint64_t sqr_end;
+} sqlt_range_t;
+
+/*
+ * Size of each chunk of input passed to the tokenizer, and the default
+ * number of chunks in the input ring.
+ */
+#define	INQ_CHUNK_SIZE		(1024 * 1024)
+#define	INQ_RING_DEPTH		8
 
 typedef struct inq {
 	char *inq_buf;
 	size_t inq_buf_size;	/* allocated size */
 	size_t inq_pos;		/* reading position */
 	size_t inq_len;		/* length of data in buffer */
-	list_node_t inq_link;
+	uint64_t inq_off;	/* offset of the data in the dump */
 } inq_t;
 
+/*
+ * The input ring is a fixed set of chunks, allocated once.  Chunks are
+ * filled at the tail, usually by the reader thread, and consumed by the
+ * tokenizer from the head.  When the ring is full the reader waits for the
+ * tokenizer to release a chunk, and when it is empty the tokenizer waits
+ * for the reader.  For a mapped input the chunks have no buffer of their
+ * own, and point into the mapping instead.
+ */
+typedef struct inq_ring {
+	pthread_mutex_t inr_lock;
+	pthread_cond_t inr_cv;
+	inq_t *inr_chunks;
+	unsigned inr_depth;
+	unsigned inr_head;	/* next chunk to consume */
+	unsigned inr_count;	/* number of filled chunks */
+	int inr_eof;		/* no more chunks will be filled */
+	uint64_t inr_wait_ns;	/* time the tokenizer spent waiting */
+} inq_ring_t;
+
+/*
+ * The tokenizer state stack is a fixed array of frames, as the grammar nests
+ * only a few states deep.  Each frame keeps the accumulator it last used, so
+ * that pushing and popping states never allocates.
+ */
+#define	SQLT_STACK_DEPTH	8
+
+/*
+ * The longest escape sequence in an escape string (E'...'), after the
+ * backslash: "U" and eight hex digits.
+ */
+#define	SQLT_ESCAPE_MAX		9
+
 typedef struct state_frame {
 	sql_state_t stfr_state;
 	custr_t *stfr_accum;
-	list_node_t stfr_link;
 } state_frame_t;
 
-static int
-isoper(char chr)
-{
-	return (strchr("+-*/<>=~!@#%^&|`?", chr) != NULL);
-}
-
-static int
-isspecial(char chr)
-{
-	return (strchr("$()[],;:*.", chr) != NULL);
-}
+typedef struct sqlt {
+	inq_ring_t sqlt_inq;
+	state_frame_t sqlt_stack[SQLT_STACK_DEPTH];
+	unsigned sqlt_depth;
+	input_t *sqlt_input;
+	sql_state_t sqlt_state;
+	custr_t *sqlt_accum;
+	custr_t *sqlt_dollar_token;
+	char sqlt_escape[SQLT_ESCAPE_MAX];	/* escape in an E'' string */
+	unsigned sqlt_escape_len;
+	list_t sqlt_command;
+	unsigned sqlt_command_count;
+	jv_arena_t *sqlt_command_arena;	/* tokens of this command */
+	sqlt_copy_t *sqlt_copy;
+	moray_buckets_t *sqlt_buckets;
+	int sqlt_buckets_loaded;	/* "buckets_config" has been read */
+	pipeline_t *sqlt_pipeline;	/* or NULL to convert rows here */
+	int sqlt_split;			/* parse COPY data on the workers */
+
+	list_t sqlt_tables;		/* CREATE TABLE column types */
+
+	list_t sqlt_spools;		/* spooled tables, in dump order */
+	int sqlt_spool_fd;
+	uint64_t sqlt_spool_len;
+	uint64_t sqlt_spool_max;
+	int sqlt_spool_raw;		/* replay without conversion */
+
+	strlist_t *sqlt_select;		/* tables to convert (-t), or NULL */
+	dump_index_t *sqlt_index;	/* being built (-w), or read (-i) */
+	int sqlt_index_build;
+	uint64_t sqlt_base;		/* offset of the tokenizer's buffer */
+	uint64_t sqlt_special_end;	/* offset after the last special */
+	uint64_t sqlt_command_start;	/* offset after the last command */
+	sqlt_range_t *sqlt_ranges;
+	unsigned sqlt_nranges;
+	unsigned sqlt_range;		/* range being read */
+	int sqlt_range_open;		/* input is positioned in the range */
+
+	uint64_t sqlt_ingest_bytes;	/* bytes passed to the tokenizer */
+	uint64_t sqlt_ingest_ns;	/* time spent tokenizing */
+	uint64_t sqlt_report_ns;	/* time of last progress report */
+} sqlt_t;
 
 void
 sqlt_push_state(sqlt_t *sqlt, sql_state_t st)
 {
 	state_frame_t *stfr;
+	custr_t *accum;
 
-	if ((stfr = calloc(1, sizeof (*stfr))) == NULL) {
-		err(1, "calloc");
+	if (sqlt->sqlt_depth == SQLT_STACK_DEPTH) {
+		errx(1, "state %d push fail", sqlt->sqlt_state);
 	}
 
+	/*
+	 * Save the current state and accumulator in the frame, and take the
+	 * accumulator it held for the new state.
+	 */
+	stfr = &sqlt->sqlt_stack[sqlt->sqlt_depth++];
+	accum = stfr->stfr_accum;
 	stfr->stfr_state = sqlt->sqlt_state;
 	stfr->stfr_accum = sqlt->sqlt_accum;
-	list_insert_head(&sqlt->sqlt_state_stack, stfr);
 
 	sqlt->sqlt_state = st;
-	if (custr_alloc(&sqlt->sqlt_accum) != 0) {
-		err(1, "custr_alloc");
-	}
+	sqlt->sqlt_accum = accum;
+	custr_reset(accum);
 }
 
-void
+/*
+ * Return to the previous state.  The accumulator of the state being popped is
+ * returned, and its contents remain valid until the next push.
+ */
+custr_t *
 sqlt_pop_state(sqlt_t *sqlt)
 {
-	if (list_is_empty(&sqlt->sqlt_state_stack)) {
+	state_frame_t *stfr;
+	custr_t *accum = sqlt->sqlt_accum;
+
+	if (sqlt->sqlt_depth == 0) {
 		errx(1, "state %d pop fail", sqlt->sqlt_state);
 	}
 
-	state_frame_t *stfr = list_remove_head(&sqlt->sqlt_state_stack);
-	custr_free(sqlt->sqlt_accum);
+	stfr = &sqlt->sqlt_stack[--sqlt->sqlt_depth];
 	sqlt->sqlt_accum = stfr->stfr_accum;
 	sqlt->sqlt_state = stfr->stfr_state;
-	free(stfr);
+	stfr->stfr_accum = accum;
+
+	return (accum);
 }
 
 int
-sqlt_inq_alloc(inq_t **inqp, size_t sz)
+inq_ring_init(inq_ring_t *inr, unsigned depth, size_t chunksz)
 {
-	inq_t *inq;
+	bzero(inr, sizeof (*inr));
 
-	if ((inq = calloc(1, sizeof (*inq))) == NULL) {
+	if ((inr->inr_chunks = calloc(depth, sizeof (inq_t))) == NULL) {
 		return (-1);
 	}
+	inr->inr_depth = depth;
 
-	inq->inq_buf_size = sz;
-	if ((inq->inq_buf = malloc(inq->inq_buf_size)) == NULL) {
-		free(inq);
-		return (-1);
+	if (pthread_mutex_init(&inr->inr_lock, NULL) != 0 ||
+	    pthread_cond_init(&inr->inr_cv, NULL) != 0) {
+		errx(1, "could not initialise input ring locks");
+	}
+
+	if (chunksz == 0) {
+		return (0);
+	}
+
+	for (unsigned i = 0; i < depth; i++) {
+		inq_t *inq = &inr->inr_chunks[i];
+
+		inq->inq_buf_size = chunksz;
+		if ((inq->inq_buf = malloc(inq->inq_buf_size)) == NULL) {
+			while (i-- > 0) {
+				free(inr->inr_chunks[i].inq_buf);
+			}
+			free(inr->inr_chunks);
+			return (-1);
+		}
 	}
 
-	*inqp = inq;
 	return (0);
 }
 
+/*
+ * Return the next chunk to be filled, waiting for the tokenizer to release
+ * one if the ring is full.
+ */
+inq_t *
+inq_ring_tail(inq_ring_t *inr)
+{
+	inq_t *inq;
+
+	pthread_mutex_lock(&inr->inr_lock);
+	while (inr->inr_count == inr->inr_depth) {
+		pthread_cond_wait(&inr->inr_cv, &inr->inr_lock);
+	}
+	inq = &inr->inr_chunks[(inr->inr_head + inr->inr_count) %
+	    inr->inr_depth];
+	pthread_mutex_unlock(&inr->inr_lock);
+
+	return (inq);
+}
+
+/*
+ * Make the chunk most recently returned by inq_ring_tail() available to the
+ * tokenizer.
+ */
+void
+inq_ring_push(inq_ring_t *inr)
+{
+	pthread_mutex_lock(&inr->inr_lock);
+	assert(inr->inr_count < inr->inr_depth);
+	inr->inr_count++;
+	pthread_cond_broadcast(&inr->inr_cv);
+	pthread_mutex_unlock(&inr->inr_lock);
+}
+
+/*
+ * Signal that the input is exhausted.
+ */
+void
+inq_ring_eof(inq_ring_t *inr)
+{
+	pthread_mutex_lock(&inr->inr_lock);
+	inr->inr_eof = 1;
+	pthread_cond_broadcast(&inr->inr_cv);
+	pthread_mutex_unlock(&inr->inr_lock);
+}
+
+/*
+ * Return the next chunk to be consumed, waiting for one to be filled if the
+ * ring is empty.  Returns NULL at the end of the input.
+ */
+inq_t *
+inq_ring_head(inq_ring_t *inr)
+{
+	inq_t *inq = NULL;
+
+	pthread_mutex_lock(&inr->inr_lock);
+	if (inr->inr_count == 0 && !inr->inr_eof) {
+		uint64_t start = gettime_ns();
+
+		while (inr->inr_count == 0 && !inr->inr_eof) {
+			pthread_cond_wait(&inr->inr_cv, &inr->inr_lock);
+		}
+		inr->inr_wait_ns += gettime_ns() - start;
+	}
+	if (inr->inr_count > 0) {
+		inq = &inr->inr_chunks[inr->inr_head];
+	}
+	pthread_mutex_unlock(&inr->inr_lock);
+
+	return (inq);
+}
+
+/*
+ * Release the chunk at the head of the ring to be filled again.
+ */
 void
-sqlt_inq_free(inq_t *inq)
+inq_ring_pop(inq_ring_t *inr)
 {
-	free(inq->inq_buf);
-	free(inq);
+	pthread_mutex_lock(&inr->inr_lock);
+	assert(inr->inr_count > 0);
+	inr->inr_head = (inr->inr_head + 1) % inr->inr_depth;
+	inr->inr_count--;
+	pthread_cond_broadcast(&inr->inr_cv);
+	pthread_mutex_unlock(&inr->inr_lock);
 }
 
+/*
+ * Fill this chunk from the input, with at most "len" bytes.  At the end of
+ * the input, the chunk will have a length of zero.
+ */
 int
-sqlt_inq_read(inq_t *inq, FILE *fstr)
+sqlt_inq_read(inq_t *inq, input_t *in, size_t len)
 {
-	if ((inq->inq_len = fread(inq->inq_buf, 1, inq->inq_buf_size, fstr)) < 1) {
-		/*
-		 * XXX
-		 */
-		errx(1, "return < 1");
+	ssize_t sz;
+
+	if (len > inq->inq_buf_size) {
+		len = inq->inq_buf_size;
+	}
+	if ((sz = input_read(in, inq->inq_buf, len)) < 0) {
+		return (-1);
 	}
 
+	inq->inq_len = sz;
+	inq->inq_pos = 0;
 	return (0);
 }
 
@@ -193,671 +513,1917 @@ sqlt_alloc(sqlt_t **sqltp)
 		return (-1);
 	}
 
-	list_create(&sqlt->sqlt_inq, sizeof (inq_t),
-	    offsetof(inq_t, inq_link));
-	list_create(&sqlt->sqlt_state_stack, sizeof (state_frame_t),
-	    offsetof(state_frame_t, stfr_link));
+	if (moray_buckets_alloc(&sqlt->sqlt_buckets) != 0) {
+		custr_free(sqlt->sqlt_dollar_token);
+		custr_free(sqlt->sqlt_accum);
+		free(sqlt);
+		return (-1);
+	}
+
+	for (unsigned i = 0; i < SQLT_STACK_DEPTH; i++) {
+		if (custr_alloc(&sqlt->sqlt_stack[i].stfr_accum) != 0) {
+			goto fail;
+		}
+	}
+
+	if (jv_arena_alloc(&sqlt->sqlt_command_arena) != 0) {
+		goto fail;
+	}
+
 	list_create(&sqlt->sqlt_command, sizeof (event_t),
 	    offsetof(event_t, evt_link));
+	list_create(&sqlt->sqlt_tables, sizeof (command_table_t),
+	    offsetof(command_table_t, cmdt_link));
+	list_create(&sqlt->sqlt_spools, sizeof (sqlt_spool_t),
+	    offsetof(sqlt_spool_t, sqsp_link));
+	sqlt->sqlt_spool_fd = -1;
+	sqlt->sqlt_spool_max = (uint64_t)SPOOL_MAX_MIB * 1024 * 1024;
 
 	sqlt->sqlt_state = STATE_SQL_REST;
 
 	*sqltp = sqlt;
 	return (0);
+
+fail:
+	for (unsigned i = 0; i < SQLT_STACK_DEPTH; i++) {
+		custr_free(sqlt->sqlt_stack[i].stfr_accum);
+	}
+	moray_buckets_free(sqlt->sqlt_buckets);
+	custr_free(sqlt->sqlt_dollar_token);
+	custr_free(sqlt->sqlt_accum);
+	free(sqlt);
+	return (-1);
 }
 
-void
-sqlt_commit(sqlt_t *sqlt, event_type_t t)
+/*
+ * Convert one row of a table that is being written out: to a Moray object
+ * with "mt" for a bucket table, or otherwise to a JSON object with a property
+ * for each column.  This is called on the tokenizer thread, or on a worker
+ * thread (with that worker's "mt") if the table is converted by the pipeline.
+ */
+static void
+sqlt_copy_emit(sqlt_copy_t *sqcp, moray_table_t *mt, json_emit_t *jse,
+    const copy_col_t *cols, unsigned ncols, uint64_t row)
 {
-	const char *val = custr_cstr(sqlt->sqlt_accum);
+	char errbuf[128];
 
-	if (t == EVENT_NEWLINE && sqlt->sqlt_command_count == 0) {
-		/*
-		 * Drop leading newlines from commands.
-		 */
-		return;
+	if (mt != NULL) {
+		moray_table_row(mt, jse, cols, ncols);
+		goto check;
 	}
 
-	if (t == EVENT_SPECIAL && strcmp(val, ";") == 0) {
-#if 0
-		fprintf(stdout, "COMMAND: ");
-
-		for (event_t *evt = list_head(&sqlt->sqlt_command);
-		    evt != NULL; evt = list_next(&sqlt->sqlt_command, evt)) {
-			switch (evt->evt_t) {
-			case EVENT_NEWLINE:
-				fprintf(stdout, "newline ");
-				break;
-			case EVENT_SPECIAL:
-				fprintf(stdout, "special(%s) ", evt->evt_v);
-				break;
-			case EVENT_STRING:
-				fprintf(stdout, "string(%s) ", evt->evt_v);
-				break;
-			case EVENT_QUOTED_NAME:
-				fprintf(stdout, "quoted_name(%s) ", evt->evt_v);
-				break;
-			case EVENT_OPERATOR:
-				fprintf(stdout, "operator(%s) ", evt->evt_v);
-				break;
-			case EVENT_NAME:
-				fprintf(stdout, "name(%s) ", evt->evt_v);
-				break;
-			case EVENT_NUMBER:
-				fprintf(stdout, "number(%s) ", evt->evt_v);
-				break;
-			}
+	json_object_begin(jse, NULL);
+	for (unsigned i = 0; i < ncols; i++) {
+		if (cols[i].cc_ptr == NULL) {
+			json_null_bound(jse, sqcp->sqcp_labels[i]);
+		} else {
+			json_utf8string_bound(jse, sqcp->sqcp_labels[i],
+			    cols[i].cc_ptr, cols[i].cc_len);
 		}
+	}
+	json_object_end(jse);
+	json_newline(jse);
+
+check:
+	if (json_get_error(jse, NULL, 0) != JSE_NONE) {
+		(void) json_get_error(jse, errbuf, sizeof (errbuf));
+		errx(1, "COPY %s: row %llu: %s",
+		    sqcp->sqcp_command->cmdc_table_name,
+		    (unsigned long long)row, errbuf);
+	}
+}
 
-		fprintf(stdout, "\n");
-#endif
-
-		/*
-		 * Parse the command!
-		 */
-		command_copy_t *copycmd = NULL;
-		switch (parse_command(&sqlt->sqlt_command, &copycmd)) {
-		case -1:
-			errx(1, "SQL PARSE ERROR");
-			break;
-
-		case 0:
-			break;
+/*
+ * Process one COPY row.  Rows of "buckets_config" are loaded into the bucket
+ * registry, and rows of bucket tables are converted to Moray objects.  Rows
+ * of other tables are written as a JSON object with a property for each
+ * column if they appear before "buckets_config", and discarded otherwise.
+ */
+static void
+sqlt_copy_row(void *arg, const copy_col_t *cols, unsigned ncols)
+{
+	sqlt_copy_t *sqcp = arg;
 
-		case 1:
-			sqlt->sqlt_copy = calloc(1, sizeof (*sqlt->sqlt_copy));
-			/* XXX */
-			sqlt->sqlt_copy->sqcp_command = copycmd;
-			sqlt->sqlt_copy->sqcp_state = STATE_COPY_REST;
-			if (strlist_alloc(&sqlt->sqlt_copy->sqcp_output, 0) != 0) {
-				err(1, "strlist_alloc");
-			}
-			if (custr_alloc(&sqlt->sqlt_copy->sqcp_accum) != 0) {
-				err(1, "custr_alloc");
-			}
+	if (sqcp->sqcp_skip || sqcp->sqcp_spool != NULL) {
+		return;
+	}
 
-			fprintf(stderr, "COPY [%s]\n", sqlt->sqlt_copy->sqcp_command->cmdc_table_name);
+	if (sqcp->sqcp_buckets != NULL) {
+		moray_bucket_config_row(sqcp->sqcp_buckets,
+		    sqcp->sqcp_command, cols, ncols);
+		return;
+	}
 
-			char buf[512];
-			snprintf(buf, 512, "%s/%s.json", "OUTPUT_DIR", sqlt->sqlt_copy->sqcp_command->cmdc_table_name);
-			if ((sqlt->sqlt_copy->sqcp_file = fopen(buf, "wx")) == NULL) {
-				err(1, "fopen(%s)", buf);
-			}
-#if 0
-			if ((sqlt->sqlt_copy->sqcp_json = json_create_stdio(sqlt->sqlt_copy->sqcp_file)) == NULL) {
-				err(1, "json_create_stdio");
-			}
-#else
-			if (nvlist_alloc(&sqlt->sqlt_copy->sqcp_nvl, NV_UNIQUE_NAME, 0) != 0) {
-				err(1, "nvlist_alloc");
-			}
-#endif
-			break;
-		}
+	if (sqcp->sqcp_stream != NULL) {
+		pipeline_stream_row(sqcp->sqcp_stream, cols, ncols);
+		return;
+	}
 
-		while (!list_is_empty(&sqlt->sqlt_command)) {
-			event_t *evt = list_remove_head(&sqlt->sqlt_command);
+	sqlt_copy_emit(sqcp, sqcp->sqcp_moray, sqcp->sqcp_json, cols, ncols,
+	    copy_parser_rows(sqcp->sqcp_parser) + 1);
+}
 
-			free(evt->evt_v);
-			free(evt);
-		}
+static void
+sqlt_copy_free(sqlt_copy_t *sqcp)
+{
+	for (unsigned i = 0; i < sqcp->sqcp_ncols; i++) {
+		json_label_fini(sqcp->sqcp_labels[i]);
+	}
+	free(sqcp->sqcp_labels);
 
-		return;
+	/*
+	 * Report how many rows of a bucket table could not be converted by
+	 * splicing the index columns into the text of "_value", which should
+	 * be few.  The workers' counts were added when they finished.
+	 */
+	if (sqcp->sqcp_moray != NULL) {
+		sqcp->sqcp_parsed += moray_table_parsed(sqcp->sqcp_moray);
+		fprintf(stderr, "FULL PARSE [%s] (%llu ROWS)\n",
+		    sqcp->sqcp_command->cmdc_table_name,
+		    (unsigned long long)sqcp->sqcp_parsed);
 	}
+	moray_table_free(sqcp->sqcp_moray);
 
 	/*
-	 * Append this token to the end of the current accumulating command.
+	 * XXX Free the command.
 	 */
-	event_t *evt = calloc(1, sizeof (*evt));
-	evt->evt_t = t;
-	evt->evt_v = strdup(custr_cstr(sqlt->sqlt_accum));
-	list_insert_tail(&sqlt->sqlt_command, evt);
+	free(sqcp);
 }
 
-static ingest_action_t
-sqlt_ingest_copy_commit(sqlt_t *sqlt, const char *val, int is_last)
+/*
+ * The pipeline operations for a table.  Each worker converts the rows of a
+ * bucket table with its own moray_table_t; the labels for the columns of
+ * other tables are only read, and are shared.
+ */
+static void *
+sqlt_stream_init(void *arg)
 {
-	sqlt_copy_t *sqcp = sqlt->sqlt_copy;
-
-	if (sqcp->sqcp_output_ncols > strlist_contig_count(sqcp->sqcp_command->cmdc_column_names)) {
-		errx(1, "too many columns on COPY row");
-		return (INGEST_ERROR);
-	}
+	sqlt_copy_t *sqcp = arg;
 
-//	strlist_set(sqcp->sqcp_output, sqcp->sqcp_output_ncols++, val);
-	if (val == NULL) {
-		nvlist_add_boolean(sqcp->sqcp_nvl, strlist_get(sqcp->sqcp_command->cmdc_column_names, sqcp->sqcp_output_ncols++));
-	} else {
-		nvlist_add_string(sqcp->sqcp_nvl, strlist_get(sqcp->sqcp_command->cmdc_column_names, sqcp->sqcp_output_ncols++), val);
+	if (sqcp->sqcp_moray == NULL) {
+		return (NULL);
 	}
+	return (moray_table_alloc(sqcp->sqcp_registry, sqcp->sqcp_bucket,
+	    sqcp->sqcp_command));
+}
 
-	if (!is_last) {
-		/*
-		 * Look for another column.
-		 */
-		sqcp->sqcp_state = STATE_COPY_NULL_CHECK;
-		custr_reset(sqcp->sqcp_accum);
-		return (INGEST_NEXT);
-	}
+static void
+sqlt_stream_row(void *arg, void *state, json_emit_t *jse,
+    const copy_col_t *cols, unsigned ncols, uint64_t row)
+{
+	moray_table_t *mt = state;
 
-	if (sqcp->sqcp_output_ncols != strlist_contig_count(sqcp->sqcp_command->cmdc_column_names)) {
-		errx(1, "too few columns on COPY row");
-		return (INGEST_ERROR);
+	if (mt != NULL) {
+		moray_table_set_rows(mt, row - 1);
 	}
+	sqlt_copy_emit(arg, mt, jse, cols, ncols, row);
+}
 
-	/*
-	 * This was the last column, and we have the correct number
-	 * of columns.  Emit the entire row.
-	 */
-	/* XXX emit COPY_ROW */
-#if 0
-	json_object_begin(sqcp->sqcp_json, NULL);
-	for (unsigned i = 0; i < sqcp->sqcp_output_ncols; i++) {
-		const char *key = strlist_get(sqcp->sqcp_command->cmdc_column_names, i);
-		const char *val = strlist_get(sqcp->sqcp_output, i);
-
-		if (val == NULL) {
-			json_null(sqcp->sqcp_json, key);
-		} else {
-			json_utf8string(sqcp->sqcp_json, key, val);
-		}
-	}
-	json_object_end(sqcp->sqcp_json);
-	json_newline(sqcp->sqcp_json);
-#else
-	/*
-	 * XXX
-	 */
-	nvlist_print_json(sqcp->sqcp_file, sqcp->sqcp_nvl);
-	fputc('\n', sqcp->sqcp_file);
-#endif
+static void
+sqlt_stream_fini(void *arg, void *state)
+{
+	sqlt_copy_t *sqcp = arg;
 
-#if 0
-	for (unsigned i = 0; i < sqcp->sqcp_output_ncols; i++) {
-		fprintf(stdout, "[%2u] %s:\n", i, strlist_get(sqcp->sqcp_command->cmdc_column_names, i));
-		const char *x = strlist_get(sqcp->sqcp_output, i);
-		fprintf(stdout, "\t%s\n", x == NULL ? "<NULL>" : x);
+	if (state != NULL) {
+		sqcp->sqcp_parsed += moray_table_parsed(state);
 	}
-	fprintf(stdout, "\n");
-#endif
-	/* XXX emit COPY_ROW */
-	sqcp->sqcp_rows++;
-	strlist_reset(sqcp->sqcp_output);
-	sqcp->sqcp_output_ncols = 0;
+	moray_table_free(state);
+}
 
-	/*
-	 * Look for another row.
-	 */
-	sqcp->sqcp_state = STATE_COPY_NULL_CHECK;
-	custr_reset(sqcp->sqcp_accum);
-	return (INGEST_NEXT);
+static void
+sqlt_stream_close(void *arg)
+{
+	sqlt_copy_free(arg);
 }
 
-ingest_action_t
-sqlt_ingest_copy(sqlt_t *sqlt, char chr)
+static const pipeline_ops_t sqlt_stream_ops = {
+	.plo_init = sqlt_stream_init,
+	.plo_row = sqlt_stream_row,
+	.plo_fini = sqlt_stream_fini,
+	.plo_close = sqlt_stream_close,
+};
+
+/*
+ * Append raw COPY data to the spool file, which is created on first use and
+ * removed from the file system at once.
+ */
+static void
+sqlt_spool_write(sqlt_t *sqlt, const char *buf, size_t len)
 {
-	sqlt_copy_t *sqcp = sqlt->sqlt_copy;
+	sqlt_spool_t *sqsp = sqlt->sqlt_copy->sqcp_spool;
+
+	if (sqlt->sqlt_spool_len + len > sqlt->sqlt_spool_max) {
+		errx(1, "COPY data before buckets_config exceeds the spool "
+		    "limit of %llu MiB (in table \"%s\"); raise it with -s",
+		    (unsigned long long)(sqlt->sqlt_spool_max / 1024 / 1024),
+		    sqsp->sqsp_command->cmdc_table_name);
+	}
 
-	switch (sqcp->sqcp_state) {
-	case STATE_COPY_REST:
-		if (chr != '\n') {
-			errx(1, "expected new line after COPY command");
-			return (INGEST_ERROR);
+	if (sqlt->sqlt_spool_fd == -1) {
+		const char *tmpdir = getenv("TMPDIR");
+		char path[512];
+
+		(void) snprintf(path, sizeof (path), "%s/dumper.spool.XXXXXX",
+		    tmpdir != NULL ? tmpdir : "/tmp");
+		if ((sqlt->sqlt_spool_fd = mkstemp(path)) < 0) {
+			err(1, "mkstemp(%s)", path);
 		}
-		sqcp->sqcp_state = STATE_COPY_NULL_CHECK;
-		return (INGEST_NEXT);
+		(void) unlink(path);
+	}
 
-	case STATE_COPY_NULL_CHECK: {
-		const char *nullstr = sqcp->sqcp_command->cmdc_null_string;
-		size_t acclen = custr_len(sqcp->sqcp_accum);
+	while (len > 0) {
+		ssize_t n = write(sqlt->sqlt_spool_fd, buf, len);
 
-		if (acclen < strlen(nullstr) && chr == nullstr[acclen]) {
-			custr_appendc(sqcp->sqcp_accum, chr);
-			return (INGEST_NEXT);
-		} else if (acclen == strlen(nullstr)) {
-			if (chr == sqcp->sqcp_command->cmdc_delimiter) {
-				return (sqlt_ingest_copy_commit(sqlt, NULL, 0));
-			} else if (chr == '\n') {
-				return (sqlt_ingest_copy_commit(sqlt, NULL, 1));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			err(1, "write (spool)");
 		}
+		buf += n;
+		len -= n;
+		sqsp->sqsp_len += n;
+		sqlt->sqlt_spool_len += n;
+	}
+}
 
-		inq_t *inq;
-		if (sqlt_inq_alloc(&inq, custr_len(sqcp->sqcp_accum)) != 0) {
-			err(1, "sqlt_inq_alloc");
-		}
-		inq->inq_len = custr_len(sqcp->sqcp_accum);
-		bcopy(custr_cstr(sqcp->sqcp_accum), inq->inq_buf, inq->inq_len);
-		list_insert_head(&sqlt->sqlt_inq, inq);
+static void sqlt_copy_begin(sqlt_t *, command_copy_t *);
+static void sqlt_copy_end(sqlt_t *);
 
-		custr_reset(sqcp->sqcp_accum);
-		sqcp->sqcp_state = STATE_COPY_COLUMN;
-		return (INGEST_AGAIN);
+/*
+ * Remember the column types of a table, replacing those of any earlier table
+ * of the same name.
+ */
+static void
+sqlt_table_add(sqlt_t *sqlt, command_table_t *cmdt)
+{
+	for (command_table_t *t = list_head(&sqlt->sqlt_tables); t != NULL;
+	    t = list_next(&sqlt->sqlt_tables, t)) {
+		if (strcmp(t->cmdt_table_name, cmdt->cmdt_table_name) == 0) {
+			list_remove(&sqlt->sqlt_tables, t);
+			command_table_free(t);
+			break;
+		}
 	}
 
-	case STATE_COPY_COLUMN:
-		if (chr == sqcp->sqcp_command->cmdc_delimiter) {
-			return (sqlt_ingest_copy_commit(sqlt, custr_cstr(sqcp->sqcp_accum), 0));
-		} else if (chr == '\n') {
-			return (sqlt_ingest_copy_commit(sqlt, custr_cstr(sqcp->sqcp_accum), 1));
-		}
+	list_insert_tail(&sqlt->sqlt_tables, cmdt);
+}
 
-		if (chr == '\\') {
-			sqcp->sqcp_state = STATE_COPY_COLUMN_ESCAPED;
-		} else {
-			custr_appendc(sqcp->sqcp_accum, chr);
-		}
-		return (INGEST_NEXT);
+/*
+ * The binary COPY format needs the type of each column, which is found in
+ * the CREATE TABLE command for the table.
+ */
+static void
+sqlt_copy_types(sqlt_t *sqlt, command_copy_t *copycmd)
+{
+	command_table_t *cmdt;
+	strlist_t *types;
 
-	case STATE_COPY_COLUMN_ESCAPED:
-		if (chr == '.' && sqcp->sqcp_output_ncols == 0 &&
-		    custr_len(sqcp->sqcp_accum) == 0) {
-			sqcp->sqcp_state = STATE_COPY_MAYBE_EOD;
-		} else {
-			sqcp->sqcp_state = STATE_COPY_COLUMN;
-		}
-		custr_appendc(sqcp->sqcp_accum, chr);
-		return (INGEST_NEXT);
+	if (copycmd->cmdc_format != COPY_FORMAT_BINARY ||
+	    copycmd->cmdc_column_types != NULL) {
+		return;
+	}
 
-	case STATE_COPY_MAYBE_EOD:
-		if (chr != '\n') {
-			/*
-			 * False alarm!
-			 */
-			sqcp->sqcp_state = STATE_COPY_COLUMN;
-			return (INGEST_AGAIN);
+	for (cmdt = list_head(&sqlt->sqlt_tables); cmdt != NULL;
+	    cmdt = list_next(&sqlt->sqlt_tables, cmdt)) {
+		if (strcmp(cmdt->cmdt_table_name,
+		    copycmd->cmdc_table_name) == 0) {
+			break;
 		}
+	}
 
-		fprintf(stderr, "COPY END (%u ROWS)\n", sqcp->sqcp_rows);
+	if (strlist_alloc(&types, 0) != 0) {
+		err(1, "strlist_alloc");
+	}
+	for (unsigned i = 0; i < strlist_contig_count(
+	    copycmd->cmdc_column_names); i++) {
+		const char *col = strlist_get(copycmd->cmdc_column_names, i);
+		const char *type = "";
+
+		for (unsigned j = 0; cmdt != NULL && j < strlist_contig_count(
+		    cmdt->cmdt_column_names); j++) {
+			if (strcmp(col, strlist_get(cmdt->cmdt_column_names,
+			    j)) == 0) {
+				type = strlist_get(cmdt->cmdt_column_types, j);
+				break;
+			}
+		}
 
-		/*
-		 * Return to the regular SQL state machine.
-		 * XXX Free this.
-		 */
-#if 0
-		json_fini(sqlt->sqlt_copy->sqcp_json);
-#else
-		nvlist_free(sqlt->sqlt_copy->sqcp_nvl);
-#endif
-		fclose(sqlt->sqlt_copy->sqcp_file);
-		sqlt->sqlt_copy = NULL;
-		return (INGEST_NEXT);
+		if (strlist_set_tail(types, type) != 0) {
+			err(1, "strlist_set_tail");
+		}
 	}
 
-	return (INGEST_ERROR);
+	copycmd->cmdc_column_types = types;
 }
 
-ingest_action_t
-sqlt_ingest_sql(sqlt_t *sqlt, char chr)
+/*
+ * Pass COPY data for the current table to its row parser, or, if the workers
+ * parse the table, divide it at row boundaries into batches for them.
+ * Returns the number of bytes consumed, as copy_parse() does.
+ */
+static size_t
+sqlt_copy_data(sqlt_t *sqlt, const char *buf, size_t len, int *donep)
 {
-	switch (sqlt->sqlt_state) {
-	case STATE_SQL_REST:
-		custr_reset(sqlt->sqlt_accum);
+	sqlt_copy_t *sqcp = sqlt->sqlt_copy;
+	copy_split_t *cs = &sqcp->sqcp_split;
+	size_t pos = 0;
 
-		if (isalpha(chr) || chr == '_') {
-			sqlt_push_state(sqlt, STATE_SQL_NAME);
-			return (INGEST_AGAIN);
-		}
+	if (!sqcp->sqcp_raw) {
+		return (copy_parse(sqcp->sqcp_parser, buf, len, donep));
+	}
 
-		if (chr == '\n') {
-			sqlt_commit(sqlt, EVENT_NEWLINE);
-			return (INGEST_NEXT);
-		}
+	*donep = 0;
+	while (pos < len && !*donep) {
+		size_t n = copy_split(cs, buf + pos, len - pos,
+		    pipeline_stream_space(sqcp->sqcp_stream));
 
-		if (isspace(chr)) {
-			return (INGEST_NEXT);
+		if (n > cs->cs_skip) {
+			pipeline_stream_data(sqcp->sqcp_stream,
+			    buf + pos + cs->cs_skip, n - cs->cs_skip,
+			    cs->cs_chunk_rows, cs->cs_cut);
 		}
+		*donep = cs->cs_done;
+		pos += n;
+	}
 
-		if (strchr(".;,()", chr) != NULL) {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			sqlt_commit(sqlt, EVENT_SPECIAL);
-			return (INGEST_NEXT);
-		}
+	return (pos);
+}
 
-		if (chr == '$') {
-			sqlt_push_state(sqlt, STATE_SQL_DOLLAR1);
-			return (INGEST_NEXT);
-		}
+/*
+ * Replay the spooled tables, in the order they appeared in the dump, as if
+ * their COPY data were being read now.
+ */
+static void
+sqlt_spool_replay(sqlt_t *sqlt)
+{
+	sqlt_spool_t *sqsp;
+	char *buf;
 
-		if (chr == '-') {
-			sqlt_push_state(sqlt, STATE_SQL_DASH1);
-			return (INGEST_NEXT);
-		}
+	if ((buf = malloc(INQ_CHUNK_SIZE)) == NULL) {
+		err(1, "malloc");
+	}
 
-		if (chr == '/') {
-			sqlt_push_state(sqlt, STATE_SQL_SLASH1);
-			return (INGEST_NEXT);
-		}
+	while ((sqsp = list_remove_head(&sqlt->sqlt_spools)) != NULL) {
+		const char *table = sqsp->sqsp_command->cmdc_table_name;
+		uint64_t off = sqsp->sqsp_off;
+		uint64_t end = off + sqsp->sqsp_len;
+		int done = 0;
+
+		fprintf(stderr, "REPLAY [%s] (%llu bytes spooled)\n", table,
+		    (unsigned long long)sqsp->sqsp_len);
+		sqlt_copy_begin(sqlt, sqsp->sqsp_command);
+		sqlt->sqlt_copy->sqcp_replay = 1;
+
+		while (off < end) {
+			size_t want = end - off < INQ_CHUNK_SIZE ?
+			    end - off : INQ_CHUNK_SIZE;
+			ssize_t n = pread(sqlt->sqlt_spool_fd, buf, want, off);
+			size_t pos = 0;
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0) {
+				err(1, "pread (spool)");
+			} else if (n == 0) {
+				break;
+			}
 
-		if (chr == '=' || chr == ':' || chr == '*' || chr == '+') {
-			sqlt_push_state(sqlt, STATE_SQL_OPERATOR);
-			return (INGEST_AGAIN);
+			while (pos < (size_t)n && !done) {
+				pos += sqlt_copy_data(sqlt, buf + pos, n - pos,
+				    &done);
+			}
+			off += n;
 		}
 
-		if (isdigit(chr)) {
-			sqlt_push_state(sqlt, STATE_SQL_NUMBER0);
-			return (INGEST_AGAIN);
+		if (!done || off != end) {
+			errx(1, "spooled COPY data for \"%s\" is incomplete",
+			    table);
 		}
+		sqlt_copy_end(sqlt);
+		free(sqsp);
+	}
 
-		if (chr == '\'') {
-			sqlt_push_state(sqlt, STATE_SQL_STRING);
-			return (INGEST_NEXT);
-		}
+	free(buf);
 
-		if (chr == '"') {
-			sqlt_push_state(sqlt, STATE_SQL_QUOTED_ID);
-			return (INGEST_NEXT);
-		}
+	if (sqlt->sqlt_spool_fd != -1) {
+		(void) close(sqlt->sqlt_spool_fd);
+		sqlt->sqlt_spool_fd = -1;
+	}
+	sqlt->sqlt_spool_len = 0;
+}
 
-		errx(1, "invalid character \"%c\"", chr);
-		return (INGEST_ERROR);
+/*
+ * Whether the rows of a table are wanted, given the tables selected with -t.
+ */
+static int
+sqlt_selected(sqlt_t *sqlt, const char *table)
+{
+	if (sqlt->sqlt_select == NULL) {
+		return (1);
+	}
 
-	case STATE_SQL_DOLLAR1:
-		if (chr == '$') {
-			custr_reset(sqlt->sqlt_dollar_token);
-			sqlt->sqlt_state = STATE_SQL_DOLLAR_STRING;
-			return (INGEST_NEXT);
+	for (unsigned i = 0; i < strlist_contig_count(sqlt->sqlt_select);
+	    i++) {
+		if (strcmp(table, strlist_get(sqlt->sqlt_select, i)) == 0) {
+			return (1);
 		}
+	}
 
-		/*
-		 * Technically any character is valid in the dollar quoting
-		 * tag, but I have not yet seen anything but letters and the
-		 * underscore.  If we relax this, we should be careful about
-		 * embedded newline characters.
+	return (0);
+}
+
+/*
+ * A COPY command has been parsed.  Open the output file for the table, and
+ * prepare the JSON labels for its columns, before the row data arrives.
+ * The table is looked up in the bucket registry, so that the rows of bucket
+ * tables can be converted to Moray objects.  Until "buckets_config" has been
+ * read, the data for other tables is spooled; after it, they are skipped, as
+ * lib/extract.js does.
+ */
+static void
+sqlt_copy_begin(sqlt_t *sqlt, command_copy_t *copycmd)
+{
+	const char *table = copycmd->cmdc_table_name;
+	sqlt_copy_t *sqcp;
+	moray_bucket_t *mb;
+	char buf[512];
+
+	if ((sqcp = calloc(1, sizeof (*sqcp))) == NULL) {
+		err(1, "calloc");
+	}
+	sqcp->sqcp_command = copycmd;
+	sqcp->sqcp_ncols = strlist_contig_count(copycmd->cmdc_column_names);
+
+	sqlt_copy_types(sqlt, copycmd);
+	if (copy_parser_alloc(&sqcp->sqcp_parser, copycmd, sqlt_copy_row,
+	    sqcp) != 0) {
+		err(1, "copy_parser_alloc");
+	}
+
+	if ((sqcp->sqcp_labels = calloc(sqcp->sqcp_ncols,
+	    sizeof (json_label_t *))) == NULL) {
+		err(1, "calloc");
+	}
+	for (unsigned i = 0; i < sqcp->sqcp_ncols; i++) {
+		const char *col = strlist_get(copycmd->cmdc_column_names, i);
+
+		if ((sqcp->sqcp_labels[i] = json_label_create(col)) == NULL) {
+			err(1, "json_label_create(%s)", col);
+		}
+	}
+
+	if (strcmp(table, "buckets_config") == 0) {
+		sqcp->sqcp_buckets = sqlt->sqlt_buckets;
+	} else if (!sqlt_selected(sqlt, table)) {
+		sqcp->sqcp_skip = 1;
+	} else if ((mb = moray_bucket_lookup(sqlt->sqlt_buckets,
+	    table)) != NULL) {
+		sqcp->sqcp_moray = moray_table_alloc(sqlt->sqlt_buckets, mb,
+		    copycmd);
+		sqcp->sqcp_registry = sqlt->sqlt_buckets;
+		sqcp->sqcp_bucket = mb;
+	} else if (sqlt->sqlt_buckets_loaded) {
+		sqcp->sqcp_skip = 1;
+	} else if (!sqlt->sqlt_spool_raw) {
+		if ((sqcp->sqcp_spool = calloc(1,
+		    sizeof (sqlt_spool_t))) == NULL) {
+			err(1, "calloc");
+		}
+		sqcp->sqcp_spool->sqsp_command = copycmd;
+		sqcp->sqcp_spool->sqsp_off = sqlt->sqlt_spool_len;
+	}
+
+	fprintf(stderr, "COPY [%s]%s\n", table,
+	    sqcp->sqcp_moray != NULL ? " (bucket)" :
+	    sqcp->sqcp_spool != NULL ? " (spooled until buckets_config)" :
+	    sqcp->sqcp_skip && !sqlt_selected(sqlt, table) ?
+	    " (skipped; not selected)" :
+	    sqcp->sqcp_skip ? " (skipped; not in bucket configuration)" : "");
+
+	sqcp->sqcp_fd = -1;
+	if (sqcp->sqcp_buckets != NULL || sqcp->sqcp_skip ||
+	    sqcp->sqcp_spool != NULL) {
+		sqlt->sqlt_copy = sqcp;
+		return;
+	}
+
+	snprintf(buf, sizeof (buf), "%s/%s.json", "OUTPUT_DIR",
+	    copycmd->cmdc_table_name);
+	if ((sqcp->sqcp_fd = open(buf, O_WRONLY | O_CREAT | O_EXCL,
+	    0666)) < 0) {
+		err(1, "open(%s)", buf);
+	}
+
+	if (sqlt->sqlt_pipeline != NULL) {
+		/*
+		 * The stream owns the file from here on.
+		 */
+		sqcp->sqcp_stream = pipeline_stream_open(sqlt->sqlt_pipeline,
+		    copycmd->cmdc_table_name, sqcp->sqcp_fd, copycmd,
+		    &sqlt_stream_ops, sqcp);
+		sqcp->sqcp_fd = -1;
+
+		/*
+		 * Only the text format can be divided into rows without
+		 * parsing it.
 		 */
-		if (chr == '_' || isalpha(chr)) {
-			sqlt->sqlt_state = STATE_SQL_DOLLAR_STRING;
-			sqlt_push_state(sqlt, STATE_SQL_DOLLAR_TAG);
-			return (INGEST_AGAIN);
+		if (sqlt->sqlt_split &&
+		    copycmd->cmdc_format == COPY_FORMAT_TEXT) {
+			sqcp->sqcp_raw = 1;
+			copy_split_init(&sqcp->sqcp_split, copycmd);
 		}
+	} else if ((sqcp->sqcp_json = json_create_fd(sqcp->sqcp_fd)) == NULL) {
+		err(1, "json_create_fd");
+	}
 
-		errx(1, "invalid sequence \"$%c\"", chr);
-		return (INGEST_ERROR);
+	sqlt->sqlt_copy = sqcp;
+}
 
-	case STATE_SQL_DOLLAR_TAG:
-		if (chr == '$') {
-			custr_reset(sqlt->sqlt_dollar_token);
-			custr_append(sqlt->sqlt_dollar_token, custr_cstr(sqlt->sqlt_accum));
-			sqlt_pop_state(sqlt);
-			return (INGEST_NEXT);
+/*
+ * The end of the COPY data has been reached.  Return to the regular SQL
+ * state machine.
+ */
+static void
+sqlt_copy_end(sqlt_t *sqlt)
+{
+	sqlt_copy_t *sqcp = sqlt->sqlt_copy;
+	uint64_t rows = sqcp->sqcp_raw ? sqcp->sqcp_split.cs_rows :
+	    copy_parser_rows(sqcp->sqcp_parser);
+	char errbuf[128];
+	int replay = 0;
+
+	fprintf(stderr, "COPY END (%llu ROWS)\n", (unsigned long long)rows);
+
+	/*
+	 * A spooled table was indexed when its data was first read.
+	 */
+	if (sqlt->sqlt_index_build && !sqcp->sqcp_replay) {
+		index_entry_t *ixe = index_add_entry(sqlt->sqlt_index,
+		    INDEX_COPY, sqcp->sqcp_command->cmdc_table_name,
+		    sqcp->sqcp_command->cmdc_column_names, sqcp->sqcp_start,
+		    sqcp->sqcp_end);
+
+		ixe->ixe_rows = rows;
+		ixe->ixe_data = sqcp->sqcp_data;
+	}
+
+	if (sqcp->sqcp_buckets != NULL) {
+		fprintf(stderr, "LOADED %u BUCKETS\n",
+		    moray_buckets_count(sqcp->sqcp_buckets));
+		sqlt->sqlt_buckets_loaded = 1;
+		replay = !list_is_empty(&sqlt->sqlt_spools);
+	}
+
+	if (sqcp->sqcp_spool != NULL) {
+		list_insert_tail(&sqlt->sqlt_spools, sqcp->sqcp_spool);
+	}
+
+	if (sqcp->sqcp_json != NULL) {
+		json_flush(sqcp->sqcp_json);
+		if (json_get_error(sqcp->sqcp_json, errbuf,
+		    sizeof (errbuf)) != JSE_NONE) {
+			errx(1, "COPY %s: %s",
+			    sqcp->sqcp_command->cmdc_table_name, errbuf);
 		}
+		json_fini(sqcp->sqcp_json);
+	}
+	if (sqcp->sqcp_fd != -1 && close(sqcp->sqcp_fd) != 0) {
+		err(1, "close(%s)", sqcp->sqcp_command->cmdc_table_name);
+	}
 
-		if (chr == '_' || isalpha(chr)) {
-			/*
-			 * See comments for DOLLAR1 state.
-			 */
-			custr_appendc(sqlt->sqlt_accum, chr);
-			return (INGEST_NEXT);
+	copy_parser_free(sqcp->sqcp_parser);
+	if (sqcp->sqcp_stream != NULL) {
+		/*
+		 * The workers may still be converting rows of this table, so
+		 * the rest is freed by the writer once they are written.
+		 */
+		pipeline_stream_close(sqcp->sqcp_stream);
+	} else {
+		sqlt_copy_free(sqcp);
+	}
+	sqlt->sqlt_copy = NULL;
+
+	if (replay) {
+		sqlt_spool_replay(sqlt);
+	}
+}
+
+void
+sqlt_commit(sqlt_t *sqlt, event_type_t t)
+{
+	const char *val = custr_cstr(sqlt->sqlt_accum);
+
+	if (t == EVENT_NEWLINE && sqlt->sqlt_command_count == 0) {
+		/*
+		 * Drop leading newlines from commands.
+		 */
+		return;
+	}
+
+	if (t == EVENT_SPECIAL && strcmp(val, ";") == 0) {
+#if 0
+		fprintf(stdout, "COMMAND: ");
+
+		for (event_t *evt = list_head(&sqlt->sqlt_command);
+		    evt != NULL; evt = list_next(&sqlt->sqlt_command, evt)) {
+			switch (evt->evt_t) {
+			case EVENT_NEWLINE:
+				fprintf(stdout, "newline ");
+				break;
+			case EVENT_SPECIAL:
+				fprintf(stdout, "special(%s) ", evt->evt_v);
+				break;
+			case EVENT_STRING:
+				fprintf(stdout, "string(%s) ", evt->evt_v);
+				break;
+			case EVENT_QUOTED_NAME:
+				fprintf(stdout, "quoted_name(%s) ", evt->evt_v);
+				break;
+			case EVENT_OPERATOR:
+				fprintf(stdout, "operator(%s) ", evt->evt_v);
+				break;
+			case EVENT_NAME:
+				fprintf(stdout, "name(%s) ", evt->evt_v);
+				break;
+			case EVENT_NUMBER:
+				fprintf(stdout, "number(%s) ", evt->evt_v);
+				break;
+			}
 		}
 
-		errx(1, "invalid sequence \"$%s%c\"",
-		    custr_cstr(sqlt->sqlt_accum), chr);
-		return (INGEST_ERROR);
+		fprintf(stdout, "\n");
+#endif
 
-	case STATE_SQL_DOLLAR_STRING:
-		if (chr == '$') {
-			sqlt_push_state(sqlt, STATE_SQL_DOLLAR_STRING_END_TAG);
-			return (INGEST_NEXT);
+		/*
+		 * Parse the command!  The command runs from the end of the
+		 * one before it to the end of this semicolon, and the data of
+		 * a COPY begins straight after it.
+		 */
+		command_copy_t *copycmd = NULL;
+		command_table_t *cmdt = NULL;
+		uint64_t start = sqlt->sqlt_command_start;
+		uint64_t end = sqlt->sqlt_special_end;
+
+		sqlt->sqlt_command_start = end;
+		switch (parse_command(&sqlt->sqlt_command, &copycmd, &cmdt)) {
+		case -1:
+			errx(1, "SQL PARSE ERROR");
+			break;
+
+		case 0:
+			break;
+
+		case 1:
+			sqlt_copy_begin(sqlt, copycmd);
+			sqlt->sqlt_copy->sqcp_start = start;
+			sqlt->sqlt_copy->sqcp_data = end;
+			break;
+
+		case 2:
+			if (sqlt->sqlt_index_build) {
+				(void) index_add_entry(sqlt->sqlt_index,
+				    INDEX_TABLE, cmdt->cmdt_table_name, NULL,
+				    start, end);
+			}
+			sqlt_table_add(sqlt, cmdt);
+			break;
+		}
+
+		/*
+		 * The tokens are all released at once with the arena.
+		 */
+		while (!list_is_empty(&sqlt->sqlt_command)) {
+			(void) list_remove_head(&sqlt->sqlt_command);
 		}
+		jv_arena_reset(sqlt->sqlt_command_arena);
 
-		if (chr == '\n') {
-			errx(1, "unterminated string \"%s\"",
+		return;
+	}
+
+	/*
+	 * Append this token to the end of the current accumulating command.
+	 * Both the event and its text are allocated from the command arena.
+	 */
+	size_t len = custr_len(sqlt->sqlt_accum);
+	event_t *evt = jv_arena_zalloc(sqlt->sqlt_command_arena,
+	    sizeof (*evt) + len + 1);
+	evt->evt_t = t;
+	evt->evt_v = (char *)(evt + 1);
+	bcopy(val, evt->evt_v, len + 1);
+	list_insert_tail(&sqlt->sqlt_command, evt);
+}
+
+/*
+ * Append a run of characters to the token being accumulated.
+ */
+static void
+sqlt_accum_run(sqlt_t *sqlt, const uint8_t *p, const uint8_t *q)
+{
+	if (q > p) {
+		custr_append_buf(sqlt->sqlt_accum, (const char *)p, q - p);
+	}
+}
+
+/*
+ * The escape sequences of an escape string (E'...') are those of PostgreSQL:
+ *
+ *	\b \f \n \r \t	the control character
+ *	\o \oo \ooo		a byte, in octal
+ *	\xh \xhh		a byte, in hexadecimal
+ *	\uxxxx \Uxxxxxxxx	a Unicode code point, in hexadecimal, written
+ *				as UTF-8
+ *
+ * and a backslash followed by any other character is that character.  The
+ * sequence after the backslash is collected in "sqlt_escape", as it may be
+ * divided between buffers.  Return the maximum length of the sequence
+ * beginning with "c".
+ */
+static unsigned
+sqlt_escape_max(char c)
+{
+	switch (c) {
+	case '0': case '1': case '2': case '3':
+	case '4': case '5': case '6': case '7':
+	case 'x':
+		return (3);
+	case 'u':
+		return (5);
+	case 'U':
+		return (9);
+	default:
+		return (1);
+	}
+}
+
+/*
+ * Return whether "c" continues the escape sequence collected so far.
+ */
+static int
+sqlt_escape_continues(sqlt_t *sqlt, uint8_t c)
+{
+	char c0 = sqlt->sqlt_escape[0];
+
+	if (sqlt->sqlt_escape_len == 0) {
+		return (1);
+	}
+	if (sqlt->sqlt_escape_len == sqlt_escape_max(c0)) {
+		return (0);
+	}
+	if (c0 >= '0' && c0 <= '7') {
+		return (c >= '0' && c <= '7');
+	}
+	return (isxdigit(c));
+}
+
+/*
+ * Decode the escape sequence collected in "sqlt_escape", and append the
+ * result to the string.
+ */
+static void
+sqlt_escape_decode(sqlt_t *sqlt)
+{
+	char *esc = sqlt->sqlt_escape;
+	unsigned len = sqlt->sqlt_escape_len;
+	unsigned long cp;
+	char buf[4];
+
+	esc[len] = '\0';
+	switch (esc[0]) {
+	case 'b':
+		custr_appendc(sqlt->sqlt_accum, '\b');
+		return;
+	case 'f':
+		custr_appendc(sqlt->sqlt_accum, '\f');
+		return;
+	case 'n':
+		custr_appendc(sqlt->sqlt_accum, '\n');
+		return;
+	case 'r':
+		custr_appendc(sqlt->sqlt_accum, '\r');
+		return;
+	case 't':
+		custr_appendc(sqlt->sqlt_accum, '\t');
+		return;
+	case '0': case '1': case '2': case '3':
+	case '4': case '5': case '6': case '7':
+		cp = strtoul(esc, NULL, 8) & 0xff;
+		break;
+	case 'x':
+		if (len == 1) {
+			custr_appendc(sqlt->sqlt_accum, 'x');
+			return;
+		}
+		cp = strtoul(esc + 1, NULL, 16);
+		break;
+	case 'u':
+	case 'U':
+		if (len != sqlt_escape_max(esc[0])) {
+			errx(1, "invalid Unicode escape \"\\%s\" in string "
+			    "\"%s\"", esc, custr_cstr(sqlt->sqlt_accum));
+		}
+		cp = strtoul(esc + 1, NULL, 16);
+		if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+			errx(1, "unsupported Unicode escape \"\\%s\" in "
+			    "string \"%s\"", esc,
 			    custr_cstr(sqlt->sqlt_accum));
-			return (INGEST_ERROR);
 		}
+		if (cp < 0x80) {
+			break;
+		}
+		if (cp < 0x800) {
+			buf[0] = 0xc0 | (cp >> 6);
+			buf[1] = 0x80 | (cp & 0x3f);
+			custr_append_buf(sqlt->sqlt_accum, buf, 2);
+		} else if (cp < 0x10000) {
+			buf[0] = 0xe0 | (cp >> 12);
+			buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+			buf[2] = 0x80 | (cp & 0x3f);
+			custr_append_buf(sqlt->sqlt_accum, buf, 3);
+		} else {
+			buf[0] = 0xf0 | (cp >> 18);
+			buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+			buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+			buf[3] = 0x80 | (cp & 0x3f);
+			custr_append_buf(sqlt->sqlt_accum, buf, 4);
+		}
+		return;
+	default:
+		custr_appendc(sqlt->sqlt_accum, esc[0]);
+		return;
+	}
+
+	if (cp == 0) {
+		errx(1, "invalid escape \"\\%s\" in string \"%s\": a string "
+		    "may not contain a zero byte", esc,
+		    custr_cstr(sqlt->sqlt_accum));
+	}
+	custr_appendc(sqlt->sqlt_accum, (char)cp);
+}
 
-		custr_appendc(sqlt->sqlt_accum, chr);
-		return (INGEST_NEXT);
+/*
+ * Tokenize SQL text from the start of "buf", until either the buffer is
+ * exhausted or a COPY command begins.  Returns the number of bytes consumed.
+ *
+ * Where a token is made up of a run of similar characters (e.g., a name or
+ * the body of a string), the whole run is found with the character class
+ * table and appended to the accumulator at once.
+ */
+static size_t
+sqlt_ingest_sql(sqlt_t *sqlt, const char *buf, size_t len)
+{
+	const uint8_t *start = (const uint8_t *)buf;
+	const uint8_t *end = start + len;
+	const uint8_t *p = start, *q;
+
+	while (p < end && sqlt->sqlt_copy == NULL) {
+		switch (sqlt->sqlt_state) {
+		case STATE_SQL_REST:
+			custr_reset(sqlt->sqlt_accum);
+
+			switch (sql_start[*p]) {
+			case SQL_S_SPACE:
+				while (++p < end &&
+				    sql_start[*p] == SQL_S_SPACE) {
+					continue;
+				}
+				continue;
+
+			case SQL_S_NEWLINE:
+				p++;
+				sqlt_commit(sqlt, EVENT_NEWLINE);
+				continue;
+
+			case SQL_S_NAME:
+				sqlt_push_state(sqlt, STATE_SQL_NAME);
+				continue;
+
+			case SQL_S_SPECIAL:
+				custr_appendc(sqlt->sqlt_accum, *p++);
+				sqlt->sqlt_special_end = sqlt->sqlt_base +
+				    (p - start);
+				sqlt_commit(sqlt, EVENT_SPECIAL);
+				continue;
+
+			case SQL_S_DOLLAR:
+				p++;
+				sqlt_push_state(sqlt, STATE_SQL_DOLLAR1);
+				continue;
+
+			case SQL_S_DASH:
+				p++;
+				sqlt_push_state(sqlt, STATE_SQL_DASH1);
+				continue;
+
+			case SQL_S_SLASH:
+				p++;
+				sqlt_push_state(sqlt, STATE_SQL_SLASH1);
+				continue;
+
+			case SQL_S_OPERATOR:
+				sqlt_push_state(sqlt, STATE_SQL_OPERATOR);
+				continue;
+
+			case SQL_S_NUMBER:
+				sqlt_push_state(sqlt, STATE_SQL_NUMBER0);
+				continue;
+
+			case SQL_S_STRING:
+				p++;
+				sqlt_push_state(sqlt, STATE_SQL_STRING);
+				continue;
+
+			case SQL_S_QUOTED_ID:
+				p++;
+				sqlt_push_state(sqlt, STATE_SQL_QUOTED_ID);
+				continue;
+
+			default:
+				errx(1, "invalid character \"%c\"", *p);
+			}
+			break;
 
-	case STATE_SQL_DOLLAR_STRING_END_TAG:
-		if (chr == '$') {
-			if (strcmp(custr_cstr(sqlt->sqlt_accum),
-			    custr_cstr(sqlt->sqlt_dollar_token)) == 0) {
-				/*
-				 * We have reached the end of the string.
-				 * The actual string is stored in the
-				 * frame above us, which should be a
-				 * DOLLAR_STRING frame.
-				 */
-				sqlt_pop_state(sqlt);
+		case STATE_SQL_DOLLAR1:
+			if (*p == '$') {
+				p++;
+				custr_reset(sqlt->sqlt_dollar_token);
+				sqlt->sqlt_state = STATE_SQL_DOLLAR_STRING;
+				continue;
+			}
+
+			/*
+			 * Technically any character is valid in the dollar
+			 * quoting tag, but I have not yet seen anything but
+			 * letters and the underscore.  If we relax this, we
+			 * should be careful about embedded newline characters.
+			 */
+			if (sql_cclass[*p] & SQL_C_NAME0) {
+				sqlt->sqlt_state = STATE_SQL_DOLLAR_STRING;
+				sqlt_push_state(sqlt, STATE_SQL_DOLLAR_TAG);
+				continue;
+			}
+
+			errx(1, "invalid sequence \"$%c\"", *p);
+			break;
+
+		case STATE_SQL_DOLLAR_TAG:
+			if (*p == '$') {
+				p++;
 				custr_reset(sqlt->sqlt_dollar_token);
-				sqlt_commit(sqlt, EVENT_STRING);
+				custr_append(sqlt->sqlt_dollar_token,
+				    custr_cstr(sqlt->sqlt_accum));
+				sqlt_pop_state(sqlt);
+				continue;
+			}
 
+			if (sql_cclass[*p] & SQL_C_NAME0) {
 				/*
-				 * Pop the dollar string frame itself.
+				 * See comments for DOLLAR1 state.
 				 */
-				assert(sqlt->sqlt_state == STATE_SQL_DOLLAR_STRING);
-				sqlt_pop_state(sqlt);
-				return (INGEST_NEXT);
+				custr_appendc(sqlt->sqlt_accum, *p++);
+				continue;
 			}
 
+			errx(1, "invalid sequence \"$%s%c\"",
+			    custr_cstr(sqlt->sqlt_accum), *p);
+			break;
+
+		case STATE_SQL_DOLLAR_STRING:
 			/*
-			 * False alarm.  Flush out the accumulator to the
-			 * frame above us.
+			 * The body of a dollar-quoted string (e.g., a function
+			 * definition) may contain anything, including
+			 * newlines.  The closing tag begins with a dollar
+			 * sign, so the text up to the next one is copied
+			 * without further inspection.
 			 */
-			char *t = strdup(custr_cstr(sqlt->sqlt_accum));
-			sqlt_pop_state(sqlt);
-			custr_append_printf(sqlt->sqlt_accum, "$%s$", t);
-			free(t);
-			return (INGEST_NEXT);
-		}
+			if ((q = memchr(p, '$', end - p)) == NULL) {
+				q = end;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
 
-		custr_appendc(sqlt->sqlt_accum, chr);
+			p++;
+			sqlt_push_state(sqlt, STATE_SQL_DOLLAR_STRING_END_TAG);
+			continue;
 
-		if (custr_len(sqlt->sqlt_accum) < custr_len(sqlt->sqlt_dollar_token)) {
-			/*
-			 * Need to read more tag characters.
-			 */
-			return (INGEST_NEXT);
-		}
+		case STATE_SQL_DOLLAR_STRING_END_TAG:
+			if (*p == '$') {
+				p++;
+				if (strcmp(custr_cstr(sqlt->sqlt_accum),
+				    custr_cstr(sqlt->sqlt_dollar_token)) == 0) {
+					/*
+					 * We have reached the end of the
+					 * string.  The actual string is stored
+					 * in the frame above us, which should
+					 * be a DOLLAR_STRING frame.
+					 */
+					sqlt_pop_state(sqlt);
+					custr_reset(sqlt->sqlt_dollar_token);
+					sqlt_commit(sqlt, EVENT_STRING);
+
+					/*
+					 * Pop the dollar string frame itself.
+					 */
+					assert(sqlt->sqlt_state ==
+					    STATE_SQL_DOLLAR_STRING);
+					sqlt_pop_state(sqlt);
+					continue;
+				}
+
+				/*
+				 * False alarm.  Flush out the accumulator to
+				 * the frame above us.  This dollar sign may
+				 * itself begin the closing tag (as in
+				 * "x$$body$"), so start matching again from
+				 * it.
+				 */
+				custr_t *tag = sqlt_pop_state(sqlt);
+				custr_append_printf(sqlt->sqlt_accum, "$%s",
+				    custr_cstr(tag));
+				sqlt_push_state(sqlt,
+				    STATE_SQL_DOLLAR_STRING_END_TAG);
+				continue;
+			}
+
+			custr_appendc(sqlt->sqlt_accum, *p++);
+
+			if (custr_len(sqlt->sqlt_accum) <
+			    custr_len(sqlt->sqlt_dollar_token)) {
+				/*
+				 * Need to read more tag characters.
+				 */
+				continue;
+			}
+
+			if (strcmp(custr_cstr(sqlt->sqlt_accum),
+			    custr_cstr(sqlt->sqlt_dollar_token)) == 0) {
+				/*
+				 * This is the token!  Now we need a closing
+				 * dollar sign.
+				 */
+				continue;
+			}
 
-		if (strcmp(custr_cstr(sqlt->sqlt_accum), custr_cstr(sqlt->sqlt_dollar_token)) == 0) {
 			/*
-			 * This is the token!  Now we need a closing dollar sign.
+			 * False alarm.  Flush out the accumulator to the frame
+			 * above us.
 			 */
-			return (INGEST_NEXT);
-		}
+			custr_t *tag = sqlt_pop_state(sqlt);
+			custr_append_printf(sqlt->sqlt_accum, "$%s",
+			    custr_cstr(tag));
+			continue;
 
-		/*
-		 * False alarm.  Flush out the accumulator to the frame above
-		 * us.
-		 */
-		char *tt = strdup(custr_cstr(sqlt->sqlt_accum));
-		sqlt_pop_state(sqlt);
-		custr_append_printf(sqlt->sqlt_accum, "$%s", tt);
-		free(tt);
-		return (INGEST_NEXT);
+		case STATE_SQL_QUOTED_ID:
+			for (q = p; q < end && !(sql_cclass[*q] & SQL_C_QUOTED);
+			    q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
 
-	case STATE_SQL_QUOTED_ID:
-		if (chr == '"') {
+			if (*p == '\n') {
+				errx(1, "unterminated quoted identifier \"%s\"",
+				    custr_cstr(sqlt->sqlt_accum));
+			}
+
+			p++;
 			sqlt->sqlt_state = STATE_SQL_QUOTED_ID_QUOTE;
-			return (INGEST_NEXT);
-		}
+			continue;
 
-		if (chr == '\n') {
-			errx(1, "unterminated quoted identifier \"%s\"",
-			    custr_cstr(sqlt->sqlt_accum));
-			return (INGEST_ERROR);
-		}
+		case STATE_SQL_QUOTED_ID_QUOTE:
+			if (*p == '"') {
+				p++;
+				custr_appendc(sqlt->sqlt_accum, '"');
+				sqlt->sqlt_state = STATE_SQL_QUOTED_ID;
+				continue;
+			}
 
-		custr_appendc(sqlt->sqlt_accum, chr);
-		return (INGEST_NEXT);
+			sqlt_commit(sqlt, EVENT_QUOTED_NAME);
+			sqlt_pop_state(sqlt);
+			continue;
 
-	case STATE_SQL_QUOTED_ID_QUOTE:
-		if (chr == '"') {
-			custr_appendc(sqlt->sqlt_accum, '"');
-			sqlt->sqlt_state = STATE_SQL_QUOTED_ID;
-			return (INGEST_NEXT);
-		}
+		case STATE_SQL_STRING:
+			for (q = p; q < end && !(sql_cclass[*q] & SQL_C_STRING);
+			    q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
 
-		sqlt_commit(sqlt, EVENT_QUOTED_NAME);
-		sqlt_pop_state(sqlt);
-		return (INGEST_AGAIN);
+			if (*p == '\n') {
+				errx(1, "unterminated string \"%s\"",
+				    custr_cstr(sqlt->sqlt_accum));
+			}
 
-	case STATE_SQL_STRING:
-		if (chr == '\'') {
+			p++;
 			sqlt->sqlt_state = STATE_SQL_STRING_QUOTE;
-			return (INGEST_NEXT);
-		}
+			continue;
 
-		if (chr == '\n') {
-			errx(1, "unterminated string \"%s\"",
-			    custr_cstr(sqlt->sqlt_accum));
-			return (INGEST_ERROR);
-		}
+		case STATE_SQL_STRING_QUOTE:
+			if (*p == '\'') {
+				p++;
+				custr_appendc(sqlt->sqlt_accum, '\'');
+				sqlt->sqlt_state = STATE_SQL_STRING;
+				continue;
+			}
 
-		custr_appendc(sqlt->sqlt_accum, chr);
-		return (INGEST_NEXT);
+			sqlt_commit(sqlt, EVENT_STRING);
+			sqlt_pop_state(sqlt);
+			continue;
 
-	case STATE_SQL_STRING_QUOTE:
-		if (chr == '\'') {
-			custr_appendc(sqlt->sqlt_accum, '\'');
-			sqlt->sqlt_state = STATE_SQL_STRING;
-			return (INGEST_NEXT);
-		}
+		case STATE_SQL_ESTRING:
+			for (q = p; q < end &&
+			    !(sql_cclass[*q] & SQL_C_ESTRING); q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
 
-		sqlt_commit(sqlt, EVENT_STRING);
-		sqlt_pop_state(sqlt);
-		return (INGEST_AGAIN);
+			if (*p == '\n') {
+				errx(1, "unterminated string \"%s\"",
+				    custr_cstr(sqlt->sqlt_accum));
+			}
 
-	case STATE_SQL_OPERATOR:
-		if (chr == '=' || chr == ':' || chr == '*' || chr == '+') {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			return (INGEST_NEXT);
-		}
+			if (*p++ == '\\') {
+				sqlt->sqlt_escape_len = 0;
+				sqlt->sqlt_state = STATE_SQL_ESTRING_ESCAPE;
+			} else {
+				sqlt->sqlt_state = STATE_SQL_ESTRING_QUOTE;
+			}
+			continue;
 
-		sqlt_commit(sqlt, EVENT_OPERATOR);
-		sqlt_pop_state(sqlt);
-		return (INGEST_AGAIN);
+		case STATE_SQL_ESTRING_ESCAPE:
+			if (sqlt_escape_continues(sqlt, *p)) {
+				sqlt->sqlt_escape[sqlt->sqlt_escape_len++] =
+				    *p++;
+				if (sqlt->sqlt_escape_len <
+				    sqlt_escape_max(sqlt->sqlt_escape[0])) {
+					continue;
+				}
+			}
 
-	case STATE_SQL_DASH1:
-		if (chr == '-') {
-			sqlt->sqlt_state = STATE_SQL_DASH_COMMENT;
-			return (INGEST_NEXT);
-		}
+			sqlt_escape_decode(sqlt);
+			sqlt->sqlt_state = STATE_SQL_ESTRING;
+			continue;
 
-		errx(1, "invalid sequence \"-%c\"", chr);
-		return (INGEST_ERROR);
+		case STATE_SQL_ESTRING_QUOTE:
+			if (*p == '\'') {
+				p++;
+				custr_appendc(sqlt->sqlt_accum, '\'');
+				sqlt->sqlt_state = STATE_SQL_ESTRING;
+				continue;
+			}
 
-	case STATE_SQL_DASH_COMMENT:
-		if (chr == '\n') {
+			sqlt_commit(sqlt, EVENT_STRING);
 			sqlt_pop_state(sqlt);
-		}
-		return (INGEST_NEXT);
+			continue;
 
-	case STATE_SQL_NAME:
-		if (isalpha(chr) || isdigit(chr) || chr == '_' || chr == '$') {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			return (INGEST_NEXT);
-		}
+		case STATE_SQL_OPERATOR:
+			for (q = p; q < end && (sql_cclass[*q] & SQL_C_OPER);
+			    q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
+
+			sqlt_commit(sqlt, EVENT_OPERATOR);
+			sqlt_pop_state(sqlt);
+			continue;
+
+		case STATE_SQL_DASH1:
+			if (*p == '-') {
+				p++;
+				sqlt->sqlt_state = STATE_SQL_DASH_COMMENT;
+				continue;
+			}
+
+			errx(1, "invalid sequence \"-%c\"", *p);
+			break;
+
+		case STATE_SQL_DASH_COMMENT:
+			/*
+			 * Skip to the end of the line.
+			 */
+			if ((q = memchr(p, '\n', end - p)) == NULL) {
+				p = end;
+				continue;
+			}
+
+			p = q + 1;
+			sqlt_pop_state(sqlt);
+			continue;
+
+		case STATE_SQL_NAME:
+			for (q = p; q < end && (sql_cclass[*q] & SQL_C_NAME);
+			    q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
+
+			/*
+			 * A quotation mark directly after "E" begins an
+			 * escape string.
+			 */
+			if (*p == '\'' && custr_len(sqlt->sqlt_accum) == 1 &&
+			    (*custr_cstr(sqlt->sqlt_accum) == 'E' ||
+			    *custr_cstr(sqlt->sqlt_accum) == 'e')) {
+				p++;
+				custr_reset(sqlt->sqlt_accum);
+				sqlt->sqlt_state = STATE_SQL_ESTRING;
+				continue;
+			}
+
+			if (!(sql_cclass[*p] & SQL_C_BREAK)) {
+				errx(1, "invalid character \"%c\"", *p);
+			}
 
-		if (isspace(chr) || isoper(chr) || isspecial(chr)) {
 			sqlt_commit(sqlt, EVENT_NAME);
 			sqlt_pop_state(sqlt);
-			return (INGEST_AGAIN);
-		}
+			continue;
+
+		case STATE_SQL_NUMBER0:
+		case STATE_SQL_NUMBER_DECIMAL:
+		case STATE_SQL_NUMBER_EXPONENT:
+			for (q = p; q < end && (sql_cclass[*q] & SQL_C_DIGIT);
+			    q++) {
+				continue;
+			}
+			sqlt_accum_run(sqlt, p, q);
+			if ((p = q) == end) {
+				continue;
+			}
 
-		errx(1, "invalid character \"%c\"", chr);
-		return (INGEST_ERROR);
+			if (*p == '.' &&
+			    sqlt->sqlt_state == STATE_SQL_NUMBER0) {
+				custr_appendc(sqlt->sqlt_accum, *p++);
+				sqlt->sqlt_state = STATE_SQL_NUMBER_DECIMAL;
+				continue;
+			}
 
-	case STATE_SQL_NUMBER0:
-		if (isdigit(chr)) {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			return (INGEST_NEXT);
-		}
+			if (*p == 'e' &&
+			    sqlt->sqlt_state != STATE_SQL_NUMBER_EXPONENT) {
+				custr_appendc(sqlt->sqlt_accum, *p++);
+				sqlt->sqlt_state = STATE_SQL_NUMBER_EXPONENT;
+				continue;
+			}
+
+			sqlt_commit(sqlt, EVENT_NUMBER);
+			sqlt_pop_state(sqlt);
+			continue;
 
-		if (chr == '.') {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			sqlt->sqlt_state = STATE_SQL_NUMBER_DECIMAL;
-			return (INGEST_NEXT);
+		default:
+			errx(1, "ended in state: %d\n", sqlt->sqlt_state);
 		}
+	}
+
+	return (p - start);
+}
 
-		if (chr == 'e') {
-			custr_appendc(sqlt->sqlt_accum, chr);
-			sqlt->sqlt_state = STATE_SQL_NUMBER_EXPONENT;
-			return (INGEST_NEXT);
+/*
+ * Tokenize the entire contents of one input chunk.
+ */
+void
+sqlt_ingest(sqlt_t *sqlt, inq_t *inq)
+{
+	while (inq->inq_pos < inq->inq_len) {
+		if (sqlt->sqlt_copy != NULL) {
+			/*
+			 * COPY row data is handed to the row parser in bulk.
+			 */
+			const char *buf = inq->inq_buf + inq->inq_pos;
+			size_t n;
+			int done;
+
+			n = sqlt_copy_data(sqlt, buf,
+			    inq->inq_len - inq->inq_pos, &done);
+			if (sqlt->sqlt_copy->sqcp_spool != NULL) {
+				sqlt_spool_write(sqlt, buf, n);
+			}
+			inq->inq_pos += n;
+			if (done) {
+				sqlt->sqlt_command_start = inq->inq_off +
+				    inq->inq_pos;
+				sqlt->sqlt_copy->sqcp_end =
+				    sqlt->sqlt_command_start;
+				sqlt_copy_end(sqlt);
+			}
+			continue;
 		}
 
-		sqlt_commit(sqlt, EVENT_NUMBER);
-		sqlt_pop_state(sqlt);
-		return (INGEST_AGAIN);
+		sqlt->sqlt_base = inq->inq_off + inq->inq_pos;
+		inq->inq_pos += sqlt_ingest_sql(sqlt,
+		    inq->inq_buf + inq->inq_pos, inq->inq_len - inq->inq_pos);
+	}
+}
+
+/*
+ * Describe what the tokenizer is in the middle of, for an error at the end of
+ * the input.  The outermost state is the one to report: within a dollar-quoted
+ * string, for instance, the tokenizer may be matching a possible closing tag.
+ */
+static const char *
+sqlt_state_describe(sqlt_t *sqlt)
+{
+	sql_state_t st = sqlt->sqlt_depth > 1 ?
+	    sqlt->sqlt_stack[1].stfr_state : sqlt->sqlt_state;
+
+	switch (st) {
+	case STATE_SQL_DOLLAR1:
+	case STATE_SQL_DOLLAR_TAG:
+	case STATE_SQL_DOLLAR_STRING:
+	case STATE_SQL_DOLLAR_STRING_END_TAG:
+		return ("a dollar-quoted string");
+
+	case STATE_SQL_STRING:
+	case STATE_SQL_STRING_QUOTE:
+	case STATE_SQL_ESTRING:
+	case STATE_SQL_ESTRING_ESCAPE:
+	case STATE_SQL_ESTRING_QUOTE:
+		return ("a quoted string");
+
+	case STATE_SQL_QUOTED_ID:
+	case STATE_SQL_QUOTED_ID_QUOTE:
+		return ("a quoted identifier");
+
+	case STATE_SQL_DASH1:
+	case STATE_SQL_DASH_COMMENT:
+	case STATE_SQL_SLASH1:
+		return ("a comment");
 
 	default:
-		errx(1, "ended in state: %d\n", sqlt->sqlt_state);
+		return ("a token");
 	}
 }
 
-void
-sqlt_ingest(sqlt_t *sqlt)
+/*
+ * Print a progress line, at most once per second unless this is the final
+ * report.  The input rate covers the time spent reading (and inflating) the
+ * dump, and the tokenizer rate the time spent in sqlt_ingest(), so that the
+ * two can be compared directly.
+ */
+static void
+sqlt_report(sqlt_t *sqlt, int final)
 {
-	for (;;) {
-		inq_t *inq;
+	uint64_t now = gettime_ns();
+	input_stats_t ins;
+	uint64_t wait_ns;
 
-		if ((inq = list_head(&sqlt->sqlt_inq)) == NULL) {
-			return;
+	if (!final && now - sqlt->sqlt_report_ns < 1000000000ULL) {
+		return;
+	}
+	sqlt->sqlt_report_ns = now;
+
+	input_stats(sqlt->sqlt_input, &ins);
+
+	pthread_mutex_lock(&sqlt->sqlt_inq.inr_lock);
+	wait_ns = sqlt->sqlt_inq.inr_wait_ns;
+	pthread_mutex_unlock(&sqlt->sqlt_inq.inr_lock);
+
+	double mib = 1024.0 * 1024.0;
+	double tok_rate = sqlt->sqlt_ingest_ns == 0 ? 0 :
+	    (sqlt->sqlt_ingest_bytes / mib) / (sqlt->sqlt_ingest_ns / 1e9);
+	char in_rate[32] = "";
+
+	/*
+	 * A mapped input is faulted in by the tokenizer itself, so there is
+	 * no separate input rate to report.
+	 */
+	if (ins.ins_ns != 0) {
+		(void) snprintf(in_rate, sizeof (in_rate), " %.1f MiB/s",
+		    (ins.ins_offset / mib) / (ins.ins_ns / 1e9));
+	}
+
+	/*
+	 * With the pipeline, the tokenizer may also wait for the workers.
+	 * Once they have finished, report how often they shared work.
+	 */
+	char workers[96] = "";
+	if (sqlt->sqlt_pipeline != NULL) {
+		int n = snprintf(workers, sizeof (workers),
+		    ", %.1fs for %u workers",
+		    pipeline_wait_ns(sqlt->sqlt_pipeline) / 1e9,
+		    pipeline_workers(sqlt->sqlt_pipeline));
+
+		if (final && n > 0 && (size_t)n < sizeof (workers)) {
+			(void) snprintf(workers + n, sizeof (workers) - n,
+			    ", %llu batches stolen", (unsigned long long)
+			    pipeline_steals(sqlt->sqlt_pipeline));
 		}
+	}
 
-		if (inq->inq_pos >= inq->inq_len) {
-			/*
-			 * This chunk has no more characters to read.
-			 */
-			list_remove(&sqlt->sqlt_inq, inq);
-			sqlt_inq_free(inq);
-			continue;
+	fprintf(stderr, "%s %.1f MiB (compressed offset %llu); "
+	    "%s%s; tokenizer %.1f MiB/s (waited %.1fs for input%s)\n",
+	    final ? "DONE" : "PROGRESS", ins.ins_offset / mib,
+	    (unsigned long long)ins.ins_raw_offset,
+	    ins.ins_kind, in_rate, tok_rate, wait_ns / 1e9, workers);
+}
+
+/*
+ * With an index, return how much may be read next from the current range,
+ * moving to the start of the next range when one is finished.  Returns 0
+ * after the last range.
+ */
+static size_t
+sqlt_range_want(sqlt_t *sqlt)
+{
+	while (sqlt->sqlt_range < sqlt->sqlt_nranges) {
+		sqlt_range_t *sqr = &sqlt->sqlt_ranges[sqlt->sqlt_range];
+		uint64_t pos;
+
+		if (!sqlt->sqlt_range_open) {
+			if (input_seek(sqlt->sqlt_input, sqr->sqr_start,
+			    sqlt->sqlt_index) != 0) {
+				err(1, "input_seek(%llu)",
+				    (unsigned long long)sqr->sqr_start);
+			}
+			sqlt->sqlt_range_open = 1;
 		}
 
-		char chr = inq->inq_buf[inq->inq_pos];
+		if ((pos = input_tell(sqlt->sqlt_input)) < sqr->sqr_end) {
+			return (sqr->sqr_end - pos < INQ_CHUNK_SIZE ?
+			    sqr->sqr_end - pos : INQ_CHUNK_SIZE);
+		}
 
-		ingest_action_t action = sqlt->sqlt_copy != NULL ?
-		    sqlt_ingest_copy(sqlt, chr) : sqlt_ingest_sql(sqlt, chr);
+		sqlt->sqlt_range++;
+		sqlt->sqlt_range_open = 0;
+	}
 
-		switch (action) {
-		case INGEST_NEXT:
-			inq->inq_pos++;
-			break;
+	return (0);
+}
 
-		case INGEST_AGAIN:
-			break;
+static void
+sqlt_range_add(sqlt_t *sqlt, uint64_t start, uint64_t end)
+{
+	sqlt_range_t *sqr;
 
-		case INGEST_ERROR:
-			errx(1, "INGEST_ERROR!\n");
-			break;
+	if (sqlt->sqlt_nranges > 0 && (sqr = &sqlt->sqlt_ranges[
+	    sqlt->sqlt_nranges - 1])->sqr_end == start) {
+		sqr->sqr_end = end;
+		return;
+	}
+
+	sqr = &sqlt->sqlt_ranges[sqlt->sqlt_nranges];
+	sqr->sqr_start = start;
+	sqr->sqr_end = end;
+	sqlt->sqlt_nranges++;
+}
+
+/*
+ * An index is only used with the file it was written for.
+ */
+static void
+sqlt_index_check(sqlt_t *sqlt, const char *path)
+{
+	dump_index_t *ix = sqlt->sqlt_index;
+	struct stat st;
+
+	if ((strcmp(path, "-") == 0 ? fstat(STDIN_FILENO, &st) :
+	    stat(path, &st)) != 0) {
+		err(1, "stat(%s)", path);
+	}
+	if (ix->ix_size == 0 || ix->ix_size != (uint64_t)st.st_size) {
+		errx(1, "the index does not match %s (%llu bytes, not %llu)",
+		    path, (unsigned long long)st.st_size,
+		    (unsigned long long)ix->ix_size);
+	}
+}
+
+/*
+ * Choose the ranges of the dump to read with an index: the COPY data of
+ * "buckets_config", which the bucket tables need, and then the CREATE TABLE
+ * and COPY commands of each selected table, in the order they appear.
+ * Neighbouring commands are read as one range.
+ */
+static void
+sqlt_ranges_init(sqlt_t *sqlt)
+{
+	dump_index_t *ix = sqlt->sqlt_index;
+	index_entry_t *ixe;
+	uint64_t total = 0;
+	unsigned n = 0;
+
+	for (ixe = list_head(&ix->ix_entries); ixe != NULL;
+	    ixe = list_next(&ix->ix_entries, ixe)) {
+		n++;
+	}
+	if ((sqlt->sqlt_ranges = calloc(n + 1, sizeof (sqlt_range_t))) ==
+	    NULL) {
+		err(1, "calloc");
+	}
+
+	for (ixe = list_head(&ix->ix_entries); ixe != NULL;
+	    ixe = list_next(&ix->ix_entries, ixe)) {
+		if (ixe->ixe_kind == INDEX_COPY &&
+		    strcmp(ixe->ixe_table, "buckets_config") == 0) {
+			sqlt_range_add(sqlt, ixe->ixe_start, ixe->ixe_end);
+		}
+	}
+	for (ixe = list_head(&ix->ix_entries); ixe != NULL;
+	    ixe = list_next(&ix->ix_entries, ixe)) {
+		if (strcmp(ixe->ixe_table, "buckets_config") != 0 &&
+		    sqlt_selected(sqlt, ixe->ixe_table)) {
+			sqlt_range_add(sqlt, ixe->ixe_start, ixe->ixe_end);
 		}
 	}
+
+	for (unsigned i = 0; i < sqlt->sqlt_nranges; i++) {
+		total += sqlt->sqlt_ranges[i].sqr_end -
+		    sqlt->sqlt_ranges[i].sqr_start;
+	}
+	fprintf(stderr, "INDEX (%u ranges, %llu of %llu bytes)\n",
+	    sqlt->sqlt_nranges, (unsigned long long)total,
+	    (unsigned long long)ix->ix_length);
+}
+
+/*
+ * Fill the next chunk in the input ring.  Returns 0 at the end of the input.
+ */
+static size_t
+sqlt_fill(sqlt_t *sqlt)
+{
+	inq_t *inq = inq_ring_tail(&sqlt->sqlt_inq);
+	size_t want = INQ_CHUNK_SIZE;
+
+	if (sqlt->sqlt_ranges != NULL &&
+	    (want = sqlt_range_want(sqlt)) == 0) {
+		inq_ring_eof(&sqlt->sqlt_inq);
+		return (0);
+	}
+
+	inq->inq_off = input_tell(sqlt->sqlt_input);
+	if (input_is_mapped(sqlt->sqlt_input)) {
+		const char *buf;
+
+		/*
+		 * The tokenizer never writes to its input, so the read-only
+		 * mapping may stand in for a chunk buffer.
+		 */
+		inq->inq_len = input_next(sqlt->sqlt_input, &buf, want);
+		inq->inq_buf = (char *)buf;
+		inq->inq_pos = 0;
+	} else if (sqlt_inq_read(inq, sqlt->sqlt_input, want) != 0) {
+		err(1, "sqlt_inq_read");
+	}
+
+	if (inq->inq_len == 0) {
+		inq_ring_eof(&sqlt->sqlt_inq);
+		return (0);
+	}
+
+	inq_ring_push(&sqlt->sqlt_inq);
+	return (inq->inq_len);
+}
+
+/*
+ * The reader thread fills the input ring ahead of the tokenizer, so that
+ * reading and inflating the input overlaps with tokenizing it.
+ */
+static void *
+sqlt_reader(void *arg)
+{
+	sqlt_t *sqlt = arg;
+
+	while (sqlt_fill(sqlt) > 0) {
+		continue;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Consume one chunk from the input ring.  Returns 0 at the end of the input.
+ */
+static int
+sqlt_consume(sqlt_t *sqlt)
+{
+	inq_t *inq;
+
+	if ((inq = inq_ring_head(&sqlt->sqlt_inq)) == NULL) {
+		return (0);
+	}
+
+	uint64_t start = gettime_ns();
+	sqlt_ingest(sqlt, inq);
+	sqlt->sqlt_ingest_bytes += inq->inq_len;
+	sqlt->sqlt_ingest_ns += gettime_ns() - start;
+
+	inq_ring_pop(&sqlt->sqlt_inq);
+
+	sqlt_report(sqlt, 0);
+	return (1);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-p] [-j workers] [-m MiB] [-r depth] "
+	    "[-s MiB]\n"
+	    "\t[-t table[,table...]] [-w index | -i index [-z threads]]\n"
+	    "\t<input_file | ->\n"
+	    "\n"
+	    "\t-i index\tuse an index written by -w, to read only the "
+	    "selected\n"
+	    "\t\t\ttables, and to inflate a gzip dump on several threads\n"
+	    "\t-j workers\tnumber of threads converting rows to JSON\n"
+	    "\t\t\t(default one fewer than the number of CPUs; 0 converts\n"
+	    "\t\t\ton the tokenizer thread)\n"
+	    "\t-m MiB\t\tlimit on COPY data and JSON output buffered for "
+	    "the\n"
+	    "\t\t\tworkers (default %u; 0 for no limit)\n"
+	    "\t-p\t\tparse text format COPY data on the workers too, in\n"
+	    "\t\t\tchunks divided at row boundaries\n"
+	    "\t-r depth\tnumber of %u KiB chunks to read ahead of the "
+	    "tokenizer\n"
+	    "\t\t\t(default %u; 0 disables the reader thread)\n"
+	    "\t-s MiB\t\tlimit on COPY data spooled to a temporary file "
+	    "until\n"
+	    "\t\t\tbuckets_config is read (default %u)\n"
+	    "\t-t tables\tconvert only these tables (and buckets_config)\n"
+	    "\t-w index\twrite an index of the tables in the dump, and of "
+	    "the\n"
+	    "\t\t\tpoints from which a gzip dump may be inflated\n"
+	    "\t-z threads\tnumber of threads inflating a gzip dump with an "
+	    "index\n"
+	    "\t\t\t(default half the number of CPUs; 0 inflates on the\n"
+	    "\t\t\treader thread)\n",
+	    progname, PIPELINE_BUDGET_MIB, INQ_CHUNK_SIZE / 1024,
+	    INQ_RING_DEPTH, SPOOL_MAX_MIB);
+	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
 	sqlt_t *sqlt;
+	unsigned depth = INQ_RING_DEPTH;
+	uint64_t spool_max = (uint64_t)SPOOL_MAX_MIB * 1024 * 1024;
+	uint64_t budget = (uint64_t)PIPELINE_BUDGET_MIB * 1024 * 1024;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nworkers = ncpu > 1 ? ncpu - 1 : 0;
+	unsigned ninflate = ncpu > 1 ? ncpu / 2 : 0;
+	const char *index_in = NULL, *index_out = NULL;
+	strlist_t *select = NULL;
+	pthread_t reader;
+	int threaded;
+	int split = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:j:m:pr:s:t:w:z:")) != -1) {
+		switch (c) {
+		case 'i':
+			index_in = optarg;
+			break;
+
+		case 'j': {
+			char *end;
+
+			errno = 0;
+			unsigned long val = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || val > PIPELINE_MAX) {
+				errx(1, "invalid number of workers \"%s\"",
+				    optarg);
+			}
+			nworkers = val;
+			break;
+		}
+
+		case 'm': {
+			char *end;
+
+			errno = 0;
+			unsigned long long val = strtoull(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' ||
+			    val > UINT64_MAX / 1024 / 1024) {
+				errx(1, "invalid memory budget \"%s\"",
+				    optarg);
+			}
+			budget = val * 1024 * 1024;
+			break;
+		}
+
+		case 'p':
+			split = 1;
+			break;
+
+		case 'r': {
+			char *end;
+
+			errno = 0;
+			unsigned long val = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || val > 4096) {
+				errx(1, "invalid read-ahead depth \"%s\"",
+				    optarg);
+			}
+			depth = val;
+			break;
+		}
+
+		case 's': {
+			char *end;
 
-	if (argc < 2) {
-		errx(1, "usage: %s <input_file>", argv[0]);
+			errno = 0;
+			unsigned long long val = strtoull(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' ||
+			    val > UINT64_MAX / 1024 / 1024) {
+				errx(1, "invalid spool limit \"%s\"", optarg);
+			}
+			spool_max = val * 1024 * 1024;
+			break;
+		}
+
+		case 't': {
+			char *tables, *table, *lasts;
+
+			if (select == NULL && strlist_alloc(&select, 0) != 0) {
+				err(1, "strlist_alloc");
+			}
+			if ((tables = strdup(optarg)) == NULL) {
+				err(1, "strdup");
+			}
+			for (table = strtok_r(tables, ",", &lasts);
+			    table != NULL;
+			    table = strtok_r(NULL, ",", &lasts)) {
+				if (strlist_set_tail(select, table) != 0) {
+					err(1, "strlist_set_tail");
+				}
+			}
+			free(tables);
+			break;
+		}
+
+		case 'w':
+			index_out = optarg;
+			break;
+
+		case 'z': {
+			char *end;
+
+			errno = 0;
+			unsigned long val = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || val > INFLATE_MAX) {
+				errx(1, "invalid number of inflate threads "
+				    "\"%s\"", optarg);
+			}
+			ninflate = val;
+			break;
+		}
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+	if (index_in != NULL && index_out != NULL) {
+		errx(1, "-i and -w may not be used together");
+	}
+	if (ninflate > INFLATE_MAX) {
+		ninflate = INFLATE_MAX;
 	}
 
 	if (sqlt_alloc(&sqlt) != 0) {
 		err(1, "sqlt_alloc");
 	}
+	sqlt->sqlt_spool_max = spool_max;
+	sqlt->sqlt_select = select;
+
+	if (nworkers > PIPELINE_MAX) {
+		nworkers = PIPELINE_MAX;
+	}
+	if (nworkers > 0 && pipeline_alloc(&sqlt->sqlt_pipeline,
+	    nworkers, budget) != 0) {
+		err(1, "pipeline_alloc");
+	}
+	if (split && nworkers == 0) {
+		errx(1, "-p requires at least one worker");
+	}
+	sqlt->sqlt_split = split;
+
+	if (input_open(&sqlt->sqlt_input, argv[optind]) != 0) {
+		err(1, "input_open(%s)", argv[optind]);
+	}
+	sqlt->sqlt_report_ns = gettime_ns();
 
-	if ((sqlt->sqlt_file = fopen(argv[1], "r")) == NULL) {
-		err(1, "fopen");
+	if (index_out != NULL) {
+		if (index_alloc(&sqlt->sqlt_index) != 0) {
+			err(1, "index_alloc");
+		}
+		sqlt->sqlt_index_build = 1;
+		input_index(sqlt->sqlt_input, sqlt->sqlt_index);
+	} else if (index_in != NULL) {
+		if (index_read(&sqlt->sqlt_index, index_in) != 0) {
+			err(1, "index_read(%s)", index_in);
+		}
+		sqlt_index_check(sqlt, argv[optind]);
+		if (select != NULL) {
+			sqlt_ranges_init(sqlt);
+		}
+
+		/*
+		 * Each thread inflates the dump from a different restart
+		 * point.
+		 */
+		if (sqlt->sqlt_index->ix_gzip &&
+		    sqlt->sqlt_index->ix_npoints > 0 &&
+		    input_parallel(sqlt->sqlt_input, sqlt->sqlt_index,
+		    ninflate) != 0) {
+			errx(1, "the index does not match %s", argv[optind]);
+		}
 	}
 
-	for (;;) {
-		inq_t *inq;
+	/*
+	 * There is no I/O to overlap for a mapped input: the pages are
+	 * faulted in by the tokenizer, and read-ahead is left to the system.
+	 * Otherwise a read-ahead depth of zero means we read the input on
+	 * this thread, one chunk at a time.
+	 */
+	threaded = depth > 0 && !input_is_mapped(sqlt->sqlt_input);
+	if (depth < 2) {
+		depth = 2;
+	}
+
+	if (inq_ring_init(&sqlt->sqlt_inq, depth,
+	    input_is_mapped(sqlt->sqlt_input) ? 0 : INQ_CHUNK_SIZE) != 0) {
+		err(1, "inq_ring_init");
+	}
 
-		if ((sqlt_inq_alloc(&inq, 1024 * 1024)) != 0) {
-			err(1, "sqlt_inq_alloc");
+	if (threaded) {
+		if ((errno = pthread_create(&reader, NULL, sqlt_reader,
+		    sqlt)) != 0) {
+			err(1, "pthread_create");
+		}
+
+		while (sqlt_consume(sqlt)) {
+			continue;
 		}
 
-		if (sqlt_inq_read(inq, sqlt->sqlt_file) != 0) {
-			err(1, "sqlt_inq_read");
+		if ((errno = pthread_join(reader, NULL)) != 0) {
+			err(1, "pthread_join");
 		}
+	} else {
+		while (sqlt_fill(sqlt) > 0) {
+			(void) sqlt_consume(sqlt);
+		}
+	}
 
-		list_insert_head(&sqlt->sqlt_inq, inq);
+	if (sqlt->sqlt_copy != NULL) {
+		errx(1, "unexpected end of input in COPY data for \"%s\"",
+		    sqlt->sqlt_copy->sqcp_command->cmdc_table_name);
+	}
+	if (sqlt->sqlt_state != STATE_SQL_REST || sqlt->sqlt_depth > 0) {
+		errx(1, "unexpected end of input in %s",
+		    sqlt_state_describe(sqlt));
+	}
 
-		sqlt_ingest(sqlt);
+	if (!list_is_empty(&sqlt->sqlt_spools)) {
+		/*
+		 * Without a bucket configuration, this is not a Moray dump;
+		 * write out each table as it is.
+		 */
+		warnx("no buckets_config table; writing spooled tables as "
+		    "they are");
+		sqlt->sqlt_spool_raw = 1;
+		sqlt_spool_replay(sqlt);
 	}
 
+	/*
+	 * Wait for the workers to finish converting, and the writer to finish
+	 * writing, before reporting.
+	 */
+	if (sqlt->sqlt_pipeline != NULL) {
+		pipeline_finish(sqlt->sqlt_pipeline);
+	}
+
+	if (index_out != NULL) {
+		sqlt->sqlt_index->ix_length = input_tell(sqlt->sqlt_input);
+		if (index_write(sqlt->sqlt_index, index_out) != 0) {
+			err(1, "index_write(%s)", index_out);
+		}
+		fprintf(stderr, "INDEX WRITTEN (%u restart points)\n",
+		    sqlt->sqlt_index->ix_npoints);
+	}
+
+	sqlt_report(sqlt, 1);
+	free(sqlt->sqlt_ranges);
+	strlist_free(select);
+	pipeline_free(sqlt->sqlt_pipeline);
+	input_close(sqlt->sqlt_input);
+	index_free(sqlt->sqlt_index);
+
 	return (0);
 }
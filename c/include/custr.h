@@ -47,6 +47,13 @@ extern int custr_alloc_buf(custr_t **, void *, size_t);
 extern int custr_appendc(custr_t *, char);
 extern int custr_append(custr_t *, const char *);
 
+/*
+ * Append "len" bytes from a buffer, which need not be NUL-terminated, to a
+ * dynamic string.  Returns 0 on success and -1 otherwise.  The dynamic string
+ * will be unmodified if the function returns -1.
+ */
+extern int custr_append_buf(custr_t *, const char *, size_t);
+
 /*
  * Append a format string and arguments as though the contents were being parsed
  * through snprintf. Returns 0 on success and -1 otherwise.  The dynamic string
@@ -22,14 +22,26 @@
  *         json_emit_t *jse = json_create_stdio(stream);
  *
  *     "stream" is a stdio stream to which the JSON output will be emitted.
+ *     Alternatively, output may be written directly to a file descriptor:
  *
- *     json_create_stdio() returns NULL on failure with errno set appropriately.
+ *         int fd = ...
+ *         json_emit_t *jse = json_create_fd(fd);
+ *
+ *     json_create_stdio() and json_create_fd() return NULL on failure with
+ *     errno set appropriately.
+ *
+ *     Both backends collect output in a large internal buffer, which is
+ *     written out when it fills, or when json_flush() is called.  Errors
+ *     from writing buffered output are reported (see "Error handling") only
+ *     once it has been written, so callers should use json_flush() before
+ *     checking for errors at the end of the document.
  *
  *     When you've completed the operation and checked for errors, use
- *     json_fini() to free resources created by the emitter.  After that, no
- *     other functions may be called using the emitter.  (This does nothing to
- *     the underlying stdio stream.  The caller may wish to flush or close that
- *     stream.)
+ *     json_fini() to free resources created by the emitter.  This writes out
+ *     any remaining buffered output.  After that, no other functions may be
+ *     called using the emitter.  (This does nothing else to the underlying
+ *     stdio stream or file descriptor.  The caller may wish to flush or close
+ *     it.)
  *
  * (2) Emitting data
  *
@@ -42,6 +54,14 @@
  *        json_uint64()
  *        json_double()*
  *        json_utf8string()
+ *        json_utf8string_len()
+ *
+ *     json_utf8string_len() takes an explicit length for the string value,
+ *     which need not be NUL-terminated.  Text that is already formatted as
+ *     a JSON value (e.g., a number) may be emitted as-is with json_rawvalue();
+ *     the caller is responsible for its validity.  A UTF-16 surrogate
+ *     encoded in a string as if it were a regular character (which is not
+ *     valid UTF-8) is emitted as a "\uXXXX" escape sequence.
  *
  *     Note that double-precision floating-point values are emitted with ten
  *     digits in the current implementation, but this is subject to change to
@@ -76,12 +96,35 @@
  *     betwen values.  This function can only be used at the top level (i.e.,
  *     not inside objects or arrays).
  *
- * (4) Error handling
+ * (4) Pre-bound labels
+ *
+ *     When the same labels are used for many objects (e.g., one object for
+ *     each row of a table), the labels can be escaped once up front:
+ *
+ *         json_label_t *jl = json_label_create("nerrors");
+ *
+ *     json_label_create() returns NULL on failure with errno set
+ *     appropriately.  The label may then be used with the "_bound" variants
+ *     of the emitter functions:
+ *
+ *        json_object_begin_bound()
+ *        json_array_begin_bound()
+ *        json_boolean_bound()
+ *        json_null_bound()
+ *        json_utf8string_bound()
+ *        json_rawvalue_bound()
+ *
+ *     json_utf8string_bound() takes an explicit length for the string value,
+ *     which need not be NUL-terminated.  A label may be used with any number
+ *     of emitters, and is freed with json_label_fini().
+ *
+ * (5) Error handling
  *
  *     There are several operational errors that can happen while emitting JSON.
  *     These are currently:
  *
- *         JSE_STDIO	An error was encountered calling a stdio function.
+ *         JSE_STDIO	An error was encountered calling a stdio function, or
+ *         		writing to the file descriptor.
  *
  *         JSE_TOODEEP	The caller attempted to emit more than the supported
  *         		number of nested objects or arrays.  Currently, 255 is
@@ -118,6 +161,7 @@
 #include <stdio.h>
 
 typedef struct json_emit json_emit_t;
+typedef struct json_label json_label_t;
 
 typedef enum {
 	JSON_B_FALSE,
@@ -132,8 +176,10 @@ typedef enum {
 } json_error_t;
 
 json_emit_t *json_create_stdio(FILE *);
+json_emit_t *json_create_fd(int);
 json_emit_t *json_create_string(void);
 json_error_t json_get_error(json_emit_t *, char *, size_t);
+void json_flush(json_emit_t *);
 void json_fini(json_emit_t *);
 
 void json_object_begin(json_emit_t *, const char *);
@@ -150,6 +196,20 @@ void json_int64(json_emit_t *, const char *, int64_t);
 void json_uint64(json_emit_t *, const char *, uint64_t);
 void json_double(json_emit_t *, const char *, double);
 void json_utf8string(json_emit_t *, const char *, const char *);
+void json_utf8string_len(json_emit_t *, const char *, const char *, size_t);
+void json_rawvalue(json_emit_t *, const char *, const char *, size_t);
+
+json_label_t *json_label_create(const char *);
+void json_label_fini(json_label_t *);
+
+void json_object_begin_bound(json_emit_t *, const json_label_t *);
+void json_array_begin_bound(json_emit_t *, const json_label_t *);
+void json_boolean_bound(json_emit_t *, const json_label_t *, json_boolean_t);
+void json_null_bound(json_emit_t *, const json_label_t *);
+void json_utf8string_bound(json_emit_t *, const json_label_t *, const char *,
+    size_t);
+void json_rawvalue_bound(json_emit_t *, const json_label_t *, const char *,
+    size_t);
 
 /*
  * For use with emitters created via json_create_string():
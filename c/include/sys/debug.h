@@ -0,0 +1,47 @@
+/*
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ */
+
+/*
+ * The subset of the illumos <sys/debug.h> assertion macros used by the
+ * routines in "deps", so that they may be built on systems that do not
+ * provide this header.
+ */
+
+#ifndef	_SYS_DEBUG_H
+#define	_SYS_DEBUG_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#ifndef	VERIFY
+#define	VERIFY(EX)	((void)((EX) || (fprintf(stderr, \
+	"assertion failed: %s, file: %s, line: %d\n", #EX, __FILE__, \
+	__LINE__), abort(), 0)))
+#endif
+
+#ifndef	VERIFY0
+#define	VERIFY0(EX)	VERIFY((EX) == 0)
+#endif
+
+#ifndef	ASSERT
+#define	ASSERT(EX)	assert(EX)
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_DEBUG_H */
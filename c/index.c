@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <zlib.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+/*
+ * The dump index: a sidecar file describing where each COPY block (and each
+ * CREATE TABLE command) lies in the uncompressed dump, so that a later run
+ * can read just the parts it needs.  For a gzip dump, the index also holds
+ * inflate restart points, as in zlib's "zran" example: the position of a
+ * deflate block boundary in both the compressed and uncompressed streams,
+ * and the 32 KiB of output before it, with which inflate can begin again
+ * from that boundary.
+ *
+ * The file is mostly text, one record per line, with tab-separated fields:
+ *
+ *	moray_dump index 1
+ *	input	<gzip | plain>	<file size>	<uncompressed length>
+ *	point	<out>	<in>	<bits>	<window length>	<deflated length>
+ *	<deflated window>
+ *	table	<name>	<start>	<end>
+ *	copy	<name>	<rows>	<start>	<data>	<end>	<column>...
+ *	end
+ *
+ * Offsets are in bytes, and all but a point's "in" are in the uncompressed
+ * dump.  The "start" of a command is the end of the command before it, so
+ * that a run of commands may be read from "start" to "end" on their own.
+ * The deflated window of a point follows its line directly.
+ */
+
+#define	INDEX_MAGIC		"moray_dump index 1"
+
+int
+index_alloc(dump_index_t **ixp)
+{
+	dump_index_t *ix;
+
+	if ((ix = calloc(1, sizeof (*ix))) == NULL) {
+		return (-1);
+	}
+
+	list_create(&ix->ix_entries, sizeof (index_entry_t),
+	    offsetof(index_entry_t, ixe_link));
+
+	*ixp = ix;
+	return (0);
+}
+
+void
+index_free(dump_index_t *ix)
+{
+	index_entry_t *ixe;
+
+	if (ix == NULL) {
+		return;
+	}
+
+	while ((ixe = list_remove_head(&ix->ix_entries)) != NULL) {
+		free(ixe->ixe_table);
+		strlist_free(ixe->ixe_columns);
+		free(ixe);
+	}
+	list_destroy(&ix->ix_entries);
+
+	for (unsigned i = 0; i < ix->ix_npoints; i++) {
+		free(ix->ix_points[i].ixp_window);
+	}
+	free(ix->ix_points);
+	free(ix);
+}
+
+/*
+ * Record a command, in the order the commands appear in the dump.  The
+ * columns (of a COPY) are copied.
+ */
+index_entry_t *
+index_add_entry(dump_index_t *ix, index_kind_t kind, const char *table,
+    strlist_t *columns, uint64_t start, uint64_t end)
+{
+	index_entry_t *ixe;
+
+	if ((ixe = calloc(1, sizeof (*ixe))) == NULL ||
+	    (ixe->ixe_table = strdup(table)) == NULL ||
+	    strlist_alloc(&ixe->ixe_columns, 0) != 0) {
+		err(1, "index_add_entry");
+	}
+
+	for (unsigned i = 0; columns != NULL &&
+	    i < strlist_contig_count(columns); i++) {
+		if (strlist_set_tail(ixe->ixe_columns,
+		    strlist_get(columns, i)) != 0) {
+			err(1, "strlist_set_tail");
+		}
+	}
+
+	ixe->ixe_kind = kind;
+	ixe->ixe_start = start;
+	ixe->ixe_data = end;
+	ixe->ixe_end = end;
+
+	list_insert_tail(&ix->ix_entries, ixe);
+	return (ixe);
+}
+
+/*
+ * Record an inflate restart point.  Points must be added in order.  The
+ * window is deflated, as the text of a dump compresses well and a large
+ * dump has many points.
+ */
+void
+index_add_point(dump_index_t *ix, uint64_t out, uint64_t in, int bits,
+    const unsigned char *window, size_t len)
+{
+	index_point_t *ixp;
+	uLongf zlen = compressBound(len);
+
+	if (ix->ix_npoints == ix->ix_maxpoints) {
+		unsigned n = ix->ix_maxpoints == 0 ? 64 : ix->ix_maxpoints * 2;
+		index_point_t *p;
+
+		if ((p = realloc(ix->ix_points, n * sizeof (*p))) == NULL) {
+			err(1, "realloc");
+		}
+		ix->ix_points = p;
+		ix->ix_maxpoints = n;
+	}
+
+	ixp = &ix->ix_points[ix->ix_npoints];
+	if ((ixp->ixp_window = malloc(zlen)) == NULL) {
+		err(1, "malloc");
+	}
+	if (compress2(ixp->ixp_window, &zlen, window, len, 6) != Z_OK) {
+		errx(1, "could not compress inflate window");
+	}
+
+	ixp->ixp_out = out;
+	ixp->ixp_in = in;
+	ixp->ixp_bits = bits;
+	ixp->ixp_window_len = len;
+	ixp->ixp_window_zlen = zlen;
+	ix->ix_npoints++;
+}
+
+/*
+ * Return the last restart point at or before uncompressed offset "off", or
+ * NULL if there is none (in which case inflate must begin at the start of
+ * the file).
+ */
+const index_point_t *
+index_find_point(dump_index_t *ix, uint64_t off)
+{
+	unsigned lo = 0, hi = ix->ix_npoints;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (ix->ix_points[mid].ixp_out <= off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo == 0 ? NULL : &ix->ix_points[lo - 1]);
+}
+
+/*
+ * Inflate the window of a restart point into "buf", which must have room for
+ * INDEX_WINDOW bytes.  Returns the length of the window, or -1 if it is
+ * corrupt.
+ */
+ssize_t
+index_point_window(const index_point_t *ixp, unsigned char *buf)
+{
+	uLongf len = INDEX_WINDOW;
+
+	if (ixp->ixp_window_len > INDEX_WINDOW ||
+	    uncompress(buf, &len, ixp->ixp_window,
+	    ixp->ixp_window_zlen) != Z_OK || len != ixp->ixp_window_len) {
+		return (-1);
+	}
+
+	return (len);
+}
+
+static int
+index_name_ok(const char *name)
+{
+	return (strpbrk(name, "\t\n") == NULL);
+}
+
+/*
+ * Write the index to "path".  Returns -1 with errno set on failure; a name
+ * that cannot be written in the file's format is EINVAL.
+ */
+int
+index_write(dump_index_t *ix, const char *path)
+{
+	FILE *f;
+
+	for (index_entry_t *ixe = list_head(&ix->ix_entries); ixe != NULL;
+	    ixe = list_next(&ix->ix_entries, ixe)) {
+		if (!index_name_ok(ixe->ixe_table)) {
+			errno = EINVAL;
+			return (-1);
+		}
+		for (unsigned i = 0; i < strlist_contig_count(
+		    ixe->ixe_columns); i++) {
+			if (!index_name_ok(strlist_get(ixe->ixe_columns, i))) {
+				errno = EINVAL;
+				return (-1);
+			}
+		}
+	}
+
+	if ((f = fopen(path, "w")) == NULL) {
+		return (-1);
+	}
+
+	fprintf(f, "%s\n", INDEX_MAGIC);
+	fprintf(f, "input\t%s\t%llu\t%llu\n", ix->ix_gzip ? "gzip" : "plain",
+	    (unsigned long long)ix->ix_size,
+	    (unsigned long long)ix->ix_length);
+
+	for (unsigned i = 0; i < ix->ix_npoints; i++) {
+		index_point_t *ixp = &ix->ix_points[i];
+
+		fprintf(f, "point\t%llu\t%llu\t%d\t%zu\t%zu\n",
+		    (unsigned long long)ixp->ixp_out,
+		    (unsigned long long)ixp->ixp_in, ixp->ixp_bits,
+		    ixp->ixp_window_len, ixp->ixp_window_zlen);
+		(void) fwrite(ixp->ixp_window, 1, ixp->ixp_window_zlen, f);
+		(void) fputc('\n', f);
+	}
+
+	for (index_entry_t *ixe = list_head(&ix->ix_entries); ixe != NULL;
+	    ixe = list_next(&ix->ix_entries, ixe)) {
+		if (ixe->ixe_kind == INDEX_TABLE) {
+			fprintf(f, "table\t%s\t%llu\t%llu\n", ixe->ixe_table,
+			    (unsigned long long)ixe->ixe_start,
+			    (unsigned long long)ixe->ixe_end);
+			continue;
+		}
+
+		fprintf(f, "copy\t%s\t%llu\t%llu\t%llu\t%llu", ixe->ixe_table,
+		    (unsigned long long)ixe->ixe_rows,
+		    (unsigned long long)ixe->ixe_start,
+		    (unsigned long long)ixe->ixe_data,
+		    (unsigned long long)ixe->ixe_end);
+		for (unsigned i = 0; i < strlist_contig_count(
+		    ixe->ixe_columns); i++) {
+			fprintf(f, "\t%s", strlist_get(ixe->ixe_columns, i));
+		}
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "end\n");
+
+	if (ferror(f)) {
+		int e = errno;
+
+		(void) fclose(f);
+		errno = e;
+		return (-1);
+	}
+	return (fclose(f));
+}
+
+/*
+ * Split a line of the index into its tab-separated fields, in place.
+ */
+static unsigned
+index_fields(char *line, char **fields, unsigned max)
+{
+	unsigned n = 0;
+	char *p = line;
+
+	while (n < max) {
+		fields[n++] = p;
+		if ((p = strchr(p, '\t')) == NULL) {
+			break;
+		}
+		*p++ = '\0';
+	}
+
+	return (n);
+}
+
+static int
+index_number(const char *s, uint64_t *valp)
+{
+	char *end;
+
+	errno = 0;
+	*valp = strtoull(s, &end, 10);
+	return (errno != 0 || *s == '\0' || *end != '\0' ? -1 : 0);
+}
+
+/*
+ * Read the index from "path".  A file that is not a complete index is
+ * reported, with the line it failed at, and is fatal.
+ */
+int
+index_read(dump_index_t **ixp, const char *path)
+{
+	dump_index_t *ix;
+	FILE *f;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	unsigned lineno = 0;
+	int done = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		return (-1);
+	}
+	if (index_alloc(&ix) != 0) {
+		err(1, "index_alloc");
+	}
+
+	while (!done && (len = getline(&line, &cap, f)) > 0) {
+		char *fields[4096];
+		unsigned n;
+		uint64_t v[5];
+
+		lineno++;
+		if (line[len - 1] != '\n') {
+			break;
+		}
+		line[len - 1] = '\0';
+
+		if (lineno == 1) {
+			if (strcmp(line, INDEX_MAGIC) != 0) {
+				errx(1, "%s: not a dump index", path);
+			}
+			continue;
+		}
+
+		n = index_fields(line, fields, 4096);
+
+		if (strcmp(fields[0], "input") == 0 && n == 4 &&
+		    index_number(fields[2], &v[0]) == 0 &&
+		    index_number(fields[3], &v[1]) == 0) {
+			ix->ix_gzip = strcmp(fields[1], "gzip") == 0;
+			ix->ix_size = v[0];
+			ix->ix_length = v[1];
+
+		} else if (strcmp(fields[0], "point") == 0 && n == 6 &&
+		    index_number(fields[1], &v[0]) == 0 &&
+		    index_number(fields[2], &v[1]) == 0 &&
+		    index_number(fields[3], &v[2]) == 0 && v[2] < 8 &&
+		    index_number(fields[4], &v[3]) == 0 &&
+		    v[3] <= INDEX_WINDOW &&
+		    index_number(fields[5], &v[4]) == 0 &&
+		    v[4] <= compressBound(INDEX_WINDOW)) {
+			unsigned char *w;
+			index_point_t *p;
+
+			if ((w = malloc(v[4] + 1)) == NULL) {
+				err(1, "malloc");
+			}
+			if (fread(w, 1, v[4] + 1, f) != v[4] + 1 ||
+			    w[v[4]] != '\n') {
+				errx(1, "%s: line %u: truncated window", path,
+				    lineno);
+			}
+
+			if (ix->ix_npoints == ix->ix_maxpoints) {
+				unsigned m = ix->ix_maxpoints == 0 ? 64 :
+				    ix->ix_maxpoints * 2;
+
+				if ((p = realloc(ix->ix_points,
+				    m * sizeof (*p))) == NULL) {
+					err(1, "realloc");
+				}
+				ix->ix_points = p;
+				ix->ix_maxpoints = m;
+			}
+			if (ix->ix_npoints > 0 &&
+			    ix->ix_points[ix->ix_npoints - 1].ixp_out >= v[0]) {
+				errx(1, "%s: line %u: points out of order",
+				    path, lineno);
+			}
+			p = &ix->ix_points[ix->ix_npoints++];
+			p->ixp_out = v[0];
+			p->ixp_in = v[1];
+			p->ixp_bits = v[2];
+			p->ixp_window_len = v[3];
+			p->ixp_window_zlen = v[4];
+			p->ixp_window = w;
+
+		} else if (strcmp(fields[0], "table") == 0 && n == 4 &&
+		    index_number(fields[2], &v[0]) == 0 &&
+		    index_number(fields[3], &v[1]) == 0 && v[0] <= v[1]) {
+			(void) index_add_entry(ix, INDEX_TABLE, fields[1], NULL,
+			    v[0], v[1]);
+
+		} else if (strcmp(fields[0], "copy") == 0 && n >= 6 &&
+		    index_number(fields[2], &v[0]) == 0 &&
+		    index_number(fields[3], &v[1]) == 0 &&
+		    index_number(fields[4], &v[2]) == 0 &&
+		    index_number(fields[5], &v[3]) == 0 &&
+		    v[1] <= v[2] && v[2] <= v[3]) {
+			index_entry_t *ixe = index_add_entry(ix, INDEX_COPY,
+			    fields[1], NULL, v[1], v[3]);
+
+			ixe->ixe_rows = v[0];
+			ixe->ixe_data = v[2];
+			for (unsigned i = 6; i < n; i++) {
+				if (strlist_set_tail(ixe->ixe_columns,
+				    fields[i]) != 0) {
+					err(1, "strlist_set_tail");
+				}
+			}
+
+		} else if (strcmp(fields[0], "end") == 0 && n == 1) {
+			done = 1;
+
+		} else {
+			errx(1, "%s: line %u: invalid index record", path,
+			    lineno);
+		}
+	}
+
+	free(line);
+	if (ferror(f)) {
+		err(1, "%s", path);
+	}
+	(void) fclose(f);
+
+	if (!done) {
+		errx(1, "%s: index is incomplete", path);
+	}
+
+	*ixp = ix;
+	return (0);
+}
@@ -0,0 +1,1193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+/*
+ * Size of the buffer used to hold data read from the input file before it is
+ * handed to the caller (plain input) or to inflate (gzip input).
+ */
+#define	INPUT_RAW_BUFSZ		(256 * 1024)
+
+/*
+ * The least amount of output between the inflate restart points recorded in
+ * a dump index.  Restarting at a point costs, on average, inflating half of
+ * this to reach the wanted offset.
+ */
+#define	INPUT_INDEX_SPAN	(4 * 1024 * 1024)
+
+/*
+ * Length of the gzip trailer (CRC and length), which follows the deflate data
+ * of each member.
+ */
+#define	INPUT_GZIP_TRAILER	8
+
+/*
+ * For parallel inflate, the number of segments that may be inflated ahead of
+ * the caller, for each thread.
+ */
+#define	INPUT_PARALLEL_SLOTS	2
+
+typedef enum input_kind {
+	INPUT_PLAIN = 1,
+	INPUT_GZIP,
+	INPUT_MMAP,
+} input_kind_t;
+
+/*
+ * Parallel inflate.  Given the restart points of an index, a gzip input is
+ * divided into segments at the points, which are inflated independently by
+ * a pool of threads.  Each segment is inflated into the next free slot of a
+ * ring, and the caller reads the slots in order.
+ */
+typedef enum input_slot_state {
+	INPUT_SLOT_FREE = 0,
+	INPUT_SLOT_BUSY,		/* being inflated */
+	INPUT_SLOT_READY,
+} input_slot_state_t;
+
+typedef struct input_slot {
+	input_slot_state_t isl_state;
+	unsigned isl_seg;
+	unsigned char *isl_buf;
+	size_t isl_size;		/* allocated size */
+	size_t isl_len;
+	size_t isl_pos;			/* reading position */
+} input_slot_t;
+
+struct input {
+	FILE *in_file;
+	input_kind_t in_kind;
+	int in_eof;		/* no more data from the file */
+	int in_done;		/* no more data for the caller */
+
+	unsigned char *in_raw;
+	size_t in_raw_pos;
+	size_t in_raw_len;
+
+	z_stream in_zs;
+	int in_zs_init;
+	int in_zs_raw;		/* restarted without the gzip header */
+	size_t in_skip;		/* bytes of gzip trailer still to skip */
+
+	uint64_t in_pos;	/* uncompressed offset of the next byte */
+
+	/*
+	 * If an index is being built, the restart points of a gzip input are
+	 * added to it as the input is inflated.  The last window of output is
+	 * kept for the next point.
+	 */
+	dump_index_t *in_index;
+	uint64_t in_index_last;
+	unsigned char *in_window;
+	size_t in_window_len;
+	unsigned char *in_window_tmp;
+
+	/*
+	 * Parallel inflate (input_parallel()).  The slots between the head
+	 * and the tail hold consecutive segments, and "in_par_next" is the
+	 * segment to go in the tail slot.
+	 */
+	dump_index_t *in_par_index;
+	pthread_t *in_par_threads;
+	unsigned in_par_nthreads;
+	pthread_mutex_t in_par_lock;
+	pthread_cond_t in_par_cv;
+	input_slot_t *in_par_slots;
+	unsigned in_par_nslots;
+	unsigned in_par_head;
+	unsigned in_par_tail;
+	unsigned in_par_nsegs;
+	unsigned in_par_next;
+	size_t in_par_skip;	/* bytes to discard after a seek */
+	int in_par_exit;
+
+	char *in_map;		/* mapping of the entire file */
+	size_t in_map_len;
+	size_t in_map_pos;
+
+	/*
+	 * The statistics are updated by whichever thread is reading the
+	 * input, and may be read by another to report progress.
+	 */
+	pthread_mutex_t in_stats_lock;
+	input_stats_t in_stats;
+};
+
+static ssize_t input_read_parallel(input_t *, char *, size_t);
+static void input_par_seek(input_t *, uint64_t);
+
+uint64_t
+gettime_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(1, "clock_gettime");
+	}
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Refill the raw buffer from the input file.  Returns the number of bytes
+ * now available, 0 at the end of the file, or -1 on error.
+ */
+static ssize_t
+input_fill_raw(input_t *in)
+{
+	size_t sz;
+
+	if (in->in_raw_pos < in->in_raw_len) {
+		return (in->in_raw_len - in->in_raw_pos);
+	}
+
+	in->in_raw_pos = in->in_raw_len = 0;
+	if (in->in_eof) {
+		return (0);
+	}
+
+	if ((sz = fread(in->in_raw, 1, INPUT_RAW_BUFSZ, in->in_file)) < 1) {
+		if (ferror(in->in_file)) {
+			return (-1);
+		}
+		in->in_eof = 1;
+		return (0);
+	}
+
+	in->in_raw_len = sz;
+	pthread_mutex_lock(&in->in_stats_lock);
+	in->in_stats.ins_raw_offset += sz;
+	pthread_mutex_unlock(&in->in_stats_lock);
+	return (sz);
+}
+
+/*
+ * Uncompressed dumps in regular files are mapped in their entirety, so that
+ * the tokenizer can walk the file contents in place without copying them
+ * into chunk buffers.  Returns 1 if the file was mapped, or 0 if the caller
+ * should fall back to buffered reads (e.g., for a pipe or a gzip file).
+ */
+static int
+input_try_map(input_t *in)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fileno(in->in_file), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size < 2 || (uint64_t)st.st_size > SIZE_MAX) {
+		return (0);
+	}
+
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+	    fileno(in->in_file), 0)) == MAP_FAILED) {
+		return (0);
+	}
+
+	if (((unsigned char *)map)[0] == 0x1f &&
+	    ((unsigned char *)map)[1] == 0x8b) {
+		(void) munmap(map, st.st_size);
+		return (0);
+	}
+
+	/*
+	 * These are only hints, so failure is not fatal.  We read the file
+	 * exactly once from front to back, so the system may read ahead
+	 * aggressively and need not keep pages around after we pass them.
+	 */
+	(void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef	MADV_HUGEPAGE
+	(void) madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+
+	in->in_map = map;
+	in->in_map_len = st.st_size;
+	in->in_kind = INPUT_MMAP;
+	in->in_stats.ins_kind = "mmap";
+	return (1);
+}
+
+int
+input_open(input_t **inp, const char *path)
+{
+	input_t *in;
+	ssize_t sz;
+
+	if ((in = calloc(1, sizeof (*in))) == NULL) {
+		return (-1);
+	}
+
+	if ((in->in_raw = malloc(INPUT_RAW_BUFSZ)) == NULL) {
+		free(in);
+		return (-1);
+	}
+
+	if (pthread_mutex_init(&in->in_stats_lock, NULL) != 0) {
+		errx(1, "could not initialise input lock");
+	}
+
+	if (strcmp(path, "-") == 0) {
+		in->in_file = stdin;
+	} else if ((in->in_file = fopen(path, "r")) == NULL) {
+		free(in->in_raw);
+		free(in);
+		return (-1);
+	}
+
+	if (input_try_map(in)) {
+		*inp = in;
+		return (0);
+	}
+
+	/*
+	 * Sniff the first bytes of the stream to determine whether this is
+	 * a gzip file.  The bytes remain in the raw buffer, to be consumed
+	 * by either inflate or the plain reader.
+	 */
+	if ((sz = input_fill_raw(in)) < 0) {
+		input_close(in);
+		return (-1);
+	}
+
+	if (sz >= 2 && in->in_raw[0] == 0x1f && in->in_raw[1] == 0x8b) {
+		in->in_kind = INPUT_GZIP;
+		in->in_stats.ins_kind = "inflate";
+
+		/*
+		 * Add 16 to the window bits so that zlib expects, and
+		 * checks, a gzip header and trailer.
+		 */
+		if (inflateInit2(&in->in_zs, 15 + 16) != Z_OK) {
+			errx(1, "inflateInit2: %s", in->in_zs.msg != NULL ?
+			    in->in_zs.msg : "failure");
+		}
+		in->in_zs_init = 1;
+	} else {
+		in->in_kind = INPUT_PLAIN;
+		in->in_stats.ins_kind = "read";
+	}
+
+	*inp = in;
+	return (0);
+}
+
+void
+input_close(input_t *in)
+{
+	if (in->in_par_nthreads > 0) {
+		pthread_mutex_lock(&in->in_par_lock);
+		in->in_par_exit = 1;
+		pthread_cond_broadcast(&in->in_par_cv);
+		pthread_mutex_unlock(&in->in_par_lock);
+
+		for (unsigned i = 0; i < in->in_par_nthreads; i++) {
+			if ((errno = pthread_join(in->in_par_threads[i],
+			    NULL)) != 0) {
+				err(1, "pthread_join");
+			}
+		}
+		for (unsigned i = 0; i < in->in_par_nslots; i++) {
+			free(in->in_par_slots[i].isl_buf);
+		}
+		free(in->in_par_slots);
+		free(in->in_par_threads);
+		(void) pthread_cond_destroy(&in->in_par_cv);
+		(void) pthread_mutex_destroy(&in->in_par_lock);
+	}
+	if (in->in_zs_init) {
+		(void) inflateEnd(&in->in_zs);
+	}
+	free(in->in_window);
+	free(in->in_window_tmp);
+	if (in->in_map != NULL) {
+		(void) munmap(in->in_map, in->in_map_len);
+	}
+	if (in->in_file != stdin) {
+		(void) fclose(in->in_file);
+	}
+	(void) pthread_mutex_destroy(&in->in_stats_lock);
+	free(in->in_raw);
+	free(in);
+}
+
+static ssize_t
+input_read_plain(input_t *in, char *buf, size_t len)
+{
+	ssize_t avail;
+	size_t sz;
+
+	if ((avail = input_fill_raw(in)) <= 0) {
+		return (avail);
+	}
+
+	/*
+	 * Serve whatever is left in the raw buffer first.  After that the
+	 * raw buffer stays empty, and we read directly into the caller's
+	 * buffer.
+	 */
+	sz = (size_t)avail < len ? (size_t)avail : len;
+	bcopy(in->in_raw + in->in_raw_pos, buf, sz);
+	in->in_raw_pos += sz;
+
+	if (sz < len && !in->in_eof) {
+		size_t more = fread(buf + sz, 1, len - sz, in->in_file);
+
+		if (more < len - sz) {
+			if (ferror(in->in_file)) {
+				return (-1);
+			}
+			in->in_eof = 1;
+		}
+		pthread_mutex_lock(&in->in_stats_lock);
+		in->in_stats.ins_raw_offset += more;
+		pthread_mutex_unlock(&in->in_stats_lock);
+		sz += more;
+	}
+
+	return (sz);
+}
+
+/*
+ * Return the window of output before the "len" bytes just inflated into
+ * "buf", for a restart point.  The window may include output from earlier
+ * reads.
+ */
+static const unsigned char *
+input_window(input_t *in, const unsigned char *buf, size_t len,
+    size_t *wlenp)
+{
+	size_t keep;
+
+	if (len >= INDEX_WINDOW) {
+		*wlenp = INDEX_WINDOW;
+		return (buf + len - INDEX_WINDOW);
+	}
+
+	keep = INDEX_WINDOW - len;
+	if (keep > in->in_window_len) {
+		keep = in->in_window_len;
+	}
+	bcopy(in->in_window + in->in_window_len - keep, in->in_window_tmp,
+	    keep);
+	bcopy(buf, in->in_window_tmp + keep, len);
+
+	*wlenp = keep + len;
+	return (in->in_window_tmp);
+}
+
+/*
+ * Inflate has stopped at a block boundary, having written "len" bytes to
+ * "buf" in this read.  Add a restart point here if it is far enough from the
+ * last one.  The boundary after the last block of a member is not a point,
+ * as inflate cannot restart there without the next gzip header.
+ */
+static void
+input_index_point(input_t *in, const unsigned char *buf, size_t len)
+{
+	z_stream *zs = &in->in_zs;
+	uint64_t out = in->in_pos + len;
+	const unsigned char *w;
+	size_t wlen;
+
+	if (!(zs->data_type & 128) || (zs->data_type & 64) ||
+	    out - in->in_index_last < INPUT_INDEX_SPAN) {
+		return;
+	}
+
+	w = input_window(in, buf, len, &wlen);
+	index_add_point(in->in_index, out, in->in_stats.ins_raw_offset -
+	    (in->in_raw_len - in->in_raw_pos), zs->data_type & 7, w, wlen);
+	in->in_index_last = out;
+}
+
+/*
+ * Keep the last window of output, after a read of "len" bytes into "buf".
+ */
+static void
+input_window_update(input_t *in, const unsigned char *buf, size_t len)
+{
+	const unsigned char *w;
+	unsigned char *t;
+	size_t wlen;
+
+	w = input_window(in, buf, len, &wlen);
+	if (w != in->in_window_tmp) {
+		bcopy(w, in->in_window_tmp, wlen);
+	}
+
+	/*
+	 * The scratch buffer becomes the window, and the old window the
+	 * scratch buffer.
+	 */
+	t = in->in_window;
+	in->in_window = in->in_window_tmp;
+	in->in_window_tmp = t;
+	in->in_window_len = wlen;
+}
+
+static ssize_t
+input_read_gzip(input_t *in, char *buf, size_t len)
+{
+	z_stream *zs = &in->in_zs;
+	int flush = in->in_index != NULL ? Z_BLOCK : Z_NO_FLUSH;
+
+	zs->next_out = (unsigned char *)buf;
+	zs->avail_out = len;
+
+	while (zs->avail_out > 0) {
+		ssize_t avail;
+		int r;
+
+		if ((avail = input_fill_raw(in)) < 0) {
+			return (-1);
+		}
+
+		if (avail == 0) {
+			if (zs->total_in != 0 || in->in_skip != 0) {
+				errx(1, "unexpected end of compressed input "
+				    "at offset %llu", (unsigned long long)
+				    in->in_stats.ins_raw_offset);
+			}
+
+			/*
+			 * The previous gzip member ended cleanly at the
+			 * end of the file.
+			 */
+			in->in_done = 1;
+			break;
+		}
+
+		if (in->in_skip > 0) {
+			/*
+			 * Skip the trailer of a member that was inflated from
+			 * a restart point, and expect a gzip header again.
+			 */
+			size_t n = (size_t)avail < in->in_skip ?
+			    (size_t)avail : in->in_skip;
+
+			in->in_raw_pos += n;
+			if ((in->in_skip -= n) == 0 &&
+			    inflateReset2(zs, 15 + 16) != Z_OK) {
+				errx(1, "inflateReset2 failure");
+			}
+			continue;
+		}
+
+		zs->next_in = in->in_raw + in->in_raw_pos;
+		zs->avail_in = avail;
+
+		r = inflate(zs, flush);
+
+		in->in_raw_pos += avail - zs->avail_in;
+
+		switch (r) {
+		case Z_OK:
+			if (in->in_index != NULL) {
+				input_index_point(in, (unsigned char *)buf,
+				    len - zs->avail_out);
+			}
+			break;
+
+		case Z_STREAM_END:
+			/*
+			 * A gzip file may consist of several concatenated
+			 * members.  Reset the stream and continue with the
+			 * next one, if there is one.  Without the header,
+			 * inflate does not know to expect the trailer.
+			 */
+			if (in->in_zs_raw) {
+				in->in_zs_raw = 0;
+				in->in_skip = INPUT_GZIP_TRAILER;
+			} else if (inflateReset(zs) != Z_OK) {
+				errx(1, "inflateReset failure");
+			}
+			break;
+
+		case Z_BUF_ERROR:
+			/*
+			 * No progress was possible; this can only happen
+			 * if the output buffer is already full.
+			 */
+			break;
+
+		default:
+			errx(1, "inflate: %s (compressed offset %llu)",
+			    zs->msg != NULL ? zs->msg : "error",
+			    (unsigned long long)(in->in_stats.ins_raw_offset -
+			    (in->in_raw_len - in->in_raw_pos)));
+		}
+	}
+
+	if (in->in_index != NULL) {
+		input_window_update(in, (unsigned char *)buf,
+		    len - zs->avail_out);
+	}
+
+	return (len - zs->avail_out);
+}
+
+/*
+ * Return the next (at most) "len" bytes of a mapped input in place.
+ */
+static size_t
+input_next_mapped(input_t *in, const char **bufp, size_t len)
+{
+	size_t sz = in->in_map_len - in->in_map_pos;
+
+	if (sz > len) {
+		sz = len;
+	}
+
+	*bufp = in->in_map + in->in_map_pos;
+	in->in_map_pos += sz;
+	pthread_mutex_lock(&in->in_stats_lock);
+	in->in_stats.ins_raw_offset += sz;
+	pthread_mutex_unlock(&in->in_stats_lock);
+
+	return (sz);
+}
+
+/*
+ * Read up to "len" bytes of SQL text into "buf", decompressing the input if
+ * required.  Returns the number of bytes read, 0 at the end of the input, or
+ * -1 on error with errno set.
+ */
+ssize_t
+input_read(input_t *in, char *buf, size_t len)
+{
+	uint64_t start = gettime_ns();
+	ssize_t r;
+
+	if (in->in_done) {
+		return (0);
+	}
+
+	switch (in->in_kind) {
+	case INPUT_GZIP:
+		r = in->in_par_nthreads > 0 ?
+		    input_read_parallel(in, buf, len) :
+		    input_read_gzip(in, buf, len);
+		break;
+
+	case INPUT_MMAP: {
+		const char *src;
+
+		r = input_next_mapped(in, &src, len);
+		bcopy(src, buf, r);
+		break;
+	}
+
+	default:
+		r = input_read_plain(in, buf, len);
+		break;
+	}
+
+	if (r == 0) {
+		in->in_done = 1;
+	}
+
+	if (r > 0) {
+		in->in_pos += r;
+	}
+
+	pthread_mutex_lock(&in->in_stats_lock);
+	if (r > 0) {
+		in->in_stats.ins_offset += r;
+	}
+	in->in_stats.ins_ns += gettime_ns() - start;
+	pthread_mutex_unlock(&in->in_stats_lock);
+
+	return (r);
+}
+
+int
+input_is_mapped(input_t *in)
+{
+	return (in->in_kind == INPUT_MMAP);
+}
+
+/*
+ * For a mapped input, return a pointer to the next (at most) "len" bytes of
+ * the file without copying them.  The data remains valid until the input is
+ * closed.  Returns the number of bytes available, or 0 at the end of the
+ * input.
+ */
+size_t
+input_next(input_t *in, const char **bufp, size_t len)
+{
+	size_t r;
+
+	if (in->in_kind != INPUT_MMAP) {
+		errx(1, "input_next: input is not mapped");
+	}
+
+	/*
+	 * No time is accounted here: the pages are faulted in as the
+	 * tokenizer walks them.
+	 */
+	if ((r = input_next_mapped(in, bufp, len)) > 0) {
+		in->in_pos += r;
+		pthread_mutex_lock(&in->in_stats_lock);
+		in->in_stats.ins_offset += r;
+		pthread_mutex_unlock(&in->in_stats_lock);
+	} else {
+		in->in_done = 1;
+	}
+
+	return (r);
+}
+
+void
+input_stats(input_t *in, input_stats_t *ins)
+{
+	pthread_mutex_lock(&in->in_stats_lock);
+	*ins = in->in_stats;
+	pthread_mutex_unlock(&in->in_stats_lock);
+}
+
+/*
+ * The uncompressed offset of the next byte to be read.
+ */
+uint64_t
+input_tell(input_t *in)
+{
+	return (in->in_pos);
+}
+
+/*
+ * Build an index of the input as it is read: note the size of the file and,
+ * for a gzip input, add restart points as it is inflated.  This must be
+ * called before anything is read.
+ */
+void
+input_index(input_t *in, dump_index_t *ix)
+{
+	struct stat st;
+
+	in->in_index = ix;
+	ix->ix_gzip = in->in_kind == INPUT_GZIP;
+	ix->ix_size = fstat(fileno(in->in_file), &st) == 0 &&
+	    S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0;
+
+	if (in->in_kind == INPUT_GZIP &&
+	    ((in->in_window = malloc(INDEX_WINDOW)) == NULL ||
+	    (in->in_window_tmp = malloc(INDEX_WINDOW)) == NULL)) {
+		err(1, "malloc");
+	}
+}
+
+/*
+ * Move the file to "off" bytes from its start, and discard the raw buffer.
+ */
+static int
+input_seek_file(input_t *in, uint64_t off)
+{
+	if (fseeko(in->in_file, off, SEEK_SET) != 0) {
+		return (-1);
+	}
+
+	in->in_raw_pos = in->in_raw_len = 0;
+	in->in_eof = 0;
+	pthread_mutex_lock(&in->in_stats_lock);
+	in->in_stats.ins_raw_offset = off;
+	pthread_mutex_unlock(&in->in_stats_lock);
+	return (0);
+}
+
+/*
+ * Prepare "zs" to inflate raw deflate data from the restart point "ixp".  If
+ * the point falls part way through a byte, "c" is that byte, and the rest of
+ * it is fed to inflate first.
+ */
+static void
+input_point_restore(z_stream *zs, const index_point_t *ixp, int c)
+{
+	unsigned char window[INDEX_WINDOW];
+	ssize_t wlen;
+
+	if (inflateReset2(zs, -15) != Z_OK) {
+		errx(1, "inflateReset2 failure");
+	}
+
+	if (ixp->ixp_bits != 0 && inflatePrime(zs, ixp->ixp_bits,
+	    c >> (8 - ixp->ixp_bits)) != Z_OK) {
+		errx(1, "inflatePrime failure");
+	}
+
+	if ((wlen = index_point_window(ixp, window)) < 0) {
+		errx(1, "corrupt inflate window in index");
+	}
+	if (inflateSetDictionary(zs, window, wlen) != Z_OK) {
+		errx(1, "inflateSetDictionary failure");
+	}
+}
+
+/*
+ * Position a gzip input at the restart point "ixp", or at the start of the
+ * file if it is NULL.
+ */
+static int
+input_restart(input_t *in, const index_point_t *ixp)
+{
+	z_stream *zs = &in->in_zs;
+	int c = 0;
+
+	in->in_skip = 0;
+
+	if (ixp == NULL) {
+		if (input_seek_file(in, 0) != 0) {
+			return (-1);
+		}
+		if (inflateReset2(zs, 15 + 16) != Z_OK) {
+			errx(1, "inflateReset2 failure");
+		}
+		in->in_zs_raw = 0;
+		in->in_pos = 0;
+		return (0);
+	}
+
+	if (input_seek_file(in, ixp->ixp_in - (ixp->ixp_bits != 0)) != 0) {
+		return (-1);
+	}
+	if (ixp->ixp_bits != 0) {
+		if (input_fill_raw(in) <= 0) {
+			errno = EINVAL;
+			return (-1);
+		}
+		c = in->in_raw[in->in_raw_pos++];
+	}
+	input_point_restore(zs, ixp, c);
+	in->in_zs_raw = 1;
+
+	in->in_pos = ixp->ixp_out;
+	return (0);
+}
+
+/*
+ * Continue reading the input from uncompressed offset "off".  A plain input
+ * must be seekable.  A gzip input is inflated from the restart point in the
+ * index "ix" nearest before the offset (or from where it is, if that is
+ * nearer), and the output up to the offset is discarded.  Returns -1 with
+ * errno set on failure.
+ */
+int
+input_seek(input_t *in, uint64_t off, dump_index_t *ix)
+{
+	const index_point_t *ixp;
+	char *scratch;
+
+	in->in_done = 0;
+
+	switch (in->in_kind) {
+	case INPUT_MMAP:
+		if (off > in->in_map_len) {
+			errno = EINVAL;
+			return (-1);
+		}
+		in->in_map_pos = off;
+		in->in_pos = off;
+		pthread_mutex_lock(&in->in_stats_lock);
+		in->in_stats.ins_raw_offset = off;
+		pthread_mutex_unlock(&in->in_stats_lock);
+		return (0);
+
+	case INPUT_PLAIN:
+		if (input_seek_file(in, off) != 0) {
+			return (-1);
+		}
+		in->in_pos = off;
+		return (0);
+
+	default:
+		break;
+	}
+
+	if (in->in_par_nthreads > 0) {
+		input_par_seek(in, off);
+		return (0);
+	}
+
+	ixp = ix != NULL ? index_find_point(ix, off) : NULL;
+	if (off < in->in_pos ||
+	    (ixp != NULL && ixp->ixp_out > in->in_pos)) {
+		if (input_restart(in, ixp) != 0) {
+			return (-1);
+		}
+	}
+
+	if ((scratch = malloc(INPUT_RAW_BUFSZ)) == NULL) {
+		return (-1);
+	}
+	while (in->in_pos < off) {
+		size_t want = off - in->in_pos < INPUT_RAW_BUFSZ ?
+		    off - in->in_pos : INPUT_RAW_BUFSZ;
+		ssize_t n;
+
+		if ((n = input_read(in, scratch, want)) <= 0) {
+			free(scratch);
+			if (n == 0) {
+				errno = EINVAL;
+			}
+			return (-1);
+		}
+		in->in_done = 0;
+	}
+	free(scratch);
+
+	return (0);
+}
+
+static uint64_t
+input_par_start(input_t *in, unsigned seg)
+{
+	return (seg == 0 ? 0 : in->in_par_index->ix_points[seg - 1].ixp_out);
+}
+
+static uint64_t
+input_par_end(input_t *in, unsigned seg)
+{
+	dump_index_t *ix = in->in_par_index;
+
+	return (seg + 1 < in->in_par_nsegs ? ix->ix_points[seg].ixp_out :
+	    ix->ix_length);
+}
+
+/*
+ * Inflate segment "seg" of a parallel input into "out", which has room for
+ * exactly all of it, with the stream "zs" and the buffer "raw" for the
+ * compressed data.  The file is read with pread(), so that the threads do
+ * not share a file position.
+ */
+static void
+input_par_inflate(input_t *in, unsigned seg, unsigned char *out, size_t len,
+    z_stream *zs, unsigned char *raw)
+{
+	const index_point_t *ixp = seg == 0 ? NULL :
+	    &in->in_par_index->ix_points[seg - 1];
+	int fd = fileno(in->in_file);
+	size_t raw_pos = 0, raw_len = 0, skip = 0;
+	uint64_t off = 0;
+	int zraw = 0;
+
+	if (ixp == NULL) {
+		if (inflateReset2(zs, 15 + 16) != Z_OK) {
+			errx(1, "inflateReset2 failure");
+		}
+	} else {
+		unsigned char c = 0;
+
+		off = ixp->ixp_in - (ixp->ixp_bits != 0);
+		if (ixp->ixp_bits != 0) {
+			if (pread(fd, &c, 1, off) != 1) {
+				err(1, "pread");
+			}
+			off++;
+		}
+		input_point_restore(zs, ixp, c);
+		zraw = 1;
+	}
+
+	zs->next_out = out;
+	zs->avail_out = len;
+
+	while (zs->avail_out > 0) {
+		int r;
+
+		if (raw_pos == raw_len) {
+			ssize_t n = pread(fd, raw, INPUT_RAW_BUFSZ, off);
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0) {
+				err(1, "pread");
+			} else if (n == 0) {
+				errx(1, "unexpected end of compressed input "
+				    "at offset %llu", (unsigned long long)off);
+			}
+			off += n;
+			raw_pos = 0;
+			raw_len = n;
+		}
+
+		if (skip > 0) {
+			size_t n = raw_len - raw_pos < skip ?
+			    raw_len - raw_pos : skip;
+
+			raw_pos += n;
+			if ((skip -= n) == 0 &&
+			    inflateReset2(zs, 15 + 16) != Z_OK) {
+				errx(1, "inflateReset2 failure");
+			}
+			continue;
+		}
+
+		zs->next_in = raw + raw_pos;
+		zs->avail_in = raw_len - raw_pos;
+
+		r = inflate(zs, Z_NO_FLUSH);
+
+		raw_pos = raw_len - zs->avail_in;
+
+		switch (r) {
+		case Z_OK:
+			break;
+
+		case Z_STREAM_END:
+			if (zraw) {
+				zraw = 0;
+				skip = INPUT_GZIP_TRAILER;
+			} else if (inflateReset(zs) != Z_OK) {
+				errx(1, "inflateReset failure");
+			}
+			break;
+
+		default:
+			errx(1, "inflate: %s (compressed offset %llu)",
+			    zs->msg != NULL ? zs->msg : "error",
+			    (unsigned long long)(off - (raw_len - raw_pos)));
+		}
+	}
+}
+
+/*
+ * Each inflate thread takes the next segment, and the slot at the tail of the
+ * ring, whenever the slot is free.
+ */
+static void *
+input_par_worker(void *arg)
+{
+	input_t *in = arg;
+	unsigned char *raw;
+	z_stream zs;
+
+	bzero(&zs, sizeof (zs));
+	if ((raw = malloc(INPUT_RAW_BUFSZ)) == NULL) {
+		err(1, "malloc");
+	}
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+		errx(1, "inflateInit2 failure");
+	}
+
+	pthread_mutex_lock(&in->in_par_lock);
+	while (!in->in_par_exit) {
+		input_slot_t *isl = &in->in_par_slots[in->in_par_tail];
+		size_t len;
+
+		if (in->in_par_next >= in->in_par_nsegs ||
+		    isl->isl_state != INPUT_SLOT_FREE) {
+			pthread_cond_wait(&in->in_par_cv, &in->in_par_lock);
+			continue;
+		}
+
+		isl->isl_state = INPUT_SLOT_BUSY;
+		isl->isl_seg = in->in_par_next++;
+		in->in_par_tail = (in->in_par_tail + 1) % in->in_par_nslots;
+		pthread_mutex_unlock(&in->in_par_lock);
+
+		len = input_par_end(in, isl->isl_seg) -
+		    input_par_start(in, isl->isl_seg);
+		if (isl->isl_size < len) {
+			free(isl->isl_buf);
+			if ((isl->isl_buf = malloc(len)) == NULL) {
+				err(1, "malloc");
+			}
+			isl->isl_size = len;
+		}
+		input_par_inflate(in, isl->isl_seg, isl->isl_buf, len, &zs,
+		    raw);
+		isl->isl_len = len;
+		isl->isl_pos = 0;
+
+		pthread_mutex_lock(&in->in_par_lock);
+		isl->isl_state = INPUT_SLOT_READY;
+		pthread_cond_broadcast(&in->in_par_cv);
+	}
+	pthread_mutex_unlock(&in->in_par_lock);
+
+	(void) inflateEnd(&zs);
+	free(raw);
+	return (NULL);
+}
+
+/*
+ * Read from the segment at the head of the ring, waiting for it to be
+ * inflated, and free its slot once it has all been read.
+ */
+static ssize_t
+input_read_parallel(input_t *in, char *buf, size_t len)
+{
+	dump_index_t *ix = in->in_par_index;
+
+	for (;;) {
+		input_slot_t *isl;
+		uint64_t raw_offset;
+		size_t n;
+
+		pthread_mutex_lock(&in->in_par_lock);
+		for (;;) {
+			isl = &in->in_par_slots[in->in_par_head];
+			if (isl->isl_state == INPUT_SLOT_READY) {
+				break;
+			}
+			if (isl->isl_state == INPUT_SLOT_FREE &&
+			    in->in_par_next >= in->in_par_nsegs) {
+				pthread_mutex_unlock(&in->in_par_lock);
+				return (0);
+			}
+			pthread_cond_wait(&in->in_par_cv, &in->in_par_lock);
+		}
+		pthread_mutex_unlock(&in->in_par_lock);
+
+		if (in->in_par_skip != SIZE_MAX) {
+			isl->isl_pos = in->in_par_skip;
+			in->in_par_skip = SIZE_MAX;
+		}
+
+		n = isl->isl_len - isl->isl_pos < len ?
+		    isl->isl_len - isl->isl_pos : len;
+		bcopy(isl->isl_buf + isl->isl_pos, buf, n);
+		if ((isl->isl_pos += n) < isl->isl_len) {
+			return (n);
+		}
+
+		raw_offset = isl->isl_seg + 1 < in->in_par_nsegs ?
+		    ix->ix_points[isl->isl_seg].ixp_in : ix->ix_size;
+
+		pthread_mutex_lock(&in->in_par_lock);
+		isl->isl_state = INPUT_SLOT_FREE;
+		in->in_par_head = (in->in_par_head + 1) % in->in_par_nslots;
+		pthread_cond_broadcast(&in->in_par_cv);
+		pthread_mutex_unlock(&in->in_par_lock);
+
+		pthread_mutex_lock(&in->in_stats_lock);
+		in->in_stats.ins_raw_offset = raw_offset;
+		pthread_mutex_unlock(&in->in_stats_lock);
+
+		if (n > 0) {
+			return (n);
+		}
+	}
+}
+
+/*
+ * Continue a parallel input from "off".  If the segment holding it is
+ * already in the ring, the segments before it are discarded as they are
+ * inflated; otherwise the ring is emptied, once no segment is being inflated,
+ * and the threads begin again from that segment.
+ */
+static void
+input_par_seek(input_t *in, uint64_t off)
+{
+	dump_index_t *ix = in->in_par_index;
+	const index_point_t *ixp = index_find_point(ix, off);
+	unsigned seg = ixp == NULL ? 0 : (ixp - ix->ix_points) + 1;
+	input_slot_t *isl;
+	unsigned first;
+
+	if (off >= ix->ix_length) {
+		seg = in->in_par_nsegs;
+	}
+
+	pthread_mutex_lock(&in->in_par_lock);
+	isl = &in->in_par_slots[in->in_par_head];
+	first = isl->isl_state == INPUT_SLOT_FREE ? in->in_par_next :
+	    isl->isl_seg;
+
+	if (seg >= first && seg < in->in_par_next) {
+		for (;;) {
+			isl = &in->in_par_slots[in->in_par_head];
+			if (isl->isl_seg == seg) {
+				break;
+			}
+			if (isl->isl_state != INPUT_SLOT_READY) {
+				pthread_cond_wait(&in->in_par_cv,
+				    &in->in_par_lock);
+				continue;
+			}
+			isl->isl_state = INPUT_SLOT_FREE;
+			in->in_par_head = (in->in_par_head + 1) %
+			    in->in_par_nslots;
+			pthread_cond_broadcast(&in->in_par_cv);
+		}
+	} else {
+		/*
+		 * No more segments are started while the ring drains.
+		 */
+		in->in_par_next = in->in_par_nsegs;
+		for (unsigned i = 0; i < in->in_par_nslots; i++) {
+			while (in->in_par_slots[i].isl_state ==
+			    INPUT_SLOT_BUSY) {
+				pthread_cond_wait(&in->in_par_cv,
+				    &in->in_par_lock);
+			}
+			in->in_par_slots[i].isl_state = INPUT_SLOT_FREE;
+		}
+		in->in_par_head = in->in_par_tail = 0;
+		in->in_par_next = seg;
+		pthread_cond_broadcast(&in->in_par_cv);
+	}
+	pthread_mutex_unlock(&in->in_par_lock);
+
+	in->in_par_skip = seg < in->in_par_nsegs ?
+	    off - input_par_start(in, seg) : SIZE_MAX;
+	in->in_pos = off;
+}
+
+/*
+ * Inflate a gzip input on "nthreads" threads, from the restart points in the
+ * index "ix", which must be kept until the input is closed.  This must be
+ * called before anything is read.  Returns -1 if the input is not gzip.
+ */
+int
+input_parallel(input_t *in, dump_index_t *ix, unsigned nthreads)
+{
+	if (in->in_kind != INPUT_GZIP || !ix->ix_gzip) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (nthreads == 0) {
+		return (0);
+	}
+
+	if (pthread_mutex_init(&in->in_par_lock, NULL) != 0 ||
+	    pthread_cond_init(&in->in_par_cv, NULL) != 0) {
+		errx(1, "could not initialise parallel inflate lock");
+	}
+
+	in->in_stats.ins_kind = "parallel inflate";
+	in->in_par_index = ix;
+	in->in_par_nsegs = ix->ix_npoints + 1;
+	in->in_par_skip = SIZE_MAX;
+	in->in_par_nslots = nthreads * INPUT_PARALLEL_SLOTS;
+	if ((in->in_par_slots = calloc(in->in_par_nslots,
+	    sizeof (input_slot_t))) == NULL ||
+	    (in->in_par_threads = calloc(nthreads,
+	    sizeof (pthread_t))) == NULL) {
+		err(1, "calloc");
+	}
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&in->in_par_threads[i], NULL,
+		    input_par_worker, in)) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+	in->in_par_nthreads = nthreads;
+
+	return (0);
+}
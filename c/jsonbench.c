@@ -0,0 +1,173 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * jsonbench.c: microbenchmark for the jsonemitter output backends
+ *
+ *     jsonbench stdio|fd path rows valsize [runs]
+ *
+ * Writes "rows" objects shaped like a converted Moray row (eight string
+ * properties, with a "_value" of "valsize" bytes) to "path" through the
+ * chosen backend, and reports the time taken.  Run it against a file on
+ * tmpfs, or /dev/null, to measure the emitter rather than the disk.  The
+ * time to allocate pages for a large file on tmpfs varies a good deal from
+ * one run to the next, so the test is run "runs" times (default 5), and the
+ * best and worst times are reported.
+ *
+ * Only the two backends of the current emitter are compared: the emitter
+ * that wrote each character with fprintf() is no longer in the tree.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jsonemitter.h"
+
+#define	JSONBENCH_NCOLS	8
+
+static const char *jsonbench_cols[JSONBENCH_NCOLS] = {
+	"_id", "_key", "_value", "_etag", "_mtime", "_vnode", "owner", "count"
+};
+
+static double
+jsonbench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Write the objects once, to a freshly truncated file.  Returns the time
+ * taken in seconds.
+ */
+static double
+jsonbench_run(const char *mode, const char *path, long rows, const char *val,
+    size_t valsize, json_label_t **labels)
+{
+	json_emit_t *jse;
+	FILE *stream = NULL;
+	int fd = -1;
+	double start, secs;
+	char errbuf[128];
+
+	if (strcmp(mode, "fd") == 0) {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			err(1, "open %s", path);
+		}
+		if ((jse = json_create_fd(fd)) == NULL) {
+			err(1, "json_create_fd");
+		}
+	} else {
+		if ((stream = fopen(path, "w")) == NULL) {
+			err(1, "fopen %s", path);
+		}
+		if ((jse = json_create_stdio(stream)) == NULL) {
+			err(1, "json_create_stdio");
+		}
+	}
+
+	start = jsonbench_now();
+	for (long r = 0; r < rows; r++) {
+		json_object_begin(jse, NULL);
+		for (int c = 0; c < JSONBENCH_NCOLS; c++) {
+			if (c == 2) {
+				json_utf8string_bound(jse, labels[c], val,
+				    valsize);
+			} else {
+				json_utf8string_bound(jse, labels[c],
+				    "12345678", 8);
+			}
+		}
+		json_object_end(jse);
+		json_newline(jse);
+	}
+	json_flush(jse);
+	if (stream != NULL && fflush(stream) != 0) {
+		err(1, "fflush");
+	}
+	secs = jsonbench_now() - start;
+
+	if (json_get_error(jse, errbuf, sizeof (errbuf)) != JSE_NONE) {
+		errx(1, "%s", errbuf);
+	}
+	json_fini(jse);
+	if (stream != NULL) {
+		(void) fclose(stream);
+	}
+	if (fd != -1) {
+		(void) close(fd);
+	}
+
+	return (secs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	json_label_t *labels[JSONBENCH_NCOLS];
+	char *val;
+	size_t valsize;
+	long rows;
+	int runs = 5;
+	double best = 0, worst = 0, mib;
+
+	if ((argc != 5 && argc != 6) || (strcmp(argv[1], "stdio") != 0 &&
+	    strcmp(argv[1], "fd") != 0)) {
+		errx(2, "usage: jsonbench stdio|fd path rows valsize [runs]");
+	}
+	rows = atol(argv[3]);
+	valsize = strtoul(argv[4], NULL, 10);
+	if (argc == 6 && (runs = atoi(argv[5])) < 1) {
+		errx(2, "runs must be at least 1");
+	}
+
+	if ((val = malloc(valsize + 1)) == NULL) {
+		err(1, "malloc");
+	}
+	memset(val, 'x', valsize);
+	val[valsize] = '\0';
+
+	for (int c = 0; c < JSONBENCH_NCOLS; c++) {
+		if ((labels[c] = json_label_create(jsonbench_cols[c])) ==
+		    NULL) {
+			err(1, "json_label_create");
+		}
+	}
+
+	for (int i = 0; i < runs; i++) {
+		double secs = jsonbench_run(argv[1], argv[2], rows, val,
+		    valsize, labels);
+
+		if (i == 0 || secs < best) {
+			best = secs;
+		}
+		if (i == 0 || secs > worst) {
+			worst = secs;
+		}
+	}
+
+	for (int c = 0; c < JSONBENCH_NCOLS; c++) {
+		json_label_fini(labels[c]);
+	}
+	free(val);
+
+	/*
+	 * The rate counts only the property values, not the labels and
+	 * punctuation around them.
+	 */
+	mib = (double)rows * (valsize + 8 * (JSONBENCH_NCOLS - 1)) /
+	    (1024 * 1024);
+	printf("%s: %ld rows of %zu bytes: best %.3fs (%.1f MiB/s), "
+	    "worst %.3fs\n", argv[1], rows, valsize, best, mib / best, worst);
+	return (0);
+}
@@ -0,0 +1,1037 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <err.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+#include <jsonemitter.h>
+
+#include "common.h"
+
+/*
+ * A small JSON parser, producing a tree of values that may be edited and then
+ * written back out with jsonemitter.  The output is intended to match what
+ * JSON.stringify() would produce for the result of JSON.parse() on the same
+ * input, as that is what the Node extraction tools write.
+ *
+ * All values are allocated from an arena, which is reset between documents.
+ * Strings that contain no escape sequences are not copied: their value
+ * points into the input text, which must remain valid while the tree is in
+ * use.
+ */
+
+#define	JV_MAX_DEPTH		512
+#define	JV_ARENA_BLOCKSZ	(64 * 1024)
+
+typedef struct jv_block {
+	struct jv_block *jvb_next;
+	size_t jvb_size;
+	size_t jvb_used;
+	char jvb_data[];
+} jv_block_t;
+
+struct jv_arena {
+	jv_block_t *jva_first;
+	jv_block_t *jva_cur;
+};
+
+typedef struct jv_parse {
+	jv_arena_t *jvp_arena;
+	const char *jvp_buf;
+	const char *jvp_pos;
+	const char *jvp_end;
+	const char *jvp_error;
+} jv_parse_t;
+
+int
+jv_arena_alloc(jv_arena_t **jvap)
+{
+	jv_arena_t *jva;
+
+	if ((jva = calloc(1, sizeof (*jva))) == NULL) {
+		return (-1);
+	}
+
+	*jvap = jva;
+	return (0);
+}
+
+void
+jv_arena_free(jv_arena_t *jva)
+{
+	jv_block_t *jvb, *next;
+
+	if (jva == NULL) {
+		return;
+	}
+
+	for (jvb = jva->jva_first; jvb != NULL; jvb = next) {
+		next = jvb->jvb_next;
+		free(jvb);
+	}
+	free(jva);
+}
+
+/*
+ * Release everything allocated from the arena.  The memory is kept for reuse
+ * by the next document.
+ */
+void
+jv_arena_reset(jv_arena_t *jva)
+{
+	for (jv_block_t *jvb = jva->jva_first; jvb != NULL;
+	    jvb = jvb->jvb_next) {
+		jvb->jvb_used = 0;
+	}
+	jva->jva_cur = jva->jva_first;
+}
+
+void *
+jv_arena_zalloc(jv_arena_t *jva, size_t len)
+{
+	jv_block_t *jvb = jva->jva_cur;
+	void *p;
+
+	len = (len + 7) & ~(size_t)7;
+
+	/*
+	 * Move on to the next block with enough room, allocating a new one at
+	 * the end of the list if need be.
+	 */
+	while (jvb == NULL || jvb->jvb_size - jvb->jvb_used < len) {
+		if (jvb != NULL && jvb->jvb_next != NULL) {
+			jvb = jvb->jvb_next;
+			continue;
+		}
+
+		size_t sz = len > JV_ARENA_BLOCKSZ ? len : JV_ARENA_BLOCKSZ;
+		jv_block_t *n;
+
+		if ((n = malloc(sizeof (*n) + sz)) == NULL) {
+			err(1, "malloc");
+		}
+		n->jvb_next = NULL;
+		n->jvb_size = sz;
+		n->jvb_used = 0;
+
+		if (jvb == NULL) {
+			n->jvb_next = jva->jva_first;
+			jva->jva_first = n;
+		} else {
+			jvb->jvb_next = n;
+		}
+		jvb = n;
+	}
+
+	jva->jva_cur = jvb;
+	p = jvb->jvb_data + jvb->jvb_used;
+	jvb->jvb_used += len;
+	bzero(p, len);
+	return (p);
+}
+
+jv_t *
+jv_alloc(jv_arena_t *jva, jv_type_t type)
+{
+	jv_t *jv = jv_arena_zalloc(jva, sizeof (*jv));
+
+	jv->jv_type = type;
+	return (jv);
+}
+
+/*
+ * Parsing.
+ */
+
+static int jv_parse_value(jv_parse_t *, jv_t **, unsigned);
+
+static int
+jv_fail(jv_parse_t *jvp, const char *msg)
+{
+	if (jvp->jvp_error == NULL) {
+		jvp->jvp_error = msg;
+	}
+	return (-1);
+}
+
+static void
+jv_skip_ws(jv_parse_t *jvp)
+{
+	while (jvp->jvp_pos < jvp->jvp_end) {
+		switch (*jvp->jvp_pos) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			jvp->jvp_pos++;
+			continue;
+		}
+		break;
+	}
+}
+
+static int
+jv_hex4(const char *p, unsigned *out)
+{
+	unsigned v = 0;
+
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+
+		v <<= 4;
+		if (c >= '0' && c <= '9') {
+			v |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			v |= c - 'A' + 10;
+		} else {
+			return (-1);
+		}
+	}
+
+	*out = v;
+	return (0);
+}
+
+static size_t
+jv_put_utf8(char *dst, unsigned cp)
+{
+	if (cp < 0x80) {
+		dst[0] = cp;
+		return (1);
+	} else if (cp < 0x800) {
+		dst[0] = 0xC0 | (cp >> 6);
+		dst[1] = 0x80 | (cp & 0x3F);
+		return (2);
+	} else if (cp < 0x10000) {
+		dst[0] = 0xE0 | (cp >> 12);
+		dst[1] = 0x80 | ((cp >> 6) & 0x3F);
+		dst[2] = 0x80 | (cp & 0x3F);
+		return (3);
+	}
+
+	dst[0] = 0xF0 | (cp >> 18);
+	dst[1] = 0x80 | ((cp >> 12) & 0x3F);
+	dst[2] = 0x80 | ((cp >> 6) & 0x3F);
+	dst[3] = 0x80 | (cp & 0x3F);
+	return (4);
+}
+
+/*
+ * Parse a string, starting at the opening quotation mark.  If "nul" is set,
+ * the decoded string is always copied and NUL-terminated, for use as an
+ * object member name.
+ */
+static int
+jv_parse_string(jv_parse_t *jvp, const char **strp, size_t *lenp, int nul)
+{
+	const char *start = ++jvp->jvp_pos;
+	const char *p = start;
+	const char *end = jvp->jvp_end;
+	int escaped = 0;
+
+	/*
+	 * Find the closing quotation mark first, so that the string can be
+	 * passed through without a copy if there are no escapes.
+	 */
+	for (;;) {
+		const char *q;
+
+		if ((q = memchr(p, '"', end - p)) == NULL) {
+			return (jv_fail(jvp, "unterminated string"));
+		}
+
+		/*
+		 * The quotation mark is escaped if it follows an odd number
+		 * of backslashes.
+		 */
+		size_t nbs = 0;
+		while (q - nbs > start && q[-1 - (ssize_t)nbs] == '\\') {
+			nbs++;
+		}
+		if (nbs % 2 == 0) {
+			p = q;
+			break;
+		}
+		p = q + 1;
+	}
+
+	for (const char *c = start; c < p; c++) {
+		if ((unsigned char)*c < 0x20) {
+			return (jv_fail(jvp, "control character in string"));
+		}
+		if (*c == '\\') {
+			escaped = 1;
+		}
+	}
+
+	jvp->jvp_pos = p + 1;
+
+	if (!escaped) {
+		if (nul) {
+			char *s = jv_arena_zalloc(jvp->jvp_arena,
+			    p - start + 1);
+
+			bcopy(start, s, p - start);
+			*strp = s;
+		} else {
+			*strp = start;
+		}
+		*lenp = p - start;
+		return (0);
+	}
+
+	/*
+	 * The decoded string is never longer than the escaped text.
+	 */
+	char *out = jv_arena_zalloc(jvp->jvp_arena, p - start + 1);
+	size_t o = 0;
+
+	for (const char *c = start; c < p; c++) {
+		unsigned cp, lo;
+
+		if (*c != '\\') {
+			out[o++] = *c;
+			continue;
+		}
+
+		switch (*++c) {
+		case '"':
+		case '\\':
+		case '/':
+			out[o++] = *c;
+			break;
+		case 'b':
+			out[o++] = '\b';
+			break;
+		case 'f':
+			out[o++] = '\f';
+			break;
+		case 'n':
+			out[o++] = '\n';
+			break;
+		case 'r':
+			out[o++] = '\r';
+			break;
+		case 't':
+			out[o++] = '\t';
+			break;
+		case 'u':
+			if (p - c < 5 || jv_hex4(c + 1, &cp) != 0) {
+				return (jv_fail(jvp, "invalid \\u escape"));
+			}
+			c += 4;
+
+			if (cp >= 0xD800 && cp <= 0xDBFF && p - c >= 7 &&
+			    c[1] == '\\' && c[2] == 'u' &&
+			    jv_hex4(c + 3, &lo) == 0 &&
+			    lo >= 0xDC00 && lo <= 0xDFFF) {
+				cp = 0x10000 + ((cp - 0xD800) << 10) +
+				    (lo - 0xDC00);
+				c += 6;
+			}
+			/*
+			 * A lone surrogate has no UTF-8 encoding, but is
+			 * encoded as if it did; jsonemitter writes it back out
+			 * as an escape sequence, as JSON.stringify() does.
+			 */
+			o += jv_put_utf8(out + o, cp);
+			break;
+		default:
+			return (jv_fail(jvp, "invalid escape sequence"));
+		}
+	}
+
+	out[o] = '\0';
+	*strp = out;
+	*lenp = o;
+	return (0);
+}
+
+static int
+jv_parse_number(jv_parse_t *jvp, jv_t *jv)
+{
+	const char *p = jvp->jvp_pos;
+	const char *end = jvp->jvp_end;
+
+#define	JV_DIGIT(p)	((p) < end && *(p) >= '0' && *(p) <= '9')
+
+	jv->jv_str = p;
+	if (p < end && *p == '-') {
+		p++;
+	}
+	if (!JV_DIGIT(p)) {
+		return (jv_fail(jvp, "invalid number"));
+	}
+	if (*p == '0') {
+		p++;
+	} else {
+		while (JV_DIGIT(p)) {
+			p++;
+		}
+	}
+	if (p < end && *p == '.') {
+		p++;
+		if (!JV_DIGIT(p)) {
+			return (jv_fail(jvp, "invalid number"));
+		}
+		while (JV_DIGIT(p)) {
+			p++;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		if (!JV_DIGIT(p)) {
+			return (jv_fail(jvp, "invalid number"));
+		}
+		while (JV_DIGIT(p)) {
+			p++;
+		}
+	}
+
+#undef	JV_DIGIT
+
+	jv->jv_len = p - jv->jv_str;
+	jvp->jvp_pos = p;
+	return (0);
+}
+
+static int
+jv_parse_literal(jv_parse_t *jvp, const char *lit, size_t len)
+{
+	if ((size_t)(jvp->jvp_end - jvp->jvp_pos) < len ||
+	    strncmp(jvp->jvp_pos, lit, len) != 0) {
+		return (jv_fail(jvp, "unexpected token"));
+	}
+
+	jvp->jvp_pos += len;
+	return (0);
+}
+
+static void
+jv_append(jv_t *parent, jv_t *child)
+{
+	if (parent->jv_last == NULL) {
+		parent->jv_first = child;
+	} else {
+		parent->jv_last->jv_next = child;
+	}
+	parent->jv_last = child;
+}
+
+static int
+jv_parse_object(jv_parse_t *jvp, jv_t *jv, unsigned depth)
+{
+	jvp->jvp_pos++;
+	jv_skip_ws(jvp);
+	if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == '}') {
+		jvp->jvp_pos++;
+		return (0);
+	}
+
+	for (;;) {
+		const char *name;
+		size_t namelen;
+		jv_t *member, *prev;
+
+		jv_skip_ws(jvp);
+		if (jvp->jvp_pos >= jvp->jvp_end || *jvp->jvp_pos != '"') {
+			return (jv_fail(jvp, "expected property name"));
+		}
+		if (jv_parse_string(jvp, &name, &namelen, 1) != 0) {
+			return (-1);
+		}
+
+		jv_skip_ws(jvp);
+		if (jvp->jvp_pos >= jvp->jvp_end || *jvp->jvp_pos != ':') {
+			return (jv_fail(jvp, "expected ':'"));
+		}
+		jvp->jvp_pos++;
+
+		if (jv_parse_value(jvp, &member, depth + 1) != 0) {
+			return (-1);
+		}
+		member->jv_name = name;
+		member->jv_namelen = namelen;
+
+		/*
+		 * As with JSON.parse(), a repeated name replaces the earlier
+		 * value, but keeps its original position.
+		 */
+		if ((prev = jv_member(jv, name)) != NULL) {
+			jv_replace(jv, prev, member);
+		} else {
+			jv_append(jv, member);
+		}
+
+		jv_skip_ws(jvp);
+		if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == ',') {
+			jvp->jvp_pos++;
+			continue;
+		}
+		if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == '}') {
+			jvp->jvp_pos++;
+			return (0);
+		}
+		return (jv_fail(jvp, "expected ',' or '}'"));
+	}
+}
+
+static int
+jv_parse_array(jv_parse_t *jvp, jv_t *jv, unsigned depth)
+{
+	jvp->jvp_pos++;
+	jv_skip_ws(jvp);
+	if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == ']') {
+		jvp->jvp_pos++;
+		return (0);
+	}
+
+	for (;;) {
+		jv_t *elem;
+
+		if (jv_parse_value(jvp, &elem, depth + 1) != 0) {
+			return (-1);
+		}
+		jv_append(jv, elem);
+
+		jv_skip_ws(jvp);
+		if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == ',') {
+			jvp->jvp_pos++;
+			continue;
+		}
+		if (jvp->jvp_pos < jvp->jvp_end && *jvp->jvp_pos == ']') {
+			jvp->jvp_pos++;
+			return (0);
+		}
+		return (jv_fail(jvp, "expected ',' or ']'"));
+	}
+}
+
+static int
+jv_parse_value(jv_parse_t *jvp, jv_t **jvout, unsigned depth)
+{
+	jv_arena_t *jva = jvp->jvp_arena;
+	jv_t *jv;
+
+	if (depth > JV_MAX_DEPTH) {
+		return (jv_fail(jvp, "nested too deeply"));
+	}
+
+	jv_skip_ws(jvp);
+	if (jvp->jvp_pos >= jvp->jvp_end) {
+		return (jv_fail(jvp, "unexpected end of input"));
+	}
+
+	switch (*jvp->jvp_pos) {
+	case '{':
+		jv = jv_alloc(jva, JV_OBJECT);
+		if (jv_parse_object(jvp, jv, depth) != 0) {
+			return (-1);
+		}
+		break;
+
+	case '[':
+		jv = jv_alloc(jva, JV_ARRAY);
+		if (jv_parse_array(jvp, jv, depth) != 0) {
+			return (-1);
+		}
+		break;
+
+	case '"':
+		jv = jv_alloc(jva, JV_STRING);
+		if (jv_parse_string(jvp, &jv->jv_str, &jv->jv_len, 0) != 0) {
+			return (-1);
+		}
+		break;
+
+	case 't':
+		jv = jv_alloc(jva, JV_TRUE);
+		if (jv_parse_literal(jvp, "true", 4) != 0) {
+			return (-1);
+		}
+		break;
+
+	case 'f':
+		jv = jv_alloc(jva, JV_FALSE);
+		if (jv_parse_literal(jvp, "false", 5) != 0) {
+			return (-1);
+		}
+		break;
+
+	case 'n':
+		jv = jv_alloc(jva, JV_NULL);
+		if (jv_parse_literal(jvp, "null", 4) != 0) {
+			return (-1);
+		}
+		break;
+
+	default:
+		jv = jv_alloc(jva, JV_NUMBER);
+		if (jv_parse_number(jvp, jv) != 0) {
+			return (-1);
+		}
+		break;
+	}
+
+	*jvout = jv;
+	return (0);
+}
+
+/*
+ * Parse the JSON document in "buf".  On failure, returns -1 and sets "errp"
+ * to a description of the problem.
+ */
+int
+jv_parse(jv_arena_t *jva, const char *buf, size_t len, jv_t **jvp,
+    const char **errp)
+{
+	jv_parse_t p;
+
+	bzero(&p, sizeof (p));
+	p.jvp_arena = jva;
+	p.jvp_buf = buf;
+	p.jvp_pos = buf;
+	p.jvp_end = buf + len;
+
+	if (jv_parse_value(&p, jvp, 0) != 0) {
+		*errp = p.jvp_error;
+		return (-1);
+	}
+
+	jv_skip_ws(&p);
+	if (p.jvp_pos != p.jvp_end) {
+		*errp = "unexpected data after JSON value";
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Editing.
+ */
+
+jv_t *
+jv_member(jv_t *obj, const char *name)
+{
+	for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+		if (strcmp(jv->jv_name, name) == 0) {
+			return (jv);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Replace the member "old" of an object with "new", in the same position.
+ */
+void
+jv_replace(jv_t *obj, jv_t *old, jv_t *new)
+{
+	jv_t **pp;
+
+	for (pp = &obj->jv_first; *pp != old; pp = &(*pp)->jv_next) {
+		if (*pp == NULL) {
+			errx(1, "jv_replace: member not found");
+		}
+	}
+
+	new->jv_name = old->jv_name;
+	new->jv_namelen = old->jv_namelen;
+	new->jv_next = old->jv_next;
+	*pp = new;
+	if (obj->jv_last == old) {
+		obj->jv_last = new;
+	}
+}
+
+/*
+ * Set the named member of an object, replacing any existing value in place
+ * or adding the member at the end.  The name must remain valid while the tree
+ * is in use.
+ */
+void
+jv_set_member(jv_t *obj, const char *name, jv_t *val)
+{
+	jv_t *old;
+
+	if ((old = jv_member(obj, name)) != NULL) {
+		jv_replace(obj, old, val);
+		return;
+	}
+
+	val->jv_name = name;
+	val->jv_namelen = strlen(name);
+	val->jv_next = NULL;
+	jv_append(obj, val);
+}
+
+void
+jv_delete_member(jv_t *obj, const char *name)
+{
+	jv_t *prev = NULL;
+
+	for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+		if (strcmp(jv->jv_name, name) != 0) {
+			prev = jv;
+			continue;
+		}
+
+		if (prev == NULL) {
+			obj->jv_first = jv->jv_next;
+		} else {
+			prev->jv_next = jv->jv_next;
+		}
+		if (obj->jv_last == jv) {
+			obj->jv_last = prev;
+		}
+		return;
+	}
+}
+
+/*
+ * Numbers.
+ */
+
+/*
+ * Format a number as JavaScript would convert it to a string: with the
+ * fewest significant digits that identify the value exactly, and with an
+ * exponent only for very large or very small values.  "buf" must be at least
+ * JV_NUMBUFSZ bytes.  Infinities and NaN are written as "null", as
+ * JSON.stringify() does.
+ */
+void
+jv_number_format(double d, char *buf)
+{
+	char tmp[40], digits[20];
+	int k = 0, n, e, p;
+	char *o = buf;
+
+	if (!isfinite(d)) {
+		(void) strcpy(buf, "null");
+		return;
+	}
+	if (d == 0) {
+		(void) strcpy(buf, "0");
+		return;
+	}
+
+	for (p = 1; p <= 17; p++) {
+		(void) snprintf(tmp, sizeof (tmp), "%.*e", p - 1, d);
+		if (strtod(tmp, NULL) == d) {
+			break;
+		}
+	}
+
+	const char *t = tmp;
+	if (*t == '-') {
+		*o++ = '-';
+		t++;
+	}
+	for (; *t != 'e'; t++) {
+		if (*t != '.') {
+			digits[k++] = *t;
+		}
+	}
+	e = atoi(t + 1);
+	while (k > 1 && digits[k - 1] == '0') {
+		k--;
+	}
+	n = e + 1;
+
+	if (k <= n && n <= 21) {
+		bcopy(digits, o, k);
+		o += k;
+		for (int i = k; i < n; i++) {
+			*o++ = '0';
+		}
+	} else if (0 < n && n <= 21) {
+		bcopy(digits, o, n);
+		o += n;
+		*o++ = '.';
+		bcopy(digits + n, o, k - n);
+		o += k - n;
+	} else if (-6 < n && n <= 0) {
+		*o++ = '0';
+		*o++ = '.';
+		for (int i = n; i < 0; i++) {
+			*o++ = '0';
+		}
+		bcopy(digits, o, k);
+		o += k;
+	} else {
+		*o++ = digits[0];
+		if (k > 1) {
+			*o++ = '.';
+			bcopy(digits + 1, o, k - 1);
+			o += k - 1;
+		}
+		o += sprintf(o, "e%c%d", n - 1 >= 0 ? '+' : '-',
+		    abs(n - 1));
+	}
+
+	*o = '\0';
+}
+
+/*
+ * Convert a JSON number to the text JSON.stringify() would use for it.
+ * Returns the text in "buf" (at least JV_NUMBUFSZ bytes), or a pointer to
+ * the original text if it is already in that form.
+ */
+const char *
+jv_number_text(const char *num, size_t len, char *buf, size_t *lenp)
+{
+	char tmp[512];
+	size_t i = 0;
+
+	/*
+	 * Integers of up to 15 digits are represented exactly, and are
+	 * written just as they appear in the input (with the exception of
+	 * negative zero).
+	 */
+	if (len > 0 && num[0] == '-') {
+		i++;
+	}
+	if (len - i >= 1 && len - i <= 15 && (num[i] != '0' || len - i == 1) &&
+	    !(i == 1 && num[i] == '0')) {
+		size_t j;
+
+		for (j = i; j < len; j++) {
+			if (num[j] < '0' || num[j] > '9') {
+				break;
+			}
+		}
+		if (j == len) {
+			*lenp = len;
+			return (num);
+		}
+	}
+
+	if (len >= sizeof (tmp)) {
+		len = sizeof (tmp) - 1;
+	}
+	bcopy(num, tmp, len);
+	tmp[len] = '\0';
+
+	jv_number_format(strtod(tmp, NULL), buf);
+	*lenp = strlen(buf);
+	return (buf);
+}
+
+/*
+ * Interpret a string as parseInt(str, 10) does in JavaScript.  Returns 0 if
+ * there is no number, as the result would be NaN.
+ */
+int
+jv_parseint(const char *s, size_t len, double *out)
+{
+	const char *end = s + len;
+	char tmp[512];
+	size_t n = 0;
+	int neg = 0;
+
+	while (s < end && (*s == ' ' || (*s >= '\t' && *s <= '\r'))) {
+		s++;
+	}
+	if (s < end && (*s == '-' || *s == '+')) {
+		neg = *s == '-';
+		s++;
+	}
+	while (s < end && *s >= '0' && *s <= '9' && n < sizeof (tmp) - 1) {
+		tmp[n++] = *s++;
+	}
+	if (n == 0) {
+		return (0);
+	}
+	tmp[n] = '\0';
+
+	*out = strtod(tmp, NULL);
+	if (neg) {
+		*out = -*out;
+	}
+	return (1);
+}
+
+/*
+ * Output.
+ */
+
+/*
+ * JavaScript objects list properties whose names are array indices (the
+ * canonical decimal form of an integer below 2^32 - 1) first, in ascending
+ * numeric order, followed by all other properties in the order they were
+ * created.
+ */
+int
+jv_array_index(const char *name, size_t len, uint32_t *idxp)
+{
+	uint64_t v = 0;
+
+	if (len == 0 || len > 10 || (name[0] == '0' && len > 1)) {
+		return (0);
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		if (name[i] < '0' || name[i] > '9') {
+			return (0);
+		}
+		v = v * 10 + (name[i] - '0');
+	}
+
+	if (v >= UINT32_MAX) {
+		return (0);
+	}
+
+	*idxp = v;
+	return (1);
+}
+
+static void jv_emit_one(json_emit_t *, const char *, const json_label_t *,
+    jv_t *);
+
+static void
+jv_emit_members(json_emit_t *jse, jv_t *obj)
+{
+	uint32_t idx, lastidx = 0;
+	int nindex = 0;
+
+	for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+		if (jv_array_index(jv->jv_name, jv->jv_namelen, &idx)) {
+			nindex++;
+		}
+	}
+
+	if (nindex == 0) {
+		for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+			jv_emit_one(jse, jv->jv_name, NULL, jv);
+		}
+		return;
+	}
+
+	/*
+	 * Emit the array index properties in order by repeated selection;
+	 * such objects are rare, and small.
+	 */
+	for (int i = 0; i < nindex; i++) {
+		jv_t *best = NULL;
+		uint32_t bestidx = 0;
+
+		for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+			if (jv_array_index(jv->jv_name, jv->jv_namelen,
+			    &idx) && (i == 0 || idx > lastidx) &&
+			    (best == NULL || idx < bestidx)) {
+				best = jv;
+				bestidx = idx;
+			}
+		}
+		jv_emit_one(jse, best->jv_name, NULL, best);
+		lastidx = bestidx;
+	}
+
+	for (jv_t *jv = obj->jv_first; jv != NULL; jv = jv->jv_next) {
+		if (!jv_array_index(jv->jv_name, jv->jv_namelen, &idx)) {
+			jv_emit_one(jse, jv->jv_name, NULL, jv);
+		}
+	}
+}
+
+/*
+ * Emit a value with either an ordinary label or a pre-bound one.
+ */
+static void
+jv_emit_one(json_emit_t *jse, const char *label, const json_label_t *jl,
+    jv_t *jv)
+{
+	char buf[JV_NUMBUFSZ];
+	const char *s;
+	size_t len;
+
+	switch (jv->jv_type) {
+	case JV_NULL:
+		if (jl != NULL) {
+			json_null_bound(jse, jl);
+		} else {
+			json_null(jse, label);
+		}
+		break;
+
+	case JV_TRUE:
+	case JV_FALSE:
+		if (jl != NULL) {
+			json_boolean_bound(jse, jl, jv->jv_type == JV_TRUE ?
+			    JSON_B_TRUE : JSON_B_FALSE);
+		} else {
+			json_boolean(jse, label, jv->jv_type == JV_TRUE ?
+			    JSON_B_TRUE : JSON_B_FALSE);
+		}
+		break;
+
+	case JV_NUMBER:
+		s = jv_number_text(jv->jv_str, jv->jv_len, buf, &len);
+		if (jl != NULL) {
+			json_rawvalue_bound(jse, jl, s, len);
+		} else {
+			json_rawvalue(jse, label, s, len);
+		}
+		break;
+
+	case JV_STRING:
+		if (jl != NULL) {
+			json_utf8string_bound(jse, jl, jv->jv_str, jv->jv_len);
+		} else {
+			json_utf8string_len(jse, label, jv->jv_str,
+			    jv->jv_len);
+		}
+		break;
+
+	case JV_ARRAY:
+		if (jl != NULL) {
+			json_array_begin_bound(jse, jl);
+		} else {
+			json_array_begin(jse, label);
+		}
+		for (jv_t *e = jv->jv_first; e != NULL; e = e->jv_next) {
+			jv_emit_one(jse, NULL, NULL, e);
+		}
+		json_array_end(jse);
+		break;
+
+	case JV_OBJECT:
+		if (jl != NULL) {
+			json_object_begin_bound(jse, jl);
+		} else {
+			json_object_begin(jse, label);
+		}
+		jv_emit_members(jse, jv);
+		json_object_end(jse);
+		break;
+	}
+}
+
+/*
+ * Emit a value, with the given label if it is inside an object.
+ */
+void
+jv_emit(json_emit_t *jse, const char *label, jv_t *jv)
+{
+	jv_emit_one(jse, label, NULL, jv);
+}
+
+/*
+ * As for jv_emit(), with a pre-bound label.
+ */
+void
+jv_emit_bound(json_emit_t *jse, const json_label_t *jl, jv_t *jv)
+{
+	jv_emit_one(jse, NULL, jl, jv);
+}
@@ -0,0 +1,1288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <err.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+#include <custr.h>
+#include <jsonemitter.h>
+
+#include "common.h"
+
+/*
+ * Reconstruction of Moray objects from the rows of bucket tables.
+ *
+ * The "buckets_config" table describes each bucket, including the set of
+ * properties of the stored objects that are indexed in separate columns.
+ * Each row of a bucket table is converted into the record that
+ * moray_row_to_object() in "lib/moray.js" produces, and written out as
+ * JSON.stringify() would:
+ *
+ *	{ "bucket", "key", "value", "_id", "_etag", "_mtime", "_txn_snap" }
+ *
+ * where "value" is the parsed "_value" column, updated from the index
+ * columns as the Moray server does in rowToObject().
+ */
+
+typedef enum moray_label {
+	ML_BUCKET = 0,
+	ML_KEY,
+	ML_VALUE,
+	ML_ID,
+	ML_ETAG,
+	ML_MTIME,
+	ML_TXN_SNAP,
+	ML_COUNT
+} moray_label_t;
+
+static const char *moray_label_names[ML_COUNT] = {
+	"bucket",
+	"key",
+	"value",
+	"_id",
+	"_etag",
+	"_mtime",
+	"_txn_snap",
+};
+
+/*
+ * The columns of a bucket table that hold the object itself, rather than the
+ * values of indexed properties.
+ */
+typedef enum moray_col {
+	MC_ID = 0,
+	MC_KEY,
+	MC_VALUE,
+	MC_ETAG,
+	MC_MTIME,
+	MC_TXN_SNAP,
+	MC_VNODE,
+	MC_COUNT
+} moray_col_t;
+
+static const char *moray_col_names[MC_COUNT] = {
+	"_id",
+	"_key",
+	"_value",
+	"_etag",
+	"_mtime",
+	"_txn_snap",
+	"_vnode",
+};
+
+/*
+ * The types of index that are written into the object as native JSON values,
+ * rather than as the string text of the column.
+ */
+typedef enum moray_type {
+	MORAY_T_STRING = 0,
+	MORAY_T_NUMBER,
+	MORAY_T_BOOLEAN,
+} moray_type_t;
+
+typedef struct moray_index {
+	char *mi_key;		/* property name */
+	size_t mi_keylen;
+	char *mi_lckey;		/* column name */
+	char *mi_label;		/* property name as JSON, with the colon */
+	size_t mi_labellen;
+	moray_type_t mi_type;
+} moray_index_t;
+
+struct moray_bucket {
+	moray_bucket_t *mb_next;	/* hash chain */
+	uint64_t mb_hash;
+	char *mb_name;
+	unsigned mb_nindex;
+	moray_index_t *mb_index;
+	int mb_splice;		/* index may be applied by moray_splice() */
+};
+
+/*
+ * A property at the top level of the "_value" object, as found by
+ * moray_splice().  The member text runs from the quotation mark that opens
+ * the name to the end of the value.
+ */
+typedef struct moray_member {
+	const char *mm_start;
+	const char *mm_end;
+	const char *mm_name;	/* name, without quotation marks */
+	size_t mm_namelen;
+	const char *mm_value;
+} moray_member_t;
+
+/*
+ * Buckets are kept in a hash table keyed by name, which is also the name of
+ * the bucket's table, as every COPY block in the dump must be looked up.
+ * The table size is a power of two, and doubles when the load factor
+ * reaches 3/4.
+ */
+#define	MORAY_HASH_INITSZ	64
+
+struct moray_buckets {
+	moray_bucket_t **mbs_hash;
+	unsigned mbs_hashsz;
+	unsigned mbs_count;
+	jv_arena_t *mbs_arena;
+	json_label_t *mbs_labels[ML_COUNT];
+};
+
+struct moray_table {
+	moray_buckets_t *mt_buckets;
+	moray_bucket_t *mt_bucket;
+	command_copy_t *mt_command;
+	unsigned mt_ncols;
+	int mt_cols[MC_COUNT];	/* column index, or -1 if absent */
+	int *mt_index_cols;	/* column for each index, or -1 */
+	jv_arena_t *mt_arena;
+	uint64_t mt_rows;
+	uint64_t mt_parsed;	/* rows not converted by moray_splice() */
+
+	/*
+	 * State for moray_splice().
+	 */
+	moray_member_t *mt_members;
+	unsigned mt_nmembers;
+	unsigned mt_maxmembers;
+	uint64_t *mt_keys;
+	unsigned mt_nkeys;
+	unsigned mt_maxkeys;
+	char *mt_seen;
+	custr_t *mt_value;
+	json_emit_t *mt_escape;
+};
+
+int
+moray_buckets_alloc(moray_buckets_t **mbsp)
+{
+	moray_buckets_t *mbs;
+
+	if ((mbs = calloc(1, sizeof (*mbs))) == NULL) {
+		return (-1);
+	}
+
+	mbs->mbs_hashsz = MORAY_HASH_INITSZ;
+	if ((mbs->mbs_hash = calloc(mbs->mbs_hashsz,
+	    sizeof (moray_bucket_t *))) == NULL) {
+		free(mbs);
+		return (-1);
+	}
+
+	if (jv_arena_alloc(&mbs->mbs_arena) != 0) {
+		free(mbs->mbs_hash);
+		free(mbs);
+		return (-1);
+	}
+
+	for (int i = 0; i < ML_COUNT; i++) {
+		if ((mbs->mbs_labels[i] = json_label_create(
+		    moray_label_names[i])) == NULL) {
+			moray_buckets_free(mbs);
+			return (-1);
+		}
+	}
+
+	*mbsp = mbs;
+	return (0);
+}
+
+void
+moray_buckets_free(moray_buckets_t *mbs)
+{
+	moray_bucket_t *mb;
+
+	if (mbs == NULL) {
+		return;
+	}
+
+	for (unsigned h = 0; h < mbs->mbs_hashsz; h++) {
+		while ((mb = mbs->mbs_hash[h]) != NULL) {
+			mbs->mbs_hash[h] = mb->mb_next;
+
+			for (unsigned i = 0; i < mb->mb_nindex; i++) {
+				free(mb->mb_index[i].mi_key);
+				free(mb->mb_index[i].mi_lckey);
+				free(mb->mb_index[i].mi_label);
+			}
+			free(mb->mb_index);
+			free(mb->mb_name);
+			free(mb);
+		}
+	}
+	free(mbs->mbs_hash);
+
+	for (int i = 0; i < ML_COUNT; i++) {
+		json_label_fini(mbs->mbs_labels[i]);
+	}
+	jv_arena_free(mbs->mbs_arena);
+	free(mbs);
+}
+
+static uint64_t
+moray_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+moray_bucket_t *
+moray_bucket_lookup(moray_buckets_t *mbs, const char *name)
+{
+	uint64_t h = moray_hash(name, strlen(name));
+
+	for (moray_bucket_t *mb = mbs->mbs_hash[h & (mbs->mbs_hashsz - 1)];
+	    mb != NULL; mb = mb->mb_next) {
+		if (mb->mb_hash == h && strcmp(mb->mb_name, name) == 0) {
+			return (mb);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+moray_bucket_insert(moray_buckets_t *mbs, moray_bucket_t *mb)
+{
+	moray_bucket_t **nh, **b;
+
+	if (mbs->mbs_count + 1 > mbs->mbs_hashsz / 4 * 3) {
+		unsigned nsz = mbs->mbs_hashsz * 2;
+
+		if ((nh = calloc(nsz, sizeof (moray_bucket_t *))) == NULL) {
+			err(1, "calloc");
+		}
+		for (unsigned h = 0; h < mbs->mbs_hashsz; h++) {
+			moray_bucket_t *o, *next;
+
+			for (o = mbs->mbs_hash[h]; o != NULL; o = next) {
+				next = o->mb_next;
+				b = &nh[o->mb_hash & (nsz - 1)];
+				o->mb_next = *b;
+				*b = o;
+			}
+		}
+		free(mbs->mbs_hash);
+		mbs->mbs_hash = nh;
+		mbs->mbs_hashsz = nsz;
+	}
+
+	b = &mbs->mbs_hash[mb->mb_hash & (mbs->mbs_hashsz - 1)];
+	mb->mb_next = *b;
+	*b = mb;
+	mbs->mbs_count++;
+}
+
+unsigned
+moray_buckets_count(moray_buckets_t *mbs)
+{
+	return (mbs->mbs_count);
+}
+
+static int
+moray_column(command_copy_t *cmdc, const char *name)
+{
+	unsigned ncols = strlist_contig_count(cmdc->cmdc_column_names);
+
+	for (unsigned i = 0; i < ncols; i++) {
+		if (strcmp(strlist_get(cmdc->cmdc_column_names, i),
+		    name) == 0) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+static char *
+moray_strndup(const char *s, size_t len)
+{
+	char *n;
+
+	if ((n = malloc(len + 1)) == NULL) {
+		err(1, "malloc");
+	}
+	bcopy(s, n, len);
+	n[len] = '\0';
+	return (n);
+}
+
+/*
+ * Format the name of an index property as the JSON text for the start of an
+ * object member, e.g., "name":
+ */
+static void
+moray_index_label(moray_index_t *mi)
+{
+	json_emit_t *jse;
+	char errbuf[128];
+
+	if ((jse = json_create_string()) == NULL) {
+		err(1, "json_create_string");
+	}
+
+	json_utf8string_len(jse, NULL, mi->mi_key, mi->mi_keylen);
+	if (json_get_error(jse, errbuf, sizeof (errbuf)) != JSE_NONE) {
+		errx(1, "index key \"%s\": %s", mi->mi_key, errbuf);
+	}
+
+	mi->mi_labellen = json_string_len(jse) + 1;
+	if ((mi->mi_label = malloc(mi->mi_labellen + 1)) == NULL) {
+		err(1, "malloc");
+	}
+	bcopy(json_string_cstr(jse), mi->mi_label, mi->mi_labellen - 1);
+	mi->mi_label[mi->mi_labellen - 1] = ':';
+	mi->mi_label[mi->mi_labellen] = '\0';
+
+	json_fini(jse);
+}
+
+/*
+ * Load the configuration of one bucket from a row of the "buckets_config"
+ * table, as moray_row_to_bucket_config() does.  Only the bucket name and the
+ * names of the indexed properties are needed here.
+ */
+void
+moray_bucket_config_row(moray_buckets_t *mbs, command_copy_t *cmdc,
+    const copy_col_t *cols, unsigned ncols)
+{
+	int namecol = moray_column(cmdc, "name");
+	int indexcol = moray_column(cmdc, "index");
+	moray_bucket_t *mb;
+	const char *errstr;
+	jv_t *index;
+
+	if (namecol < 0 || indexcol < 0 || (unsigned)namecol >= ncols ||
+	    (unsigned)indexcol >= ncols) {
+		errx(1, "buckets_config: missing \"name\" or \"index\" column");
+	}
+	if (cols[namecol].cc_ptr == NULL || cols[indexcol].cc_ptr == NULL) {
+		errx(1, "buckets_config: NULL \"name\" or \"index\"");
+	}
+
+	if ((mb = calloc(1, sizeof (*mb))) == NULL) {
+		err(1, "calloc");
+	}
+	mb->mb_name = moray_strndup(cols[namecol].cc_ptr, cols[namecol].cc_len);
+	mb->mb_hash = moray_hash(mb->mb_name, strlen(mb->mb_name));
+
+	if (moray_bucket_lookup(mbs, mb->mb_name) != NULL) {
+		errx(1, "duplicate bucket: %s", mb->mb_name);
+	}
+
+	jv_arena_reset(mbs->mbs_arena);
+	if (jv_parse(mbs->mbs_arena, cols[indexcol].cc_ptr,
+	    cols[indexcol].cc_len, &index, &errstr) != 0) {
+		errx(1, "bucket %s: invalid index: %s", mb->mb_name, errstr);
+	}
+	if (index->jv_type != JV_OBJECT) {
+		errx(1, "bucket %s: index is not an object", mb->mb_name);
+	}
+
+	for (jv_t *jv = index->jv_first; jv != NULL; jv = jv->jv_next) {
+		mb->mb_nindex++;
+	}
+	if ((mb->mb_index = calloc(mb->mb_nindex + 1,
+	    sizeof (moray_index_t))) == NULL) {
+		err(1, "calloc");
+	}
+
+	/*
+	 * moray_splice() finds index properties by comparing the text of each
+	 * name with the text of the index key, and appends missing properties
+	 * at the end of the object.  Neither works for a key that must be
+	 * escaped in JSON, or for an array index, which JavaScript would list
+	 * first.
+	 */
+	mb->mb_splice = 1;
+
+	unsigned i = 0;
+	for (jv_t *jv = index->jv_first; jv != NULL; jv = jv->jv_next, i++) {
+		moray_index_t *mi = &mb->mb_index[i];
+		uint32_t idx;
+		jv_t *type;
+
+		mi->mi_key = moray_strndup(jv->jv_name, jv->jv_namelen);
+		mi->mi_keylen = jv->jv_namelen;
+		mi->mi_lckey = moray_strndup(jv->jv_name, jv->jv_namelen);
+		for (char *c = mi->mi_lckey; *c != '\0'; c++) {
+			*c = tolower(*c);
+		}
+
+		if (jv->jv_type == JV_OBJECT &&
+		    (type = jv_member(jv, "type")) != NULL &&
+		    type->jv_type == JV_STRING) {
+			if (type->jv_len == 6 &&
+			    bcmp(type->jv_str, "number", 6) == 0) {
+				mi->mi_type = MORAY_T_NUMBER;
+			} else if (type->jv_len == 7 &&
+			    bcmp(type->jv_str, "boolean", 7) == 0) {
+				mi->mi_type = MORAY_T_BOOLEAN;
+			}
+		}
+
+		moray_index_label(mi);
+		if (mi->mi_labellen != mi->mi_keylen + 3 ||
+		    jv_array_index(mi->mi_key, mi->mi_keylen, &idx)) {
+			mb->mb_splice = 0;
+		}
+	}
+
+	moray_bucket_insert(mbs, mb);
+}
+
+/*
+ * Prepare to convert the rows of a COPY block for a bucket table.
+ */
+moray_table_t *
+moray_table_alloc(moray_buckets_t *mbs, moray_bucket_t *mb,
+    command_copy_t *cmdc)
+{
+	moray_table_t *mt;
+
+	if ((mt = calloc(1, sizeof (*mt))) == NULL) {
+		err(1, "calloc");
+	}
+	if (jv_arena_alloc(&mt->mt_arena) != 0) {
+		err(1, "jv_arena_alloc");
+	}
+
+	mt->mt_buckets = mbs;
+	mt->mt_bucket = mb;
+	mt->mt_command = cmdc;
+	mt->mt_ncols = strlist_contig_count(cmdc->cmdc_column_names);
+
+	for (int i = 0; i < MC_COUNT; i++) {
+		mt->mt_cols[i] = moray_column(cmdc, moray_col_names[i]);
+	}
+
+	if (mt->mt_cols[MC_VALUE] < 0) {
+		errx(1, "bucket table %s has no _value column",
+		    cmdc->cmdc_table_name);
+	}
+
+	if ((mt->mt_index_cols = calloc(mb->mb_nindex + 1,
+	    sizeof (int))) == NULL || (mt->mt_seen = calloc(mb->mb_nindex + 1,
+	    1)) == NULL) {
+		err(1, "calloc");
+	}
+	for (unsigned i = 0; i < mb->mb_nindex; i++) {
+		mt->mt_index_cols[i] = moray_column(cmdc,
+		    mb->mb_index[i].mi_lckey);
+	}
+
+	if (custr_alloc(&mt->mt_value) != 0) {
+		err(1, "custr_alloc");
+	}
+	if ((mt->mt_escape = json_create_string()) == NULL) {
+		err(1, "json_create_string");
+	}
+
+	return (mt);
+}
+
+void
+moray_table_free(moray_table_t *mt)
+{
+	if (mt == NULL) {
+		return;
+	}
+
+	json_fini(mt->mt_escape);
+	custr_free(mt->mt_value);
+	free(mt->mt_members);
+	free(mt->mt_keys);
+	free(mt->mt_seen);
+	free(mt->mt_index_cols);
+	jv_arena_free(mt->mt_arena);
+	free(mt);
+}
+
+/*
+ * Set the number of rows of the table that have been converted, for the row
+ * numbers in error messages, when rows are not all converted in order by the
+ * one moray_table_t.
+ */
+void
+moray_table_set_rows(moray_table_t *mt, uint64_t rows)
+{
+	mt->mt_rows = rows;
+}
+
+/*
+ * Return the number of rows for which "_value" was parsed in full, rather
+ * than converted by moray_splice().
+ */
+uint64_t
+moray_table_parsed(moray_table_t *mt)
+{
+	return (mt->mt_parsed);
+}
+
+static void
+moray_errx(moray_table_t *mt, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	(void) vsnprintf(buf, sizeof (buf), fmt, ap);
+	va_end(ap);
+
+	errx(1, "%s: row %llu: %s", mt->mt_command->cmdc_table_name,
+	    (unsigned long long)mt->mt_rows, buf);
+}
+
+static const copy_col_t *
+moray_col(moray_table_t *mt, const copy_col_t *cols, moray_col_t mc)
+{
+	int c = mt->mt_cols[mc];
+
+	return (c < 0 ? NULL : &cols[c]);
+}
+
+/*
+ * Interpret a property value of the object as parseInt() would, after
+ * conversion to a string.
+ */
+static int
+moray_value_parseint(jv_t *jv, double *out)
+{
+	char buf[JV_NUMBUFSZ];
+	const char *s;
+	size_t len;
+
+	switch (jv->jv_type) {
+	case JV_STRING:
+		return (jv_parseint(jv->jv_str, jv->jv_len, out));
+	case JV_NUMBER:
+		s = jv_number_text(jv->jv_str, jv->jv_len, buf, &len);
+		return (jv_parseint(s, len, out));
+	case JV_ARRAY:
+		/*
+		 * An array converts to its elements joined with commas, so
+		 * only the first element matters here.
+		 */
+		return (jv->jv_first != NULL &&
+		    moray_value_parseint(jv->jv_first, out));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Check that the "vnode" property of the object, converted with parseInt(),
+ * agrees with the "_vnode" column.  If the result of the conversion was NaN,
+ * "hasobj" is zero.
+ */
+static void
+moray_check_vnode(moray_table_t *mt, const copy_col_t *cols, int hasobj,
+    double objv)
+{
+	const copy_col_t *cc = moray_col(mt, cols, MC_VNODE);
+	double colv;
+	int hascol;
+
+	hascol = cc != NULL && cc->cc_ptr != NULL &&
+	    jv_parseint(cc->cc_ptr, cc->cc_len, &colv);
+
+	if (!hascol || !hasobj || colv != objv) {
+		char cbuf[JV_NUMBUFSZ], obuf[JV_NUMBUFSZ];
+
+		if (hascol) {
+			jv_number_format(colv, cbuf);
+		} else {
+			(void) strcpy(cbuf, "NaN");
+		}
+		if (hasobj) {
+			jv_number_format(objv, obuf);
+		} else {
+			(void) strcpy(obuf, "NaN");
+		}
+		moray_errx(mt, "_vnode value \"%s\" did not match value.vnode "
+		    "value \"%s\"", cbuf, obuf);
+	}
+}
+
+/*
+ * Return the length of the JSON number at the start of "p", or 0 if there is
+ * none.
+ */
+static size_t
+moray_number_len(const char *p, const char *end)
+{
+	const char *start = p;
+
+#define	MORAY_DIGIT(p)	((p) < end && *(p) >= '0' && *(p) <= '9')
+	if (p < end && *p == '-') {
+		p++;
+	}
+	if (!MORAY_DIGIT(p)) {
+		return (0);
+	}
+	if (*p == '0') {
+		p++;
+	} else {
+		while (MORAY_DIGIT(p)) {
+			p++;
+		}
+	}
+	if (p < end && *p == '.') {
+		p++;
+		if (!MORAY_DIGIT(p)) {
+			return (0);
+		}
+		while (MORAY_DIGIT(p)) {
+			p++;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		if (++p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		if (!MORAY_DIGIT(p)) {
+			return (0);
+		}
+		while (MORAY_DIGIT(p)) {
+			p++;
+		}
+	}
+#undef	MORAY_DIGIT
+
+	return (p - start);
+}
+
+/*
+ * Every column is text in the dump, but the Moray server reads index columns
+ * of type "number" and "boolean" back as native values.  Return the JSON
+ * text for the value of such a column, or NULL if it is to be written as a
+ * string: either because of the type of the index, or because the column
+ * does not hold a finite number or a PostgreSQL boolean.
+ */
+static const char *
+moray_index_value(const moray_index_t *mi, const copy_col_t *cc, char *buf,
+    size_t *lenp)
+{
+	const char *p = cc->cc_ptr;
+	size_t len = cc->cc_len;
+	const char *text;
+
+	switch (mi->mi_type) {
+	case MORAY_T_NUMBER:
+		if (len == 0 || moray_number_len(p, p + len) != len) {
+			return (NULL);
+		}
+		text = jv_number_text(p, len, buf, lenp);
+		if (*lenp == 4 && bcmp(text, "null", 4) == 0) {
+			return (NULL);
+		}
+		return (text);
+
+	case MORAY_T_BOOLEAN:
+		if ((len == 1 && *p == 't') ||
+		    (len == 4 && bcmp(p, "true", 4) == 0)) {
+			*lenp = 4;
+			return ("true");
+		}
+		if ((len == 1 && *p == 'f') ||
+		    (len == 5 && bcmp(p, "false", 5) == 0)) {
+			*lenp = 5;
+			return ("false");
+		}
+		return (NULL);
+
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Moray supports a bulk update operation which can change the value of an
+ * index column without updating the serialised JSON object in the "_value"
+ * column.  Mirror the logic in "rowToObject()" in the Moray server: a NULL
+ * (or missing) index column removes the property, and any other value
+ * replaces it, unless the property is an array.  Number and boolean values
+ * are given their native type.
+ */
+static void
+moray_overlay(moray_table_t *mt, const copy_col_t *cols, jv_t *value)
+{
+	moray_bucket_t *mb = mt->mt_bucket;
+
+	if (value->jv_type != JV_OBJECT) {
+		return;
+	}
+
+	for (unsigned i = 0; i < mb->mb_nindex; i++) {
+		moray_index_t *mi = &mb->mb_index[i];
+		int c = mt->mt_index_cols[i];
+		char buf[JV_NUMBUFSZ];
+		const char *text;
+		jv_t *old, *nv;
+		size_t len;
+
+		if (c < 0 || cols[c].cc_ptr == NULL) {
+			jv_delete_member(value, mi->mi_key);
+			continue;
+		}
+
+		if ((old = jv_member(value, mi->mi_key)) != NULL &&
+		    old->jv_type == JV_ARRAY) {
+			continue;
+		}
+
+		if ((text = moray_index_value(mi, &cols[c], buf,
+		    &len)) == NULL) {
+			nv = jv_alloc(mt->mt_arena, JV_STRING);
+		} else if (mi->mi_type == MORAY_T_NUMBER) {
+			nv = jv_alloc(mt->mt_arena, JV_NUMBER);
+		} else {
+			nv = jv_alloc(mt->mt_arena, *text == 't' ? JV_TRUE :
+			    JV_FALSE);
+		}
+		nv->jv_str = cols[c].cc_ptr;
+		nv->jv_len = cols[c].cc_len;
+		jv_set_member(value, mi->mi_key, nv);
+	}
+}
+
+/*
+ * The index overlay usually changes only a few properties at the top level of
+ * the object, so rather than parse the entire "_value" into a tree and write
+ * it all out again, moray_splice() scans the text and copies every member
+ * that is not indexed through unmodified.
+ *
+ * That is only correct if JSON.stringify() would write out the text of the
+ * object exactly as it appears in the column: without insignificant white
+ * space, with every number and string in its canonical form, and without
+ * duplicate or array index property names, which would change the order of
+ * the properties.  Values written by Moray are nearly always in that form.
+ * The scan checks that this holds, and returns -1 if it does not (or if the
+ * text is not valid JSON) so that the caller can fall back to the full parse.
+ */
+#define	MORAY_SCAN_MAX_DEPTH	512
+
+static int moray_scan_value(moray_table_t *, const char **, const char *,
+    unsigned);
+
+static int
+moray_scan_string(const char **pp, const char *end, int *escp)
+{
+	const char *p = *pp + 1;
+	unsigned cp;
+
+	*escp = 0;
+	for (;;) {
+		if (p >= end || (unsigned char)*p < 0x20) {
+			return (-1);
+		}
+		if (*p == '"') {
+			break;
+		}
+		if (*p != '\\') {
+			p++;
+			continue;
+		}
+
+		/*
+		 * JSON.stringify() uses the short escape sequences where they
+		 * exist, and four hex digit sequences only for other control
+		 * characters.
+		 */
+		*escp = 1;
+		if (end - p < 2) {
+			return (-1);
+		}
+		switch (p[1]) {
+		case '"':
+		case '\\':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			p += 2;
+			continue;
+		case 'u':
+			if (end - p < 6 || p[2] != '0' || p[3] != '0' ||
+			    (p[4] != '0' && p[4] != '1') ||
+			    !((p[5] >= '0' && p[5] <= '9') ||
+			    (p[5] >= 'a' && p[5] <= 'f'))) {
+				return (-1);
+			}
+			cp = (p[4] - '0') * 16 + (p[5] <= '9' ? p[5] - '0' :
+			    p[5] - 'a' + 10);
+			if (cp == '\b' || cp == '\f' || cp == '\n' ||
+			    cp == '\r' || cp == '\t') {
+				return (-1);
+			}
+			p += 6;
+			continue;
+		default:
+			return (-1);
+		}
+	}
+
+	*pp = p + 1;
+	return (0);
+}
+
+static int
+moray_scan_number(const char **pp, const char *end)
+{
+	const char *start = *pp;
+	size_t numlen = moray_number_len(start, end);
+	char buf[JV_NUMBUFSZ];
+	const char *text;
+	size_t len;
+
+	if (numlen == 0) {
+		return (-1);
+	}
+
+	text = jv_number_text(start, numlen, buf, &len);
+	if (len != numlen || (text != start && bcmp(text, start, len) != 0)) {
+		return (-1);
+	}
+
+	*pp = start + numlen;
+	return (0);
+}
+
+/*
+ * Scan an object.  If "top" is set, record each member in "mt_members".
+ * The hashes of the names in each enclosing object are kept on a stack in
+ * "mt_keys" to detect duplicates; a collision is treated as a duplicate.
+ */
+static int
+moray_scan_object(moray_table_t *mt, const char **pp, const char *end,
+    unsigned depth, int top)
+{
+	const char *p = *pp + 1;
+	unsigned base = mt->mt_nkeys;
+
+	if (p < end && *p == '}') {
+		*pp = p + 1;
+		return (0);
+	}
+
+	for (;;) {
+		const char *start = p, *name;
+		uint32_t idx;
+		uint64_t h;
+		int esc;
+
+		if (p >= end || *p != '"' ||
+		    moray_scan_string(&p, end, &esc) != 0) {
+			return (-1);
+		}
+		name = start + 1;
+		if (*name >= '0' && *name <= '9' &&
+		    jv_array_index(name, p - 1 - name, &idx)) {
+			return (-1);
+		}
+
+		h = moray_hash(name, p - 1 - name);
+		for (unsigned i = base; i < mt->mt_nkeys; i++) {
+			if (mt->mt_keys[i] == h) {
+				return (-1);
+			}
+		}
+		if (mt->mt_nkeys == mt->mt_maxkeys) {
+			mt->mt_maxkeys = mt->mt_maxkeys * 2 + 64;
+			if ((mt->mt_keys = realloc(mt->mt_keys,
+			    mt->mt_maxkeys * sizeof (uint64_t))) == NULL) {
+				err(1, "realloc");
+			}
+		}
+		mt->mt_keys[mt->mt_nkeys++] = h;
+
+		if (p >= end || *p++ != ':') {
+			return (-1);
+		}
+
+		const char *value = p;
+		if (moray_scan_value(mt, &p, end, depth + 1) != 0) {
+			return (-1);
+		}
+
+		if (top) {
+			moray_member_t *mm;
+
+			if (mt->mt_nmembers == mt->mt_maxmembers) {
+				mt->mt_maxmembers = mt->mt_maxmembers * 2 + 32;
+				if ((mt->mt_members = realloc(mt->mt_members,
+				    mt->mt_maxmembers *
+				    sizeof (moray_member_t))) == NULL) {
+					err(1, "realloc");
+				}
+			}
+			mm = &mt->mt_members[mt->mt_nmembers++];
+			mm->mm_start = start;
+			mm->mm_end = p;
+			mm->mm_name = esc ? NULL : name;
+			mm->mm_namelen = value - 2 - name;
+			mm->mm_value = value;
+		}
+
+		if (p >= end) {
+			return (-1);
+		}
+		if (*p == '}') {
+			break;
+		}
+		if (*p++ != ',') {
+			return (-1);
+		}
+	}
+
+	mt->mt_nkeys = base;
+	*pp = p + 1;
+	return (0);
+}
+
+static int
+moray_scan_array(moray_table_t *mt, const char **pp, const char *end,
+    unsigned depth)
+{
+	const char *p = *pp + 1;
+
+	if (p < end && *p == ']') {
+		*pp = p + 1;
+		return (0);
+	}
+
+	for (;;) {
+		if (moray_scan_value(mt, &p, end, depth + 1) != 0 ||
+		    p >= end) {
+			return (-1);
+		}
+		if (*p == ']') {
+			break;
+		}
+		if (*p++ != ',') {
+			return (-1);
+		}
+	}
+
+	*pp = p + 1;
+	return (0);
+}
+
+static int
+moray_scan_literal(const char **pp, const char *end, const char *lit,
+    size_t len)
+{
+	if ((size_t)(end - *pp) < len || bcmp(*pp, lit, len) != 0) {
+		return (-1);
+	}
+
+	*pp += len;
+	return (0);
+}
+
+static int
+moray_scan_value(moray_table_t *mt, const char **pp, const char *end,
+    unsigned depth)
+{
+	int esc;
+
+	if (*pp >= end || depth > MORAY_SCAN_MAX_DEPTH) {
+		return (-1);
+	}
+
+	switch (**pp) {
+	case '{':
+		return (moray_scan_object(mt, pp, end, depth, 0));
+	case '[':
+		return (moray_scan_array(mt, pp, end, depth));
+	case '"':
+		return (moray_scan_string(pp, end, &esc));
+	case 't':
+		return (moray_scan_literal(pp, end, "true", 4));
+	case 'f':
+		return (moray_scan_literal(pp, end, "false", 5));
+	case 'n':
+		return (moray_scan_literal(pp, end, "null", 4));
+	default:
+		return (moray_scan_number(pp, end));
+	}
+}
+
+/*
+ * Append the member for an index property, with the value of its column, to
+ * the spliced object.
+ */
+static int
+moray_splice_index(moray_table_t *mt, const moray_index_t *mi,
+    const copy_col_t *cc)
+{
+	json_emit_t *esc = mt->mt_escape;
+	char buf[JV_NUMBUFSZ];
+	const char *text;
+	size_t len;
+
+	if ((text = moray_index_value(mi, cc, buf, &len)) != NULL) {
+		if (custr_append_buf(mt->mt_value, mi->mi_label,
+		    mi->mi_labellen) != 0 ||
+		    custr_append_buf(mt->mt_value, text, len) != 0) {
+			err(1, "custr_append_buf");
+		}
+		return (0);
+	}
+
+	json_string_clear(esc);
+	json_utf8string_len(esc, NULL, cc->cc_ptr, cc->cc_len);
+	if (json_get_error(esc, NULL, 0) != JSE_NONE) {
+		/*
+		 * The full conversion will report the error.
+		 */
+		return (-1);
+	}
+
+	if (custr_append_buf(mt->mt_value, mi->mi_label,
+	    mi->mi_labellen) != 0 ||
+	    custr_append_buf(mt->mt_value, json_string_cstr(esc),
+	    json_string_len(esc)) != 0) {
+		err(1, "custr_append_buf");
+	}
+
+	return (0);
+}
+
+static void
+moray_splice_member(moray_table_t *mt, const moray_member_t *mm)
+{
+	if (custr_len(mt->mt_value) > 1 &&
+	    custr_appendc(mt->mt_value, ',') != 0) {
+		err(1, "custr_appendc");
+	}
+	if (custr_append_buf(mt->mt_value, mm->mm_start,
+	    mm->mm_end - mm->mm_start) != 0) {
+		err(1, "custr_append_buf");
+	}
+}
+
+/*
+ * Check the "vnode" property, and apply the index overlay to the text of the
+ * object in "_value", leaving the result in "mt_value".  Returns -1 if the
+ * object must instead be converted with the full parse.
+ */
+static int
+moray_splice(moray_table_t *mt, const copy_col_t *cols, const copy_col_t *vc)
+{
+	moray_bucket_t *mb = mt->mt_bucket;
+	const char *p = vc->cc_ptr;
+	const char *end = p + vc->cc_len;
+	custr_t *out = mt->mt_value;
+
+	if (!mb->mb_splice || p >= end || *p != '{') {
+		return (-1);
+	}
+
+	mt->mt_nmembers = 0;
+	mt->mt_nkeys = 0;
+	if (moray_scan_object(mt, &p, end, 0, 1) != 0 || p != end) {
+		return (-1);
+	}
+
+	for (unsigned m = 0; m < mt->mt_nmembers; m++) {
+		moray_member_t *mm = &mt->mt_members[m];
+		const char *v = mm->mm_value;
+		double objv;
+		int hasobj;
+
+		if (mm->mm_name == NULL || mm->mm_namelen != 5 ||
+		    bcmp(mm->mm_name, "vnode", 5) != 0) {
+			continue;
+		}
+
+		if (*v == '"') {
+			if (memchr(v, '\\', mm->mm_end - v) != NULL) {
+				return (-1);
+			}
+			hasobj = jv_parseint(v + 1, mm->mm_end - v - 2, &objv);
+		} else if (*v == '[') {
+			return (-1);
+		} else {
+			/*
+			 * The canonical text of a number is what String()
+			 * would produce, and the other values convert to NaN.
+			 */
+			hasobj = jv_parseint(v, mm->mm_end - v, &objv);
+		}
+		moray_check_vnode(mt, cols, hasobj, objv);
+		break;
+	}
+
+	custr_reset(out);
+	if (custr_appendc(out, '{') != 0) {
+		err(1, "custr_appendc");
+	}
+	bzero(mt->mt_seen, mb->mb_nindex);
+
+	for (unsigned m = 0; m < mt->mt_nmembers; m++) {
+		moray_member_t *mm = &mt->mt_members[m];
+		const moray_index_t *mi = NULL;
+		unsigned i;
+		int c;
+
+		for (i = 0; mm->mm_name != NULL && i < mb->mb_nindex; i++) {
+			if (mb->mb_index[i].mi_keylen == mm->mm_namelen &&
+			    bcmp(mb->mb_index[i].mi_key, mm->mm_name,
+			    mm->mm_namelen) == 0) {
+				mi = &mb->mb_index[i];
+				break;
+			}
+		}
+
+		if (mi == NULL) {
+			moray_splice_member(mt, mm);
+			continue;
+		}
+
+		mt->mt_seen[i] = 1;
+		if ((c = mt->mt_index_cols[i]) < 0 || cols[c].cc_ptr == NULL) {
+			continue;
+		}
+		if (*mm->mm_value == '[') {
+			moray_splice_member(mt, mm);
+			continue;
+		}
+
+		if (custr_len(out) > 1 && custr_appendc(out, ',') != 0) {
+			err(1, "custr_appendc");
+		}
+		if (moray_splice_index(mt, mi, &cols[c]) != 0) {
+			return (-1);
+		}
+	}
+
+	for (unsigned i = 0; i < mb->mb_nindex; i++) {
+		int c = mt->mt_index_cols[i];
+
+		if (mt->mt_seen[i] || c < 0 || cols[c].cc_ptr == NULL) {
+			continue;
+		}
+
+		if (custr_len(out) > 1 && custr_appendc(out, ',') != 0) {
+			err(1, "custr_appendc");
+		}
+		if (moray_splice_index(mt, &mb->mb_index[i], &cols[c]) != 0) {
+			return (-1);
+		}
+	}
+
+	if (custr_appendc(out, '}') != 0) {
+		err(1, "custr_appendc");
+	}
+
+	return (0);
+}
+
+static void
+moray_emit_string(moray_table_t *mt, json_emit_t *jse, moray_label_t ml,
+    const copy_col_t *cc)
+{
+	json_label_t *jl = mt->mt_buckets->mbs_labels[ml];
+
+	if (cc == NULL) {
+		/*
+		 * The property is undefined, and JSON.stringify() omits it.
+		 */
+		return;
+	}
+
+	if (cc->cc_ptr == NULL) {
+		json_null_bound(jse, jl);
+	} else {
+		json_utf8string_bound(jse, jl, cc->cc_ptr, cc->cc_len);
+	}
+}
+
+/*
+ * Convert one row of a bucket table to a Moray object, and emit it.
+ */
+void
+moray_table_row(moray_table_t *mt, json_emit_t *jse, const copy_col_t *cols,
+    unsigned ncols)
+{
+	json_label_t **labels = mt->mt_buckets->mbs_labels;
+	const copy_col_t *cc;
+	const char *errstr;
+	char buf[JV_NUMBUFSZ];
+	double mtime, objv;
+	jv_t *value = NULL, *vn;
+
+	mt->mt_rows++;
+	if (ncols != mt->mt_ncols) {
+		moray_errx(mt, "expected %u columns, got %u", mt->mt_ncols,
+		    ncols);
+	}
+
+	cc = moray_col(mt, cols, MC_VALUE);
+	if (cc->cc_ptr == NULL) {
+		moray_errx(mt, "_value is NULL");
+	}
+
+	if (moray_splice(mt, cols, cc) != 0) {
+		mt->mt_parsed++;
+		jv_arena_reset(mt->mt_arena);
+		if (jv_parse(mt->mt_arena, cc->cc_ptr, cc->cc_len, &value,
+		    &errstr) != 0) {
+			moray_errx(mt, "invalid _value: %s", errstr);
+		}
+		if (value->jv_type == JV_NULL) {
+			moray_errx(mt, "_value is null");
+		}
+
+		if (value->jv_type == JV_OBJECT &&
+		    (vn = jv_member(value, "vnode")) != NULL) {
+			int hasobj = moray_value_parseint(vn, &objv);
+
+			moray_check_vnode(mt, cols, hasobj, objv);
+		}
+		moray_overlay(mt, cols, value);
+	}
+
+	json_object_begin(jse, NULL);
+	json_utf8string_bound(jse, labels[ML_BUCKET], mt->mt_bucket->mb_name,
+	    strlen(mt->mt_bucket->mb_name));
+	moray_emit_string(mt, jse, ML_KEY, moray_col(mt, cols, MC_KEY));
+	if (value != NULL) {
+		jv_emit_bound(jse, labels[ML_VALUE], value);
+	} else {
+		json_rawvalue_bound(jse, labels[ML_VALUE],
+		    custr_cstr(mt->mt_value), custr_len(mt->mt_value));
+	}
+	moray_emit_string(mt, jse, ML_ID, moray_col(mt, cols, MC_ID));
+	moray_emit_string(mt, jse, ML_ETAG, moray_col(mt, cols, MC_ETAG));
+
+	/*
+	 * The modification time is converted with parseInt(), which gives NaN
+	 * (and thus null) if the column is NULL or missing.
+	 */
+	cc = moray_col(mt, cols, MC_MTIME);
+	if (cc != NULL && cc->cc_ptr != NULL &&
+	    jv_parseint(cc->cc_ptr, cc->cc_len, &mtime)) {
+		jv_number_format(mtime, buf);
+		json_rawvalue_bound(jse, labels[ML_MTIME], buf, strlen(buf));
+	} else {
+		json_null_bound(jse, labels[ML_MTIME]);
+	}
+
+	moray_emit_string(mt, jse, ML_TXN_SNAP,
+	    moray_col(mt, cols, MC_TXN_SNAP));
+	json_object_end(jse);
+	json_newline(jse);
+}
@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <err.h>
 
@@ -75,6 +76,289 @@ valid_initial_keyword(const char *nam)
 	return (0);
 }
 
+/*
+ * Check whether an event is a token of type "t" matching "v" (or any of the
+ * strings in "v"), ignoring case.
+ */
+static int
+event_is(event_t *evt, event_type_t t, const char *v)
+{
+	return (evt != NULL && evt->evt_t == t &&
+	    strcasecmp(evt->evt_v, v) == 0);
+}
+
+static int
+event_is_any(event_t *evt, event_type_t t, const char *const *v)
+{
+	for (unsigned i = 0; v[i] != NULL; i++) {
+		if (event_is(evt, t, v[i])) {
+			return (1);
+		}
+	}
+
+	return (0);
+}
+
+typedef struct copy_options {
+	const char *co_format;
+	const char *co_delimiter;
+	const char *co_null;
+	const char *co_quote;
+	const char *co_escape;
+	int co_header;
+} copy_options_t;
+
+static void
+copy_option_set(const char **optp, const char *name, const char *value)
+{
+	if (*optp != NULL) {
+		errx(1, "conflicting or redundant COPY option \"%s\"", name);
+	}
+	if (value == NULL) {
+		errx(1, "COPY option \"%s\" requires a value", name);
+	}
+	*optp = value;
+}
+
+/*
+ * Interpret a boolean option value, which may be omitted.
+ */
+static int
+copy_option_bool(const char *name, const char *value)
+{
+	static const char *const yes[] = { "true", "on", "1", NULL };
+	static const char *const no[] = { "false", "off", "0", NULL };
+
+	if (value == NULL) {
+		return (1);
+	}
+	for (unsigned i = 0; yes[i] != NULL; i++) {
+		if (strcasecmp(value, yes[i]) == 0) {
+			return (1);
+		}
+		if (strcasecmp(value, no[i]) == 0) {
+			return (0);
+		}
+	}
+
+	errx(1, "COPY option \"%s\" requires a Boolean value", name);
+	return (-1);
+}
+
+static void
+copy_option(copy_options_t *co, const char *name, const char *value)
+{
+	if (strcasecmp(name, "format") == 0) {
+		copy_option_set(&co->co_format, name, value);
+	} else if (strcasecmp(name, "delimiter") == 0) {
+		copy_option_set(&co->co_delimiter, name, value);
+	} else if (strcasecmp(name, "null") == 0) {
+		copy_option_set(&co->co_null, name, value);
+	} else if (strcasecmp(name, "quote") == 0) {
+		copy_option_set(&co->co_quote, name, value);
+	} else if (strcasecmp(name, "escape") == 0) {
+		copy_option_set(&co->co_escape, name, value);
+	} else if (strcasecmp(name, "header") == 0) {
+		/*
+		 * "HEADER MATCH" checks the header against the column list;
+		 * we just skip it.
+		 */
+		co->co_header = value != NULL &&
+		    strcasecmp(value, "match") == 0 ? 1 :
+		    copy_option_bool(name, value);
+	} else if (strcasecmp(name, "freeze") == 0) {
+		(void) copy_option_bool(name, value);
+	} else if (strcasecmp(name, "oids") == 0) {
+		if (copy_option_bool(name, value)) {
+			errx(1, "COPY with OIDS is not supported");
+		}
+	} else if (strcasecmp(name, "encoding") == 0) {
+		if (value == NULL || (strcasecmp(value, "utf8") != 0 &&
+		    strcasecmp(value, "utf-8") != 0 &&
+		    strcasecmp(value, "unicode") != 0)) {
+			errx(1, "COPY encoding \"%s\" is not supported",
+			    value != NULL ? value : "");
+		}
+	} else {
+		errx(1, "COPY option \"%s\" is not supported", name);
+	}
+}
+
+/*
+ * Return a single-byte option value as a character.
+ */
+static char
+copy_option_char(const char *name, const char *value)
+{
+	if (strlen(value) != 1) {
+		errx(1, "COPY %s must be a single one-byte character", name);
+	}
+
+	return (value[0]);
+}
+
+/*
+ * Parse the options that follow "FROM stdin" in a COPY command, in either
+ * the current syntax:
+ *
+ *	[ WITH ] ( option [ value ] [, ...] )
+ *
+ * or the syntax from before PostgreSQL 9.0, which is still accepted:
+ *
+ *	[ WITH ] [ BINARY ] [ DELIMITER [ AS ] 'c' ] [ NULL [ AS ] 'null' ]
+ *	    [ CSV [ HEADER ] [ QUOTE [ AS ] 'q' ] [ ESCAPE [ AS ] 'e' ] ]
+ *
+ * The options are checked as PostgreSQL checks them, and the defaults for
+ * the format are filled in.  FORCE_NOT_NULL and FORCE_NULL are not
+ * supported.
+ */
+static void
+parse_copy_options(list_t *cmd, event_t *evt, command_copy_t *cmdc)
+{
+	static const char *const value_opts[] = { "delimiter", "null",
+	    "quote", "escape", NULL };
+	copy_options_t co;
+
+	bzero(&co, sizeof (co));
+
+	if (event_is(evt, EVENT_NAME, "with")) {
+		evt = list_next(cmd, evt);
+	}
+
+	if (event_is(evt, EVENT_SPECIAL, "(")) {
+		for (;;) {
+			const char *name, *value = NULL;
+
+			evt = list_next(cmd, evt);
+			if (evt == NULL || evt->evt_t != EVENT_NAME) {
+				errx(1, "invalid COPY option list");
+			}
+			name = evt->evt_v;
+
+			evt = list_next(cmd, evt);
+			if (evt != NULL && evt->evt_t != EVENT_SPECIAL) {
+				value = evt->evt_v;
+				evt = list_next(cmd, evt);
+			}
+			copy_option(&co, name, value);
+
+			if (event_is(evt, EVENT_SPECIAL, ")")) {
+				evt = list_next(cmd, evt);
+				break;
+			}
+			if (!event_is(evt, EVENT_SPECIAL, ",")) {
+				errx(1, "invalid COPY option list");
+			}
+		}
+	} else {
+		while (evt != NULL) {
+			const char *name = evt->evt_v;
+
+			if (evt->evt_t != EVENT_NAME) {
+				break;
+			}
+
+			if (strcasecmp(name, "binary") == 0) {
+				copy_option(&co, "format", "binary");
+			} else if (strcasecmp(name, "csv") == 0) {
+				copy_option(&co, "format", "csv");
+			} else if (strcasecmp(name, "header") == 0) {
+				copy_option(&co, name, NULL);
+			} else if (strcasecmp(name, "oids") == 0) {
+				copy_option(&co, name, NULL);
+			} else if (event_is_any(evt, EVENT_NAME, value_opts)) {
+				evt = list_next(cmd, evt);
+				if (event_is(evt, EVENT_NAME, "as")) {
+					evt = list_next(cmd, evt);
+				}
+				if (evt == NULL || evt->evt_t != EVENT_STRING) {
+					errx(1, "COPY option \"%s\" requires "
+					    "a value", name);
+				}
+				copy_option(&co, name, evt->evt_v);
+			} else {
+				errx(1, "COPY option \"%s\" is not "
+				    "supported", name);
+			}
+			evt = list_next(cmd, evt);
+		}
+	}
+
+	if (evt != NULL) {
+		errx(1, "unexpected \"%s\" after COPY options", evt->evt_v);
+	}
+
+	/*
+	 * Check the options, and fill in the defaults for the format.
+	 */
+	if (co.co_format == NULL || strcasecmp(co.co_format, "text") == 0) {
+		cmdc->cmdc_format = COPY_FORMAT_TEXT;
+	} else if (strcasecmp(co.co_format, "csv") == 0) {
+		cmdc->cmdc_format = COPY_FORMAT_CSV;
+	} else if (strcasecmp(co.co_format, "binary") == 0) {
+		cmdc->cmdc_format = COPY_FORMAT_BINARY;
+	} else {
+		errx(1, "COPY format \"%s\" not recognized", co.co_format);
+	}
+
+	if (cmdc->cmdc_format == COPY_FORMAT_BINARY) {
+		if (co.co_delimiter != NULL || co.co_null != NULL ||
+		    co.co_header) {
+			errx(1, "cannot specify DELIMITER, NULL or HEADER in "
+			    "BINARY mode");
+		}
+	}
+	if (cmdc->cmdc_format != COPY_FORMAT_CSV) {
+		if (co.co_quote != NULL || co.co_escape != NULL) {
+			errx(1, "COPY QUOTE and ESCAPE are available only in "
+			    "CSV mode");
+		}
+	}
+
+	if (cmdc->cmdc_format == COPY_FORMAT_CSV) {
+		cmdc->cmdc_delimiter = co.co_delimiter != NULL ?
+		    copy_option_char("delimiter", co.co_delimiter) : ',';
+		cmdc->cmdc_null_string = strdup(co.co_null != NULL ?
+		    co.co_null : "");
+		cmdc->cmdc_quote = co.co_quote != NULL ?
+		    copy_option_char("quote", co.co_quote) : '"';
+		cmdc->cmdc_escape = co.co_escape != NULL ?
+		    copy_option_char("escape", co.co_escape) :
+		    cmdc->cmdc_quote;
+		if (cmdc->cmdc_delimiter == cmdc->cmdc_quote) {
+			errx(1, "COPY delimiter and quote must be different");
+		}
+	} else {
+		cmdc->cmdc_delimiter = co.co_delimiter != NULL ?
+		    copy_option_char("delimiter", co.co_delimiter) : '\t';
+		cmdc->cmdc_null_string = strdup(co.co_null != NULL ?
+		    co.co_null : "\\N");
+		if (cmdc->cmdc_format == COPY_FORMAT_TEXT &&
+		    strchr("\\.abcdefghijklmnopqrstuvwxyz0123456789",
+		    cmdc->cmdc_delimiter) != NULL) {
+			errx(1, "COPY delimiter cannot be \"%c\"",
+			    cmdc->cmdc_delimiter);
+		}
+	}
+	cmdc->cmdc_header = co.co_header;
+
+	if (cmdc->cmdc_null_string == NULL) {
+		err(1, "strdup");
+	}
+	if (cmdc->cmdc_delimiter == '\n' || cmdc->cmdc_delimiter == '\r') {
+		errx(1, "COPY delimiter cannot be newline or carriage return");
+	}
+	if (strpbrk(cmdc->cmdc_null_string, "\r\n") != NULL) {
+		errx(1, "COPY null representation cannot use newline or "
+		    "carriage return");
+	}
+	if (cmdc->cmdc_format != COPY_FORMAT_BINARY &&
+	    strchr(cmdc->cmdc_null_string, cmdc->cmdc_delimiter) != NULL) {
+		errx(1, "COPY delimiter must not appear in the NULL "
+		    "specification");
+	}
+}
+
 /*
  * XXX this function is structured poorly and leaks memory.
  */
@@ -188,8 +472,7 @@ parse_command_copy(list_t *cmd, command_copy_t **out)
 
 			cmdc->cmdc_table_name = table_name;
 			cmdc->cmdc_column_names = column_names;
-			cmdc->cmdc_delimiter = '\t';
-			cmdc->cmdc_null_string = strdup("\\N");
+			parse_copy_options(cmd, list_next(cmd, evt), cmdc);
 
 			*out = cmdc;
 			return (1);
@@ -200,10 +483,168 @@ parse_command_copy(list_t *cmd, command_copy_t **out)
 	return (-1);
 }
 
+void
+command_table_free(command_table_t *cmdt)
+{
+	if (cmdt == NULL) {
+		return;
+	}
+
+	free(cmdt->cmdt_table_name);
+	strlist_free(cmdt->cmdt_column_names);
+	strlist_free(cmdt->cmdt_column_types);
+	free(cmdt);
+}
+
+/*
+ * Record the column types from a CREATE TABLE command:
+ *
+ *	CREATE [ TEMP | UNLOGGED | ... ] TABLE [ IF NOT EXISTS ] name (
+ *	    column type [ constraints ] [, ...] [, table constraints ] )
+ *
+ * Each type is reduced to its words, without modifiers in parentheses or a
+ * schema name: e.g., "character(8)" becomes "character", and "timestamp(3)
+ * without time zone" becomes "timestamp without time zone".  Other forms of
+ * CREATE TABLE (e.g., "AS" or "PARTITION OF") are ignored.
+ */
+static int
+parse_command_create_table(list_t *cmd, command_table_t **out)
+{
+	static const char *const prefixes[] = { "global", "local", "temp",
+	    "temporary", "unlogged", NULL };
+	static const char *const table_constraints[] = { "constraint",
+	    "primary", "unique", "check", "foreign", "exclude", "like", NULL };
+	static const char *const column_constraints[] = { "not", "null",
+	    "default", "constraint", "primary", "unique", "check",
+	    "references", "collate", "generated", "deferrable", "initially",
+	    NULL };
+	enum {
+		PCT_ELEMENT = 1,
+		PCT_TYPE,
+		PCT_SKIP,
+	} state = PCT_ELEMENT;
+	command_table_t *cmdt;
+	const char *column = NULL;
+	char type[256];
+	size_t typelen = 0;
+	unsigned depth = 1;
+	event_t *evt;
+
+	evt = list_next(cmd, list_head(cmd));
+	while (event_is_any(evt, EVENT_NAME, prefixes)) {
+		evt = list_next(cmd, evt);
+	}
+	if (!event_is(evt, EVENT_NAME, "table")) {
+		return (0);
+	}
+	evt = list_next(cmd, evt);
+	if (event_is(evt, EVENT_NAME, "if")) {
+		evt = list_next(cmd, list_next(cmd, list_next(cmd, evt)));
+	}
+	if (evt == NULL || (evt->evt_t != EVENT_NAME &&
+	    evt->evt_t != EVENT_QUOTED_NAME) ||
+	    !event_is(list_next(cmd, evt), EVENT_SPECIAL, "(")) {
+		return (0);
+	}
+
+	if ((cmdt = calloc(1, sizeof (*cmdt))) == NULL ||
+	    (cmdt->cmdt_table_name = strdup(evt->evt_v)) == NULL ||
+	    strlist_alloc(&cmdt->cmdt_column_names, 0) != 0 ||
+	    strlist_alloc(&cmdt->cmdt_column_types, 0) != 0) {
+		err(1, "calloc");
+	}
+
+	for (evt = list_next(cmd, list_next(cmd, evt)); evt != NULL;
+	    evt = list_next(cmd, evt)) {
+		int open = event_is(evt, EVENT_SPECIAL, "(");
+		int close = event_is(evt, EVENT_SPECIAL, ")");
+
+		if (depth > 1 || open) {
+			/*
+			 * Skip type modifiers and constraint expressions.
+			 */
+			depth += open ? 1 : close ? -1 : 0;
+			continue;
+		}
+
+		if (close || event_is(evt, EVENT_SPECIAL, ",")) {
+			if (column != NULL && typelen > 0) {
+				type[typelen] = '\0';
+				if (strlist_set_tail(cmdt->cmdt_column_names,
+				    column) != 0 ||
+				    strlist_set_tail(cmdt->cmdt_column_types,
+				    type) != 0) {
+					err(1, "strlist_set_tail");
+				}
+			}
+			if (close) {
+				*out = cmdt;
+				return (2);
+			}
+			column = NULL;
+			state = PCT_ELEMENT;
+			continue;
+		}
+
+		switch (state) {
+		case PCT_ELEMENT:
+			if (event_is_any(evt, EVENT_NAME, table_constraints) ||
+			    (evt->evt_t != EVENT_NAME &&
+			    evt->evt_t != EVENT_QUOTED_NAME)) {
+				state = PCT_SKIP;
+				break;
+			}
+			column = evt->evt_v;
+			typelen = 0;
+			state = PCT_TYPE;
+			break;
+
+		case PCT_TYPE:
+			if (event_is(evt, EVENT_SPECIAL, ".")) {
+				/*
+				 * Drop the schema from a qualified type name.
+				 */
+				typelen = 0;
+				break;
+			}
+			if (event_is_any(evt, EVENT_NAME, column_constraints) ||
+			    (evt->evt_t != EVENT_NAME &&
+			    evt->evt_t != EVENT_QUOTED_NAME)) {
+				state = PCT_SKIP;
+				break;
+			}
+			size_t len = strlen(evt->evt_v);
+			if (typelen + len + 2 > sizeof (type)) {
+				state = PCT_SKIP;
+				typelen = 0;
+				break;
+			}
+			if (typelen > 0) {
+				type[typelen++] = ' ';
+			}
+			bcopy(evt->evt_v, type + typelen, len);
+			typelen += len;
+			break;
+
+		case PCT_SKIP:
+			break;
+		}
+	}
+
+	command_table_free(cmdt);
+	return (0);
+}
+
+/*
+ * Parse a complete SQL command.  Returns 1 for a COPY command, with "out" set
+ * to a description of it; 2 for a CREATE TABLE command, with "tablep" set to
+ * the column types of the table; and 0 for any other command.
+ */
 int
-parse_command(list_t *cmd, command_copy_t **out)
+parse_command(list_t *cmd, command_copy_t **out, command_table_t **tablep)
 {
 	*out = NULL;
+	*tablep = NULL;
 
 	if (list_is_empty(cmd)) {
 		return (0);
@@ -222,6 +663,8 @@ parse_command(list_t *cmd, command_copy_t **out)
 
 	if (strcasecmp(evt->evt_v, "COPY") == 0) {
 		return (parse_command_copy(cmd, out));
+	} else if (strcasecmp(evt->evt_v, "CREATE") == 0) {
+		return (parse_command_create_table(cmd, tablep));
 	} else {
 		return (0);
 	}
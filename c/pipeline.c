@@ -0,0 +1,1084 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+/*
+ * The conversion pipeline.  The tokenizer thread splits COPY data into rows,
+ * as it always has, but rather than convert each row to JSON itself it packs
+ * the rows of each table into batches.  Batches are converted by a pool of
+ * worker threads, and the output of each is written to the table's file by
+ * the writer thread:
+ *
+ *	reader --> tokenizer --[work]--> workers --[done]--> writer
+ *	                ^                                      |
+ *	                +---------------[free]-----------------+
+ *
+ * Batches complete in any order, but each stream (the output of one table)
+ * numbers its batches as they are filled, and the writer holds any batch
+ * that arrives early until those before it have been written.  The output
+ * of each table is thus exactly what a single thread would have written.
+ *
+ * There is a fixed number of batches, allocated once.  A batch returns to
+ * the free queue when it has been written, and the tokenizer waits for one
+ * there when all of them are in use; this bounds the memory used by the
+ * pipeline, and keeps the tokenizer from running too far ahead of the
+ * workers.
+ *
+ * Each stream is given a home worker when it is opened, in turn, and its
+ * batches are queued for that worker.  A worker with nothing queued steals
+ * from the queues of the others.  The tables of a dump are thus spread over
+ * the workers while a large table is still being read, and each worker
+ * keeps to as few streams (and their per-worker state) as it can; but no
+ * worker is idle while there is a batch waiting anywhere.
+ *
+ * The batches in flight are also limited by a memory budget: the tokenizer
+ * waits for batches to be written before it fills another once their row
+ * data and converted output together exceed the budget.
+ *
+ * A batch may instead hold the raw COPY data of a run of whole rows, which
+ * the worker parses before converting the rows.  The tokenizer then only
+ * looks for the ends of rows, and the parsing of one table is spread over
+ * the workers as well as its conversion.
+ */
+
+/*
+ * Size of the row data (or number of rows) in a batch, beyond which it is
+ * handed to the workers, and the number of batches for each worker.
+ */
+#define	PIPELINE_BATCH_SIZE	(256 * 1024)
+#define	PIPELINE_BATCH_ROWS	4096
+#define	PIPELINE_BATCHES	4
+
+/*
+ * Buffers of a batch that have grown beyond this (for very large rows) are
+ * released once the batch has been written, so that they do not remain
+ * allocated outside the memory budget.
+ */
+#define	PIPELINE_BATCH_TRIM	(4 * PIPELINE_BATCH_SIZE)
+
+/*
+ * The memory a batch usually holds once it has been used: its row data,
+ * which may reach twice the batch size before it is handed on, and its
+ * output.  Batches keep their buffers when they are reused, so the memory
+ * budget also limits the number of batches.
+ */
+#define	PIPELINE_BATCH_COST	(4 * PIPELINE_BATCH_SIZE)
+
+/*
+ * A bounded multi-producer, multi-consumer queue (after Dmitry Vyukov's
+ * design).  Each slot carries a sequence number, which tells a producer
+ * whether the slot is free for the lap of the ring it is on, and a consumer
+ * whether it has been filled.  Positions are claimed with compare-and-swap,
+ * so neither pushing nor popping takes a lock.
+ *
+ * Threads only sleep when the queue is full (or empty), on the condition
+ * variable.  A thread that has pushed or popped an item checks for sleepers
+ * afterwards, and takes the lock to wake them only if there are any.
+ */
+typedef struct workq_slot {
+	uint64_t wqs_seq;
+	void *wqs_item;
+} workq_slot_t;
+
+typedef struct workq {
+	workq_slot_t *wq_slots;
+	uint64_t wq_mask;
+	uint64_t wq_enq __attribute__((__aligned__(64)));
+	uint64_t wq_deq __attribute__((__aligned__(64)));
+	unsigned wq_sleepers __attribute__((__aligned__(64)));
+	int wq_closed;
+	pthread_mutex_t wq_lock;
+	pthread_cond_t wq_cv;
+	uint64_t wq_wait_ns;		/* time spent asleep, under wq_lock */
+} workq_t;
+
+static workq_t *
+workq_alloc(unsigned size)
+{
+	workq_t *wq;
+	uint64_t n = 2;
+
+	while (n < size) {
+		n *= 2;
+	}
+
+	if ((wq = calloc(1, sizeof (*wq))) == NULL ||
+	    (wq->wq_slots = calloc(n, sizeof (workq_slot_t))) == NULL) {
+		err(1, "calloc");
+	}
+	for (uint64_t i = 0; i < n; i++) {
+		wq->wq_slots[i].wqs_seq = i;
+	}
+	wq->wq_mask = n - 1;
+
+	if (pthread_mutex_init(&wq->wq_lock, NULL) != 0 ||
+	    pthread_cond_init(&wq->wq_cv, NULL) != 0) {
+		errx(1, "could not initialise work queue locks");
+	}
+
+	return (wq);
+}
+
+static void
+workq_free(workq_t *wq)
+{
+	(void) pthread_mutex_destroy(&wq->wq_lock);
+	(void) pthread_cond_destroy(&wq->wq_cv);
+	free(wq->wq_slots);
+	free(wq);
+}
+
+static int
+workq_try_push(workq_t *wq, void *item)
+{
+	uint64_t pos = __atomic_load_n(&wq->wq_enq, __ATOMIC_RELAXED);
+	workq_slot_t *s;
+
+	for (;;) {
+		s = &wq->wq_slots[pos & wq->wq_mask];
+		int64_t diff = (int64_t)(__atomic_load_n(&s->wqs_seq,
+		    __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&wq->wq_enq, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return (-1);
+		} else {
+			pos = __atomic_load_n(&wq->wq_enq, __ATOMIC_RELAXED);
+		}
+	}
+
+	s->wqs_item = item;
+	__atomic_store_n(&s->wqs_seq, pos + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+static void *
+workq_try_pop(workq_t *wq)
+{
+	uint64_t pos = __atomic_load_n(&wq->wq_deq, __ATOMIC_RELAXED);
+	workq_slot_t *s;
+	void *item;
+
+	for (;;) {
+		s = &wq->wq_slots[pos & wq->wq_mask];
+		int64_t diff = (int64_t)(__atomic_load_n(&s->wqs_seq,
+		    __ATOMIC_ACQUIRE) - (pos + 1));
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&wq->wq_deq, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return (NULL);
+		} else {
+			pos = __atomic_load_n(&wq->wq_deq, __ATOMIC_RELAXED);
+		}
+	}
+
+	item = s->wqs_item;
+	__atomic_store_n(&s->wqs_seq, pos + wq->wq_mask + 1, __ATOMIC_RELEASE);
+	return (item);
+}
+
+/*
+ * Wake any threads sleeping on the queue, after an item has been pushed or
+ * popped.  The sleeper count is read with an atomic read-modify-write, which
+ * is ordered with the increment made by a thread going to sleep: either that
+ * thread sees this operation on the queue when it tries again, or its
+ * increment is seen here.
+ */
+static void
+workq_wake(workq_t *wq)
+{
+	if (__atomic_fetch_add(&wq->wq_sleepers, 0, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&wq->wq_lock);
+	pthread_cond_broadcast(&wq->wq_cv);
+	pthread_mutex_unlock(&wq->wq_lock);
+}
+
+static void
+workq_push(workq_t *wq, void *item)
+{
+	if (workq_try_push(wq, item) != 0) {
+		uint64_t start = gettime_ns();
+
+		pthread_mutex_lock(&wq->wq_lock);
+		__atomic_add_fetch(&wq->wq_sleepers, 1, __ATOMIC_SEQ_CST);
+		while (workq_try_push(wq, item) != 0) {
+			pthread_cond_wait(&wq->wq_cv, &wq->wq_lock);
+		}
+		__atomic_sub_fetch(&wq->wq_sleepers, 1, __ATOMIC_SEQ_CST);
+		wq->wq_wait_ns += gettime_ns() - start;
+		pthread_mutex_unlock(&wq->wq_lock);
+	}
+
+	workq_wake(wq);
+}
+
+/*
+ * Take the next item from the queue, waiting for one if it is empty.
+ * Returns NULL once the queue has been closed and emptied.
+ */
+static void *
+workq_pop(workq_t *wq)
+{
+	void *item;
+
+	if ((item = workq_try_pop(wq)) == NULL) {
+		uint64_t start = gettime_ns();
+
+		pthread_mutex_lock(&wq->wq_lock);
+		__atomic_add_fetch(&wq->wq_sleepers, 1, __ATOMIC_SEQ_CST);
+		while ((item = workq_try_pop(wq)) == NULL && !wq->wq_closed) {
+			pthread_cond_wait(&wq->wq_cv, &wq->wq_lock);
+		}
+		__atomic_sub_fetch(&wq->wq_sleepers, 1, __ATOMIC_SEQ_CST);
+		wq->wq_wait_ns += gettime_ns() - start;
+		pthread_mutex_unlock(&wq->wq_lock);
+	}
+
+	if (item != NULL) {
+		workq_wake(wq);
+	}
+	return (item);
+}
+
+/*
+ * No more items will be pushed.  Consumers return NULL from workq_pop() once
+ * the remaining items have been taken.
+ */
+static void
+workq_close(workq_t *wq)
+{
+	pthread_mutex_lock(&wq->wq_lock);
+	wq->wq_closed = 1;
+	pthread_cond_broadcast(&wq->wq_cv);
+	pthread_mutex_unlock(&wq->wq_lock);
+}
+
+static uint64_t
+workq_wait_ns(workq_t *wq)
+{
+	uint64_t ns;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	ns = wq->wq_wait_ns;
+	pthread_mutex_unlock(&wq->wq_lock);
+
+	return (ns);
+}
+
+/*
+ * A column of a row in a batch, as an offset into the batch's row data.
+ */
+#define	PIPELINE_NULL	SIZE_MAX
+
+typedef struct pipeline_col {
+	size_t plc_off;			/* or PIPELINE_NULL */
+	size_t plc_len;
+} pipeline_col_t;
+
+typedef struct pipeline_batch {
+	pipeline_stream_t *plb_stream;
+	uint64_t plb_seq;		/* position in the stream */
+	uint64_t plb_row;		/* rows in the stream before this */
+	int plb_end;			/* marks the end of the stream */
+	int plb_raw;			/* data is unparsed rows */
+
+	unsigned plb_ncols;
+	unsigned plb_nrows;
+	pipeline_col_t *plb_cols;
+	size_t plb_ncells;
+	size_t plb_maxcells;
+	char *plb_data;
+	size_t plb_len;
+	size_t plb_size;
+
+	json_emit_t *plb_json;		/* converted output */
+	struct pipeline_batch *plb_next;	/* held by the writer */
+} pipeline_batch_t;
+
+struct pipeline_stream {
+	pipeline_t *pls_pipeline;
+	unsigned pls_home;		/* worker to queue batches for */
+	int pls_fd;
+	const char *pls_name;
+	command_copy_t *pls_command;
+	const pipeline_ops_t *pls_ops;
+	void *pls_arg;
+
+	/*
+	 * Per-worker state, created by the worker on first use.
+	 */
+	void **pls_state;
+	char *pls_ready;
+	copy_parser_t **pls_parsers;	/* for raw batches */
+
+	/*
+	 * Filled by the tokenizer.
+	 */
+	pipeline_batch_t *pls_batch;
+	uint64_t pls_seq;
+	uint64_t pls_rows;
+
+	/*
+	 * Written by the writer, in order.
+	 */
+	uint64_t pls_next;
+	pipeline_batch_t *pls_held;	/* sorted by plb_seq */
+};
+
+typedef struct pipeline_worker {
+	pipeline_t *plw_pipeline;
+	unsigned plw_index;
+	pthread_t plw_thread;
+	copy_col_t *plw_cols;
+	unsigned plw_maxcols;
+	pipeline_batch_t *plw_batch;	/* being parsed */
+	workq_t *plw_work;		/* batches of streams homed here */
+	uint64_t plw_steals;
+} pipeline_worker_t;
+
+struct pipeline {
+	unsigned pl_nworkers;
+	pipeline_worker_t *pl_workers;
+	pthread_t pl_writer;
+	unsigned pl_next_home;
+
+	unsigned pl_nbatches;
+	pipeline_batch_t *pl_batches;
+	workq_t *pl_free;
+	workq_t *pl_done;
+	int pl_finished;
+
+	/*
+	 * Idle workers wait on pl_work_cv, and the tokenizer on pl_budget_cv
+	 * when the budget is exhausted.  The counts of waiters are read
+	 * without the lock, as the work queue's are.
+	 */
+	pthread_mutex_t pl_lock;
+	pthread_cond_t pl_work_cv;
+	pthread_cond_t pl_budget_cv;
+	unsigned pl_idle;
+	unsigned pl_over;
+	int pl_closed;
+	uint64_t pl_budget;		/* bytes, or 0 for no limit */
+	uint64_t pl_buffered;		/* bytes in batches in flight */
+	uint64_t pl_budget_ns;		/* time waited, under pl_lock */
+};
+
+static void
+pipeline_parse_row(void *arg, const copy_col_t *cols, unsigned ncols)
+{
+	pipeline_worker_t *plw = arg;
+	pipeline_batch_t *plb = plw->plw_batch;
+	pipeline_stream_t *pls = plb->plb_stream;
+	unsigned w = plw->plw_index;
+
+	pls->pls_ops->plo_row(pls->pls_arg, pls->pls_state[w], plb->plb_json,
+	    cols, ncols, copy_parser_rows(pls->pls_parsers[w]) + 1);
+}
+
+/*
+ * Parse a raw batch with this worker's parser for the stream, converting
+ * each row as it is found.  The batch must hold exactly the rows the
+ * tokenizer counted in it.
+ */
+static void
+pipeline_parse(pipeline_worker_t *plw, pipeline_batch_t *plb)
+{
+	pipeline_stream_t *pls = plb->plb_stream;
+	copy_parser_t **cpp = &pls->pls_parsers[plw->plw_index];
+	size_t n;
+	int done;
+
+	if (*cpp == NULL && copy_parser_alloc(cpp, pls->pls_command,
+	    pipeline_parse_row, plw) != 0) {
+		err(1, "copy_parser_alloc");
+	}
+
+	plw->plw_batch = plb;
+	copy_parser_restart(*cpp, plb->plb_row);
+	n = copy_parse(*cpp, plb->plb_data, plb->plb_len, &done);
+	plw->plw_batch = NULL;
+
+	if (n != plb->plb_len || !copy_parser_at_row(*cpp) ||
+	    copy_parser_rows(*cpp) - plb->plb_row != plb->plb_nrows) {
+		errx(1, "COPY %s: data was not divided at the end of a row",
+		    pls->pls_name);
+	}
+}
+
+static void
+pipeline_convert(pipeline_worker_t *plw, pipeline_batch_t *plb)
+{
+	pipeline_stream_t *pls = plb->plb_stream;
+	const pipeline_ops_t *ops = pls->pls_ops;
+	unsigned w = plw->plw_index;
+	pipeline_col_t *plc = plb->plb_cols;
+
+	if (!pls->pls_ready[w]) {
+		pls->pls_state[w] = ops->plo_init != NULL ?
+		    ops->plo_init(pls->pls_arg) : NULL;
+		pls->pls_ready[w] = 1;
+	}
+
+	if (plb->plb_raw) {
+		pipeline_parse(plw, plb);
+		return;
+	}
+
+	if (plb->plb_ncols > plw->plw_maxcols) {
+		free(plw->plw_cols);
+		if ((plw->plw_cols = calloc(plb->plb_ncols,
+		    sizeof (copy_col_t))) == NULL) {
+			err(1, "calloc");
+		}
+		plw->plw_maxcols = plb->plb_ncols;
+	}
+
+	for (unsigned r = 0; r < plb->plb_nrows; r++) {
+		for (unsigned i = 0; i < plb->plb_ncols; i++, plc++) {
+			copy_col_t *cc = &plw->plw_cols[i];
+
+			cc->cc_ptr = plc->plc_off == PIPELINE_NULL ? NULL :
+			    plb->plb_data + plc->plc_off;
+			cc->cc_len = plc->plc_len;
+		}
+
+		ops->plo_row(pls->pls_arg, pls->pls_state[w], plb->plb_json,
+		    plw->plw_cols, plb->plb_ncols, plb->plb_row + r + 1);
+	}
+}
+
+/*
+ * Take a batch from this worker's queue, or else steal one from another's.
+ */
+static pipeline_batch_t *
+pipeline_work_take(pipeline_worker_t *plw)
+{
+	pipeline_t *pl = plw->plw_pipeline;
+	pipeline_batch_t *plb;
+
+	if ((plb = workq_try_pop(plw->plw_work)) != NULL) {
+		return (plb);
+	}
+
+	for (unsigned i = 1; i < pl->pl_nworkers; i++) {
+		pipeline_worker_t *victim = &pl->pl_workers[
+		    (plw->plw_index + i) % pl->pl_nworkers];
+
+		if ((plb = workq_try_pop(victim->plw_work)) != NULL) {
+			plw->plw_steals++;
+			return (plb);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Wait for a batch to convert.  Returns NULL once the pipeline is finishing
+ * and every queue is empty.
+ */
+static pipeline_batch_t *
+pipeline_work_get(pipeline_worker_t *plw)
+{
+	pipeline_t *pl = plw->plw_pipeline;
+	pipeline_batch_t *plb;
+
+	if ((plb = pipeline_work_take(plw)) != NULL) {
+		return (plb);
+	}
+
+	pthread_mutex_lock(&pl->pl_lock);
+	__atomic_add_fetch(&pl->pl_idle, 1, __ATOMIC_SEQ_CST);
+	while ((plb = pipeline_work_take(plw)) == NULL && !pl->pl_closed) {
+		pthread_cond_wait(&pl->pl_work_cv, &pl->pl_lock);
+	}
+	__atomic_sub_fetch(&pl->pl_idle, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pl->pl_lock);
+
+	return (plb);
+}
+
+static void *
+pipeline_worker(void *arg)
+{
+	pipeline_worker_t *plw = arg;
+	pipeline_t *pl = plw->plw_pipeline;
+	pipeline_batch_t *plb;
+
+	while ((plb = pipeline_work_get(plw)) != NULL) {
+		if (!plb->plb_end) {
+			pipeline_convert(plw, plb);
+			__atomic_add_fetch(&pl->pl_buffered,
+			    json_string_len(plb->plb_json), __ATOMIC_RELAXED);
+		}
+		workq_push(pl->pl_done, plb);
+	}
+
+	return (NULL);
+}
+
+static void
+pipeline_write(pipeline_stream_t *pls, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(pls->pls_fd, buf, len);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(1, "write (%s)", pls->pls_name);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+pipeline_batch_reset(pipeline_batch_t *plb)
+{
+	if (json_string_len(plb->plb_json) > PIPELINE_BATCH_TRIM) {
+		json_fini(plb->plb_json);
+		if ((plb->plb_json = json_create_string()) == NULL) {
+			err(1, "json_create_string");
+		}
+	} else {
+		json_string_clear(plb->plb_json);
+	}
+	if (plb->plb_size > PIPELINE_BATCH_TRIM) {
+		free(plb->plb_data);
+		plb->plb_data = NULL;
+		plb->plb_size = 0;
+	}
+	if (plb->plb_maxcells * sizeof (pipeline_col_t) > PIPELINE_BATCH_TRIM) {
+		free(plb->plb_cols);
+		plb->plb_cols = NULL;
+		plb->plb_maxcells = 0;
+	}
+
+	plb->plb_stream = NULL;
+	plb->plb_end = 0;
+	plb->plb_raw = 0;
+	plb->plb_nrows = 0;
+	plb->plb_ncells = 0;
+	plb->plb_len = 0;
+	plb->plb_next = NULL;
+}
+
+/*
+ * All of the output of a stream has been written.  The per-worker state is
+ * released here, as no worker can be using it: every batch of the stream has
+ * been through the workers.
+ */
+static void
+pipeline_stream_finish(pipeline_stream_t *pls)
+{
+	pipeline_t *pl = pls->pls_pipeline;
+
+	if (close(pls->pls_fd) != 0) {
+		err(1, "close(%s)", pls->pls_name);
+	}
+
+	for (unsigned w = 0; w < pl->pl_nworkers; w++) {
+		if (pls->pls_ready[w] && pls->pls_ops->plo_fini != NULL) {
+			pls->pls_ops->plo_fini(pls->pls_arg, pls->pls_state[w]);
+		}
+		copy_parser_free(pls->pls_parsers[w]);
+	}
+	if (pls->pls_ops->plo_close != NULL) {
+		pls->pls_ops->plo_close(pls->pls_arg);
+	}
+
+	free(pls->pls_state);
+	free(pls->pls_ready);
+	free(pls->pls_parsers);
+	free(pls);
+}
+
+/*
+ * A batch of "len" bytes has been written.  Wake the tokenizer if it is
+ * waiting for the budget; the waiter count is read as in workq_wake().
+ */
+static void
+pipeline_release(pipeline_t *pl, uint64_t len)
+{
+	__atomic_sub_fetch(&pl->pl_buffered, len, __ATOMIC_SEQ_CST);
+	if (__atomic_fetch_add(&pl->pl_over, 0, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pl->pl_lock);
+	pthread_cond_broadcast(&pl->pl_budget_cv);
+	pthread_mutex_unlock(&pl->pl_lock);
+}
+
+static void *
+pipeline_writer(void *arg)
+{
+	pipeline_t *pl = arg;
+	pipeline_batch_t *plb;
+
+	while ((plb = workq_pop(pl->pl_done)) != NULL) {
+		pipeline_stream_t *pls = plb->plb_stream;
+		pipeline_batch_t **pp = &pls->pls_held;
+
+		while (*pp != NULL && (*pp)->plb_seq < plb->plb_seq) {
+			pp = &(*pp)->plb_next;
+		}
+		plb->plb_next = *pp;
+		*pp = plb;
+
+		while ((plb = pls->pls_held) != NULL &&
+		    plb->plb_seq == pls->pls_next) {
+			int end = plb->plb_end;
+
+			pls->pls_held = plb->plb_next;
+			pls->pls_next++;
+
+			if (plb->plb_nrows > 0) {
+				pipeline_write(pls,
+				    json_string_cstr(plb->plb_json),
+				    json_string_len(plb->plb_json));
+			}
+			pipeline_release(pl, plb->plb_len +
+			    json_string_len(plb->plb_json));
+			pipeline_batch_reset(plb);
+			workq_push(pl->pl_free, plb);
+
+			if (end) {
+				pipeline_stream_finish(pls);
+				break;
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+int
+pipeline_alloc(pipeline_t **plp, unsigned nworkers, uint64_t budget)
+{
+	pipeline_t *pl;
+
+	if ((pl = calloc(1, sizeof (*pl))) == NULL ||
+	    (pl->pl_workers = calloc(nworkers,
+	    sizeof (pipeline_worker_t))) == NULL) {
+		free(pl);
+		return (-1);
+	}
+	pl->pl_nworkers = nworkers;
+	pl->pl_budget = budget;
+
+	if (pthread_mutex_init(&pl->pl_lock, NULL) != 0 ||
+	    pthread_cond_init(&pl->pl_work_cv, NULL) != 0 ||
+	    pthread_cond_init(&pl->pl_budget_cv, NULL) != 0) {
+		errx(1, "could not initialise pipeline locks");
+	}
+
+	/*
+	 * The queues are large enough to hold every batch, so that only the
+	 * free queue is ever waited on when full.
+	 */
+	pl->pl_nbatches = PIPELINE_BATCHES * nworkers + 2;
+	if (budget != 0 && budget / PIPELINE_BATCH_COST < pl->pl_nbatches) {
+		pl->pl_nbatches = budget / PIPELINE_BATCH_COST < 2 ? 2 :
+		    budget / PIPELINE_BATCH_COST;
+	}
+	if ((pl->pl_batches = calloc(pl->pl_nbatches,
+	    sizeof (pipeline_batch_t))) == NULL) {
+		free(pl->pl_workers);
+		free(pl);
+		return (-1);
+	}
+	pl->pl_free = workq_alloc(pl->pl_nbatches);
+	pl->pl_done = workq_alloc(pl->pl_nbatches);
+	for (unsigned i = 0; i < nworkers; i++) {
+		pl->pl_workers[i].plw_work = workq_alloc(pl->pl_nbatches);
+	}
+
+	for (unsigned i = 0; i < pl->pl_nbatches; i++) {
+		pipeline_batch_t *plb = &pl->pl_batches[i];
+
+		if ((plb->plb_json = json_create_string()) == NULL) {
+			err(1, "json_create_string");
+		}
+		workq_push(pl->pl_free, plb);
+	}
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		pipeline_worker_t *plw = &pl->pl_workers[i];
+
+		plw->plw_pipeline = pl;
+		plw->plw_index = i;
+		if ((errno = pthread_create(&plw->plw_thread, NULL,
+		    pipeline_worker, plw)) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+	if ((errno = pthread_create(&pl->pl_writer, NULL, pipeline_writer,
+	    pl)) != 0) {
+		err(1, "pthread_create");
+	}
+
+	*plp = pl;
+	return (0);
+}
+
+/*
+ * Wait for all of the streams to be converted and written, and stop the
+ * threads.  Every stream must have been closed.
+ */
+void
+pipeline_finish(pipeline_t *pl)
+{
+	if (pl->pl_finished) {
+		return;
+	}
+	pl->pl_finished = 1;
+
+	pthread_mutex_lock(&pl->pl_lock);
+	pl->pl_closed = 1;
+	pthread_cond_broadcast(&pl->pl_work_cv);
+	pthread_mutex_unlock(&pl->pl_lock);
+
+	for (unsigned i = 0; i < pl->pl_nworkers; i++) {
+		if ((errno = pthread_join(pl->pl_workers[i].plw_thread,
+		    NULL)) != 0) {
+			err(1, "pthread_join");
+		}
+		free(pl->pl_workers[i].plw_cols);
+	}
+
+	workq_close(pl->pl_done);
+	if ((errno = pthread_join(pl->pl_writer, NULL)) != 0) {
+		err(1, "pthread_join");
+	}
+}
+
+void
+pipeline_free(pipeline_t *pl)
+{
+	if (pl == NULL) {
+		return;
+	}
+
+	pipeline_finish(pl);
+
+	for (unsigned i = 0; i < pl->pl_nbatches; i++) {
+		pipeline_batch_t *plb = &pl->pl_batches[i];
+
+		json_fini(plb->plb_json);
+		free(plb->plb_cols);
+		free(plb->plb_data);
+	}
+	free(pl->pl_batches);
+	for (unsigned i = 0; i < pl->pl_nworkers; i++) {
+		workq_free(pl->pl_workers[i].plw_work);
+	}
+	free(pl->pl_workers);
+	workq_free(pl->pl_free);
+	workq_free(pl->pl_done);
+	(void) pthread_mutex_destroy(&pl->pl_lock);
+	(void) pthread_cond_destroy(&pl->pl_work_cv);
+	(void) pthread_cond_destroy(&pl->pl_budget_cv);
+	free(pl);
+}
+
+unsigned
+pipeline_workers(pipeline_t *pl)
+{
+	return (pl->pl_nworkers);
+}
+
+/*
+ * Time the tokenizer has spent waiting for a free batch or for the memory
+ * budget, which is time the workers or the writer were not keeping up.
+ */
+uint64_t
+pipeline_wait_ns(pipeline_t *pl)
+{
+	uint64_t ns;
+
+	pthread_mutex_lock(&pl->pl_lock);
+	ns = pl->pl_budget_ns;
+	pthread_mutex_unlock(&pl->pl_lock);
+
+	return (ns + workq_wait_ns(pl->pl_free));
+}
+
+/*
+ * The number of batches that workers took from the queues of others.  This
+ * is only stable once the pipeline has finished.
+ */
+uint64_t
+pipeline_steals(pipeline_t *pl)
+{
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < pl->pl_nworkers; i++) {
+		n += pl->pl_workers[i].plw_steals;
+	}
+
+	return (n);
+}
+
+/*
+ * Begin a stream of rows of the COPY command "cmdc", to be converted with
+ * "ops" and written to "fd".  The stream takes ownership of the file
+ * descriptor, and closes it once everything has been written.
+ */
+pipeline_stream_t *
+pipeline_stream_open(pipeline_t *pl, const char *name, int fd,
+    command_copy_t *cmdc, const pipeline_ops_t *ops, void *arg)
+{
+	pipeline_stream_t *pls;
+
+	if ((pls = calloc(1, sizeof (*pls))) == NULL ||
+	    (pls->pls_state = calloc(pl->pl_nworkers,
+	    sizeof (void *))) == NULL ||
+	    (pls->pls_ready = calloc(pl->pl_nworkers, 1)) == NULL ||
+	    (pls->pls_parsers = calloc(pl->pl_nworkers,
+	    sizeof (copy_parser_t *))) == NULL) {
+		err(1, "calloc");
+	}
+
+	pls->pls_pipeline = pl;
+	pls->pls_home = pl->pl_next_home++ % pl->pl_nworkers;
+	pls->pls_name = name;
+	pls->pls_fd = fd;
+	pls->pls_command = cmdc;
+	pls->pls_ops = ops;
+	pls->pls_arg = arg;
+
+	return (pls);
+}
+
+/*
+ * Wait until the batches in flight are within the memory budget.  They are
+ * all on their way to the writer, so this always ends.
+ */
+static void
+pipeline_budget_wait(pipeline_t *pl)
+{
+	uint64_t start;
+
+	if (pl->pl_budget == 0 || __atomic_load_n(&pl->pl_buffered,
+	    __ATOMIC_RELAXED) < pl->pl_budget) {
+		return;
+	}
+
+	start = gettime_ns();
+	pthread_mutex_lock(&pl->pl_lock);
+	__atomic_add_fetch(&pl->pl_over, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pl->pl_buffered, __ATOMIC_SEQ_CST) >=
+	    pl->pl_budget) {
+		pthread_cond_wait(&pl->pl_budget_cv, &pl->pl_lock);
+	}
+	__atomic_sub_fetch(&pl->pl_over, 1, __ATOMIC_SEQ_CST);
+	pl->pl_budget_ns += gettime_ns() - start;
+	pthread_mutex_unlock(&pl->pl_lock);
+}
+
+static pipeline_batch_t *
+pipeline_batch_get(pipeline_stream_t *pls)
+{
+	pipeline_batch_t *plb;
+
+	pipeline_budget_wait(pls->pls_pipeline);
+	plb = workq_pop(pls->pls_pipeline->pl_free);
+
+	plb->plb_stream = pls;
+	plb->plb_seq = pls->pls_seq++;
+	plb->plb_row = pls->pls_rows;
+	return (plb);
+}
+
+/*
+ * Queue a batch for the stream's home worker, and wake an idle worker (which
+ * may be another, to steal it).
+ */
+static void
+pipeline_batch_submit(pipeline_stream_t *pls, pipeline_batch_t *plb)
+{
+	pipeline_t *pl = pls->pls_pipeline;
+
+	__atomic_add_fetch(&pl->pl_buffered, plb->plb_len, __ATOMIC_RELAXED);
+	workq_push(pl->pl_workers[pls->pls_home].plw_work, plb);
+
+	if (__atomic_fetch_add(&pl->pl_idle, 0, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pl->pl_lock);
+	pthread_cond_signal(&pl->pl_work_cv);
+	pthread_mutex_unlock(&pl->pl_lock);
+}
+
+/*
+ * Make room for "len" more bytes of data in a batch.
+ */
+static void
+pipeline_batch_reserve(pipeline_batch_t *plb, size_t len)
+{
+	size_t n;
+	char *d;
+
+	if (len <= plb->plb_size - plb->plb_len) {
+		return;
+	}
+
+	n = plb->plb_size == 0 ? PIPELINE_BATCH_SIZE : plb->plb_size * 2;
+	while (n - plb->plb_len < len) {
+		n *= 2;
+	}
+	if ((d = realloc(plb->plb_data, n)) == NULL) {
+		err(1, "realloc");
+	}
+	plb->plb_data = d;
+	plb->plb_size = n;
+}
+
+/*
+ * Add a row to the stream.  The row is copied, and the columns need not
+ * remain valid after this returns.
+ */
+void
+pipeline_stream_row(pipeline_stream_t *pls, const copy_col_t *cols,
+    unsigned ncols)
+{
+	pipeline_batch_t *plb = pls->pls_batch;
+	size_t len = 0;
+
+	if (plb == NULL) {
+		plb = pls->pls_batch = pipeline_batch_get(pls);
+		plb->plb_ncols = ncols;
+	}
+	assert(!plb->plb_raw && ncols == plb->plb_ncols);
+
+	for (unsigned i = 0; i < ncols; i++) {
+		len += cols[i].cc_len;
+	}
+
+	if (plb->plb_ncells + ncols > plb->plb_maxcells) {
+		size_t n = plb->plb_maxcells == 0 ? 1024 :
+		    plb->plb_maxcells * 2;
+		pipeline_col_t *c;
+
+		while (n < plb->plb_ncells + ncols) {
+			n *= 2;
+		}
+		if ((c = realloc(plb->plb_cols, n * sizeof (*c))) == NULL) {
+			err(1, "realloc");
+		}
+		plb->plb_cols = c;
+		plb->plb_maxcells = n;
+	}
+	pipeline_batch_reserve(plb, len);
+
+	for (unsigned i = 0; i < ncols; i++) {
+		pipeline_col_t *plc = &plb->plb_cols[plb->plb_ncells++];
+
+		if (cols[i].cc_ptr == NULL) {
+			plc->plc_off = PIPELINE_NULL;
+			plc->plc_len = 0;
+			continue;
+		}
+		plc->plc_off = plb->plb_len;
+		plc->plc_len = cols[i].cc_len;
+		bcopy(cols[i].cc_ptr, plb->plb_data + plb->plb_len,
+		    cols[i].cc_len);
+		plb->plb_len += cols[i].cc_len;
+	}
+	plb->plb_nrows++;
+	pls->pls_rows++;
+
+	if (plb->plb_len >= PIPELINE_BATCH_SIZE ||
+	    plb->plb_nrows >= PIPELINE_BATCH_ROWS) {
+		pipeline_batch_submit(pls, plb);
+		pls->pls_batch = NULL;
+	}
+}
+
+/*
+ * The number of bytes of raw data that would fill the current batch, which
+ * is how much the tokenizer should look for the end of a row beyond.
+ */
+size_t
+pipeline_stream_space(pipeline_stream_t *pls)
+{
+	size_t len = pls->pls_batch == NULL ? 0 : pls->pls_batch->plb_len;
+
+	return (len >= PIPELINE_BATCH_SIZE ? 0 : PIPELINE_BATCH_SIZE - len);
+}
+
+/*
+ * Add raw row data to the stream, containing the ends of "rows" rows.  If
+ * "boundary" is set the data ends at the end of a row, and the batch may be
+ * handed to the workers; a row is never divided between batches.
+ */
+void
+pipeline_stream_data(pipeline_stream_t *pls, const char *buf, size_t len,
+    uint64_t rows, int boundary)
+{
+	pipeline_batch_t *plb = pls->pls_batch;
+
+	if (plb == NULL) {
+		plb = pls->pls_batch = pipeline_batch_get(pls);
+		plb->plb_raw = 1;
+	}
+	assert(plb->plb_raw);
+
+	pipeline_batch_reserve(plb, len);
+	bcopy(buf, plb->plb_data + plb->plb_len, len);
+	plb->plb_len += len;
+	plb->plb_nrows += rows;
+	pls->pls_rows += rows;
+
+	if (boundary && plb->plb_len >= PIPELINE_BATCH_SIZE) {
+		pipeline_batch_submit(pls, plb);
+		pls->pls_batch = NULL;
+	}
+}
+
+/*
+ * There are no more rows for this stream.  The stream is released by the
+ * writer once its output has been written, so it must not be used again.
+ */
+void
+pipeline_stream_close(pipeline_stream_t *pls)
+{
+	pipeline_batch_t *plb;
+
+	if (pls->pls_batch != NULL) {
+		pipeline_batch_submit(pls, pls->pls_batch);
+		pls->pls_batch = NULL;
+	}
+
+	plb = pipeline_batch_get(pls);
+	plb->plb_end = 1;
+	pipeline_batch_submit(pls, plb);
+}
@@ -0,0 +1,172 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define	SCAN_X86	1
+#endif
+
+/*
+ * Scanning for the special characters of the COPY formats.  Nearly all of a
+ * dump is COPY row data, and nearly all of that is ordinary column text.
+ * Rather than examine one byte at a time, we look for the next special
+ * character (e.g., delimiter, newline or backslash in the text format) a
+ * vector at a time, so that the ordinary text in between can be copied in
+ * bulk.  Each scanner looks for any of three characters, which need not be
+ * distinct.
+ */
+
+static size_t
+copy_scan_scalar(const char *buf, size_t len, char a, char b, char c)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		char ch = buf[i];
+
+		if (ch == a || ch == b || ch == c) {
+			break;
+		}
+	}
+
+	return (i);
+}
+
+#ifdef	SCAN_X86
+
+static size_t
+copy_scan_sse2(const char *buf, size_t len, char a, char b, char c)
+{
+	const __m128i vd = _mm_set1_epi8(a);
+	const __m128i vn = _mm_set1_epi8(b);
+	const __m128i vb = _mm_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, vd),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, vn), _mm_cmpeq_epi8(v, vb)));
+		unsigned mask = _mm_movemask_epi8(m);
+
+		if (mask != 0) {
+			return (i + __builtin_ctz(mask));
+		}
+	}
+
+	return (i + copy_scan_scalar(buf + i, len - i, a, b, c));
+}
+
+__attribute__((__target__("avx2")))
+static size_t
+copy_scan_avx2(const char *buf, size_t len, char a, char b, char c)
+{
+	const __m256i vd = _mm256_set1_epi8(a);
+	const __m256i vn = _mm256_set1_epi8(b);
+	const __m256i vb = _mm256_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, vd),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, vn),
+		    _mm256_cmpeq_epi8(v, vb)));
+		unsigned mask = _mm256_movemask_epi8(m);
+
+		if (mask != 0) {
+			return (i + __builtin_ctz(mask));
+		}
+	}
+
+	return (i + copy_scan_sse2(buf + i, len - i, a, b, c));
+}
+
+#endif	/* SCAN_X86 */
+
+typedef size_t copy_scan_func_t(const char *, size_t, char, char, char);
+
+static copy_scan_func_t copy_scan_init;
+static copy_scan_func_t *copy_scan_impl = copy_scan_init;
+
+/*
+ * The implementation is read and set with relaxed atomics: the conversion
+ * workers may each make the selection on first use, but they all make the
+ * same one.
+ */
+#define	COPY_SCAN_IMPL()	\
+	__atomic_load_n(&copy_scan_impl, __ATOMIC_RELAXED)
+
+/*
+ * Select the widest implementation this CPU supports on first use.  The
+ * selection may be overridden with DUMPER_SCAN set to "scalar", "sse2" or
+ * "avx2", for comparison.  A setting this CPU cannot honour is reported,
+ * once, and the widest implementation is used instead.
+ */
+static size_t
+copy_scan_init(const char *buf, size_t len, char a, char b, char c)
+{
+	static int warned;
+	const char *force = getenv("DUMPER_SCAN");
+	copy_scan_func_t *best = copy_scan_scalar;
+	const char *best_name = "scalar";
+	copy_scan_func_t *impl;
+
+#ifdef	SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		best = copy_scan_avx2;
+		best_name = "avx2";
+	} else {
+		best = copy_scan_sse2;
+		best_name = "sse2";
+	}
+#endif
+
+	if (force == NULL || strcmp(force, best_name) == 0) {
+		impl = best;
+	} else if (strcmp(force, "scalar") == 0) {
+		impl = copy_scan_scalar;
+#ifdef	SCAN_X86
+	} else if (strcmp(force, "sse2") == 0) {
+		impl = copy_scan_sse2;
+#endif
+	} else {
+		impl = best;
+		if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+			warnx("DUMPER_SCAN \"%s\" is unknown, or not "
+			    "supported by this CPU; using \"%s\"", force,
+			    best_name);
+		}
+	}
+
+	__atomic_store_n(&copy_scan_impl, impl, __ATOMIC_RELAXED);
+	return (impl(buf, len, a, b, c));
+}
+
+/*
+ * Return the length of the leading part of "buf" that contains no column
+ * delimiter, newline or backslash.
+ */
+size_t
+copy_scan(const char *buf, size_t len, char delim)
+{
+	return (COPY_SCAN_IMPL()(buf, len, delim, '\n', '\\'));
+}
+
+/*
+ * Return the length of the leading part of "buf" that contains none of the
+ * characters "a", "b" and "c".
+ */
+size_t
+copy_scan_chars(const char *buf, size_t len, char a, char b, char c)
+{
+	return (COPY_SCAN_IMPL()(buf, len, a, b, c));
+}
@@ -0,0 +1,126 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <sys/list.h>
+#include <strlist.h>
+
+#include "common.h"
+
+/*
+ * scanbench: microbenchmark for copy_scan()
+ *
+ *     scanbench file [scalar|sse2|avx2 ...]
+ *
+ * Reads "file" (typically an uncompressed dump) into memory, then runs
+ * copy_scan() over all of it, from each stop to the next, as the COPY
+ * tokenizer does with tab-delimited column text.  The implementation is
+ * chosen once per process, so each DUMPER_SCAN setting named (by default,
+ * all of them) is timed in a child process of its own.  The best of
+ * SCANBENCH_RUNS passes is reported.  A setting the CPU does not support
+ * (such as "avx2" without AVX2) is timed with the widest one it does, after
+ * a warning.
+ */
+
+#define	SCANBENCH_RUNS	5
+
+static uint64_t
+scanbench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+scanbench_run(const char *setting, const char *buf, size_t len)
+{
+	uint64_t best = UINT64_MAX;
+	size_t stops = 0;
+
+	if (setenv("DUMPER_SCAN", setting, 1) != 0) {
+		err(1, "setenv");
+	}
+
+	for (int r = 0; r < SCANBENCH_RUNS; r++) {
+		uint64_t start = scanbench_now();
+		size_t pos = 0;
+
+		stops = 0;
+		while (pos < len) {
+			pos += copy_scan(buf + pos, len - pos, '\t') + 1;
+			stops++;
+		}
+
+		uint64_t ns = scanbench_now() - start;
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	printf("%-8s %.2f GB/s (%zu stops, %.1f bytes apart)\n", setting,
+	    len / (best / 1e9) / 1e9, stops, (double)len / stops);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char *all[] = { "scalar", "sse2", "avx2" };
+	char **settings = all;
+	int nsettings = 3;
+	FILE *f;
+	char *buf;
+	long len;
+
+	if (argc < 2) {
+		errx(2, "usage: scanbench file [scalar|sse2|avx2 ...]");
+	}
+	if (argc > 2) {
+		settings = &argv[2];
+		nsettings = argc - 2;
+	}
+
+	if ((f = fopen(argv[1], "r")) == NULL) {
+		err(1, "fopen %s", argv[1]);
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0) {
+		err(1, "seek %s", argv[1]);
+	}
+	rewind(f);
+	if ((buf = malloc(len)) == NULL) {
+		err(1, "malloc");
+	}
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		err(1, "read %s", argv[1]);
+	}
+	(void) fclose(f);
+
+	for (int i = 0; i < nsettings; i++) {
+		pid_t pid;
+		int status;
+
+		(void) fflush(stdout);
+		if ((pid = fork()) < 0) {
+			err(1, "fork");
+		} else if (pid == 0) {
+			scanbench_run(settings[i], buf, len);
+			exit(0);
+		}
+
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "%s: child failed", settings[i]);
+		}
+	}
+
+	free(buf);
+	return (0);
+}
@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# Regression tests for the dumper, run by "make check".
+#
+# Each dump named with check_dump is converted twice: on the tokenizer
+# thread, and again by worker threads that also parse the COPY data.  The
+# tables written each time must match the expected output in the directory
+# of the same name with ".out" appended.  If there is a file with ".err"
+# appended, each line of it must also appear in the dumper's messages.
+#
+# Each dump named with check_fail must instead be rejected, with a message
+# containing the given text.
+#
+# Each dump named with check_index is compressed with gzip, and converted
+# while writing an index.  The index is then used to convert just the given
+# table, which must match the expected output, and must be refused for any
+# other input.
+#
+# check_inflate does the same with a generated dump, large enough that the
+# index holds several restart points, and inflates it on three threads.
+#
+
+testdir=$(cd "$(dirname "$0")" && pwd)
+dumper=$(dirname "$testdir")/dumper
+work=$(mktemp -d "${TMPDIR:-/tmp}/dumper-check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+#
+# Run the dumper in the work directory, with the messages in "$work/log".
+#
+run()
+{
+	rm -rf "$work/OUTPUT_DIR" && mkdir "$work/OUTPUT_DIR" &&
+	    (cd "$work" && "$dumper" "$@") >"$work/log" 2>&1
+}
+
+check_dump()
+{
+	name=$1
+	shift
+
+	for jobs in "-j 0" "-j 2 -p"; do
+		run $jobs "$@" "$testdir/$name.sql" ||
+		    fail "$name ($jobs): $(tail -1 "$work/log")"
+		diff -r "$testdir/$name.out" "$work/OUTPUT_DIR" >&2 ||
+		    fail "$name ($jobs): output differs"
+		if [ -f "$testdir/$name.err" ]; then
+			while IFS= read -r line; do
+				grep -Fqx -- "$line" "$work/log" ||
+				    fail "$name ($jobs): no \"$line\""
+			done <"$testdir/$name.err"
+		fi
+	done
+
+	echo "ok $name"
+}
+
+check_fail()
+{
+	name=$1
+	message=$2
+	shift 2
+
+	run -j 0 "$@" "$testdir/$name.sql" &&
+	    fail "$name: converted without error"
+	grep -Fq -- "$message" "$work/log" ||
+	    fail "$name: $(tail -1 "$work/log")"
+
+	echo "ok $name"
+}
+
+check_index()
+{
+	name=$1
+	table=$2
+	gz=$work/$name.sql.gz
+	index=$work/$name.index
+
+	gzip -c "$testdir/$name.sql" >"$gz" || fail "$name: gzip failed"
+
+	run -j 0 -w "$index" "$gz" ||
+	    fail "$name (-w): $(tail -1 "$work/log")"
+	diff -r "$testdir/$name.out" "$work/OUTPUT_DIR" >&2 ||
+	    fail "$name (-w): output differs"
+
+	run -j 0 -i "$index" -t "$table" "$gz" ||
+	    fail "$name (-i): $(tail -1 "$work/log")"
+	[ "$(ls "$work/OUTPUT_DIR")" = "$table.json" ] ||
+	    fail "$name (-i): wrote $(ls "$work/OUTPUT_DIR")"
+	diff "$testdir/$name.out/$table.json" "$work/OUTPUT_DIR/$table.json" \
+	    >&2 || fail "$name (-i): output differs"
+
+	run -j 0 -i "$index" "$testdir/$name.sql" &&
+	    fail "$name (-i): index used with the wrong input"
+	grep -Fq "the index does not match" "$work/log" ||
+	    fail "$name (-i): $(tail -1 "$work/log")"
+
+	echo "ok $name (index)"
+}
+
+#
+# Write a dump of about 16 MiB to standard output: a bucket of 100,000
+# rows, then a small one.
+#
+big_dump()
+{
+	awk 'BEGIN {
+		pad = sprintf("%100s", "");
+		gsub(/ /, "x", pad);
+		cols = "_id, _txn_snap, _key, _value, _etag, _mtime, _vnode";
+
+		print "COPY buckets_config (name, index, pre, post, " \
+		    "options, mtime, reindex_active) FROM stdin;";
+		for (b = 0; b < 2; b++) {
+			printf("big_%d\t{}\t[]\t[]\t{\"version\": 2}\t" \
+			    "2016-01-01 00:00:00.000\t\\N\n", b);
+		}
+		print "\\.";
+
+		for (b = 0; b < 2; b++) {
+			printf("\nCOPY big_%d (%s) FROM stdin;\n", b, cols);
+			for (i = 1; i <= (b == 0 ? 100000 : 10); i++) {
+				printf("%d\t\\N\t/%d/%d\t{\"n\":%d," \
+				    "\"pad\":\"%s\"}\tC9E9C616\t" \
+				    "1460000000000\t%d\n", i, b, i, i, pad,
+				    i % 128);
+			}
+			print "\\.";
+		}
+	}'
+}
+
+check_inflate()
+{
+	gz=$work/big.sql.gz
+	index=$work/big.index
+
+	big_dump | gzip -c >"$gz" || fail "big: gzip failed"
+
+	run -j 0 -w "$index" "$gz" || fail "big (-w): $(tail -1 "$work/log")"
+	points=$(sed -n 's/^INDEX WRITTEN (\([0-9]*\) restart points)$/\1/p' \
+	    "$work/log")
+	[ "${points:-0}" -ge 3 ] ||
+	    fail "big (-w): only ${points:-0} restart points"
+	mv "$work/OUTPUT_DIR" "$work/big.out"
+
+	run -j 0 -i "$index" -z 3 "$gz" ||
+	    fail "big (-i -z 3): $(tail -1 "$work/log")"
+	diff -r "$work/big.out" "$work/OUTPUT_DIR" >&2 ||
+	    fail "big (-i -z 3): output differs"
+
+	run -j 0 -i "$index" -z 3 -t big_1 "$gz" ||
+	    fail "big (-i -z 3 -t big_1): $(tail -1 "$work/log")"
+	diff -r "$work/big.out/big_1.json" "$work/OUTPUT_DIR/big_1.json" >&2 ||
+	    fail "big (-i -z 3 -t big_1): output differs"
+
+	echo "ok big (inflate)"
+}
+
+check_dump dollar_tags
+check_dump copy_csv
+check_dump copy_delim
+check_dump copy_binary
+check_dump unescape
+check_dump spool_replay
+check_dump spool_no_config
+check_fail estring_surrogate "unsupported Unicode escape"
+check_dump moray
+check_index moray moray_typed
+check_inflate
+check_fail moray_vnode "did not match value.vnode"
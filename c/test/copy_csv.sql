@@ -0,0 +1,36 @@
+--
+-- COPY data in the CSV format: quoted values that hold the delimiter, the
+-- quote, a newline or the end-of-data marker; an unquoted empty value, which
+-- is NULL, and a quoted one, which is not.  The second table gives each
+-- option a value other than its default, some as escape strings.
+--
+
+CREATE TABLE csv_quoting (
+    id integer,
+    a text,
+    b text
+);
+
+CREATE TABLE csv_options (
+    id integer,
+    a text,
+    b text
+);
+
+COPY csv_quoting (id, a, b) FROM stdin WITH CSV HEADER;
+id,a,b
+1,plain,"quoted"
+2,"a, b","say ""hi"""
+3,"first line
+second line",x
+4,,""
+5,"\.",\N
+6,"",
+\.
+
+COPY csv_options (id, a, b) FROM stdin WITH (FORMAT csv, DELIMITER E'\t', QUOTE '''', ESCAPE E'\\', NULL 'NUL');
+1	'it\'s'	NUL
+2	'tab	inside'	'NUL'
+3	'two
+lines'	"double"
+\.
@@ -0,0 +1,28 @@
+--
+-- COPY data in the text format with a DELIMITER and NULL other than the
+-- defaults, given in the syntax from before PostgreSQL 9.0, and as escape
+-- strings.
+--
+
+CREATE TABLE delim_old (
+    a text,
+    b text,
+    c text
+);
+
+CREATE TABLE delim_escape (
+    a text,
+    b text
+);
+
+COPY delim_old (a, b, c) FROM stdin DELIMITER AS '|' NULL AS 'nil';
+one|two|three
+pipe\|inside|nil|\nil
+tab	inside|back\\slash|new\nline
+|nil|
+\.
+
+COPY delim_escape (a, b) FROM stdin WITH DELIMITER E'\x3b' NULL E'\\\\N';
+a;\\N
+\N;b
+\.
@@ -0,0 +1,24 @@
+--
+-- Dollar-quoted bodies in which a "$" that does not begin the closing tag
+-- is followed directly by one that does.  The rows of the table after them
+-- are only converted if the end of each body is found.
+--
+
+CREATE FUNCTION tag_after_dollar() RETURNS text
+    LANGUAGE sql
+    AS $body$SELECT 'x'::text AS x$$body$;
+
+CREATE FUNCTION tag_after_false_tag() RETURNS text
+    LANGUAGE sql
+    AS $fn$SELECT 'a'::text AS a$b$fn$;
+
+CREATE TABLE dollar_tags (
+    name text,
+    value text
+);
+
+COPY dollar_tags (name, value) FROM stdin;
+first	one
+second	two
+\.
+
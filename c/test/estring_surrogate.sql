@@ -0,0 +1,12 @@
+--
+-- A Unicode escape for half of a surrogate pair cannot be converted to UTF-8
+-- on its own, so PostgreSQL rejects it, and so does the dumper.
+--
+
+CREATE TABLE estring_surrogate (
+    a text
+);
+
+COPY estring_surrogate (a) FROM stdin WITH (DELIMITER E'\uD800');
+x
+\.
@@ -0,0 +1,136 @@
+--
+-- Conversion of the rows of a bucket table to Moray objects.  The expected
+-- output in moray.out was written by moray_row_to_object() in lib/moray.js,
+-- and JSON.stringify().
+--
+-- Every row of moray_spliced is in the form JSON.stringify() would write, so
+-- the index columns can be spliced into the text of _value.  Every row of
+-- moray_parsed is not, for one reason each, and must be parsed in full.
+-- moray.err holds the number of rows of each table that were parsed.
+--
+
+CREATE TABLE buckets_config (
+    name text NOT NULL,
+    index text NOT NULL,
+    pre text NOT NULL,
+    post text NOT NULL,
+    options text,
+    mtime timestamp without time zone DEFAULT now() NOT NULL,
+    reindex_active text
+);
+
+CREATE TABLE moray_objects (
+    _id integer NOT NULL,
+    _txn_snap integer,
+    _key text NOT NULL,
+    _value text NOT NULL,
+    _etag character(8) NOT NULL,
+    _mtime bigint,
+    _vnode bigint,
+    owner text,
+    tags text,
+    gone text
+);
+
+COPY buckets_config (name, index, pre, post, options, mtime, reindex_active) FROM stdin;
+moray_objects	{"owner": {"type": "string"}, "tags": {"type": "string"}, "gone": {"type": "string"}}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+moray_spliced	{"owner": {"type": "string"}, "tags": {"type": "string"}, "gone": {"type": "string"}}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+moray_parsed	{"owner": {"type": "string"}, "tags": {"type": "string"}, "gone": {"type": "string"}}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+moray_typed	{"size": {"type": "number"}, "active": {"type": "boolean"}}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+\.
+
+COPY moray_objects (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode, owner, tags, gone) FROM stdin;
+1	1001	/canonical	{"owner":"val","tags":"x","gone":"y","vnode":1}	C9E9C616	1460000000000	1	col-owner	t1	\N
+2	1001	/white space	{ "owner" : "a" ,\t"n" : [ 1 , 2 ] ,\n"o" : { "p" : null } }	C9E9C616	1460000000000	\N	b	\N	\N
+3	1001	/duplicates	{"owner":"a","k":1,"k":{"k":2,"k":3},"owner":"c"}	C9E9C616	1460000000000	\N	d	\N	\N
+4	1001	/integer keys	{"z":1,"10":"ten","2":"two","a":{"1":true,"b":false,"0":null},"01":"not an index","4294967295":"too big"}	C9E9C616	1460000000000	\N	e	\N	\N
+5	1001	/escapes	{"s":"\\u0041\\u00e9\\u2603","lone":"\\ud800","pair":"\\ud83d\\ude00","low":"x\\udc00","ctl":"\\u001f\\u0008\\/","raw":"café ☃"}	C9E9C616	1460000000000	\N	f	\N	\N
+6	1001	/arrays	{"owner":["a","b"],"tags":["t"],"gone":[]}	C9E9C616	1460000000000	\N	z	\N	g
+7	1001	/missing	{"x":1}	C9E9C616	1460000000000	\N	added	tag	\N
+8	1001	/vnode string	{"vnode":"3"}	C9E9C616	1460000000000	3	\N	\N	\N
+9	1001	/vnode array	{"vnode":["4","5"]}	C9E9C616	1460000000000	4	\N	\N	\N
+10	1001	/vnode fraction	{"vnode":7.9}	C9E9C616	1460000000000	7	\N	\N	\N
+11	\N	/nulls	{}	C9E9C616	\N	\N	\N	\N	\N
+12	1001	/quote"tab\tnewline\nback\\slash	{"owner":"o"}	C9E9C616	1460000000000	\N	q"\t\n\\é	ok	\N
+13	1001	/array	[1,{"owner":2}]	C9E9C616	1460000000000	\N	ignored	\N	\N
+14	1001	/string	"text"	C9E9C616	1460000000000	\N	ignored	\N	\N
+\.
+
+COPY moray_spliced (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode, owner, tags, gone) FROM stdin;
+1	1001	/plain	{"owner":"a","n":1,"tags":"b"}	C9E9C616	1460000000000	\N	c	d	\N
+2	1001	/short escapes	{"s":"q\\"b\\\\n\\nt\\tr\\rb\\bf\\f","owner":"x"}	C9E9C616	1460000000000	\N	o	\N	\N
+3	1001	/control escape	{"c":"\\u001f\\u0000\\u000b"}	C9E9C616	1460000000000	\N	o	\N	\N
+4	1001	/numbers	{"n":[0,-1,1.5,1e+21,1e-7,123456789012,0.1,-0.5]}	C9E9C616	1460000000000	\N	o	\N	\N
+5	1001	/not indices	{"z":1,"01":2,"-1":3,"4294967295":4,"1.5":5,"":6}	C9E9C616	1460000000000	\N	o	\N	\N
+6	1001	/nested	{"a":{"b":[{"c":null},true,false,"é"]},"vnode":2}	C9E9C616	1460000000000	2	o	\N	\N
+7	1001	/index array	{"owner":["a"],"tags":"t","gone":"g"}	C9E9C616	1460000000000	\N	z	\N	\N
+8	1001	/index missing	{"x":1}	C9E9C616	1460000000000	\N	\N	t	g
+9	1001	/empty	{}	C9E9C616	1460000000000	\N	\N	\N	\N
+10	1001	/vnode string	{"vnode":"12abc"}	C9E9C616	1460000000000	12	\N	\N	\N
+\.
+
+COPY moray_parsed (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode, owner, tags, gone) FROM stdin;
+1	1001	/one point zero	{"n":1.0}	C9E9C616	1460000000000	\N	o	\N	\N
+2	1001	/exponent	{"n":1e2}	C9E9C616	1460000000000	\N	o	\N	\N
+3	1001	/negative zero	{"n":-0}	C9E9C616	1460000000000	\N	o	\N	\N
+4	1001	/upper exponent	{"n":1E+21}	C9E9C616	1460000000000	\N	o	\N	\N
+5	1001	/trailing zero	{"n":0.10}	C9E9C616	1460000000000	\N	o	\N	\N
+6	1001	/big integer	{"n":12345678901234567890}	C9E9C616	1460000000000	\N	o	\N	\N
+7	1001	/unicode escape	{"s":"\\u0041"}	C9E9C616	1460000000000	\N	o	\N	\N
+8	1001	/solidus escape	{"s":"a\\/b"}	C9E9C616	1460000000000	\N	o	\N	\N
+9	1001	/long newline escape	{"s":"\\u000a"}	C9E9C616	1460000000000	\N	o	\N	\N
+10	1001	/upper hex escape	{"s":"\\u001F"}	C9E9C616	1460000000000	\N	o	\N	\N
+11	1001	/lone surrogate	{"s":"\\udbff"}	C9E9C616	1460000000000	\N	o	\N	\N
+12	1001	/escaped name	{"\\u006fwner":"x"}	C9E9C616	1460000000000	\N	o	\N	\N
+13	1001	/integer key	{"b":1,"7":2}	C9E9C616	1460000000000	\N	o	\N	\N
+14	1001	/largest index	{"b":1,"4294967294":2}	C9E9C616	1460000000000	\N	o	\N	\N
+15	1001	/nested integer key	{"a":{"b":1,"0":2}}	C9E9C616	1460000000000	\N	o	\N	\N
+16	1001	/duplicate	{"a":1,"a":2}	C9E9C616	1460000000000	\N	o	\N	\N
+17	1001	/nested duplicate	{"a":{"b":1,"b":2}}	C9E9C616	1460000000000	\N	o	\N	\N
+18	1001	/space	{"a": 1}	C9E9C616	1460000000000	\N	o	\N	\N
+19	1001	/vnode escape	{"vnode":"\\u0033"}	C9E9C616	1460000000000	3	\N	\N	\N
+20	1001	/vnode array	{"vnode":[3]}	C9E9C616	1460000000000	3	\N	\N	\N
+21	1001	/array	[]	C9E9C616	1460000000000	\N	o	\N	\N
+\.
+
+COPY moray_typed (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode, size, active) FROM stdin;
+1	1001	/typed 1	{"size":0,"active":false}	C9E9C616	1460000000000	\N	1.50	t
+2	1001	/typed 2	{"size": 0}	C9E9C616	1460000000000	\N	1.50	t
+3	1001	/typed 3	{"size":0,"active":false}	C9E9C616	1460000000000	\N	007	f
+4	1001	/typed 4	{"size": 0}	C9E9C616	1460000000000	\N	007	f
+5	1001	/typed 5	{"size":0,"active":false}	C9E9C616	1460000000000	\N	1e21	true
+6	1001	/typed 6	{"size": 0}	C9E9C616	1460000000000	\N	1e21	true
+7	1001	/typed 7	{"size":0,"active":false}	C9E9C616	1460000000000	\N	12345678901234567890	false
+8	1001	/typed 8	{"size": 0}	C9E9C616	1460000000000	\N	12345678901234567890	false
+9	1001	/typed 9	{"size":0,"active":false}	C9E9C616	1460000000000	\N	NaN	yes
+10	1001	/typed 10	{"size": 0}	C9E9C616	1460000000000	\N	NaN	yes
+11	1001	/typed 11	{"size":0,"active":false}	C9E9C616	1460000000000	\N	-0	no
+12	1001	/typed 12	{"size": 0}	C9E9C616	1460000000000	\N	-0	no
+13	1001	/typed 13	{"size":0,"active":false}	C9E9C616	1460000000000	\N	1.0	TRUE
+14	1001	/typed 14	{"size": 0}	C9E9C616	1460000000000	\N	1.0	TRUE
+15	1001	/typed 15	{"size":0,"active":false}	C9E9C616	1460000000000	\N	0	T
+16	1001	/typed 16	{"size": 0}	C9E9C616	1460000000000	\N	0	T
+17	1001	/typed 17	{"size":0,"active":false}	C9E9C616	1460000000000	\N	-12.5e-3	1
+18	1001	/typed 18	{"size": 0}	C9E9C616	1460000000000	\N	-12.5e-3	1
+19	1001	/typed 19	{"size":0,"active":false}	C9E9C616	1460000000000	\N	1E+2	
+20	1001	/typed 20	{"size": 0}	C9E9C616	1460000000000	\N	1E+2	
+21	1001	/typed 21	{"size":0,"active":false}	C9E9C616	1460000000000	\N	1e400	 t
+22	1001	/typed 22	{"size": 0}	C9E9C616	1460000000000	\N	1e400	 t
+23	1001	/typed 23	{"size":0,"active":false}	C9E9C616	1460000000000	\N	Infinity	\N
+24	1001	/typed 24	{"size": 0}	C9E9C616	1460000000000	\N	Infinity	\N
+25	1001	/typed 25	{"size":0,"active":false}	C9E9C616	1460000000000	\N	0x10	\N
+26	1001	/typed 26	{"size": 0}	C9E9C616	1460000000000	\N	0x10	\N
+27	1001	/typed 27	{"size":0,"active":false}	C9E9C616	1460000000000	\N	 1	\N
+28	1001	/typed 28	{"size": 0}	C9E9C616	1460000000000	\N	 1	\N
+29	1001	/typed 29	{"size":0,"active":false}	C9E9C616	1460000000000	\N		\N
+30	1001	/typed 30	{"size": 0}	C9E9C616	1460000000000	\N		\N
+31	1001	/typed 31	{"size":0,"active":false}	C9E9C616	1460000000000	\N	.5	\N
+32	1001	/typed 32	{"size": 0}	C9E9C616	1460000000000	\N	.5	\N
+33	1001	/typed 33	{"size":0,"active":false}	C9E9C616	1460000000000	\N	5.	\N
+34	1001	/typed 34	{"size": 0}	C9E9C616	1460000000000	\N	5.	\N
+35	1001	/typed 35	{"size":0,"active":false}	C9E9C616	1460000000000	\N	+1	\N
+36	1001	/typed 36	{"size": 0}	C9E9C616	1460000000000	\N	+1	\N
+37	1001	/typed 37	{"size":0,"active":false}	C9E9C616	1460000000000	\N	-	\N
+38	1001	/typed 38	{"size": 0}	C9E9C616	1460000000000	\N	-	\N
+39	1001	/typed array	{"size":[1],"active":[true]}	C9E9C616	1460000000000	\N	2	f
+\.
@@ -0,0 +1,13 @@
+--
+-- A row in which the "vnode" property of the object does not agree with the
+-- _vnode column, which lib/moray.js rejects.
+--
+
+COPY buckets_config (name, index, pre, post, options, mtime, reindex_active) FROM stdin;
+moray_vnode	{}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+\.
+
+COPY moray_vnode (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode) FROM stdin;
+1	1001	/match	{"vnode":5}	C9E9C616	1460000000000	5
+2	1001	/mismatch	{"vnode":5}	C9E9C616	1460000000000	6
+\.
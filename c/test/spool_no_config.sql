@@ -0,0 +1,22 @@
+--
+-- A dump with no buckets_config table: every table is spooled to the end,
+-- and then written as plain objects.
+--
+
+CREATE TABLE plain_first (
+    a text,
+    b text
+);
+
+CREATE TABLE plain_second (
+    c text
+);
+
+COPY plain_first (a, b) FROM stdin;
+1	one
+2	\N
+\.
+
+COPY plain_second (c) FROM stdin;
+only
+\.
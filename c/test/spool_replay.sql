@@ -0,0 +1,45 @@
+--
+-- A bucket table, and a table that is not a bucket, before buckets_config.
+-- Both are spooled until buckets_config is read, and then replayed: the
+-- bucket is converted as Moray rows, and the other table is skipped, as is
+-- the table that is not a bucket after buckets_config.
+--
+
+CREATE TABLE replay_objects (
+    _id integer NOT NULL,
+    _txn_snap integer,
+    _key text NOT NULL,
+    _value text NOT NULL,
+    _etag character(8) NOT NULL,
+    _mtime bigint,
+    _vnode bigint,
+    owner text
+);
+
+CREATE TABLE replay_before (
+    a text,
+    b text
+);
+
+CREATE TABLE replay_after (
+    a text
+);
+
+COPY replay_objects (_id, _txn_snap, _key, _value, _etag, _mtime, _vnode, owner) FROM stdin;
+1	\N	/a	{"owner":"alice","n":1}	C9E9C616	1460000000000	1	alice
+2	7	/b\tc	{"owner":"bob","list":[1,2,3]}	C9E9C616	1460000000001	2	\N
+3	\N	/d	{"owner":"carol","s":"x\\ny"}	C9E9C616	\N	\N	carol
+\.
+
+COPY replay_before (a, b) FROM stdin;
+one	\N
+two\ttab	2
+\.
+
+COPY buckets_config (name, index, pre, post, options, mtime, reindex_active) FROM stdin;
+replay_objects	{"owner": {"type": "string"}}	[]	[]	{"version": 2}	2016-01-01 00:00:00.000	\N
+\.
+
+COPY replay_after (a) FROM stdin;
+skipped
+\.
@@ -0,0 +1,24 @@
+--
+-- Backslash sequences in COPY data in the text format.  Only a field that is
+-- exactly \N is NULL; elsewhere, a backslash before a character that is not
+-- one of the escapes is dropped.  Hex and octal escapes take as many digits
+-- as follow, up to two and three, and "\x" with no digits is an "x".
+--
+
+CREATE TABLE unescape (
+    name text,
+    value text
+);
+
+COPY unescape (name, value) FROM stdin;
+hex	\x41
+octal	\101
+vtab	\v
+octal short	\7
+hex bare	\x
+hex short	\x4g
+N inside	a\Nb
+backslash N	\\N
+null	\N
+other	\q\"
+\.
@@ -23,13 +23,47 @@ moray_row_to_bucket_config(row)
 	out._indexKeys = Object.keys(out.index).map(function (k) {
 		return ({
 			key: k,
-			lcKey: k.toLowerCase()
+			lcKey: k.toLowerCase(),
+			type: out.index[k] ? out.index[k].type : undefined
 		});
 	});
 
 	return (out);
 }
 
+/*
+ * Every column is text in the dump, but the Moray server reads index columns
+ * of type "number" and "boolean" back as native values.  Restore the type of
+ * the column value if it holds a finite number or a PostgreSQL boolean.
+ */
+function
+moray_index_value(type, colv)
+{
+	switch (type) {
+	case 'number':
+		if (/^-?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?$/.test(
+		    colv)) {
+			var n = Number(colv);
+
+			if (isFinite(n)) {
+				return (n);
+			}
+		}
+		break;
+
+	case 'boolean':
+		if (colv === 't' || colv === 'true') {
+			return (true);
+		}
+		if (colv === 'f' || colv === 'false') {
+			return (false);
+		}
+		break;
+	}
+
+	return (colv);
+}
+
 function
 moray_row_to_object(bucket, row)
 {
@@ -84,7 +118,8 @@ moray_row_to_object(bucket, row)
 		 * Replace the value in the object with the (potentially
 		 * updated) index column value.
 		 */
-		out.value[prop] = colv;
+		out.value[prop] = moray_index_value(bucket._indexKeys[i].type,
+		    colv);
 	}
 
 	return (out);